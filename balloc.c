@@ -0,0 +1,768 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+#include "testfs.h"
+
+/*
+ * Data block allocator.
+ *
+ * The data region is split in groups of s_blocks_per_group blocks, group
+ * g has data bitmap block s_dbitmap_blkid + g and bit 0 of it is block
+ * s_data_blkid + g * s_blocks_per_group. Block numbers handed out and
+ * taken back here are absolute block indexes, the same values stored in
+ * i_block[]. Runs never cross a group.
+ *
+ * On striped volumes the data region goes on over the member devices in
+ * the order of s_devs[], each holding whole groups. A run is allocated on
+ * the device of its goal, so the blocks of a file never leave the device
+ * its first block went to: iomap merges bios by sector alone, a file
+ * spread over several devices could get one bio across two of them.
+ */
+
+/* the device data block @blkid is on, metadata blocks are on the first */
+u32 testfs_dev_of(struct super_block *sb, u32 blkid)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 i;
+
+	for (i = sbi->s_ndevs - 1; i > 0; i--)
+		if (blkid >= sbi->s_devs[i].first)
+			break;
+	return i;
+}
+
+/**
+ * testfs_map_dev - where block @blkid of the volume is
+ *
+ * @sb:		the super block
+ * @blkid:	a block number as stored in i_block[], or a metadata block
+ * @pblk:	out: the block on the returned device
+ * @left:	out, may be NULL: blocks of the device from @blkid on
+ *
+ * Return: the device. Runs reaching beyond *@left are split.
+ */
+struct block_device *testfs_map_dev(struct super_block *sb, u32 blkid,
+				sector_t *pblk, u32 *left)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct testfs_dev *dev = &sbi->s_devs[testfs_dev_of(sb, blkid)];
+
+	*pblk = (u32)(blkid - dev->first + dev->start);
+	if (left)
+		*left = dev->first + dev->nr - blkid;
+	return dev->bdev;
+}
+
+/*
+ * new files go to the next device every s_stripe_blocks allocated, never
+ * to a metadata device
+ */
+u32 testfs_next_dev(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 first = sbi->s_first_file_dev;
+
+	if (sbi->s_ndevs - first < 2)
+		return first;
+	return first + (u32)atomic_read(&sbi->s_stripe_pos) /
+		sbi->s_stripe_blocks % (sbi->s_ndevs - first);
+}
+
+/* blocks in @group, the last group may be short */
+static u32 testfs_group_nbits(struct testfs_sb_info *sbi, u32 group)
+{
+	return min_t(u32, sbi->s_blocks_per_group,
+			sbi->s_data_blknr - group * sbi->s_blocks_per_group);
+}
+
+/*
+ * Allocate a run in @group, searching from bit @start. With @exact the run
+ * is *@count blocks or nothing, otherwise it is the first free block and
+ * as many of the following ones as are free, up to *@count.
+ */
+static int testfs_alloc_in_group(struct super_block *sb, u32 group,
+				unsigned long start, u32 *count, bool exact,
+				u32 *blkid)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	unsigned long nbits = testfs_group_nbits(sbi, group);
+	u32 base = sbi->s_data_blkid + group * sbi->s_blocks_per_group;
+	unsigned long *bitmap, index, end = 0, i;
+	struct buffer_head *bh;
+	int ret;
+
+	/* read data bitmap */
+	bh = sb_bread_unmovable(sb, sbi->s_dbitmap_blkid + group);
+	if (!bh) {
+		log_err("failed to read data bitmap of group %u\n", group);
+		return -EIO;
+	}
+
+	bitmap = (unsigned long *)bh->b_data;
+
+retry:
+	spin_lock(&sbi->s_balloc_lock);
+
+	index = find_next_zero_bit_le(bitmap, nbits, start);
+	if (exact) {
+		while (index + *count <= nbits) {
+			end = find_next_bit_le(bitmap, index + *count, index);
+			if (end - index == *count)
+				break;
+			index = find_next_zero_bit_le(bitmap, nbits, end);
+		}
+		if (index + *count > nbits)
+			index = nbits;
+	} else if (index < nbits) {
+		end = find_next_bit_le(bitmap, min_t(unsigned long, nbits,
+							index + *count), index);
+	}
+
+	if (index >= nbits) {
+		spin_unlock(&sbi->s_balloc_lock);
+		brelse(bh);
+		return -ENOSPC;
+	}
+
+	/* copied for the snapshot before it changes, then searched again */
+	if (testfs_snap_must_copy(sbi, bh->b_blocknr)) {
+		spin_unlock(&sbi->s_balloc_lock);
+		ret = testfs_snap_cow(sb, bh->b_blocknr);
+		if (ret) {
+			brelse(bh);
+			return ret;
+		}
+		goto retry;
+	}
+
+	for (i = index; i < end; i++)
+		__set_bit_le(i, bitmap);
+
+	spin_unlock(&sbi->s_balloc_lock);
+
+	*count = end - index;
+	*blkid = base + index;
+	percpu_counter_sub(&sbi->s_freeblocks_counter, *count);
+
+	/* update data bitmap */
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Walk the groups of the device of @goal from the one of @goal, wrapping
+ * around once; the goal group is searched from @goal first and from its
+ * start last.
+ */
+static int testfs_alloc_blocks(struct super_block *sb, u32 goal, u32 *count,
+				bool exact, u32 *blkid)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct testfs_dev *dev = &sbi->s_devs[testfs_dev_of(sb, goal)];
+	u32 i, group = 0, start = 0;
+	int ret;
+
+	/* no need to scan full bitmaps */
+	if (percpu_counter_read_positive(&sbi->s_freeblocks_counter) <
+							(exact ? *count : 1))
+		return -ENOSPC;
+
+	if (goal >= dev->first && goal - dev->first < dev->nr) {
+		group = (goal - dev->first) / sbi->s_blocks_per_group;
+		start = (goal - dev->first) % sbi->s_blocks_per_group;
+	}
+
+	for (i = 0; i <= dev->ngroups; i++) {
+		if (i == dev->ngroups && !start)
+			break;
+
+		ret = testfs_alloc_in_group(sb, dev->first_group +
+				(group + i) % dev->ngroups,
+				i ? 0 : start, count, exact, blkid);
+		if (ret == -ENOSPC)
+			continue;
+		if (!ret && sbi->s_ndevs > 1)
+			atomic_add(*count, &sbi->s_stripe_pos);
+		return ret;
+	}
+
+	return -ENOSPC;
+}
+
+/**
+ * testfs_new_blocks - allocate a run of contiguous data blocks
+ *
+ * @sb:		the super block
+ * @goal:	preferred first block, 0 means no preference
+ * @count:	in: blocks wanted, out: blocks allocated (at least 1)
+ * @blkid:	out: the first allocated block
+ *
+ * The search starts at @goal and wraps around once, on striped volumes
+ * only over the device of @goal. The run is extended
+ * from the first free block as far as @count and the bitmap allow, so
+ * callers get one extent per call rather than one block.
+ *
+ * Return: 0 on success, -ENOSPC if the data region is full, -EIO if the
+ * bitmap can not be read.
+ */
+int testfs_new_blocks(struct super_block *sb, u32 goal, u32 *count,
+			u32 *blkid)
+{
+	int ret;
+
+	ret = testfs_alloc_blocks(sb, goal, count, false, blkid);
+	if (ret == -ENOSPC)
+		log_err("not found available data block\n");
+
+	return ret;
+}
+
+/**
+ * testfs_new_contig_blocks - allocate exactly @count contiguous data blocks
+ *
+ * @sb:		the super block
+ * @goal:	preferred first block, 0 means no preference
+ * @count:	blocks wanted
+ * @blkid:	out: the first allocated block
+ *
+ * Unlike testfs_new_blocks() the run is never cut short, free runs are
+ * walked from @goal on, then from the start of the region, until one is
+ * long enough.
+ *
+ * Return: 0 on success, -ENOSPC if no free run is long enough, -EIO if the
+ * bitmap can not be read.
+ */
+int testfs_new_contig_blocks(struct super_block *sb, u32 goal, u32 count,
+				u32 *blkid)
+{
+	return testfs_alloc_blocks(sb, goal, &count, true, blkid);
+}
+
+/*
+ * Write lifetime streams.
+ *
+ * Each write lifetime hint (F_SET_RW_HINT, kept in the disk inode) gets
+ * its own slice of the data region of every device. Data that dies
+ * together then sits together, and deleting it frees long runs instead of
+ * holes between longer lived files. A file's first block comes from its stream's
+ * cursor and the rest follow the file's previous block. Files without a
+ * hint keep allocating from the front of the device. The cursors are only
+ * hints, they are read and moved without a lock.
+ */
+static u32 testfs_stream_of(struct inode *inode)
+{
+	if (inode->i_write_hint <= WRITE_LIFE_NONE)
+		return 0;
+	return min_t(u32, inode->i_write_hint - WRITE_LIFE_NONE,
+			TESTFS_NR_STREAMS - 1);
+}
+
+static u32 testfs_stream_start(struct testfs_dev *dev, u32 stream)
+{
+	return dev->first + div_u64((u64)dev->nr * stream, TESTFS_NR_STREAMS);
+}
+
+/* where the next file of @inode's stream on device @dev starts */
+u32 testfs_stream_goal(struct inode *inode, u32 dev)
+{
+	struct testfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct testfs_dev *d = &sbi->s_devs[dev];
+	u32 stream = testfs_stream_of(inode), goal;
+
+	if (!stream)
+		return d->first;
+
+	goal = READ_ONCE(d->stream_goal[stream]);
+	return goal ? goal : testfs_stream_start(d, stream);
+}
+
+/*
+ * Move @inode's stream on past a run it was given. Once the stream runs
+ * out of its slice it starts over from the beginning of it, where its
+ * short lived data has been freed in the meantime.
+ */
+void testfs_stream_advance(struct inode *inode, u32 blkid, u32 count)
+{
+	struct testfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct testfs_dev *d = &sbi->s_devs[testfs_dev_of(inode->i_sb, blkid)];
+	u32 stream = testfs_stream_of(inode), next = blkid + count;
+
+	if (!stream)
+		return;
+
+	if (next <= testfs_stream_start(d, stream) ||
+	    next >= testfs_stream_start(d, stream + 1))
+		next = 0;
+	WRITE_ONCE(d->stream_goal[stream], next);
+}
+
+/*
+ * Block sharing.
+ *
+ * The refcount table holds one __le16 per block of the data region, the
+ * number of files referencing the block beyond the first one. 0, what
+ * mktestfs writes, is a block with a single owner, so only shared blocks
+ * ever dirty the table. Volumes formatted without the table can not share
+ * blocks at all.
+ */
+
+/* with @nowait only a table block already in the cache is returned */
+static struct buffer_head *testfs_read_refcount(struct super_block *sb,
+					u32 blkid, __le16 **ref, bool nowait)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 index = blkid - sbi->s_data_blkid;
+	u32 per_block = sb->s_blocksize / sizeof(__le16);
+	sector_t blknr = sbi->s_refcount_blkid + index / per_block;
+	struct buffer_head *bh;
+
+	if (nowait) {
+		bh = sb_find_get_block(sb, blknr);
+		if (bh && !buffer_uptodate(bh)) {
+			brelse(bh);
+			bh = NULL;
+		}
+		if (!bh)
+			return NULL;
+	} else {
+		bh = sb_bread(sb, blknr);
+		if (!bh) {
+			log_err("failed to read refcount of block %u\n", blkid);
+			return NULL;
+		}
+	}
+
+	*ref = (__le16 *)bh->b_data + index % per_block;
+	return bh;
+}
+
+/*
+ * Add @delta to the extra references of @blkid. Return the new count, or
+ * a negative errno, the count is left alone if it would leave [0, U16_MAX].
+ */
+static int testfs_adjust_refcount(struct super_block *sb, u32 blkid,
+				int delta)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	__le16 *ref;
+	int refs;
+
+	bh = testfs_read_refcount(sb, blkid, &ref, false);
+	if (!bh)
+		return -EIO;
+
+	spin_lock(&sbi->s_balloc_lock);
+	refs = le16_to_cpu(*ref) + delta;
+	if (refs >= 0 && refs <= U16_MAX)
+		*ref = cpu_to_le16(refs);
+	spin_unlock(&sbi->s_balloc_lock);
+
+	if (refs < 0 || refs > U16_MAX) {
+		brelse(bh);
+		return -EMLINK;
+	}
+
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+
+	return refs;
+}
+
+/**
+ * testfs_share_blocks - take one more reference on a run of data blocks
+ *
+ * @sb:		the super block
+ * @blkid:	the first block
+ * @count:	number of blocks
+ *
+ * Return: 0 on success, -EOPNOTSUPP if the volume has no refcount table,
+ * -EMLINK if a block is already shared by too many files.
+ */
+int testfs_share_blocks(struct super_block *sb, u32 blkid, u32 count)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 i;
+	int ret;
+
+	if (!sbi->s_refcount_blknr)
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < count; i++) {
+		ret = testfs_adjust_refcount(sb, blkid + i, 1);
+		if (ret < 0)
+			goto undo;
+	}
+
+	return 0;
+undo:
+	while (i--)
+		testfs_adjust_refcount(sb, blkid + i, -1);
+	return ret;
+}
+
+/*
+ * whether @blkid is shared: referenced by more than one file or still in
+ * the snapshot; a negative errno if that can not be told
+ */
+static int testfs_block_shared(struct super_block *sb, u32 blkid,
+				bool nowait)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	__le16 *ref;
+	bool shared;
+
+	if (sbi->s_refcount_blknr) {
+		bh = testfs_read_refcount(sb, blkid, &ref, nowait);
+		if (!bh)
+			return -EIO;
+		shared = *ref != 0;
+		brelse(bh);
+		if (shared)
+			return 1;
+	}
+
+	return testfs_snap_owned(sb, blkid, nowait);
+}
+
+/**
+ * testfs_shared_blocks - tell whether a run of data blocks is shared
+ *
+ * @sb:		the super block
+ * @blkid:	the first block
+ * @count:	number of blocks
+ * @shared:	out: whether @blkid is referenced by more than one file, or
+ *		by the snapshot
+ * @nowait:	do not read the refcount table or a data bitmap, only look
+ *		at cached blocks
+ *
+ * Return: how many blocks from @blkid on have the same answer.
+ */
+u32 testfs_shared_blocks(struct super_block *sb, u32 blkid, u32 count,
+			bool *shared, bool nowait)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 i;
+	int ret;
+
+	*shared = false;
+	if (!sbi->s_refcount_blknr && !testfs_snap_active(sbi))
+		return count;
+
+	for (i = 0; i < count; i++) {
+		ret = testfs_block_shared(sb, blkid + i, nowait);
+		if (ret < 0)
+			break;
+		if (!i)
+			*shared = ret;
+		else if (ret != *shared)
+			break;
+	}
+
+	/*
+	 * an unreadable table counts as shared, the block gets copied; so does
+	 * one not cached with @nowait, the caller backs off
+	 */
+	if (!i) {
+		*shared = true;
+		return 1;
+	}
+	return i;
+}
+
+/*
+ * Drop one extra reference of @blkid if it has any; false means the
+ * caller held the last reference and the block can be freed.
+ */
+static bool testfs_put_block_ref(struct super_block *sb, u32 blkid)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+
+	if (!sbi->s_refcount_blknr)
+		return false;
+
+	/* fails without touching the table if the count is already 0 */
+	return testfs_adjust_refcount(sb, blkid, -1) >= 0;
+}
+
+/**
+ * testfs_rw_blocks - read or write a run of blocks with a single bio
+ *
+ * @sb:		the super block
+ * @op:		REQ_OP_READ or REQ_OP_WRITE
+ * @blkid:	the first block
+ * @count:	number of blocks, at most TEST_FS_N_BLOCKS
+ * @pages:	the data, PAGE_SIZE bytes per page
+ */
+int testfs_rw_blocks(struct super_block *sb, unsigned int op, u32 blkid,
+			u32 count, struct page **pages)
+{
+	size_t len = (size_t)count << sb->s_blocksize_bits;
+	struct block_device *bdev;
+	unsigned int i, n;
+	struct bio *bio;
+	sector_t pblk;
+	int ret;
+
+	bdev = testfs_map_dev(sb, blkid, &pblk, NULL);
+	bio = bio_alloc(GFP_NOFS, DIV_ROUND_UP(len, PAGE_SIZE));
+	bio_set_dev(bio, bdev);
+	bio->bi_iter.bi_sector = pblk << (sb->s_blocksize_bits - 9);
+	bio->bi_opf = op;
+
+	for (i = 0; len; i++, len -= n) {
+		n = min_t(size_t, len, PAGE_SIZE);
+		bio_add_page(bio, pages[i], n, 0);
+	}
+
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	return ret;
+}
+
+/**
+ * testfs_copy_blocks - copy a run of blocks to another place of the volume
+ *
+ * @sb:		the super block
+ * @src:	the first block to read
+ * @dst:	the first block to write
+ * @count:	number of blocks, at most TEST_FS_N_BLOCKS
+ *
+ * The whole run moves with one read bio and one write bio, the data does
+ * not go through any page cache.
+ */
+int testfs_copy_blocks(struct super_block *sb, u32 src, u32 dst, u32 count)
+{
+	size_t len = (size_t)count << sb->s_blocksize_bits;
+	unsigned int nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+	struct page *pages[TEST_FS_N_BLOCKS] = { };
+	unsigned int i;
+	int ret = 0;
+
+	if (WARN_ON_ONCE(nr_pages > TEST_FS_N_BLOCKS))
+		return -EINVAL;
+
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = alloc_page(GFP_NOFS);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = testfs_rw_blocks(sb, REQ_OP_READ, src, count, pages);
+	if (!ret)
+		ret = testfs_rw_blocks(sb, REQ_OP_WRITE, dst, count, pages);
+
+out:
+	for (i = 0; i < nr_pages && pages[i]; i++)
+		__free_page(pages[i]);
+	return ret;
+}
+
+/* write zeroes over a run of blocks, the device may unmap them */
+int testfs_zero_blocks(struct super_block *sb, u32 blkid, u32 count)
+{
+	unsigned int bits = sb->s_blocksize_bits;
+	struct block_device *bdev;
+	sector_t pblk;
+
+	bdev = testfs_map_dev(sb, blkid, &pblk, NULL);
+	return blkdev_issue_zeroout(bdev, pblk << (bits - 9),
+				    (sector_t)count << (bits - 9), GFP_NOFS, 0);
+}
+
+/* write a bitmap block back, with a change or not */
+static void testfs_put_bitmap(struct buffer_head *bh)
+{
+	if (!bh)
+		return;
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+}
+
+/*
+ * Move *@bh on to bitmap block @blknr, the one it was on is written back.
+ * A data bitmap is copied for the snapshot before it changes.
+ */
+static int testfs_switch_bitmap(struct super_block *sb,
+				struct buffer_head **bh, u32 blknr)
+{
+	if (*bh && (*bh)->b_blocknr == blknr)
+		return 0;
+
+	testfs_put_bitmap(*bh);
+	*bh = sb_bread_unmovable(sb, blknr);
+	if (!*bh) {
+		log_err("failed to read bitmap %u\n", blknr);
+		return -EIO;
+	}
+
+	return testfs_snap_cow(sb, blknr);
+}
+
+/**
+ * testfs_free_blocks - release a run of data blocks
+ *
+ * @sb:		the super block
+ * @blkid:	the first block to release
+ * @count:	number of blocks
+ *
+ * Blocks shared with another file only lose the caller's reference.
+ * Blocks the snapshot has stay allocated, in the deferred free bitmap of
+ * their group, until it is dropped.
+ */
+void testfs_free_blocks(struct super_block *sb, u32 blkid, u32 count)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh = NULL, *fbh = NULL;
+	u32 i, index, group, bit;
+	bool freed;
+	int owned;
+
+	if (blkid < sbi->s_data_blkid ||
+	    blkid - sbi->s_data_blkid + count > sbi->s_data_blknr) {
+		log_err("freeing blocks not in data region, %u+%u\n",
+			blkid, count);
+		return;
+	}
+
+	index = blkid - sbi->s_data_blkid;
+
+	for (i = index; i < index + count; i++) {
+		if (testfs_put_block_ref(sb, i + sbi->s_data_blkid))
+			continue;
+
+		group = i / sbi->s_blocks_per_group;
+		bit = i % sbi->s_blocks_per_group;
+
+		/* kept if the snapshot may have it, better leaked than lost */
+		owned = testfs_snap_owned(sb, i + sbi->s_data_blkid, false);
+
+		/* a run may cross into the next group, one bitmap at a time */
+		if (testfs_switch_bitmap(sb, &bh, sbi->s_dbitmap_blkid + group))
+			break;
+		if (owned && testfs_switch_bitmap(sb, &fbh,
+					sbi->s_snap_free_blkid + group))
+			break;
+
+		/* the snapshot may have been dropped in the meantime */
+		spin_lock(&sbi->s_balloc_lock);
+		if (owned && sbi->s_snap_state == TESTFS_SNAP_ACTIVE) {
+			__set_bit_le(bit, fbh->b_data);
+			spin_unlock(&sbi->s_balloc_lock);
+			continue;
+		}
+		freed = __test_and_clear_bit_le(bit, bh->b_data);
+		spin_unlock(&sbi->s_balloc_lock);
+
+		if (freed)
+			percpu_counter_inc(&sbi->s_freeblocks_counter);
+		else
+			log_err("block %u already free\n",
+				i + sbi->s_data_blkid);
+	}
+
+	/* update data bitmap */
+	testfs_put_bitmap(bh);
+	testfs_put_bitmap(fbh);
+}
+
+/**
+ * testfs_count_free - count the clear bits of a bitmap block
+ *
+ * @sb:		the super block
+ * @blkid:	the bitmap block
+ * @nbits:	how many bits of it are in use as a bitmap
+ * @free:	out: the number of clear bits
+ *
+ * Only used to rebuild the free counters when the volume was not unmounted
+ * cleanly, everything else reads the counters.
+ */
+int testfs_count_free(struct super_block *sb, u32 blkid, u32 nbits,
+			u32 *free)
+{
+	struct buffer_head *bh;
+	u8 *map;
+	u32 used;
+
+	bh = sb_bread_unmovable(sb, blkid);
+	if (!bh) {
+		log_err("failed to read bitmap %u\n", blkid);
+		return -EIO;
+	}
+
+	/* byte wise, the bitmaps are little endian */
+	map = (u8 *)bh->b_data;
+	used = memweight(map, nbits / 8);
+	if (nbits % 8)
+		used += hweight8(map[nbits / 8] & ((1 << (nbits % 8)) - 1));
+	brelse(bh);
+
+	*free = nbits - used;
+	return 0;
+}
+
+/* rebuild the free block count from the data bitmaps, group by group */
+int testfs_count_free_blocks(struct super_block *sb, u32 *free)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 group, n;
+	int ret;
+
+	*free = 0;
+	for (group = 0; group < sbi->s_groups_count; group++) {
+		ret = testfs_count_free(sb, sbi->s_dbitmap_blkid + group,
+					testfs_group_nbits(sbi, group), &n);
+		if (ret)
+			return ret;
+		*free += n;
+	}
+
+	return 0;
+}
+
+/* rebuild the free inode count from the inode bitmap blocks */
+int testfs_count_free_inodes(struct super_block *sb, u32 *free)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 per_block = sb->s_blocksize * 8;
+	u32 i, n;
+	int ret;
+
+	*free = 0;
+	for (i = 0; i < sbi->s_ibitmap_blknr; i++) {
+		ret = testfs_count_free(sb, sbi->s_ibitmap_blkid + i,
+				min_t(u32, per_block,
+				      sbi->s_inodes_count - i * per_block), &n);
+		if (ret)
+			return ret;
+		*free += n;
+	}
+
+	return 0;
+}
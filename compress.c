@@ -0,0 +1,707 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+#include <linux/cpuhotplug.h>
+#include <linux/vmalloc.h>
+#include <linux/zstd.h>
+
+#include "testfs.h"
+
+/*
+ * Transparent compression.
+ *
+ * Files with TESTFS_COMPR_FL, set by chattr +c or inherited from the
+ * directory, are compressed a cluster of TESTFS_CLUSTER_BLOCKS blocks at a
+ * time. Writes and page faults allocate plain blocks as for any file;
+ * writeback compresses the whole cluster and, if that saves a block,
+ * writes it to a new contiguous run and switches the block map over. A
+ * page is a block on such files, FS_IOC_SETFLAGS checks it.
+ *
+ * Reads of a compressed cluster decompress it into the page cache, all of
+ * it at once. Anything that has to change the blocks of a compressed
+ * cluster, a write, a partial punch, a direct I/O mapping, first stores it
+ * plain again, see testfs_uncompress_cluster().
+ *
+ * Each CPU has its workspaces, set up when it comes online; compression
+ * runs with preemption off, on one cluster, which is short.
+ */
+#define TESTFS_ZSTD_LEVEL	3
+/* the largest cluster, compressed files have blocks of PAGE_SIZE */
+#define TESTFS_CLUSTER_BYTES	(TESTFS_CLUSTER_BLOCKS * PAGE_SIZE)
+
+struct testfs_compr_ws {
+	void *lz4;			/* LZ4_MEM_COMPRESS bytes */
+	void *zstd_c;
+	size_t zstd_c_size;
+	void *zstd_d;
+	size_t zstd_d_size;
+};
+
+static struct testfs_compr_ws __percpu *testfs_compr_ws;
+static int testfs_compr_hp_state;
+
+static int testfs_compr_cpu_dead(unsigned int cpu)
+{
+	struct testfs_compr_ws *ws = per_cpu_ptr(testfs_compr_ws, cpu);
+
+	kvfree(ws->lz4);
+	ws->lz4 = NULL;
+	kvfree(ws->zstd_c);
+	ws->zstd_c = NULL;
+	kvfree(ws->zstd_d);
+	ws->zstd_d = NULL;
+	return 0;
+}
+
+static int testfs_compr_cpu_prepare(unsigned int cpu)
+{
+	struct testfs_compr_ws *ws = per_cpu_ptr(testfs_compr_ws, cpu);
+	ZSTD_parameters params = ZSTD_getParams(TESTFS_ZSTD_LEVEL,
+						TESTFS_CLUSTER_BYTES, 0);
+
+	ws->zstd_c_size = ZSTD_CCtxWorkspaceBound(params.cParams);
+	ws->zstd_c = kvmalloc(ws->zstd_c_size, GFP_KERNEL);
+	ws->zstd_d_size = ZSTD_DCtxWorkspaceBound();
+	ws->zstd_d = kvmalloc(ws->zstd_d_size, GFP_KERNEL);
+	if (!ws->zstd_c || !ws->zstd_d)
+		goto fail;
+	ws->lz4 = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	if (!ws->lz4)
+		goto fail;
+	return 0;
+
+fail:
+	testfs_compr_cpu_dead(cpu);
+	return -ENOMEM;
+}
+
+int testfs_compr_init(void)
+{
+	int ret;
+
+	testfs_compr_ws = alloc_percpu(struct testfs_compr_ws);
+	if (!testfs_compr_ws)
+		return -ENOMEM;
+
+	ret = cpuhp_setup_state(CPUHP_BP_PREPARE_DYN, "fs/testfs:compr",
+				testfs_compr_cpu_prepare,
+				testfs_compr_cpu_dead);
+	if (ret < 0) {
+		free_percpu(testfs_compr_ws);
+		return ret;
+	}
+	testfs_compr_hp_state = ret;
+	return 0;
+}
+
+void testfs_compr_exit(void)
+{
+	cpuhp_remove_state(testfs_compr_hp_state);
+	free_percpu(testfs_compr_ws);
+}
+
+/* compress= mount option */
+int testfs_compr_parse(struct testfs_sb_info *sbi, const char *algo)
+{
+	if (!strcmp(algo, "lz4")) {
+		sbi->s_compr_algo = TESTFS_COMPR_LZ4;
+		return 0;
+	}
+	if (!strcmp(algo, "zstd")) {
+		sbi->s_compr_algo = TESTFS_COMPR_ZSTD;
+		return 0;
+	}
+	log_err("unknown compression: %s\n", algo);
+	return -EINVAL;
+}
+
+/*
+ * Compress @len bytes at @src into @dst, header included. Return its
+ * length, 0 if it does not fit in @cap bytes.
+ */
+static size_t testfs_compress(u32 algo, const void *src, size_t len,
+				void *dst, size_t cap)
+{
+	struct testfs_compr_hdr *hdr = dst;
+	struct testfs_compr_ws *ws;
+	size_t clen = 0;
+	ZSTD_parameters params;
+	ZSTD_CCtx *cctx;
+
+	if (cap <= sizeof(*hdr))
+		return 0;
+	cap -= sizeof(*hdr);
+
+	ws = get_cpu_ptr(testfs_compr_ws);
+	switch (algo) {
+	case TESTFS_COMPR_LZ4:
+		if (ws->lz4)
+			clen = LZ4_compress_default(src, (char *)(hdr + 1), len,
+						    cap, ws->lz4);
+		break;
+	case TESTFS_COMPR_ZSTD:
+		/* as sized in testfs_compr_cpu_prepare() */
+		params = ZSTD_getParams(TESTFS_ZSTD_LEVEL,
+					TESTFS_CLUSTER_BYTES, 0);
+		cctx = ws->zstd_c ? ZSTD_initCCtx(ws->zstd_c,
+						  ws->zstd_c_size) : NULL;
+		if (cctx) {
+			clen = ZSTD_compressCCtx(cctx, hdr + 1, cap, src, len,
+						 params);
+			if (ZSTD_isError(clen))
+				clen = 0;
+		}
+		break;
+	}
+	put_cpu_ptr(testfs_compr_ws);
+
+	if (!clen)
+		return 0;
+	hdr->c_len = cpu_to_le32(clen);
+	hdr->c_algo = algo;
+	memset(hdr->c_reserved, 0, sizeof(hdr->c_reserved));
+	return sizeof(*hdr) + clen;
+}
+
+/* decompress @srclen bytes at @src into @dst, return the data length */
+static int testfs_decompress(const void *src, size_t srclen, void *dst,
+				size_t cap)
+{
+	const struct testfs_compr_hdr *hdr = src;
+	size_t clen = le32_to_cpu(hdr->c_len);
+	int ret = -EIO;
+	struct testfs_compr_ws *ws;
+	ZSTD_DCtx *dctx;
+	size_t n;
+
+	if (srclen < sizeof(*hdr) || clen > srclen - sizeof(*hdr))
+		return -EIO;
+
+	switch (hdr->c_algo) {
+	case TESTFS_COMPR_LZ4:
+		ret = LZ4_decompress_safe((const char *)(hdr + 1), dst, clen,
+					  cap);
+		if (ret < 0)
+			ret = -EIO;
+		break;
+	case TESTFS_COMPR_ZSTD:
+		ws = get_cpu_ptr(testfs_compr_ws);
+		dctx = ws->zstd_d ? ZSTD_initDCtx(ws->zstd_d,
+						  ws->zstd_d_size) : NULL;
+		if (dctx) {
+			n = ZSTD_decompressDCtx(dctx, dst, cap, hdr + 1, clen);
+			ret = ZSTD_isError(n) ? -EIO : n;
+		} else {
+			ret = -ENOMEM;
+		}
+		put_cpu_ptr(testfs_compr_ws);
+		break;
+	default:
+		log_err("unknown compression %u\n", hdr->c_algo);
+	}
+	return ret;
+}
+
+/*
+ * A cluster sized buffer: the pages for testfs_rw_blocks(), mapped
+ * contiguously for the codecs.
+ */
+struct testfs_cbuf {
+	struct page *pages[TESTFS_CLUSTER_BLOCKS];
+	u32 nr;
+	void *addr;
+};
+
+static void testfs_cbuf_free(struct testfs_cbuf *cb)
+{
+	u32 i;
+
+	if (cb->addr)
+		vunmap(cb->addr);
+	for (i = 0; i < cb->nr; i++)
+		__free_page(cb->pages[i]);
+	cb->addr = NULL;
+	cb->nr = 0;
+}
+
+static int testfs_cbuf_alloc(struct testfs_cbuf *cb, u32 nr)
+{
+	for (cb->nr = 0; cb->nr < nr; cb->nr++) {
+		cb->pages[cb->nr] = alloc_page(GFP_NOFS);
+		if (!cb->pages[cb->nr])
+			goto fail;
+	}
+	cb->addr = vmap(cb->pages, nr, VM_MAP, PAGE_KERNEL);
+	if (cb->addr)
+		return 0;
+fail:
+	testfs_cbuf_free(cb);
+	return -ENOMEM;
+}
+
+/* blocks of the compressed run of @cluster */
+static u32 testfs_cluster_run(struct testfs_inode *ti, u32 cluster)
+{
+	u32 i, first = cluster * TESTFS_CLUSTER_BLOCKS;
+
+	for (i = 0; i < TESTFS_CLUSTER_BLOCKS; i++)
+		if (!ti->i_block[first + i])
+			break;
+	return i;
+}
+
+/*
+ * Decompress @cluster into @out, allocated here if it is not yet. Return
+ * the data length. Called with i_map_sem held.
+ */
+static int testfs_read_cluster(struct inode *inode, u32 cluster,
+				struct testfs_cbuf *out)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 bno = le32_to_cpu(ti->i_block[cluster * TESTFS_CLUSTER_BLOCKS]);
+	u32 count = testfs_cluster_run(ti, cluster);
+	struct testfs_cbuf in = { };
+	int ret;
+
+	if (!out->addr) {
+		ret = testfs_cbuf_alloc(out, TESTFS_CLUSTER_BLOCKS);
+		if (ret)
+			return ret;
+	}
+
+	ret = testfs_cbuf_alloc(&in, count);
+	if (ret)
+		return ret;
+	ret = testfs_rw_blocks(sb, REQ_OP_READ, bno, count, in.pages);
+	if (!ret)
+		ret = testfs_decompress(in.addr, count << sb->s_blocksize_bits,
+					out->addr, TESTFS_CLUSTER_BYTES);
+	testfs_cbuf_free(&in);
+
+	if (ret < 0)
+		log_err("ino:%lu cluster %u: failed to read, %d\n",
+			inode->i_ino, cluster, ret);
+	return ret;
+}
+
+/**
+ * testfs_uncompress_cluster - store a compressed cluster as plain blocks
+ *
+ * @inode:	the inode
+ * @cluster:	the cluster, compressed
+ * @nowait:	-EAGAIN instead of any I/O
+ *
+ * The data is decompressed to newly allocated blocks and the compressed
+ * run freed, as testfs_unshare_blocks() does with shared blocks. The
+ * blocks past the end of the data become holes. Called with i_map_sem
+ * held for write.
+ */
+int testfs_uncompress_cluster(struct inode *inode, u32 cluster, bool nowait)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 first = cluster * TESTFS_CLUSTER_BLOCKS;
+	u32 bno = le32_to_cpu(ti->i_block[first]);
+	__le32 map[TESTFS_CLUSTER_BLOCKS] = { };
+	struct testfs_cbuf data = { };
+	u32 i, j, n, run, blkid, goal = bno;
+	int len, ret = 0;
+
+	if (nowait)
+		return -EAGAIN;
+
+	len = testfs_read_cluster(inode, cluster, &data);
+	if (len < 0) {
+		ret = len;
+		goto out;
+	}
+
+	/* next to the compressed run, on the device of the file */
+	n = DIV_ROUND_UP(len, sb->s_blocksize);
+	for (i = 0; i < n; i += run) {
+		run = n - i;
+		ret = testfs_new_blocks(sb, goal, &run, &blkid);
+		if (ret)
+			goto free;
+		for (j = 0; j < run; j++)
+			map[i + j] = cpu_to_le32(blkid + j);
+		ret = testfs_rw_blocks(sb, REQ_OP_WRITE, blkid, run,
+				       &data.pages[i]);
+		if (ret)
+			goto free;
+		goal = blkid + run;
+	}
+
+	testfs_free_blocks(sb, bno, testfs_cluster_run(ti, cluster));
+	memcpy(&ti->i_block[first], map, sizeof(map));
+	ti->i_compr_map &= ~BIT(cluster);
+	ti->i_map_seq++;
+	testfs_update_i_blocks(inode);
+	mark_inode_dirty(inode);
+	goto out;
+
+free:
+	for (i = 0; i < n; i++)
+		if (map[i])
+			testfs_free_blocks(sb, le32_to_cpu(map[i]), 1);
+out:
+	testfs_cbuf_free(&data);
+	return ret;
+}
+
+/* the cluster decompressed last, reused for the next pages of it */
+struct testfs_read_ctx {
+	struct testfs_cbuf data;
+	u32 cluster;		/* TESTFS_NR_CLUSTERS for none */
+	int len;		/* data length, or the error */
+};
+
+/*
+ * Bring @page, locked, uptodate and unlock it. Pages of plain clusters go
+ * through iomap. A cluster only becomes compressed with all its pages
+ * locked and back only under i_map_sem, so a plain one stays plain while
+ * the page is locked, and the data in @ctx stays valid for the pages of
+ * one readahead batch, all locked.
+ */
+static int testfs_compr_fill(struct inode *inode, struct page *page,
+				struct testfs_read_ctx *ctx)
+{
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 cluster = page->index / TESTFS_CLUSTER_BLOCKS;
+	size_t offset, n;
+	void *kaddr;
+
+	down_read(&ti->i_map_sem);
+	if (cluster >= TESTFS_NR_CLUSTERS ||
+	    !(ti->i_compr_map & BIT(cluster))) {
+		up_read(&ti->i_map_sem);
+		return iomap_readpage(page, &testfs_iomap_ops);
+	}
+	if (ctx->cluster != cluster) {
+		ctx->len = testfs_read_cluster(inode, cluster, &ctx->data);
+		ctx->cluster = cluster;
+	}
+	up_read(&ti->i_map_sem);
+
+	if (ctx->len < 0) {
+		SetPageError(page);
+		unlock_page(page);
+		return ctx->len;
+	}
+
+	offset = (page->index % TESTFS_CLUSTER_BLOCKS) << PAGE_SHIFT;
+	n = offset < ctx->len ? min_t(size_t, ctx->len - offset, PAGE_SIZE) : 0;
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, ctx->data.addr + offset, n);
+	memset(kaddr + n, 0, PAGE_SIZE - n);
+	kunmap_atomic(kaddr);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+	unlock_page(page);
+	return 0;
+}
+
+/*
+ * ->readpage of files with compressed clusters: the other pages of the
+ * cluster are filled as well if they are not cached, the data is there.
+ */
+int testfs_compr_readpage(struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct testfs_read_ctx ctx = { .cluster = TESTFS_NR_CLUSTERS };
+	pgoff_t index, first, end;
+	struct page *p;
+	int ret;
+
+	ret = testfs_compr_fill(mapping->host, page, &ctx);
+
+	if (ctx.cluster < TESTFS_NR_CLUSTERS && ctx.len > 0) {
+		first = ctx.cluster * TESTFS_CLUSTER_BLOCKS;
+		end = first + DIV_ROUND_UP(ctx.len, PAGE_SIZE);
+		for (index = first; index < end; index++) {
+			if (index == page->index)
+				continue;
+			p = grab_cache_page_nowait(mapping, index);
+			if (!p)
+				continue;
+			if (PageUptodate(p))
+				unlock_page(p);
+			else
+				testfs_compr_fill(mapping->host, p, &ctx);
+			put_page(p);
+		}
+	}
+
+	testfs_cbuf_free(&ctx.data);
+	return ret;
+}
+
+void testfs_compr_readahead(struct readahead_control *rac)
+{
+	struct testfs_read_ctx ctx = { .cluster = TESTFS_NR_CLUSTERS };
+	struct page *page;
+
+	while ((page = readahead_page(rac))) {
+		testfs_compr_fill(rac->mapping->host, page, &ctx);
+		put_page(page);
+	}
+
+	testfs_cbuf_free(&ctx.data);
+}
+
+/*
+ * Compress the @nr pages at @pages, cluster @cluster, to a new run. The
+ * blocks it had are added to @old, freed by the caller once the inode is
+ * on disk. Return -E2BIG if that saves no block.
+ */
+static int testfs_compress_cluster(struct inode *inode, u32 cluster,
+				struct page **pages, u32 nr, __le32 *old)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 i, m, blkid, goal, first = cluster * TESTFS_CLUSTER_BLOCKS;
+	struct testfs_cbuf out = { };
+	size_t clen;
+	void *src;
+	int ret;
+
+	if (nr < 2)
+		return -E2BIG;
+
+	src = vmap(pages, nr, VM_MAP, PAGE_KERNEL);
+	if (!src)
+		return -ENOMEM;
+	ret = testfs_cbuf_alloc(&out, nr - 1);
+	if (ret)
+		goto out_unmap;
+
+	clen = testfs_compress(sbi->s_compr_algo, src,
+			       min_t(loff_t, i_size_read(inode) -
+				     ((loff_t)first << PAGE_SHIFT),
+				     (size_t)nr << PAGE_SHIFT),
+			       out.addr, (size_t)(nr - 1) << PAGE_SHIFT);
+	ret = -E2BIG;
+	if (!clen)
+		goto out_free;
+	m = DIV_ROUND_UP(clen, sb->s_blocksize);
+	memset(out.addr + clen, 0, ((size_t)m << PAGE_SHIFT) - clen);
+
+	/* where the cluster is, else where the file's stream is at */
+	down_read(&ti->i_map_sem);
+	goal = le32_to_cpu(ti->i_block[first]);
+	if (!goal)
+		goal = testfs_stream_goal(inode, testfs_file_dev(inode));
+	up_read(&ti->i_map_sem);
+
+	ret = testfs_new_contig_blocks(sb, goal, m, &blkid);
+	if (ret)
+		goto out_free;
+	testfs_stream_advance(inode, blkid, m);
+
+	ret = testfs_rw_blocks(sb, REQ_OP_WRITE, blkid, m, out.pages);
+	if (ret) {
+		testfs_free_blocks(sb, blkid, m);
+		goto out_free;
+	}
+
+	down_write(&ti->i_map_sem);
+	for (i = 0; i < TESTFS_CLUSTER_BLOCKS; i++) {
+		if (ti->i_block[first + i])
+			old[first + i] = ti->i_block[first + i];
+		ti->i_block[first + i] = i < m ? cpu_to_le32(blkid + i) : 0;
+	}
+	ti->i_compr_map |= BIT(cluster);
+	ti->i_map_seq++;
+	testfs_update_i_blocks(inode);
+	up_write(&ti->i_map_sem);
+	mark_inode_dirty(inode);
+
+out_free:
+	testfs_cbuf_free(&out);
+out_unmap:
+	vunmap(src);
+	return ret;
+}
+
+/* write the pages of @dirty in place, blocks allocated as for a write */
+static int testfs_write_plain(struct inode *inode, u32 first,
+				struct page **pages, u32 nr, u32 dirty)
+{
+	u32 i, n, bno;
+	bool new;
+	int ret;
+
+	for (i = 0; i < nr; i += n) {
+		n = 1;
+		if (!(dirty & BIT(i)))
+			continue;
+		ret = testfs_map_blocks(inode, first + i, nr - i, &bno, &new,
+					TESTFS_MAP_CREATE);
+		if (ret < 0)
+			return ret;
+		while (n < ret && (dirty & BIT(i + n)))
+			n++;
+		ret = testfs_rw_blocks(inode->i_sb, REQ_OP_WRITE, bno, n,
+				       &pages[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Write back cluster @cluster if it has dirty pages. All its pages within
+ * EOF are read in and locked in index order, so the data compressed is
+ * the whole cluster and nobody dirties it meanwhile.
+ */
+static int testfs_writeback_cluster(struct address_space *mapping,
+				u32 cluster, struct writeback_control *wbc,
+				__le32 *old)
+{
+	struct inode *inode = mapping->host;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	pgoff_t first = cluster * TESTFS_CLUSTER_BLOCKS;
+	struct page *pages[TESTFS_CLUSTER_BLOCKS] = { };
+	pgoff_t index = first, eof;
+	u32 i, nr, dirty = 0;
+	int ret = 0;
+
+	eof = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+	if (first >= eof)
+		return 0;
+	nr = min_t(pgoff_t, TESTFS_CLUSTER_BLOCKS, eof - first);
+	if (!find_get_pages_range_tag(mapping, &index, first + nr - 1,
+				      PAGECACHE_TAG_DIRTY, 1, pages))
+		return 0;
+	put_page(pages[0]);
+	pages[0] = NULL;
+
+	for (i = 0; i < nr; i++) {
+		pages[i] = read_mapping_page(mapping, first + i, NULL);
+		if (IS_ERR(pages[i])) {
+			ret = PTR_ERR(pages[i]);
+			pages[i] = NULL;
+			goto out;
+		}
+		lock_page(pages[i]);
+		if (pages[i]->mapping != mapping) {
+			/* truncated meanwhile, the cluster ends here */
+			unlock_page(pages[i]);
+			put_page(pages[i]);
+			pages[i] = NULL;
+			nr = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		wait_on_page_writeback(pages[i]);
+		if (clear_page_dirty_for_io(pages[i]))
+			dirty |= BIT(i);
+	}
+	if (!dirty)
+		goto out;
+	for (i = 0; i < nr; i++)
+		if (dirty & BIT(i))
+			set_page_writeback(pages[i]);
+
+	ret = -E2BIG;
+	if (ti->i_flags & TESTFS_COMPR_FL)
+		ret = testfs_compress_cluster(inode, cluster, pages, nr, old);
+	/* incompressible, or no room for a run: stored as it is */
+	if (ret == -E2BIG || ret == -ENOSPC)
+		ret = testfs_write_plain(inode, first, pages, nr, dirty);
+
+	for (i = 0; i < nr; i++) {
+		if (!(dirty & BIT(i)))
+			continue;
+		if (ret)
+			SetPageError(pages[i]);
+		end_page_writeback(pages[i]);
+	}
+	if (ret)
+		mapping_set_error(mapping, ret);
+	wbc->nr_to_write -= hweight32(dirty);
+out:
+	for (i = 0; i < TESTFS_CLUSTER_BLOCKS && pages[i]; i++) {
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+	return ret;
+}
+
+/**
+ * testfs_compr_writepages - ->writepages of files with compression
+ *
+ * Cluster by cluster, synchronously. Blocks a cluster had before it was
+ * compressed are freed once the inode pointing at the new run is on disk,
+ * as testfs_defrag_file() does; the inode is written directly, this runs
+ * under I_SYNC and sync_inode_metadata() would wait for it.
+ */
+int testfs_compr_writepages(struct address_space *mapping,
+			struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct writeback_control iwbc = { .sync_mode = WB_SYNC_ALL };
+	__le32 old[TEST_FS_N_BLOCKS] = { };
+	u32 cluster, first, i, bno, start = 0, count = 0;
+	int ret = 0, err;
+
+	first = min_t(loff_t, wbc->range_start >> PAGE_SHIFT, TEST_FS_N_BLOCKS);
+	for (cluster = first / TESTFS_CLUSTER_BLOCKS;
+	     cluster < TESTFS_NR_CLUSTERS && wbc->nr_to_write > 0 &&
+	     ((loff_t)cluster * TESTFS_CLUSTER_BYTES) <= wbc->range_end;
+	     cluster++) {
+		err = testfs_writeback_cluster(mapping, cluster, wbc, old);
+		if (err && !ret)
+			ret = err;
+	}
+
+	if (!memchr_inv(old, 0, sizeof(old)))
+		return ret;
+
+	err = testfs_write_inode(inode, &iwbc);
+	if (err) {
+		log_err("ino:%lu failed to write inode, %d\n", inode->i_ino, err);
+		return ret ? ret : err;
+	}
+
+	/* free physically contiguous blocks with one bitmap update */
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+		bno = le32_to_cpu(old[i]);
+		if (!bno)
+			continue;
+		if (count && bno == start + count) {
+			count++;
+			continue;
+		}
+		if (count)
+			testfs_free_blocks(sb, start, count);
+		start = bno;
+		count = 1;
+	}
+	if (count)
+		testfs_free_blocks(sb, start, count);
+	return ret;
+}
@@ -20,6 +20,7 @@
  *
  */
 #include "testfs.h"
+#include "testfs_trace.h"
 
 static struct page *testfs_get_page(struct inode *inode, unsigned long n)
 {
@@ -48,9 +49,41 @@ static void testfs_put_page(struct page *page)
 	put_page(page);
 }
 
+/*
+ * Directory blocks the snapshot has are never written over: with a
+ * snapshot, the buffers in range are moved to the blocks
+ * testfs_map_blocks() unshares them to, their data goes along.
+ */
 static int testfs_prepare_block(struct page *page, loff_t pos, unsigned len)
 {
-	return __block_write_begin(page, pos, len, testfs_get_block);
+	struct inode *dir = page->mapping->host;
+	unsigned from = pos & (PAGE_SIZE - 1), to = from + len, start = 0;
+	struct buffer_head *head, *bh;
+	sector_t iblock;
+	bool new;
+	u32 bno;
+	int ret;
+
+	ret = __block_write_begin(page, pos, len, testfs_get_block);
+	if (ret || !testfs_snap_active(dir->i_sb->s_fs_info))
+		return ret;
+
+	iblock = (sector_t)page->index << (PAGE_SHIFT - dir->i_blkbits);
+	bh = head = page_buffers(page);
+	do {
+		if (start < to && start + bh->b_size > from) {
+			ret = testfs_map_blocks(dir, iblock, 1, &bno, &new,
+						TESTFS_MAP_CREATE);
+			if (ret < 0)
+				return ret;
+			bh->b_blocknr = bno;
+		}
+		start += bh->b_size;
+		iblock++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	return 0;
 }
 
 static int testfs_commit_block(struct page *page, loff_t pos, unsigned len)
@@ -166,20 +199,25 @@ static int testfs_add_inode_to_dir(struct dentry *dentry, struct inode *inode)
 static int testfs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {
         struct inode *inode;
+        int ret;
 
         inode = testfs_new_inode(dir, mode, &dentry->d_name);
-        if (IS_ERR(inode))
-                return PTR_ERR(inode);
+        if (IS_ERR(inode)) {
+                ret = PTR_ERR(inode);
+        } else {
+                mark_inode_dirty(inode);
+                ret = testfs_add_inode_to_dir(dentry, inode);
+        }
 
-        mark_inode_dirty(inode);
-        return testfs_add_inode_to_dir(dentry, inode);
+        trace_testfs_create(dir, dentry, ret ? NULL : inode, mode, ret);
+        return ret;
 }
 
 /**
  * testfs_lookup_by_name - lookup a file/dir/symlink by name
  *
  * @dir:	the parent direcotry will be searched
- * @dentry:	the dentry->d_name.name will be will be searched
+ * @qstr:	the name will be searched
  * @pg:		the page pointer that contains struct testfs_dir_entry
  *
  * Attenton: the caller should unmap and put @pg by call testfs_put_page
@@ -187,12 +225,12 @@ static int testfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
  * Return: the pointer of struct testfs_dir_entry* on succes, others on error
  */
 static struct testfs_dir_entry *testfs_lookup_by_name(struct inode *dir,
-					struct dentry *dentry, struct page **pg)
+					const struct qstr *qstr, struct page **pg)
 {
 	struct testfs_dir_entry *tde;
 	struct page *page;
 	unsigned long i, total_pages = dir_pages(dir);
-	unsigned j, name_len = dentry->d_name.len;
+	unsigned j, name_len = qstr->len;
 	loff_t pos = 0, entry_size = sizeof(struct testfs_dir_entry);
 
 	if (name_len > TESTFS_FILE_NAME_LEN)
@@ -211,7 +249,7 @@ static struct testfs_dir_entry *testfs_lookup_by_name(struct inode *dir,
 			if (tde[j].name_len != name_len)
 				continue;
 
-			if (!strncmp(dentry->d_name.name, tde[j].name,name_len)) {
+			if (!strncmp(qstr->name, tde[j].name, name_len)) {
 				*pg = page;
 				return &tde[j];
 			}
@@ -222,7 +260,7 @@ static struct testfs_dir_entry *testfs_lookup_by_name(struct inode *dir,
 	return ERR_PTR(-ENOENT);
 }
 
-static int testfs_unlink(struct inode *dir, struct dentry *dentry)
+static int __testfs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct inode * inode = d_inode(dentry);
 	struct testfs_dir_entry *tde;
@@ -231,7 +269,7 @@ static int testfs_unlink(struct inode *dir, struct dentry *dentry)
 	int ret;
 	loff_t pos;
 
-	tde = testfs_lookup_by_name(dir, dentry, &page);
+	tde = testfs_lookup_by_name(dir, &dentry->d_name, &page);
 	if (IS_ERR(tde))
 		return PTR_ERR(tde);
 
@@ -265,12 +303,23 @@ out:
 	return ret;
 }
 
-static int testfs_name_to_ino(struct inode *dir, struct dentry *dentry, ino_t *ino)
+static int testfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	ret = __testfs_unlink(dir, dentry);
+	trace_testfs_unlink(dir, dentry, inode, inode->i_mode, ret);
+	return ret;
+}
+
+static int testfs_name_to_ino(struct inode *dir, const struct qstr *qstr,
+			      ino_t *ino)
 {
 	struct testfs_dir_entry *tde;
 	struct page *page;
 
-	tde = testfs_lookup_by_name(dir, dentry, &page);
+	tde = testfs_lookup_by_name(dir, qstr, &page);
 	if (IS_ERR(tde))
 		return PTR_ERR(tde);
 
@@ -287,10 +336,12 @@ static struct dentry *testfs_lookup(struct inode *dir, struct dentry *dentry,
 	ino_t ino;
 	int res;
 
-	res = testfs_name_to_ino(dir, dentry, &ino);
+	res = testfs_name_to_ino(dir, &dentry->d_name, &ino);
 	if (res) {
-		if (res != -ENOENT)
+		if (res != -ENOENT) {
+			trace_testfs_lookup(dir, dentry, NULL, 0, res);
 			return ERR_PTR(res);
+		}
 		inode = NULL;
 	} else {
 		inode = testfs_iget(dir->i_sb, ino);
@@ -300,9 +351,53 @@ static struct dentry *testfs_lookup(struct inode *dir, struct dentry *dentry,
 		}
 	}
 
+	trace_testfs_lookup(dir, dentry, IS_ERR(inode) ? NULL : inode, 0,
+			    PTR_ERR_OR_ZERO(inode));
 	return d_splice_alias(inode, dentry);
 }
 
+/*
+ * ".." is the second entry of a directory, testfs_make_empty_dir() and
+ * mktestfs put it there: read it in place, without a name scan. Only a
+ * directory repaired by testfsck may have it elsewhere.
+ */
+static int testfs_dotdot_ino(struct inode *dir, ino_t *ino)
+{
+	static const struct qstr dotdot = QSTR_INIT("..", 2);
+	struct testfs_dir_entry *tde;
+	struct page *page;
+
+	if (dir->i_size < 2 * TEST_FS_DENTRY_SIZE)
+		return -ENOENT;
+
+	page = testfs_get_page(dir, 0);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	tde = (struct testfs_dir_entry *)page_address(page) + 1;
+	if (tde->name_len == 2 && !memcmp(tde->name, "..", 2)) {
+		*ino = le32_to_cpu(tde->inode);
+		testfs_put_page(page);
+		return 0;
+	}
+	testfs_put_page(page);
+
+	return testfs_name_to_ino(dir, &dotdot, ino);
+}
+
+/* the parent of a directory, for file handles whose dentry is gone */
+struct dentry *testfs_get_parent(struct dentry *child)
+{
+	struct inode *dir = d_inode(child);
+	ino_t ino;
+	int ret;
+
+	ret = testfs_dotdot_ino(dir, &ino);
+	if (ret)
+		return ERR_PTR(ret);
+
+	return d_obtain_alias(testfs_iget(dir->i_sb, ino));
+}
+
 static int testfs_make_empty_dir(struct inode *parent, struct inode *new_dir)
 {
 	struct page *page;
@@ -368,6 +463,7 @@ static int testfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 		goto destroy_inode;
 	}
 
+	trace_testfs_mkdir(dir, dentry, inode, mode, 0);
 	return 0;
 
 destroy_inode:
@@ -375,6 +471,7 @@ destroy_inode:
         discard_new_inode(inode);
 dec_dir_link:
 	inode_dec_link_count(dir);
+	trace_testfs_mkdir(dir, dentry, NULL, mode, ret);
 	return ret;
 }
 
@@ -446,7 +543,7 @@ static int testfs_rmdir(struct inode *dir, struct dentry *dentry)
 	int ret = -ENOTEMPTY;
 
 	if (testfs_dir_empty(inode)) {
-		ret = testfs_unlink(dir, dentry);
+		ret = __testfs_unlink(dir, dentry);
 		if (!ret) {
 			inode->i_size = 0;
 			inode_dec_link_count(inode);
@@ -454,6 +551,7 @@ static int testfs_rmdir(struct inode *dir, struct dentry *dentry)
 		}
 	}
 
+	trace_testfs_rmdir(dir, dentry, inode, inode->i_mode, ret);
 	return ret;
 }
 
@@ -472,6 +570,8 @@ static int testfs_readdir(struct file *file, struct dir_context *ctx)
 	bool need_revalidate = !inode_eq_iversion(inode, file->f_version);
 #endif
 
+	trace_testfs_readdir(inode, pos);
+
 	if (pos > inode->i_size - TEST_FS_DENTRY_SIZE)
 		return 0;
 
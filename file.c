@@ -20,30 +20,276 @@
  *
  */
 #include "testfs.h"
+#include "testfs_trace.h"
 
-long testfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/*
+ * SEEK_DATA and SEEK_HOLE are answered from the block map. Dirty pages
+ * always have blocks behind them, allocated when they were dirtied, so the
+ * page cache never needs to be looked at.
+ */
+static loff_t testfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	trace_testfs_llseek(inode, offset, whence);
+
+	switch (whence) {
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &testfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &testfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+static int testfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+			u64 start, u64 len)
+{
+	int ret;
+
+	trace_testfs_fiemap(inode, start, len);
+
+	inode_lock_shared(inode);
+	ret = iomap_fiemap(inode, fieinfo, start, len, &testfs_iomap_ops);
+	inode_unlock_shared(inode);
+
+	return ret;
+}
+
+/*
+ * The file stays open and in use, writes wait for i_rwsem, write faults
+ * for the page locks taken by testfs_defrag_file().
+ */
+static int testfs_ioc_defrag(struct file *filp)
 {
 	struct inode *inode = file_inode(filp);
+	int ret;
 
-	log_err("ino:%lu cmd: %x, arg:%lx\n", inode->i_ino, cmd, arg);
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
 
-	return 0;
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	ret = testfs_defrag_file(inode);
+	inode_unlock(inode);
+
+	mnt_drop_write_file(filp);
+	return ret;
 }
 
-#ifdef CONFIG_COMPAT
-long testfs_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/*
+ * Taking a snapshot freezes the volume, it can not hold write access to
+ * the mount meanwhile; dropping one only needs that.
+ */
+static int testfs_ioc_snap(struct file *filp, unsigned int cmd)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (cmd == TESTFS_IOC_SNAP_CREATE)
+		return __mnt_is_readonly(filp->f_path.mnt) ? -EROFS :
+			testfs_snap_create(sb);
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+	ret = testfs_snap_drop(sb);
+	mnt_drop_write_file(filp);
+	return ret;
+}
+
+/*
+ * FS_IOC_SETFLAGS changes FS_COMPR_FL only: on a directory for the files
+ * created in it later, on a regular file while it is empty. Clearing it
+ * stops compression, the clusters compressed so far are stored plain as
+ * they are written to.
+ */
+static int testfs_ioc_setflags(struct file *filp, unsigned int __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct testfs_inode *ti = TESTFS_I(inode);
+	unsigned int flags;
+	int ret;
+
+	if (!inode_owner_or_capable(inode))
+		return -EACCES;
+	if (get_user(flags, arg))
+		return -EFAULT;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	ret = -EOPNOTSUPP;
+	if (((flags ^ ti->i_flags) & TESTFS_FL_USER_VISIBLE &
+	     ~TESTFS_FL_USER_MODIFIABLE) || (flags & ~TESTFS_FL_USER_VISIBLE))
+		goto out;
+	ret = 0;
+	if (!((flags ^ ti->i_flags) & TESTFS_COMPR_FL))
+		goto out;
+
+	if (flags & TESTFS_COMPR_FL) {
+		/*
+		 * a cluster is a number of whole pages, rewritten in place at
+		 * writeback, never untorn
+		 */
+		ret = -EOPNOTSUPP;
+		if (inode->i_sb->s_blocksize != PAGE_SIZE ||
+		    (ti->i_flags & TESTFS_ATOMIC_FL))
+			goto out;
+		ret = -EINVAL;
+		if (S_ISREG(inode->i_mode) && i_size_read(inode))
+			goto out;
+		ret = 0;
+	}
+
+	ti->i_flags ^= TESTFS_COMPR_FL;
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+	return ret;
+}
+
+/*
+ * TESTFS_ATOMIC_FL only changes how later direct writes of one unit are
+ * done, the blocks the file has stay where they are. Compressed files go through
+ * the page cache only, they can not have it.
+ */
+static int testfs_ioc_set_atomic(struct file *filp, __u32 __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct testfs_inode *ti = TESTFS_I(inode);
+	__u32 enable;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!inode_owner_or_capable(inode))
+		return -EACCES;
+	if (get_user(enable, arg))
+		return -EFAULT;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	ret = -EOPNOTSUPP;
+	if (enable && testfs_compr_inode(inode))
+		goto out;
+	ret = 0;
+	if (!enable == !(ti->i_flags & TESTFS_ATOMIC_FL))
+		goto out;
+
+	ti->i_flags ^= TESTFS_ATOMIC_FL;
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+	return ret;
+}
+
+static int testfs_ioc_get_atomic(struct file *filp,
+				struct testfs_atomic_info __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct testfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct testfs_atomic_info info = {
+		.enabled	= !!(TESTFS_I(inode)->i_flags & TESTFS_ATOMIC_FL),
+		.unit_min	= sbi->s_awu_min,
+		.unit_max	= sbi->s_awu_max,
+	};
+
+	return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+}
+
+/*
+ * FICLONE, FICLONERANGE and FIDEDUPERANGE never get here, the VFS turns
+ * them into ->remap_file_range() calls.
+ */
+long testfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct inode *inode = file_inode(filp);
 
+	trace_testfs_ioctl(inode, cmd, arg);
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		return put_user(TESTFS_I(inode)->i_flags &
+				TESTFS_FL_USER_VISIBLE, (int __user *)arg);
+	case FS_IOC_SETFLAGS:
+		return testfs_ioc_setflags(filp, (unsigned int __user *)arg);
+	case TESTFS_IOC_DEFRAG:
+		return testfs_ioc_defrag(filp);
+	case TESTFS_IOC_SNAP_CREATE:
+	case TESTFS_IOC_SNAP_DROP:
+		return testfs_ioc_snap(filp, cmd);
+	case TESTFS_IOC_GET_ATOMIC:
+		return testfs_ioc_get_atomic(filp,
+				(struct testfs_atomic_info __user *)arg);
+	case TESTFS_IOC_SET_ATOMIC:
+		return testfs_ioc_set_atomic(filp, (__u32 __user *)arg);
+	}
+
 	log_err("ino:%lu cmd: %x, arg:%lx\n", inode->i_ino, cmd, arg);
 
-	return 0;
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+long testfs_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FS_IOC32_GETFLAGS:
+		cmd = FS_IOC_GETFLAGS;
+		break;
+	case FS_IOC32_SETFLAGS:
+		cmd = FS_IOC_SETFLAGS;
+		break;
+	}
+	return testfs_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
 }
 #endif
 
 static int testfs_file_open(struct inode *inode, struct file *file)
 {
 	log_err("ino:%lu\n", inode->i_ino);
+	trace_testfs_open(inode, file);
+
+	/*
+	 * Reads and direct writes honor IOCB_NOWAIT, io_uring issues them
+	 * inline and only punts to a worker on -EAGAIN; buffered reads that
+	 * miss the page cache wait for the page asynchronously.
+	 */
+	file->f_mode |= FMODE_NOWAIT | FMODE_BUF_RASYNC;
+#ifdef FMODE_CAN_ATOMIC_WRITE
+	/* RWF_ATOMIC, on kernels that have it */
+	file->f_mode |= FMODE_CAN_ATOMIC_WRITE;
+#endif
 
 	return 0;
 }
@@ -51,6 +297,7 @@ static int testfs_file_open(struct inode *inode, struct file *file)
 static int testfs_file_release(struct inode *inode, struct file *file)
 {
 	log_err("ino:%lu\n", inode->i_ino);
+	trace_testfs_release(inode, file);
 
 	return 0;
 }
@@ -59,32 +306,746 @@ int testfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
         int ret;
 
+	trace_testfs_fsync(file_inode(file), start, end, datasync);
+
         ret = generic_file_fsync(file, start, end, datasync);
+	if (!ret)
+		ret = testfs_flush_devs(file_inode(file)->i_sb);
         if (ret == -EIO)
                 /* We don't really know where the IO error happened... */
                 log_err("detected IO error when writing metadata buffers");
         return ret;
 }
 
+static ssize_t testfs_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+	ret = iomap_dio_rw(iocb, to, &testfs_iomap_ops, NULL,
+			   is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+static ssize_t testfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t ret;
+
+	trace_testfs_read_iter(iocb, iov_iter_count(to));
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	/* compressed data only ever goes through the page cache */
+	if (testfs_compr_inode(file_inode(iocb->ki_filp)))
+		iocb->ki_flags &= ~IOCB_DIRECT;
+
+	/* -ENOTBLK: iomap could not do it direct, read through the cache */
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = testfs_dio_read_iter(iocb, to);
+		if (ret != -ENOTBLK)
+			return ret;
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	}
+
+	return generic_file_read_iter(iocb, to);
+}
+
+/*
+ * Extending direct writes complete asynchronously and end_io moves i_size.
+ * The blocks such a write allocated past EOF hold stale data until its
+ * bios are done, so i_size never passes the start of an extending write
+ * still in flight: they are queued on i_dio_extends in issue order and
+ * i_size only grows over completed ones that nothing pending precedes. A
+ * write that fails or comes up short gives back the blocks it allocated
+ * past EOF first, that range reads as a hole; one that wrote nothing is
+ * dropped from the queue and leaves i_size alone.
+ */
+struct testfs_dio_extend {
+	struct list_head list;
+	struct kiocb *iocb;
+	loff_t pos, end;	/* written range, end as requested until done */
+	loff_t isize;		/* i_size when the write was issued */
+	bool done;
+};
+
+static int testfs_dio_extend_start(struct kiocb *iocb, size_t count)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct testfs_inode *ti = TESTFS_I(inode);
+	struct testfs_dio_extend *de;
+
+	de = kmalloc(sizeof(*de), iocb->ki_flags & IOCB_NOWAIT ?
+				  GFP_NOWAIT : GFP_NOFS);
+	if (!de)
+		return iocb->ki_flags & IOCB_NOWAIT ? -EAGAIN : -ENOMEM;
+
+	de->iocb = iocb;
+	de->pos = iocb->ki_pos;
+	de->end = iocb->ki_pos + count;
+	de->isize = i_size_read(inode);
+	de->done = false;
+
+	spin_lock(&ti->i_dio_lock);
+	list_add_tail(&de->list, &ti->i_dio_extends);
+	spin_unlock(&ti->i_dio_lock);
+	return 0;
+}
+
+/* false if @iocb was not an extending write, or is already accounted */
+static bool testfs_dio_extend_done(struct kiocb *iocb, ssize_t size,
+				int error)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct testfs_inode *ti = TESTFS_I(inode);
+	struct testfs_dio_extend *de, *tmp, *found = NULL;
+	loff_t limit = LLONG_MAX, new_size = 0, written;
+	LIST_HEAD(done);
+
+	spin_lock(&ti->i_dio_lock);
+	list_for_each_entry(de, &ti->i_dio_extends, list) {
+		if (de->iocb == iocb && !de->done) {
+			found = de;
+			break;
+		}
+	}
+	spin_unlock(&ti->i_dio_lock);
+	if (!found)
+		return false;
+
+	/*
+	 * still pending, nobody moves i_size over the range meanwhile; but
+	 * a truncate below where the write started drops it altogether
+	 */
+	written = found->pos + (error || size < 0 ? 0 : size);
+	if (i_size_read(inode) < found->isize)
+		written = found->pos;
+	if (written < found->end)
+		testfs_punch_blocks(inode, max(written, found->isize),
+				    found->end);
+
+	spin_lock(&ti->i_dio_lock);
+	found->end = written;
+	found->done = true;
+	if (written == found->pos)
+		list_move(&found->list, &done);
+
+	list_for_each_entry(de, &ti->i_dio_extends, list)
+		if (!de->done)
+			limit = min(limit, de->pos);
+	list_for_each_entry_safe(de, tmp, &ti->i_dio_extends, list) {
+		if (!de->done || de->end > limit)
+			continue;
+		new_size = max(new_size, de->end);
+		list_move(&de->list, &done);
+	}
+	if (new_size > i_size_read(inode))
+		i_size_write(inode, new_size);
+	else
+		new_size = 0;
+	spin_unlock(&ti->i_dio_lock);
+
+	list_for_each_entry_safe(de, tmp, &done, list)
+		kfree(de);
+	if (new_size)
+		mark_inode_dirty(inode);
+	return true;
+}
+
+/* iomap only updates the in-memory i_size for direct writes */
+static int testfs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+				int error, unsigned flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (testfs_dio_extend_done(iocb, size, error) || error)
+		return error;
+
+	if (size && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_dio_ops testfs_dio_write_ops = {
+	.end_io		= testfs_dio_write_end_io,
+};
+
+/* an untorn write is one power of two unit, aligned, within the limits */
+static int testfs_atomic_write_check(struct kiocb *iocb, size_t count)
+{
+	struct testfs_sb_info *sbi = file_inode(iocb->ki_filp)->i_sb->s_fs_info;
+
+	if (!is_power_of_2(count) || !IS_ALIGNED(iocb->ki_pos, count))
+		return -EINVAL;
+	if (count < sbi->s_awu_min || count > sbi->s_awu_max)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * Untorn writes are asked for per write with RWF_ATOMIC on kernels that
+ * have it, else per file with TESTFS_ATOMIC_FL: there the writes that are
+ * one unit are untorn, the others are done as on any file.
+ */
+static bool testfs_atomic_iocb(struct kiocb *iocb, size_t count)
+{
+#ifdef IOCB_ATOMIC
+	if (iocb->ki_flags & IOCB_ATOMIC)
+		return true;
+#endif
+	return (TESTFS_I(file_inode(iocb->ki_filp))->i_flags &
+		TESTFS_ATOMIC_FL) && !testfs_atomic_write_check(iocb, count);
+}
+
+/*
+ * An untorn direct write: the data is copied from the user and written
+ * out of place by testfs_map_atomic(). It is never cut
+ * short, and never goes through the page cache. Called with i_rwsem held.
+ */
+static ssize_t testfs_atomic_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct page *pages[TEST_FS_N_BLOCKS] = { };
+	size_t count = iov_iter_count(from), n;
+	loff_t pos = iocb->ki_pos, end = pos + count;
+	u32 i, nr = DIV_ROUND_UP(count, PAGE_SIZE);
+	ssize_t ret;
+
+	ret = testfs_atomic_write_check(iocb, count);
+	if (ret)
+		return ret;
+
+	inode_dio_wait(inode);
+	ret = filemap_write_and_wait_range(inode->i_mapping, pos, end - 1);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		pages[i] = alloc_page(GFP_NOFS);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		n = min_t(size_t, count - i * PAGE_SIZE, PAGE_SIZE);
+		if (copy_page_from_iter(pages[i], 0, n, from) != n) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+	ret = testfs_map_atomic(inode, pos >> inode->i_blkbits,
+				count >> inode->i_blkbits, pages, end);
+	if (ret)
+		goto out;
+
+	invalidate_inode_pages2_range(inode->i_mapping, pos >> PAGE_SHIFT,
+				      (end - 1) >> PAGE_SHIFT);
+	iocb->ki_pos = end;
+	ret = count;
+out:
+	/* nothing of a failed write counts as written */
+	if (ret < 0)
+		iov_iter_revert(from, count - iov_iter_count(from));
+	for (i = 0; i < nr && pages[i]; i++)
+		__free_page(pages[i]);
+	return ret;
+}
+
+static ssize_t testfs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	size_t count = iov_iter_count(from);
+	ssize_t ret;
+
+	/* allocating and writing the new run both block */
+	if (testfs_atomic_iocb(iocb, count))
+		return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN :
+			testfs_atomic_write(iocb, from);
+
+	if (iocb->ki_pos + count <= i_size_read(inode))
+		return iomap_dio_rw(iocb, from, &testfs_iomap_ops,
+				    &testfs_dio_write_ops, is_sync_kiocb(iocb));
+
+	ret = testfs_dio_extend_start(iocb, count);
+	if (ret)
+		return ret;
+
+	ret = iomap_dio_rw(iocb, from, &testfs_iomap_ops, &testfs_dio_write_ops,
+			   is_sync_kiocb(iocb));
+
+	/* failed before any bio was built, end_io was never called */
+	if (ret != -EIOCBQUEUED)
+		testfs_dio_extend_done(iocb, 0, ret < 0 ? ret : 0);
+	return ret;
+}
+
+/*
+ * iomap_dio_rw() gives -ENOTBLK when the page cache over the range could
+ * not be invalidated, and may write less than asked for. The rest goes
+ * through the cache then, and is written back and dropped from it before
+ * returning as a direct write would be. @written is what the direct
+ * write did. Called with i_rwsem held.
+ */
+static ssize_t testfs_dio_fallback_write(struct kiocb *iocb,
+				struct iov_iter *from, ssize_t written)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+	int err;
+
+	/* as for any buffered write, see testfs_file_write_iter() */
+	if (!list_empty_careful(&TESTFS_I(inode)->i_dio_extends))
+		inode_dio_wait(inode);
+
+	ret = iomap_file_buffered_write(iocb, from, &testfs_iomap_ops);
+	if (ret <= 0)
+		return written ? written : ret;
+	iocb->ki_pos += ret;
+
+	err = filemap_write_and_wait_range(inode->i_mapping, pos,
+					   pos + ret - 1);
+	if (err)
+		return written ? written : err;
+	invalidate_mapping_pages(inode->i_mapping, pos >> PAGE_SHIFT,
+				 (pos + ret - 1) >> PAGE_SHIFT);
+	return written + ret;
+}
+
+static ssize_t testfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	ssize_t ret;
+
+	trace_testfs_write_iter(iocb, iov_iter_count(from));
+
+	/* as for reads */
+	if (testfs_compr_inode(inode))
+		iocb->ki_flags &= ~IOCB_DIRECT;
+#ifdef IOCB_ATOMIC
+	/* only direct writes are untorn */
+	if ((iocb->ki_flags & IOCB_ATOMIC) && !(iocb->ki_flags & IOCB_DIRECT))
+		return -EOPNOTSUPP;
+#endif
+
+	/*
+	 * generic_write_checks() turns away buffered IOCB_NOWAIT writes with
+	 * -EINVAL. -EOPNOTSUPP makes io_uring retry them from a worker, as
+	 * for the other block file systems.
+	 */
+	if (nowait && !(iocb->ki_flags & IOCB_DIRECT))
+		return -EOPNOTSUPP;
+
+	if (nowait) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	/* the write does not fit in the inode any more */
+	if (testfs_has_inline_data(inode) &&
+	    iocb->ki_pos + iov_iter_count(from) > TESTFS_INLINE_DATA_SIZE) {
+		ret = nowait ? -EAGAIN : testfs_convert_inline_data(inode);
+		if (ret)
+			goto out_unlock;
+	}
+
+	/*
+	 * A buffered write past EOF would move i_size over blocks that
+	 * extending direct writes still fill. New ones are only queued
+	 * under i_rwsem, held here.
+	 */
+	if (!(iocb->ki_flags & IOCB_DIRECT) &&
+	    !list_empty_careful(&TESTFS_I(inode)->i_dio_extends))
+		inode_dio_wait(inode);
+
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = testfs_dio_write_iter(iocb, from);
+		if (ret == -ENOTBLK && nowait)
+			ret = -EAGAIN;
+		else if (!nowait && (ret == -ENOTBLK ||
+				     (ret >= 0 && iov_iter_count(from))))
+			ret = testfs_dio_fallback_write(iocb, from,
+							max_t(ssize_t, ret, 0));
+	} else {
+		ret = iomap_file_buffered_write(iocb, from, &testfs_iomap_ops);
+		if (ret > 0)
+			iocb->ki_pos += ret;
+	}
+
+out_unlock:
+	inode_unlock(inode);
+
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static vm_fault_t testfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	trace_testfs_page_mkwrite(inode, page_offset(vmf->page));
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+
+	/*
+	 * Blocks are allocated here, on the first write to a page, so holes
+	 * that are only read through a mapping stay holes.
+	 */
+	if (testfs_has_inline_data(inode))
+		ret = testfs_inline_page_mkwrite(vmf);
+	else
+		ret = iomap_page_mkwrite(vmf, &testfs_iomap_ops);
+
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct testfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= testfs_page_mkwrite,
+};
+
+static int testfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	trace_testfs_mmap(file_inode(file), vma);
+
+	file_accessed(file);
+	vma->vm_ops = &testfs_file_vm_ops;
+
+	return 0;
+}
+
+/* the generic helpers, traced: they end up in ->read_iter and ->write_iter */
+static ssize_t testfs_file_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	ret = generic_file_splice_read(in, ppos, pipe, len, flags);
+	trace_testfs_splice_read(file_inode(in), pos, len, ret);
+	return ret;
+}
+
+static ssize_t testfs_file_splice_write(struct pipe_inode_info *pipe,
+				struct file *out, loff_t *ppos, size_t len,
+				unsigned int flags)
+{
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	ret = iter_file_splice_write(pipe, out, ppos, len, flags);
+	trace_testfs_splice_write(file_inode(out), pos, len, ret);
+	return ret;
+}
+
+/*
+ * testfs_copy_file_range - copy between two files of the same testfs
+ *
+ * Block aligned ranges are copied disk to disk, extent by extent, without
+ * going through the page cache of either file. Holes in the source stay
+ * holes in the destination, blocks the destination already has there are
+ * zeroed. Anything else, unaligned ranges, inline or compressed files and
+ * copies from another file system, goes the generic splice way.
+ */
+static ssize_t testfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out,
+				size_t len, unsigned int flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct super_block *sb = dst->i_sb;
+	unsigned int bits = sb->s_blocksize_bits;
+	u32 iblock, oblock, nblocks, done, sbno, dbno, n;
+	loff_t isize;
+	bool new;
+	ssize_t ret;
+	int err = 0;
+
+	if (src->i_sb != sb)
+		return -EXDEV;
+
+	lock_two_nondirectories(src, dst);
+
+	ret = -EOPNOTSUPP;
+	if (testfs_has_inline_data(src) || testfs_has_inline_data(dst) ||
+	    testfs_compr_inode(src) || testfs_compr_inode(dst))
+		goto out_unlock;
+
+	isize = i_size_read(src);
+	if (pos_in >= isize) {
+		ret = 0;
+		goto out_unlock;
+	}
+	len = min_t(loff_t, len, isize - pos_in);
+
+	/*
+	 * A partial last block is fine when it ends the source file and
+	 * nothing of the destination follows it.
+	 */
+	if (!IS_ALIGNED(pos_in | pos_out, sb->s_blocksize))
+		goto out_unlock;
+	if (!IS_ALIGNED(len, sb->s_blocksize) &&
+	    (pos_in + len != isize || pos_out + len < i_size_read(dst)))
+		goto out_unlock;
+
+	ret = file_modified(file_out);
+	if (ret)
+		goto out_unlock;
+
+	ret = filemap_write_and_wait_range(src->i_mapping, pos_in,
+					   pos_in + len - 1);
+	if (ret)
+		goto out_unlock;
+	ret = filemap_write_and_wait_range(dst->i_mapping, pos_out,
+					   pos_out + len - 1);
+	if (ret)
+		goto out_unlock;
+	truncate_inode_pages_range(dst->i_mapping, pos_out,
+			round_up(pos_out + len, sb->s_blocksize) - 1);
+
+	iblock = pos_in >> bits;
+	oblock = pos_out >> bits;
+	nblocks = DIV_ROUND_UP(len, sb->s_blocksize);
+
+	for (done = 0; done < nblocks; done += n) {
+		err = testfs_map_blocks(src, iblock + done, nblocks - done,
+					&sbno, &new, 0);
+		if (err < 0)
+			break;
+		n = err;
+
+		err = testfs_map_blocks(dst, oblock + done, n, &dbno, &new, 0);
+		if (err < 0)
+			break;
+		n = err;
+
+		/* written blocks, zeroed ones too, must not be shared */
+		if (sbno || dbno) {
+			err = testfs_map_blocks(dst, oblock + done, n, &dbno,
+						&new, TESTFS_MAP_CREATE);
+			if (err < 0)
+				break;
+			n = err;
+		}
+
+		if (sbno)
+			err = testfs_copy_blocks(sb, sbno, dbno, n);
+		else if (dbno)
+			err = testfs_zero_blocks(sb, dbno, n);
+		if (err)
+			break;
+	}
+
+	/* report what was copied, the error only if nothing was */
+	ret = done ? min_t(loff_t, (loff_t)done << bits, len) : err;
+	if (ret > 0 && pos_out + ret > i_size_read(dst)) {
+		i_size_write(dst, pos_out + ret);
+		mark_inode_dirty(dst);
+	}
+
+out_unlock:
+	unlock_two_nondirectories(src, dst);
+
+	if (ret == -EOPNOTSUPP)
+		ret = generic_copy_file_range(file_in, pos_in, file_out,
+					      pos_out, len, flags);
+	trace_testfs_copy_file_range(src, pos_in, dst, pos_out, len, flags, ret);
+	return ret;
+}
+
+/*
+ * testfs_remap_file_range - FICLONE, FICLONERANGE and FIDEDUPERANGE
+ *
+ * The destination range is pointed at the source blocks and every block
+ * gains a reference, no data moves. A later write to either file copies
+ * the blocks it touches, see testfs_unshare_blocks().
+ */
+static loff_t testfs_remap_file_range(struct file *file_in, loff_t pos_in,
+				struct file *file_out, loff_t pos_out,
+				loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct testfs_sb_info *sbi = dst->i_sb->s_fs_info;
+	unsigned int bits = dst->i_blkbits;
+	int ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+
+	if (!sbi->s_refcount_blknr)
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+
+	/* inline data has no block to share, compressed clusters none apart */
+	ret = -EOPNOTSUPP;
+	if (testfs_has_inline_data(src) || testfs_compr_inode(src) ||
+	    testfs_compr_inode(dst))
+		goto out_unlock;
+
+	if (testfs_has_inline_data(dst)) {
+		ret = testfs_convert_inline_data(dst);
+		if (ret)
+			goto out_unlock;
+	}
+
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || len == 0)
+		goto out_unlock;
+
+	/* the destination pages would hide the shared blocks */
+	truncate_inode_pages_range(dst->i_mapping, pos_out,
+				   PAGE_ALIGN(pos_out + len) - 1);
+
+	ret = testfs_remap_blocks(src, pos_in >> bits, dst, pos_out >> bits,
+				  DIV_ROUND_UP(len, i_blocksize(dst)));
+	if (ret)
+		goto out_unlock;
+
+	if (pos_out + len > i_size_read(dst)) {
+		i_size_write(dst, pos_out + len);
+		mark_inode_dirty(dst);
+	}
+
+out_unlock:
+	unlock_two_nondirectories(src, dst);
+	if (ret >= 0)
+		ret = 0;
+	trace_testfs_remap_file_range(src, pos_in, dst, pos_out, len,
+				      remap_flags, ret);
+	return ret < 0 ? ret : len;
+}
+
 int testfs_getattr(const struct path *path, struct kstat *stat,
                 unsigned int request_mask, unsigned int query_flags)
 {
         struct inode *inode = d_backing_inode(path->dentry);
 
 	log_err("ino:%lu\n", inode->i_ino);
+	trace_testfs_getattr(inode);
 
         generic_fillattr(inode, stat);
+	if (TESTFS_I(inode)->i_flags & TESTFS_COMPR_FL)
+		stat->attributes |= STATX_ATTR_COMPRESSED;
+	stat->attributes_mask |= STATX_ATTR_COMPRESSED;
+#ifdef STATX_WRITE_ATOMIC
+	/* the limits of TESTFS_IOC_GET_ATOMIC, for RWF_ATOMIC */
+	if ((request_mask & STATX_WRITE_ATOMIC) && S_ISREG(inode->i_mode) &&
+	    !testfs_compr_inode(inode)) {
+		struct testfs_sb_info *sbi = inode->i_sb->s_fs_info;
+
+		stat->result_mask |= STATX_WRITE_ATOMIC;
+		stat->atomic_write_unit_min = sbi->s_awu_min;
+		stat->atomic_write_unit_max = sbi->s_awu_max;
+		stat->atomic_write_segments_max = 1;
+		stat->attributes |= STATX_ATTR_WRITE_ATOMIC;
+	}
+	stat->attributes_mask |= STATX_ATTR_WRITE_ATOMIC;
+#endif
         return 0;
 }
 
+/*
+ * A smaller size clears the rest of the last block, of the inode for
+ * inline data, and frees the blocks past it, so that a later extension
+ * reads zeroes rather than what was truncated away.
+ */
+static int testfs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct testfs_inode *ti = TESTFS_I(inode);
+	loff_t size = iattr->ia_size, old_size = i_size_read(inode);
+	int ret;
+
+	ret = setattr_prepare(dentry, iattr);
+	if (ret)
+		return ret;
+
+	if (iattr->ia_valid & ATTR_SIZE) {
+		/* extending direct writes in flight move i_size as they end */
+		inode_dio_wait(inode);
+
+		/* grows past the inode, the data moves to a block first */
+		if (testfs_has_inline_data(inode) &&
+		    size > TESTFS_INLINE_DATA_SIZE) {
+			ret = testfs_convert_inline_data(inode);
+			if (ret)
+				return ret;
+		}
+
+		if (!testfs_has_inline_data(inode) && size < old_size) {
+			ret = iomap_truncate_page(inode, size, NULL,
+						  &testfs_iomap_ops);
+			if (ret)
+				return ret;
+		}
+
+		truncate_setsize(inode, size);
+		if (size < old_size) {
+			if (testfs_has_inline_data(inode))
+				memset(ti->i_data + size, 0,
+				       TESTFS_INLINE_DATA_SIZE - size);
+			else
+				testfs_punch_blocks(inode, size, LLONG_MAX);
+		}
+	}
+
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
 const struct inode_operations testfs_file_iops = {
+        .setattr        = testfs_setattr,
         .getattr        = testfs_getattr,
+        .fiemap         = testfs_fiemap,
 };
 
 const struct file_operations testfs_file_fops = {
-        .llseek         = generic_file_llseek,
-        .read_iter      = generic_file_read_iter,
-        .write_iter     = generic_file_write_iter,
+        .llseek         = testfs_file_llseek,
+        .read_iter      = testfs_file_read_iter,
+        .write_iter     = testfs_file_write_iter,
+        .iopoll         = iomap_dio_iopoll,
+        .mmap           = testfs_file_mmap,
+        .splice_read    = testfs_file_splice_read,
+        .splice_write   = testfs_file_splice_write,
+        .copy_file_range = testfs_copy_file_range,
+        .remap_file_range = testfs_remap_file_range,
         .unlocked_ioctl = testfs_ioctl,
 #ifdef CONFIG_COMPAT
         .compat_ioctl   = testfs_compat_ioctl,
@@ -27,6 +27,9 @@ static void init_once(void *foo)
 {
 	struct testfs_inode *ti = (struct testfs_inode *)foo;
 
+	init_rwsem(&ti->i_map_sem);
+	spin_lock_init(&ti->i_dio_lock);
+	INIT_LIST_HEAD(&ti->i_dio_extends);
 	inode_init_once(&ti->vfs_inode);
 }
 
@@ -35,7 +38,9 @@ int testfs_inode_cache_init(void)
 	log_err("\n");
 
 	testfs_icachep = kmem_cache_create("testfs_icache",
-				sizeof(struct testfs_inode), 0,
+				sizeof(struct testfs_inode),
+				/* keep i_data within one page for iomap */
+				__alignof__(struct testfs_inode),
 				(SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD|
 					SLAB_ACCOUNT),
 				init_once);
@@ -82,10 +87,14 @@ static int testfs_free_disk_inode(struct inode *inode)
 {
 	struct buffer_head *bh;
 	struct super_block *sb = inode->i_sb;
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bits_per_block = sb->s_blocksize * 8;
 	unsigned long *bitmap;
+	bool freed;
 
 	/* read inode bitmap from disk */
-	bh = sb_bread_unmovable(sb, TEST_FS_BLKID_IBITMAP);
+	bh = sb_bread_unmovable(sb, sbi->s_ibitmap_blkid +
+					inode->i_ino / bits_per_block);
 	if (!bh) {
 		log_err("failed to read inode bitmap\n");
 		return -EIO;
@@ -93,7 +102,17 @@ static int testfs_free_disk_inode(struct inode *inode)
 
 	bitmap = (unsigned long *)bh->b_data;
 
-	clear_bit_le(inode->i_ino, bitmap);
+	if (testfs_snap_cow(sb, bh->b_blocknr)) {
+		brelse(bh);
+		return -EIO;
+	}
+
+	spin_lock(&sbi->s_ialloc_lock);
+	freed = __test_and_clear_bit_le(inode->i_ino % bits_per_block, bitmap);
+	spin_unlock(&sbi->s_ialloc_lock);
+
+	if (freed)
+		percpu_counter_inc(&sbi->s_freeinodes_counter);
 
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
@@ -102,6 +121,25 @@ static int testfs_free_disk_inode(struct inode *inode)
 	return 0;
 }
 
+/* 1 if @ino is set in the inode bitmap, 0 if it is free */
+int testfs_inode_in_use(struct super_block *sb, ino_t ino)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bits_per_block = sb->s_blocksize * 8;
+	struct buffer_head *bh;
+	int ret;
+
+	bh = sb_bread(sb, sbi->s_ibitmap_blkid + ino / bits_per_block);
+	if (!bh) {
+		log_err("failed to read inode bitmap\n");
+		return -EIO;
+	}
+
+	ret = test_bit_le(ino % bits_per_block, bh->b_data);
+	brelse(bh);
+	return ret;
+}
+
 /*
  * testfs_get_disk_inode - get inode from the disk's inode table
  *
@@ -132,6 +170,100 @@ struct testfs_disk_inode *testfs_get_disk_inode(struct super_block *sb,
 	return (struct testfs_disk_inode *)(tmp->b_data + offset);
 }
 
+/*
+ * A mounted snapshot reads its inodes through the live volume, into
+ * @copy: the live inode table block may be copied away and change.
+ */
+static struct testfs_disk_inode *testfs_get_snap_inode(struct super_block *sb,
+				ino_t ino, struct testfs_disk_inode *copy)
+{
+	unsigned long blkid, offset;
+	int ret;
+
+	if (testfs_get_block_and_offset(sb, ino, &blkid, &offset))
+		return ERR_PTR(-EINVAL);
+
+	ret = testfs_snap_read(sb, blkid, offset, copy, sizeof(*copy));
+	return ret ? ERR_PTR(ret) : copy;
+}
+
+/* timestamps are stored as 32-bit seconds plus nanoseconds */
+static inline void testfs_encode_times(struct inode *inode,
+				struct testfs_disk_inode *tdi)
+{
+	tdi->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
+	tdi->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
+	tdi->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	tdi->i_atime_nsec = cpu_to_le32(inode->i_atime.tv_nsec);
+	tdi->i_ctime_nsec = cpu_to_le32(inode->i_ctime.tv_nsec);
+	tdi->i_mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
+}
+
+static inline void testfs_decode_times(struct inode *inode,
+				struct testfs_disk_inode *tdi)
+{
+	inode->i_atime.tv_sec = (signed)le32_to_cpu(tdi->i_atime);
+	inode->i_ctime.tv_sec = (signed)le32_to_cpu(tdi->i_ctime);
+	inode->i_mtime.tv_sec = (signed)le32_to_cpu(tdi->i_mtime);
+	inode->i_atime.tv_nsec = le32_to_cpu(tdi->i_atime_nsec);
+	inode->i_ctime.tv_nsec = le32_to_cpu(tdi->i_ctime_nsec);
+	inode->i_mtime.tv_nsec = le32_to_cpu(tdi->i_mtime_nsec);
+}
+
+/*
+ * testfs_update_other_inode_time - flush lazytime timestamps of @ino
+ *
+ * If @ino is cached and only its timestamps are dirty (I_DIRTY_TIME), copy
+ * them into @tdi and clear the dirty state, so the inode table block that
+ * is being written anyway carries them and no later write is needed.
+ */
+static void testfs_update_other_inode_time(struct super_block *sb,
+				unsigned long ino, struct testfs_disk_inode *tdi)
+{
+	struct inode *inode;
+
+	inode = find_inode_by_ino_rcu(sb, ino);
+	if (!inode)
+		return;
+
+	if ((inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW |
+			       I_DIRTY_INODE)) ||
+	    !(inode->i_state & I_DIRTY_TIME))
+		return;
+
+	spin_lock(&inode->i_lock);
+	if (!(inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW |
+				I_DIRTY_INODE)) &&
+	    (inode->i_state & I_DIRTY_TIME)) {
+		inode->i_state &= ~I_DIRTY_TIME;
+		spin_unlock(&inode->i_lock);
+		testfs_encode_times(inode, tdi);
+		return;
+	}
+	spin_unlock(&inode->i_lock);
+}
+
+/*
+ * With lazytime, piggyback the pending timestamps of every other inode in
+ * the same inode table block on this write.
+ */
+static void testfs_update_other_inodes_time(struct super_block *sb,
+				unsigned long orig_ino, char *buf)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	int i, inode_per_block = sbi->s_block_size / sbi->s_inode_size;
+	unsigned long ino = orig_ino - orig_ino % inode_per_block;
+
+	rcu_read_lock();
+	for (i = 0; i < inode_per_block; i++, ino++, buf += sbi->s_inode_size) {
+		if (ino == orig_ino)
+			continue;
+		testfs_update_other_inode_time(sb, ino,
+				(struct testfs_disk_inode *)buf);
+	}
+	rcu_read_unlock();
+}
+
 int testfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
 	struct super_block *sb = inode->i_sb;
@@ -150,6 +282,11 @@ int testfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 		return -EIO;
 	}
 
+	if (testfs_snap_cow(sb, bh->b_blocknr)) {
+		brelse(bh);
+		return -EIO;
+	}
+
 	if (ti->is_new_inode)
 		memset(tdi, 0, sizeof(*tdi));
 	/* fillin inode info into @tdi disk inode */
@@ -157,19 +294,23 @@ int testfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 	tdi->i_uid = cpu_to_le32(uid);
 	tdi->i_gid = cpu_to_le32(gid);
 	tdi->i_size = cpu_to_le32(inode->i_size);
-	tdi->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
-	tdi->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
-	tdi->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+	testfs_encode_times(inode, tdi);
 	tdi->i_generation = cpu_to_le32(inode->i_generation);
 	tdi->i_links_count = cpu_to_le16(inode->i_nlink);
 	tdi->i_blocks = cpu_to_le32(inode->i_blocks);
+	tdi->i_flags = cpu_to_le32(ti->i_flags);
+	tdi->i_write_hint = inode->i_write_hint;
+	tdi->i_compr_map = ti->i_compr_map;
 
-	/* block mapping */
+	/* block mapping, or the file data itself for inline inodes */
 	for (i = 0; i < TEST_FS_N_BLOCKS; i++)
 		tdi->i_block[i] = ti->i_block[i];
 
 	ti->is_new_inode = 0;
 
+	if (sb->s_flags & SB_LAZYTIME)
+		testfs_update_other_inodes_time(sb, inode->i_ino, bh->b_data);
+
 	mark_buffer_dirty(bh);
 
 	if (is_sync)
@@ -180,51 +321,92 @@ int testfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 	return 0;
 }
 
-static inline int testfs_free_inode_data_blocks(struct inode *inode, u32 from, u32 to)
+/* i_blocks counts 512-byte sectors of the mapped blocks */
+void testfs_update_i_blocks(struct inode *inode)
 {
-	struct super_block *sb = inode->i_sb;
-	struct testfs_sb_info *sbi = sb->s_fs_info;
 	struct testfs_inode *ti = TESTFS_I(inode);
-	struct buffer_head *bh;
-	unsigned long *bitmap;
-	u32 i, blkid;
+	blkcnt_t blocks = 0;
+	int i;
 
-	/* read data bitmap */
-	bh = sb_bread_unmovable(sb, TEST_FS_BLKID_DBITMAP);
-	if (!bh) {
-		log_err("failed to read data bitmap\n");
-		return -EIO;
-	}
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++)
+		if (ti->i_block[i])
+			blocks++;
 
-	bitmap = (unsigned long *)bh->b_data;
+	inode->i_blocks = blocks << (inode->i_blkbits - 9);
+}
 
-	for (i = from; i <= to ; i++) {
+/*
+ * testfs_punch_blocks - release the data blocks starting in [@start, @end)
+ */
+void testfs_punch_blocks(struct inode *inode, loff_t start, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 from = (start + sb->s_blocksize - 1) >> inode->i_blkbits;
+	u32 to = TEST_FS_N_BLOCKS;
+	u32 i, c, blkid, first = 0, count = 0, keep = 0;
+
+	/* i_block[] holds data rather than block numbers */
+	if (testfs_has_inline_data(inode))
+		return;
+
+	if (end < (loff_t)TEST_FS_N_BLOCKS << inode->i_blkbits)
+		to = (end + sb->s_blocksize - 1) >> inode->i_blkbits;
+
+	down_write(&ti->i_map_sem);
+	/* a compressed cluster goes whole, or is stored plain first */
+	for (c = from / TESTFS_CLUSTER_BLOCKS;
+	     c * TESTFS_CLUSTER_BLOCKS < to; c++) {
+		if (!(ti->i_compr_map & BIT(c)))
+			continue;
+		if (c * TESTFS_CLUSTER_BLOCKS >= from &&
+		    (c + 1) * TESTFS_CLUSTER_BLOCKS <= to) {
+			ti->i_compr_map &= ~BIT(c);
+		} else if (testfs_uncompress_cluster(inode, c, false)) {
+			log_err("ino:%lu cluster %u kept compressed\n",
+				inode->i_ino, c);
+			keep |= BIT(c);
+		}
+	}
+	for (i = from; i < to; i++) {
 		blkid = le32_to_cpu(ti->i_block[i]);
-		if (blkid > 0) {
-			log_err("ino:%lu, [%u]=%u\n", inode->i_ino, i, blkid);
-			clear_bit_le(blkid - sbi->s_data_blkid, bitmap);
+		if (!blkid || (keep & BIT(i / TESTFS_CLUSTER_BLOCKS)))
+			continue;
+		ti->i_block[i] = 0;
+
+		/* free physically contiguous blocks with one bitmap update */
+		if (count && blkid == first + count) {
+			count++;
+			continue;
 		}
+		if (count)
+			testfs_free_blocks(sb, first, count);
+		first = blkid;
+		count = 1;
 	}
+	if (count)
+		testfs_free_blocks(sb, first, count);
+	ti->i_map_seq++;
+	testfs_update_i_blocks(inode);
+	up_write(&ti->i_map_sem);
 
-	/* update data bitmap */
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-
-	return 0;
+	mark_inode_dirty(inode);
 }
 
+/*
+ * testfs_truncate_blocks - release the data blocks beyond @offset
+ */
 static void testfs_truncate_blocks(struct inode *inode, loff_t offset)
 {
-	u32 from = (offset + TEST_FS_BLOCK_SIZE - 1) / TEST_FS_BLOCK_SIZE;
-	u32 to = TEST_FS_N_BLOCKS - 1;
-
 	log_err("ino:%lu\n", inode->i_ino);
-	testfs_free_inode_data_blocks(inode, from, to);
+
+	testfs_punch_blocks(inode, offset, LLONG_MAX);
 }
 
 /*
- * Called at the last iput() if i_nlink is zero.
+ * Called at the last iput(), the on-disk inode and its blocks are only
+ * released if i_nlink is zero; otherwise the inode is just dropped from
+ * the cache (memory reclaim, umount).
  *
  * The code flow of unlink:
  *
@@ -248,221 +430,1077 @@ static void testfs_truncate_blocks(struct inode *inode, loff_t offset)
  */
 void testfs_evict_inode(struct inode * inode)
 {
+	/* a mounted snapshot has unlinked inodes that were still open */
+	int want_delete = !inode->i_nlink && !is_bad_inode(inode) &&
+			  !sb_rdonly(inode->i_sb);
+
 	log_err("ino:%lu\n", inode->i_ino);
 
 	truncate_inode_pages_final(&inode->i_data);
 
-	sb_start_intwrite(inode->i_sb);
+	if (want_delete) {
+		sb_start_intwrite(inode->i_sb);
 
-	/* remove all data blocks of this inode: clear data bitmap */
-	inode->i_size = 0;
-	testfs_truncate_blocks(inode, 0);
+		/* remove all data blocks of this inode: clear data bitmap */
+		inode->i_size = 0;
+		testfs_truncate_blocks(inode, 0);
+	}
 
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 
-	/* remove inode from disk: clear inode bitmap for this inode */
-	testfs_free_disk_inode(inode);
-
-	sb_end_intwrite(inode->i_sb);
+	if (want_delete) {
+		/* remove inode from disk: clear inode bitmap for this inode */
+		testfs_free_disk_inode(inode);
+		sb_end_intwrite(inode->i_sb);
+	}
 }
 
-static int testfs_get_new_block(struct super_block *sb, u32 *blkid)
+/*
+ * length of the extent, or the hole, starting at @iblock and ending
+ * before @end; *@bno is set to its first disk block, 0 for a hole. An
+ * extent never goes on over the end of a device.
+ */
+static u32 testfs_lookup_extent(struct testfs_inode *ti, u32 iblock, u32 end,
+				u32 *bno)
 {
-	struct buffer_head *bh;
-	struct testfs_sb_info *sbi = sb->s_fs_info;
-	unsigned long *bitmap, index = 0;
-	bool got = false;
+	u32 i, next, left, blkid = le32_to_cpu(ti->i_block[iblock]);
+	sector_t pblk;
 
-	/* read data bitmap */
-	bh = sb_bread_unmovable(sb, TEST_FS_BLKID_DBITMAP);
-	if (!bh) {
-		log_err("failed to read data bitmap\n");
-		return -EIO;
+	if (blkid) {
+		testfs_map_dev(ti->vfs_inode.i_sb, blkid, &pblk, &left);
+		end = min(end, iblock + left);
 	}
 
-	bitmap = (unsigned long *)bh->b_data;
+	for (i = iblock + 1; i < end; i++) {
+		next = le32_to_cpu(ti->i_block[i]);
+		if (blkid ? next != blkid + (i - iblock) : next != 0)
+			break;
+	}
 
-	while (1) {
-		/* find the first available bit */
-		index = find_first_zero_bit_le(bitmap, TEST_FS_BLOCK_SIZE);
+	*bno = blkid;
+	return i - iblock;
+}
 
-		/* if return 0, means this bit has been used, retry other bit */
-		if (!test_and_set_bit_le(index, bitmap)) {
-			*blkid = (u32)index + sbi->s_data_blkid;
-			got = true;
-			break;
-		}
+/*
+ * Writes never go to a block shared with another file. The shared part at
+ * the head of the extent @iblock..@iblock+@count is copied to new blocks
+ * and the reference on the old ones dropped; an unshared head is left
+ * alone. Return the length of that head, the caller's run, with *@bno
+ * updated. Called with i_map_sem held for write.
+ */
+static int testfs_unshare_blocks(struct inode *inode, u32 iblock, u32 count,
+				u32 *bno, bool nowait)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 i, blkid;
+	bool shared;
+	int ret;
+
+	count = testfs_shared_blocks(sb, *bno, count, &shared, nowait);
+	if (!shared)
+		return count;
+	if (nowait)
+		return -EAGAIN;
+
+	ret = testfs_new_blocks(sb, *bno, &count, &blkid);
+	if (ret)
+		return ret;
+
+	ret = testfs_copy_blocks(sb, *bno, blkid, count);
+	if (ret) {
+		testfs_free_blocks(sb, blkid, count);
+		return ret;
 	}
 
-	if (!got) {
-		log_err("not found available data block\n");
-		goto free_bh;
+	for (i = 0; i < count; i++)
+		ti->i_block[iblock + i] = cpu_to_le32(blkid + i);
+	testfs_free_blocks(sb, *bno, count);
+	ti->i_map_seq++;
+	mark_inode_dirty(inode);
+
+	*bno = blkid;
+	return count;
+}
+
+/* the device the blocks of @inode are on, false if it has none */
+static bool testfs_blocks_dev(struct inode *inode, u32 *dev)
+{
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 i, blkid;
+
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+		blkid = le32_to_cpu(ti->i_block[i]);
+		if (blkid) {
+			*dev = testfs_dev_of(inode->i_sb, blkid);
+			return true;
+		}
 	}
+	return false;
+}
 
+/*
+ * the device the blocks of @inode go to: the one of the blocks it has,
+ * else the next one in turn for a regular file. Directories stay on the
+ * first device, their pages go through buffer_heads on s_bdev. Called
+ * with i_map_sem held.
+ */
+u32 testfs_file_dev(struct inode *inode)
+{
+	u32 dev;
 
-	/* update data bitmap */
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	if (testfs_blocks_dev(inode, &dev))
+		return dev;
+	return S_ISREG(inode->i_mode) ? testfs_next_dev(inode->i_sb) : 0;
+}
 
-	return 0;
+/* where a lookup from @iblock ends, at the next compressed cluster */
+static u32 testfs_plain_end(struct testfs_inode *ti, u32 iblock, u32 end)
+{
+	u32 c;
 
-free_bh:
-	brelse(bh);
-	return -ENOSPC;
+	for (c = iblock / TESTFS_CLUSTER_BLOCKS + 1;
+	     c * TESTFS_CLUSTER_BLOCKS < end; c++)
+		if (ti->i_compr_map & BIT(c))
+			return c * TESTFS_CLUSTER_BLOCKS;
+	return end;
 }
 
 /*
- * testfs_get_blocks - alloc/read block from disk for this inode
+ * testfs_map_blocks - map a run of file blocks to disk blocks
+ *
  * @inode:	the inode interested
- * @iblock:	offset within @inode
- * @bno:	block index on disk
- * @new:	new allocated ? maybe it has been in disk
- * @boundary:	??
- * @create:	create new block if no
+ * @iblock:	the first block offset within @inode
+ * @max_blocks:	the longest run the caller can use
+ * @bno:	out: the first disk block of the run, 0 for a hole
+ * @new:	out: set if the run was allocated by this call
+ * @flags:	TESTFS_MAP_CREATE allocates blocks for a hole and unshares
+ *		shared blocks; TESTFS_MAP_NOWAIT fails with -EAGAIN instead
+ *		of waiting for i_map_sem or reading a bitmap or the refcount
+ *		table, so it never allocates or unshares;
+ *		TESTFS_MAP_DECOMPRESS, implied by TESTFS_MAP_CREATE, stores
+ *		a compressed cluster at @iblock as plain blocks first
  *
+ * Return: the length of the run in blocks, or a negative errno. The run is
+ * one physically contiguous extent or one hole, never a mix of both. With
+ * TESTFS_MAP_CREATE the extent is never shared with another file. Without
+ * TESTFS_MAP_DECOMPRESS a compressed cluster is one run to its end, at the
+ * first block of its compressed data.
  */
-static int _testfs_get_block(struct inode *inode, sector_t iblock, u32 *bno,
-			bool *new, int create)
+int testfs_map_blocks(struct inode *inode, u32 iblock, u32 max_blocks,
+			u32 *bno, bool *new, int flags)
 {
-	struct super_block *sb = inode->i_sb;
 	struct testfs_inode *ti = TESTFS_I(inode);
-	unsigned old_blkid;
-	int ret = -ENOSPC;
+	bool create = flags & TESTFS_MAP_CREATE;
+	bool nowait = flags & TESTFS_MAP_NOWAIT;
+	bool excl = create || (flags & TESTFS_MAP_DECOMPRESS);
+	u32 i, end, blkid, goal = 0, count, dev;
+	u32 cluster = iblock / TESTFS_CLUSTER_BLOCKS;
+	int ret;
 
 	/*
 	 * how many blocked has been allocated ?, to simplify the code logic
 	 * we only allocate maximun 16 blocks for a file.
 	 */
 	if (iblock >= TEST_FS_N_BLOCKS) {
-		log_err("file size limitation\n");
-		return -ENOSPC;
+		if (create) {
+			log_err("file size limitation\n");
+			return -ENOSPC;
+		}
+		*bno = 0;
+		return max_blocks;
+	}
+	end = min_t(u32, iblock + max_blocks, TEST_FS_N_BLOCKS);
+
+	if (!nowait) {
+		if (excl)
+			down_write(&ti->i_map_sem);
+		else
+			down_read(&ti->i_map_sem);
+	} else if (excl ? !down_write_trylock(&ti->i_map_sem) :
+			  !down_read_trylock(&ti->i_map_sem)) {
+		return -EAGAIN;
 	}
 
-	/* check allocated ? */
-	old_blkid = le32_to_cpu(ti->i_block[iblock]);
-	if (old_blkid > 0) {
-		*bno = old_blkid;
-		ret = 0;
-		goto out;
+	if (ti->i_compr_map & BIT(cluster)) {
+		if (!excl) {
+			*bno = le32_to_cpu(ti->i_block[cluster *
+						TESTFS_CLUSTER_BLOCKS]);
+			ret = min((cluster + 1) * TESTFS_CLUSTER_BLOCKS, end) -
+			      iblock;
+			goto out;
+		}
+		ret = testfs_uncompress_cluster(inode, cluster, nowait);
+		if (ret)
+			goto out;
 	}
+	end = testfs_plain_end(ti, iblock, end);
 
-	if (create == 0)
+	ret = testfs_lookup_extent(ti, iblock, end, bno);
+	if (*bno && create)
+		ret = testfs_unshare_blocks(inode, iblock, ret, bno, nowait);
+	if (*bno || !create)
 		goto out;
 
-	/* alloc new data block */
-	ret = testfs_get_new_block(sb, bno);
+	/* filling the hole reads and writes the data bitmap */
+	if (nowait) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	/*
+	 * fill the hole, right behind the previous block if there is one,
+	 * else where the file's write lifetime stream is at on its device
+	 */
+	dev = testfs_file_dev(inode);
+	for (i = iblock; i > 0 && !goal; i--) {
+		goal = le32_to_cpu(ti->i_block[i - 1]);
+		if (goal)
+			goal += iblock - (i - 1);
+	}
+	if (!goal || testfs_dev_of(inode->i_sb, goal) != dev)
+		goal = testfs_stream_goal(inode, dev);
+
+	count = ret;
+	ret = testfs_new_blocks(inode->i_sb, goal, &count, &blkid);
 	if (ret)
 		goto out;
+	testfs_stream_advance(inode, blkid, count);
 
-	*new = true;
+	for (i = 0; i < count; i++)
+		ti->i_block[iblock + i] = cpu_to_le32(blkid + i);
+	ti->i_map_seq++;
+	testfs_update_i_blocks(inode);
+	mark_inode_dirty(inode);
 
-	/* update inode dentry */
-	ti->i_block[iblock] = cpu_to_le32(*bno);
+	*bno = blkid;
+	*new = true;
+	ret = count;
 out:
+	if (excl)
+		up_write(&ti->i_map_sem);
+	else
+		up_read(&ti->i_map_sem);
+	return ret;
+}
+
+/*
+ * testfs_remap_blocks - make a range of @dst share the blocks of @src
+ *
+ * @src:	the inode to share from
+ * @iblock:	the first block offset within @src
+ * @dst:	the inode to remap
+ * @oblock:	the first block offset within @dst
+ * @count:	number of blocks
+ *
+ * Blocks @dst had in the range are released, holes of @src become holes
+ * of @dst. Called with i_rwsem of both inodes held, their page cache
+ * written back. Return -EXDEV if both have blocks, on different devices.
+ */
+int testfs_remap_blocks(struct inode *src, u32 iblock, struct inode *dst,
+			u32 oblock, u32 count)
+{
+	struct super_block *sb = dst->i_sb;
+	struct testfs_inode *si = TESTFS_I(src), *di = TESTFS_I(dst);
+	u32 done, n, i, m, sbno, old, sdev, ddev;
+	bool src_mapped, dst_mapped;
+	int ret = 0;
+
+	if (iblock + count > TEST_FS_N_BLOCKS ||
+	    oblock + count > TEST_FS_N_BLOCKS)
+		return -EFBIG;
+
+	/* a file keeps to one device, see testfs_alloc_blocks() */
+	down_read(&si->i_map_sem);
+	src_mapped = testfs_blocks_dev(src, &sdev);
+	up_read(&si->i_map_sem);
+	down_read(&di->i_map_sem);
+	dst_mapped = testfs_blocks_dev(dst, &ddev);
+	up_read(&di->i_map_sem);
+	if (src_mapped && dst_mapped && sdev != ddev)
+		return -EXDEV;
+
+	for (done = 0; done < count; done += n) {
+		/* the source can not unshare the run until it is referenced */
+		down_read(&si->i_map_sem);
+		n = testfs_lookup_extent(si, iblock + done, iblock + count,
+					 &sbno);
+		if (sbno)
+			ret = testfs_share_blocks(sb, sbno, n);
+		up_read(&si->i_map_sem);
+		if (ret)
+			break;
+
+		down_write(&di->i_map_sem);
+		for (i = oblock + done; i < oblock + done + n; i += m) {
+			m = testfs_lookup_extent(di, i, oblock + done + n, &old);
+			if (old)
+				testfs_free_blocks(sb, old, m);
+		}
+		for (i = 0; i < n; i++)
+			di->i_block[oblock + done + i] =
+					cpu_to_le32(sbno ? sbno + i : 0);
+		di->i_map_seq++;
+		testfs_update_i_blocks(dst);
+		up_write(&di->i_map_sem);
+	}
+
+	mark_inode_dirty(dst);
+	return ret;
+}
+
+/*
+ * true if @pages[@n] is part of the same compound page as the one before,
+ * the pages are in index order
+ */
+static bool testfs_same_head(struct page **pages, u32 n)
+{
+	return n && compound_head(pages[n]) == compound_head(pages[n - 1]);
+}
+
+/*
+ * testfs_defrag_file - move the blocks of a file into one contiguous run
+ *
+ * The data is taken from the page cache: every mapped page is read in and
+ * kept locked, once per compound page, so neither writeback nor a write
+ * fault can touch it, then
+ * written to a freshly allocated run with one bio. The block map is
+ * switched over in one go under i_map_sem and the old blocks are freed
+ * once the inode pointing at the new ones is on disk. Holes stay holes,
+ * blocks shared with other files get a private copy.
+ *
+ * Called with i_rwsem held. Return: 0, also if the file already was in one
+ * piece, -EAGAIN if a write fault changed the block map meanwhile, or
+ * -ENOSPC if there is no free run large enough.
+ */
+int testfs_defrag_file(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	struct page *pages[TEST_FS_N_BLOCKS] = { };
+	__le32 old[TEST_FS_N_BLOCKS];
+	u32 i, n, nr = 0, extents = 0, bno, last = 0, donor, seq;
+	u32 start = 0, count = 0;
+	int ret;
+
+	/* compressed clusters are one run each already */
+	if (testfs_has_inline_data(inode) || testfs_compr_inode(inode))
+		return 0;
+
+	/* a page caches exactly one block below */
+	if (sb->s_blocksize != PAGE_SIZE)
+		return -EOPNOTSUPP;
+
+	inode_dio_wait(inode);
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		return ret;
+
+	down_read(&ti->i_map_sem);
+	seq = ti->i_map_seq;
+	memcpy(old, ti->i_block, sizeof(old));
+	up_read(&ti->i_map_sem);
+
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+		bno = le32_to_cpu(old[i]);
+		if (!bno)
+			continue;
+		if (bno != last + 1)
+			extents++;
+		last = bno;
+		nr++;
+	}
+	if (extents <= 1)
+		return 0;
+
+	/* on the device the file is on */
+	ret = testfs_new_contig_blocks(sb, last, nr, &donor);
+	if (ret)
+		return ret;
+
+	/* in index order, like truncate and writeback */
+	for (i = 0, n = 0; i < TEST_FS_N_BLOCKS; i++) {
+		if (!old[i])
+			continue;
+
+		pages[n] = read_mapping_page(inode->i_mapping, i, NULL);
+		if (IS_ERR(pages[n])) {
+			ret = PTR_ERR(pages[n]);
+			pages[n] = NULL;
+			goto out_free;
+		}
+		/* the pages of a compound page share its lock, take it once */
+		if (!testfs_same_head(pages, n)) {
+			lock_page(pages[n]);
+			wait_on_page_writeback(pages[n]);
+		}
+		n++;
+	}
+
+	ret = testfs_rw_blocks(sb, REQ_OP_WRITE, donor, nr, pages);
+	if (ret)
+		goto out_free;
+
+	down_write(&ti->i_map_sem);
+	if (ti->i_map_seq != seq) {
+		up_write(&ti->i_map_sem);
+		ret = -EAGAIN;
+		goto out_free;
+	}
+	for (i = 0, n = 0; i < TEST_FS_N_BLOCKS; i++) {
+		if (old[i])
+			ti->i_block[i] = cpu_to_le32(donor + n++);
+	}
+	ti->i_map_seq++;
+	up_write(&ti->i_map_sem);
+
+	/* the old blocks are leaked rather than freed while still on disk */
+	mark_inode_dirty(inode);
+	ret = sync_inode_metadata(inode, 1);
+	if (ret) {
+		log_err("ino:%lu failed to write inode, %d\n", inode->i_ino, ret);
+		goto out_unlock;
+	}
+
+	/* free physically contiguous blocks with one bitmap update */
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+		bno = le32_to_cpu(old[i]);
+		if (!bno)
+			continue;
+		if (count && bno == start + count) {
+			count++;
+			continue;
+		}
+		if (count)
+			testfs_free_blocks(sb, start, count);
+		start = bno;
+		count = 1;
+	}
+	if (count)
+		testfs_free_blocks(sb, start, count);
+	goto out_unlock;
+
+out_free:
+	testfs_free_blocks(sb, donor, nr);
+out_unlock:
+	for (i = 0; i < TEST_FS_N_BLOCKS && pages[i]; i++) {
+		if (!testfs_same_head(pages, i))
+			unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
 	return ret;
 }
 
+/*
+ * Whether @count blocks at @bno can be overwritten in place untorn: the
+ * device writes one of its logical blocks whole, a longer run only as one
+ * REQ_ATOMIC bio within its limits, on kernels that have it.
+ */
+static bool testfs_atomic_in_place(struct super_block *sb, u32 bno,
+				u32 count, unsigned int *op)
+{
+	size_t len = (size_t)count << sb->s_blocksize_bits;
+	struct block_device *bdev;
+	sector_t pblk;
+
+	bdev = testfs_map_dev(sb, bno, &pblk, NULL);
+	*op = REQ_OP_WRITE;
+	if (count == 1 && bdev_logical_block_size(bdev) >= len)
+		return true;
+#ifdef REQ_ATOMIC
+	if (bdev_can_atomic_write(bdev) &&
+	    len >= bdev_atomic_write_unit_min_bytes(bdev) &&
+	    len <= bdev_atomic_write_unit_max_bytes(bdev) &&
+	    !do_div(pblk, count)) {
+		*op |= REQ_ATOMIC;
+		return true;
+	}
+#endif
+	return false;
+}
+
+/*
+ * testfs_map_atomic - write @count blocks at @iblock untorn
+ *
+ * A range inside i_size that is one extent of unshared blocks the device
+ * can overwrite untorn is written in place, see testfs_atomic_in_place().
+ * Anything else goes out of place: @pages, the whole new data of the
+ * range, goes to a freshly allocated run of blocks, then the range of the block map is
+ * pointed at it, with i_size moved on to @end if that is past it. The
+ * inode write with both is the one point where the file changes, until it
+ * is on disk the old blocks are not freed, after a crash the file has the
+ * old data or the new one. If that write fails the file is switched back
+ * to the old blocks and the new run is freed.
+ *
+ * Called with i_rwsem held and the page cache over the range written back.
+ * Return: 0, -ENOSPC if there is no free run of @count blocks.
+ */
+int testfs_map_atomic(struct inode *inode, u32 iblock, u32 count,
+			struct page **pages, loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	__le32 old[TEST_FS_N_BLOCKS];
+	u32 i, bno, blkid, goal, run, start = 0, n = 0;
+	unsigned int op;
+	loff_t old_size;
+	bool shared;
+	int ret;
+
+	if (iblock + count > TEST_FS_N_BLOCKS)
+		return -EFBIG;
+
+	/* where the range is, else the file's stream on its device */
+	down_read(&ti->i_map_sem);
+	run = testfs_lookup_extent(ti, iblock, iblock + count, &goal);
+	bno = goal;
+	if (!goal)
+		goal = testfs_stream_goal(inode, testfs_file_dev(inode));
+	up_read(&ti->i_map_sem);
+
+	if (bno && run == count && end <= i_size_read(inode) &&
+	    testfs_shared_blocks(sb, bno, count, &shared, false) == count &&
+	    !shared && testfs_atomic_in_place(sb, bno, count, &op))
+		return testfs_rw_blocks(sb, op, bno, count, pages);
+
+	ret = testfs_new_contig_blocks(sb, goal, count, &blkid);
+	if (ret)
+		return ret;
+	testfs_stream_advance(inode, blkid, count);
+
+	/* on disk before any inode points at it */
+	ret = testfs_rw_blocks(sb, REQ_OP_WRITE | REQ_FUA, blkid, count, pages);
+	if (ret) {
+		testfs_free_blocks(sb, blkid, count);
+		return ret;
+	}
+
+	down_write(&ti->i_map_sem);
+	for (i = 0; i < count; i++) {
+		old[i] = ti->i_block[iblock + i];
+		ti->i_block[iblock + i] = cpu_to_le32(blkid + i);
+	}
+	ti->i_map_seq++;
+	testfs_update_i_blocks(inode);
+	old_size = i_size_read(inode);
+	if (end > old_size)
+		i_size_write(inode, end);
+	up_write(&ti->i_map_sem);
+
+	mark_inode_dirty(inode);
+	ret = sync_inode_metadata(inode, 1);
+	if (ret) {
+		log_err("ino:%lu failed to write inode, %d\n", inode->i_ino, ret);
+		down_write(&ti->i_map_sem);
+		memcpy(&ti->i_block[iblock], old, count * sizeof(old[0]));
+		ti->i_map_seq++;
+		testfs_update_i_blocks(inode);
+		i_size_write(inode, old_size);
+		up_write(&ti->i_map_sem);
+		mark_inode_dirty(inode);
+		testfs_free_blocks(sb, blkid, count);
+		return ret;
+	}
+
+	/* shared ones only lose this file's reference */
+	for (i = 0; i < count; i++) {
+		bno = le32_to_cpu(old[i]);
+		if (!bno)
+			continue;
+		if (n && bno == start + n) {
+			n++;
+			continue;
+		}
+		if (n)
+			testfs_free_blocks(sb, start, n);
+		start = bno;
+		n = 1;
+	}
+	if (n)
+		testfs_free_blocks(sb, start, n);
+	return 0;
+}
+
 int testfs_get_block(struct inode *inode, sector_t iblock,
                 struct buffer_head *bh_result, int create)
 {
+	u32 max_blocks = bh_result->b_size >> inode->i_blkbits;
         bool new = false;
         u32 bno;
         int ret;
 
-        ret = _testfs_get_block(inode, iblock, &bno, &new, create);
-        if (ret)
+        ret = testfs_map_blocks(inode, iblock, max_blocks, &bno, &new,
+				create ? TESTFS_MAP_CREATE : 0);
+        if (ret < 0)
                 return ret;
 
+	/* a hole, leave @bh_result unmapped */
+	if (!bno)
+		return 0;
+
         map_bh(bh_result, inode->i_sb, bno);
-        bh_result->b_size = (1 << inode->i_blkbits);
+        bh_result->b_size = ret << inode->i_blkbits;
         if (new)
                 set_buffer_new(bh_result);
 
-	log_err("ino:%lu, [%u]=%u\n", inode->i_ino, (u32)iblock, bno);
         return 0;
 }
 
-static int testfs_readpage(struct file *file, struct page *page)
+/*
+ * Copy page 0 of an inline file back into i_data, the page is locked.
+ */
+static void testfs_fold_inline_page(struct inode *inode, struct page *page)
 {
-	return mpage_readpage(page, testfs_get_block);
+	loff_t size = min_t(loff_t, i_size_read(inode), TESTFS_INLINE_DATA_SIZE);
+	void *kaddr;
+
+	if (page->index || !size)
+		return;
+
+	kaddr = kmap_atomic(page);
+	memcpy(TESTFS_I(inode)->i_data, kaddr, size);
+	kunmap_atomic(kaddr);
+
+	mark_inode_dirty(inode);
 }
 
-static void testfs_readahead(struct readahead_control *rac)
+/*
+ * testfs_inline_page_mkwrite - write fault on a page of an inline file
+ *
+ * There is no block to allocate, the page is only dirtied and
+ * ->writepage folds it back into i_data. The inline flag is checked again
+ * under the page lock, testfs_convert_inline_data() holds page 0 locked
+ * while it moves the data out.
+ */
+vm_fault_t testfs_inline_page_mkwrite(struct vm_fault *vmf)
 {
-        mpage_readahead(rac, testfs_get_block);
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct page *page = vmf->page;
+
+	lock_page(page);
+	if (page->mapping != inode->i_mapping) {
+		unlock_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+
+	if (!testfs_has_inline_data(inode)) {
+		unlock_page(page);
+		return iomap_page_mkwrite(vmf, &testfs_iomap_ops);
+	}
+
+	set_page_dirty(page);
+	wait_for_stable_page(page);
+	return VM_FAULT_LOCKED;
 }
 
-static void testfs_write_failed(struct address_space *mapping, loff_t to)
+/*
+ * testfs_convert_inline_data - move inline data out to a data block
+ *
+ * Called with i_rwsem held before a write that does not fit in the inode.
+ * The data is written to a new block before i_block[] becomes a block map
+ * again. Page 0 stays locked meanwhile, so ->readpage can not copy from
+ * i_data while it is being rewritten; if the page is uptodate it already
+ * matches the new block.
+ */
+int testfs_convert_inline_data(struct inode *inode)
 {
-        struct inode *inode = mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	unsigned size = i_size_read(inode);
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	struct page *page;
+	u32 bno = 0, count = 1;
+	sector_t pblk;
+	int ret = 0;
 
-        if (to > inode->i_size) {
-                truncate_pagecache(inode, inode->i_size);
-                testfs_truncate_blocks(inode, inode->i_size);
-        }
+	log_err("ino:%lu, size:%u\n", inode->i_ino, size);
+
+	page = grab_cache_page(inode->i_mapping, 0);
+	if (!page)
+		return -ENOMEM;
+
+	/* data stored through a shared mapping is newer than i_data */
+	if (PageDirty(page) && clear_page_dirty_for_io(page))
+		testfs_fold_inline_page(inode, page);
+
+	if (size) {
+		/* i_block[] has data, the file has no device yet */
+		ret = testfs_new_blocks(sb,
+				testfs_stream_goal(inode, testfs_next_dev(sb)),
+				&count, &bno);
+		if (ret)
+			goto out;
+
+		bdev = testfs_map_dev(sb, bno, &pblk, NULL);
+		bh = __getblk(bdev, pblk, sb->s_blocksize);
+		if (!bh) {
+			ret = -ENOMEM;
+			goto free_block;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, ti->i_data, size);
+		memset(bh->b_data + size, 0, bh->b_size - size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+		brelse(bh);
+		if (ret)
+			goto free_block;
+	}
+
+	down_write(&ti->i_map_sem);
+	memset(ti->i_block, 0, sizeof(ti->i_block));
+	ti->i_block[0] = cpu_to_le32(bno);
+	ti->i_flags &= ~TESTFS_INLINE_DATA_FL;
+	ti->i_map_seq++;
+	testfs_update_i_blocks(inode);
+	up_write(&ti->i_map_sem);
+
+	mark_inode_dirty(inode);
+	goto out;
+
+free_block:
+	log_err("ino:%lu, failed to convert inline data\n", inode->i_ino);
+	testfs_free_blocks(sb, bno, 1);
+out:
+	unlock_page(page);
+	put_page(page);
+	return ret;
+}
+
+/*
+ * Inline data is mapped as IOMAP_INLINE: reads see exactly i_size bytes,
+ * writes may use the whole inline area.
+ */
+static int testfs_iomap_inline(struct inode *inode, loff_t pos, loff_t length,
+				unsigned flags, struct iomap *iomap)
+{
+	loff_t size = i_size_read(inode);
+
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->flags = 0;
+
+	if (flags & IOMAP_WRITE) {
+		/* larger writes call testfs_convert_inline_data() first */
+		if (WARN_ON_ONCE(pos + length > TESTFS_INLINE_DATA_SIZE))
+			return -EIO;
+		size = TESTFS_INLINE_DATA_SIZE;
+	} else if (pos >= size) {
+		iomap->type = IOMAP_HOLE;
+		iomap->offset = pos;
+		iomap->length = length;
+		return 0;
+	}
+
+	iomap->type = IOMAP_INLINE;
+	iomap->inline_data = TESTFS_I(inode)->i_data;
+	iomap->offset = 0;
+	iomap->length = size;
+	return 0;
+}
+
+/*
+ * The tail of a packed image is mapped as IOMAP_INLINE out of the buffer
+ * head of its block, released by testfs_iomap_end(). testfs_iget() checked
+ * that it stays in the block, a page as well.
+ */
+static int testfs_iomap_tail(struct inode *inode, loff_t pos, loff_t length,
+				unsigned flags, struct iomap *iomap)
+{
+	struct testfs_inode *ti = TESTFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	u32 blkid = le32_to_cpu(ti->i_block[0]);
+	loff_t size = i_size_read(inode);
+	struct buffer_head *bh;
+
+	/* packed images are only mounted read-only */
+	if (WARN_ON_ONCE(flags & IOMAP_WRITE))
+		return -EROFS;
+
+	iomap->addr = IOMAP_NULL_ADDR;
+	iomap->flags = 0;
+	if (pos >= size) {
+		iomap->type = IOMAP_HOLE;
+		iomap->offset = pos;
+		iomap->length = length;
+		return 0;
+	}
+
+	if (flags & IOMAP_NOWAIT) {
+		bh = sb_find_get_block(sb, blkid);
+		if (!bh || !buffer_uptodate(bh)) {
+			brelse(bh);
+			return -EAGAIN;
+		}
+	} else {
+		bh = sb_bread(sb, blkid);
+		if (!bh)
+			return -EIO;
+	}
+
+	iomap->type = IOMAP_INLINE;
+	iomap->inline_data = bh->b_data + le32_to_cpu(ti->i_block[1]);
+	iomap->private = bh;
+	iomap->offset = 0;
+	iomap->length = size;
+	return 0;
+}
+
+/*
+ * testfs_iomap_begin - map the range [@pos, @pos + @length)
+ *
+ * The returned mapping is the whole contiguous extent (or hole) at @pos,
+ * so readahead, writeback and direct I/O are built from large bios instead
+ * of one mapping call per block. Writes allocate holes up front.
+ */
+static int testfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+			unsigned flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	unsigned blkbits = inode->i_blkbits;
+	u32 iblock = pos >> blkbits;
+	u32 max_blocks;
+	bool new = false, shared = false;
+	int map_flags = 0;
+	sector_t pblk = 0;
+	u32 bno;
+	int ret;
+
+	if (testfs_has_inline_data(inode))
+		return testfs_iomap_inline(inode, pos, length, flags, iomap);
+	if (TESTFS_I(inode)->i_flags & TESTFS_TAIL_FL)
+		return testfs_iomap_tail(inode, pos, length, flags, iomap);
+
+	max_blocks = min_t(u64, ((pos + length - 1) >> blkbits) - iblock + 1,
+				TEST_FS_N_BLOCKS);
+
+	if (flags & IOMAP_WRITE)
+		map_flags |= TESTFS_MAP_CREATE;
+	if (flags & IOMAP_NOWAIT)
+		map_flags |= TESTFS_MAP_NOWAIT;
+	/* the raw data of a compressed cluster is only of use to fiemap */
+	if (iblock < TEST_FS_N_BLOCKS && !(flags & IOMAP_REPORT) &&
+	    (READ_ONCE(TESTFS_I(inode)->i_compr_map) &
+	     BIT(iblock / TESTFS_CLUSTER_BLOCKS)))
+		map_flags |= TESTFS_MAP_DECOMPRESS;
+
+	ret = testfs_map_blocks(inode, iblock, max_blocks, &bno, &new,
+				map_flags);
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * fiemap flags extents shared with other files, compressed runs are
+	 * not and are shorter than the range reported for them
+	 */
+	if ((flags & IOMAP_REPORT) && bno && iblock < TEST_FS_N_BLOCKS &&
+	    !(READ_ONCE(TESTFS_I(inode)->i_compr_map) &
+	      BIT(iblock / TESTFS_CLUSTER_BLOCKS)))
+		ret = testfs_shared_blocks(inode->i_sb, bno, ret, &shared,
+					   false);
+
+	iomap->bdev = bno ? testfs_map_dev(inode->i_sb, bno, &pblk, NULL) :
+			    inode->i_sb->s_bdev;
+	iomap->offset = (u64)iblock << blkbits;
+	iomap->length = (u64)ret << blkbits;
+	iomap->flags = new ? IOMAP_F_NEW : 0;
+	if (shared)
+		iomap->flags |= IOMAP_F_SHARED;
+	if (bno) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)pblk << blkbits;
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
+
+	return 0;
+}
+
+static int testfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+			ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	/* the tail block of testfs_iomap_tail() */
+	if (iomap->type == IOMAP_INLINE && iomap->private)
+		brelse(iomap->private);
+
+	/* iomap_write_end() only updates the in-memory i_size */
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+		mark_inode_dirty(inode);
+
+	/*
+	 * A short write must not leave new blocks behind beyond EOF. Only
+	 * the unused part of this mapping goes, blocks further out may
+	 * belong to extending direct writes still in flight.
+	 */
+	if ((flags & IOMAP_WRITE) && (iomap->flags & IOMAP_F_NEW) &&
+	    written < length && pos + length > i_size_read(inode))
+		testfs_punch_blocks(inode, max_t(loff_t, pos + written,
+						 i_size_read(inode)),
+				    pos + length);
+
+	return 0;
+}
+
+const struct iomap_ops testfs_iomap_ops = {
+	.iomap_begin		= testfs_iomap_begin,
+	.iomap_end		= testfs_iomap_end,
+};
+
+/*
+ * The extent cached in the writeback context stays valid as long as the
+ * block map has not changed, i_map_seq tells.
+ */
+struct testfs_writepage_ctx {
+	struct iomap_writepage_ctx ctx;
+	u32 map_seq;
+};
+
+static int testfs_writeback_map_blocks(struct iomap_writepage_ctx *wpc,
+				struct inode *inode, loff_t offset)
+{
+	struct testfs_writepage_ctx *twpc =
+		container_of(wpc, struct testfs_writepage_ctx, ctx);
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 seq = READ_ONCE(ti->i_map_seq);
+	int ret;
+
+	/* dirty inline pages are folded back by testfs_writepage() */
+	if (WARN_ON_ONCE(testfs_has_inline_data(inode)))
+		return -EIO;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length &&
+	    twpc->map_seq == seq)
+		return 0;
+
+	twpc->map_seq = seq;
+
+	/*
+	 * Blocks were allocated and unshared when the pages were dirtied, a
+	 * lookup returns whole extents without unsharing the blocks behind
+	 * clean pages. A dirty block is still never skipped as a hole.
+	 */
+	ret = testfs_iomap_begin(inode, offset, i_size_read(inode) - offset,
+				0, &wpc->iomap, NULL);
+	if (ret || wpc->iomap.type != IOMAP_HOLE)
+		return ret;
+
+	return testfs_iomap_begin(inode, offset, i_blocksize(inode),
+				IOMAP_WRITE, &wpc->iomap, NULL);
+}
+
+static const struct iomap_writeback_ops testfs_writeback_ops = {
+	.map_blocks		= testfs_writeback_map_blocks,
+};
+
+/* compressed clusters are decompressed by compress.c */
+static int testfs_readpage(struct file *file, struct page *page)
+{
+	if (READ_ONCE(TESTFS_I(page->mapping->host)->i_compr_map))
+		return testfs_compr_readpage(page);
+	return iomap_readpage(page, &testfs_iomap_ops);
+}
+
+static void testfs_readahead(struct readahead_control *rac)
+{
+	if (READ_ONCE(TESTFS_I(rac->mapping->host)->i_compr_map))
+		testfs_compr_readahead(rac);
+	else
+		iomap_readahead(rac, &testfs_iomap_ops);
 }
 
 static int testfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-        return block_write_full_page(page, testfs_get_block, wbc);
+	struct inode *inode = page->mapping->host;
+	struct testfs_writepage_ctx wpc = { };
+
+	/* dirtied through a shared mapping, the data belongs in i_data */
+	if (testfs_has_inline_data(inode)) {
+		testfs_fold_inline_page(inode, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	/* a cluster is written whole, by ->writepages */
+	if (testfs_compr_inode(inode)) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	return iomap_writepage(page, wbc, &wpc.ctx, &testfs_writeback_ops);
 }
 
 static int
 testfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
 {
-        return mpage_writepages(mapping, wbc, testfs_get_block);
+	struct testfs_writepage_ctx wpc = { };
+
+	if (testfs_has_inline_data(mapping->host))
+		return generic_writepages(mapping, wbc);
+	if (testfs_compr_inode(mapping->host))
+		return testfs_compr_writepages(mapping, wbc);
+
+	return iomap_writepages(mapping, wbc, &wpc.ctx, &testfs_writeback_ops);
 }
 
-static int testfs_write_begin(struct file *file, struct address_space *mapping,
-                loff_t pos, unsigned len, unsigned flags,
-                struct page **pagep, void **fsdata)
+static sector_t testfs_bmap(struct address_space *mapping, sector_t block)
 {
-        int ret;
-
-        ret = block_write_begin(mapping, pos, len, flags, pagep,
-                                testfs_get_block);
-        if (ret < 0)
-                testfs_write_failed(mapping, pos + len);
-        return ret;
+	/* no block holds the data of a compressed cluster as it is */
+	if (testfs_compr_inode(mapping->host))
+		return 0;
+	return iomap_bmap(mapping, block, &testfs_iomap_ops);
 }
 
-static int testfs_write_end(struct file *file, struct address_space *mapping,
-                        loff_t pos, unsigned len, unsigned copied,
-                        struct page *page, void *fsdata)
+/* regular files: iomap based, direct I/O is done by testfs_file_fops */
+const struct address_space_operations testfs_aops = {
+	.readpage		= testfs_readpage,
+	.readahead		= testfs_readahead,
+	.writepage		= testfs_writepage,
+	.writepages		= testfs_writepages,
+	.set_page_dirty		= iomap_set_page_dirty,
+	.releasepage		= iomap_releasepage,
+	.invalidatepage		= iomap_invalidatepage,
+	.bmap			= testfs_bmap,
+	.direct_IO		= noop_direct_IO,
+	.migratepage		= iomap_migrate_page,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+};
+
+static int testfs_dir_readpage(struct file *file, struct page *page)
 {
-        int ret;
+	return mpage_readpage(page, testfs_get_block);
+}
 
-        ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-        if (ret < len)
-                testfs_write_failed(mapping, pos + len);
-        return ret;
+static void testfs_dir_readahead(struct readahead_control *rac)
+{
+        mpage_readahead(rac, testfs_get_block);
 }
 
-static ssize_t testfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+static int testfs_dir_writepage(struct page *page, struct writeback_control *wbc)
 {
-        struct file *file = iocb->ki_filp;
-        struct address_space *mapping = file->f_mapping;
-        struct inode *inode = mapping->host;
-        size_t count = iov_iter_count(iter);
-        loff_t offset = iocb->ki_pos;
-        ssize_t ret;
+        return block_write_full_page(page, testfs_get_block, wbc);
+}
 
-        ret = blockdev_direct_IO(iocb, inode, iter, testfs_get_block);
-        if (ret < 0 && iov_iter_rw(iter) == WRITE)
-                testfs_write_failed(mapping, offset + count);
-        return ret;
+static int
+testfs_dir_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+        return mpage_writepages(mapping, wbc, testfs_get_block);
 }
 
-const struct address_space_operations testfs_aops = {
-        .readpage               = testfs_readpage,
-        .readahead              = testfs_readahead,
-        .writepage              = testfs_writepage,
-        .writepages             = testfs_writepages,
-        .write_begin            = testfs_write_begin,
-        .write_end              = testfs_write_end,
-        .direct_IO              = testfs_direct_IO,
+/*
+ * directories: dir.c edits their pages in place with __block_write_begin()
+ * and block_write_end(), so they stay on buffer_heads.
+ */
+static const struct address_space_operations testfs_dir_aops = {
+	.readpage		= testfs_dir_readpage,
+	.readahead		= testfs_dir_readahead,
+	.writepage		= testfs_dir_writepage,
+	.writepages		= testfs_dir_writepages,
 };
 
 static int testfs_set_ops(struct inode *inode)
@@ -474,7 +1512,7 @@ static int testfs_set_ops(struct inode *inode)
 	}  else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &testfs_dir_iops;
 		inode->i_fop = &testfs_dir_fops;
-		inode->i_mapping->a_ops = &testfs_aops;
+		inode->i_mapping->a_ops = &testfs_dir_aops;
 	} else {
 		log_err("not supported mode, %x\n", inode->i_mode);
 		return -1;
@@ -483,22 +1521,45 @@ static int testfs_set_ops(struct inode *inode)
 	return 0;
 }
 
+/* a tail is a regular file of a packed image, inside one data block */
+static bool testfs_tail_ok(struct inode *inode)
+{
+	struct testfs_sb_info *sbi = inode->i_sb->s_fs_info;
+	struct testfs_inode *ti = TESTFS_I(inode);
+	u32 blkid = le32_to_cpu(ti->i_block[0]);
+	u32 offset = le32_to_cpu(ti->i_block[1]);
+
+	return (sbi->s_ro_flags & TESTFS_RO_PACKED) &&
+	       S_ISREG(inode->i_mode) &&
+	       !(ti->i_flags & TESTFS_INLINE_DATA_FL) &&
+	       blkid > sbi->s_data_blkid &&
+	       blkid - sbi->s_data_blkid < sbi->s_data_blknr &&
+	       offset < inode->i_sb->s_blocksize &&
+	       inode->i_size <= inode->i_sb->s_blocksize - offset;
+}
+
 struct inode *testfs_iget(struct super_block *sb, int ino)
 {
+	struct testfs_sb_info *sbi = sb->s_fs_info;
 	struct inode *inode;
 	struct testfs_inode *ti;
-	struct testfs_disk_inode *tdi;
-	struct buffer_head *bh;
+	struct testfs_disk_inode *tdi, copy;
+	struct buffer_head *bh = NULL;
 	int err;
 
 	inode = iget_locked(sb, ino);
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
 
 	ti = TESTFS_I(inode);
 
 	/* read inode info from disk for this ino */
-	tdi = testfs_get_disk_inode(sb, ino, &bh);
+	if (sbi->s_snap_of)
+		tdi = testfs_get_snap_inode(sb, ino, &copy);
+	else
+		tdi = testfs_get_disk_inode(sb, ino, &bh);
 	if (IS_ERR(tdi)) {
 		err = PTR_ERR(tdi);
 		goto out;
@@ -514,18 +1575,27 @@ struct inode *testfs_iget(struct super_block *sb, int ino)
 	inode->i_size = le32_to_cpu(tdi->i_size);
 	inode->i_blocks = le32_to_cpu(tdi->i_blocks);
 
-	inode->i_atime.tv_sec = (signed)le32_to_cpu(tdi->i_atime);
-	inode->i_ctime.tv_sec = (signed)le32_to_cpu(tdi->i_ctime);
-	inode->i_mtime.tv_sec = (signed)le32_to_cpu(tdi->i_mtime);
-	inode->i_atime.tv_nsec = 0;
-	inode->i_mtime.tv_nsec = 0;
-	inode->i_ctime.tv_nsec = 0;
+	testfs_decode_times(inode, tdi);
 	inode->i_generation = le32_to_cpu(tdi->i_generation);
+	ti->i_flags = le32_to_cpu(tdi->i_flags);
+	ti->i_compr_map = tdi->i_compr_map &
+			  (BIT(TESTFS_NR_CLUSTERS) - 1);
+	if (tdi->i_write_hint <= WRITE_LIFE_EXTREME)
+		inode->i_write_hint = tdi->i_write_hint;
 	ti->is_new_inode = 0;
-	/* copy the mapping from the disk to in-memory structure */
+	/* copy the mapping (or inline data) from the disk to in-memory structure */
 	memcpy(ti->i_block, tdi->i_block, sizeof(ti->i_block));
 
+	if ((ti->i_flags & TESTFS_TAIL_FL) && !testfs_tail_ok(inode)) {
+		log_err("ino:%d, bad tail %u:%u\n", ino,
+			le32_to_cpu(ti->i_block[0]),
+			le32_to_cpu(ti->i_block[1]));
+		err = -EIO;
+		goto out;
+	}
+
 	/* operations */
+	err = -EIO;
 	if (testfs_set_ops(inode))
 		goto out;
 
@@ -539,6 +1609,183 @@ out:
 	return ERR_PTR(err);
 }
 
+/*
+ * Take the first free inode, inode bitmap block by block. Inodes in the
+ * inode table block being zeroed in the background are passed over.
+ */
+static int testfs_alloc_disk_inode(struct super_block *sb, ino_t *ino)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bits_per_block = sb->s_blocksize * 8;
+	u32 inodes_per_block = sb->s_blocksize / sbi->s_inode_size;
+	unsigned long *bitmap, bit, nbits;
+	struct buffer_head *bh;
+	u32 i;
+
+	for (i = 0; i < sbi->s_ibitmap_blknr; i++) {
+		nbits = min_t(u32, bits_per_block,
+			      sbi->s_inodes_count - i * bits_per_block);
+
+		/* read inode bitmap from disk */
+		bh = sb_bread_unmovable(sb, sbi->s_ibitmap_blkid + i);
+		if (!bh) {
+			log_err("failed to read inode bitmap\n");
+			return -EIO;
+		}
+
+		bitmap = (unsigned long *)bh->b_data;
+
+retry:
+		spin_lock(&sbi->s_ialloc_lock);
+		bit = find_next_zero_bit_le(bitmap, nbits, 0);
+		while (bit < nbits && (i * bits_per_block + bit) /
+				inodes_per_block == sbi->s_itable_busy)
+			bit = find_next_zero_bit_le(bitmap, nbits, bit + 1);
+		/* copied for the snapshot before it changes */
+		if (bit < nbits && testfs_snap_must_copy(sbi, bh->b_blocknr)) {
+			spin_unlock(&sbi->s_ialloc_lock);
+			if (testfs_snap_cow(sb, bh->b_blocknr)) {
+				brelse(bh);
+				return -EIO;
+			}
+			goto retry;
+		}
+		if (bit < nbits)
+			__set_bit_le(bit, bitmap);
+		spin_unlock(&sbi->s_ialloc_lock);
+
+		if (bit < nbits) {
+			*ino = i * bits_per_block + bit;
+			percpu_counter_dec(&sbi->s_freeinodes_counter);
+
+			/* write inode bitmap back to disk */
+			mark_buffer_dirty(bh);
+			if (sb->s_flags & SB_SYNCHRONOUS)
+				sync_dirty_buffer(bh);
+			brelse(bh);
+			return 0;
+		}
+		brelse(bh);
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * Lazy inode table initialization.
+ *
+ * mktestfs leaves the inode table as it found it on the device, apart
+ * from the blocks it writes, and the rest is zeroed here after a
+ * read-write mount, a batch at a time so the work stays in the background.
+ * In a block that already holds inodes only the free slots are zeroed:
+ * new inodes are written out whole (is_new_inode), but testfsck and the
+ * allocator take every slot below s_itable_zeroed for zeroed. It is on
+ * disk, the next mount carries on, as does a remount read-write.
+ */
+#define TESTFS_ITABLE_ZERO_BATCH	64
+
+/* zero the free slots of inode table block @blk, false if it can't */
+static bool testfs_zero_itable_block(struct super_block *sb, u32 blk)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bits_per_block = sb->s_blocksize * 8;
+	u32 per_block = sb->s_blocksize / sbi->s_inode_size;
+	u32 first = blk * per_block;
+	u32 nbits = min_t(u32, per_block,
+			  sbi->s_inodes_count - min(first, sbi->s_inodes_count));
+	struct buffer_head *bh = NULL, *ibh;
+	unsigned long *bitmap = NULL;
+	u32 i, bit = first % bits_per_block;
+	bool used = false;
+
+	if (nbits) {
+		bh = sb_bread_unmovable(sb, sbi->s_ibitmap_blkid +
+						first / bits_per_block);
+		if (!bh)
+			return false;
+		bitmap = (unsigned long *)bh->b_data;
+	}
+
+	/* no inode is allocated in the block meanwhile, one may be freed */
+	spin_lock(&sbi->s_ialloc_lock);
+	if (nbits)
+		used = find_next_bit_le(bitmap, bit + nbits, bit) < bit + nbits;
+	sbi->s_itable_busy = blk;
+	spin_unlock(&sbi->s_ialloc_lock);
+
+	/*
+	 * Through the buffer cache, write_inode() reads the same buffer and
+	 * only ever writes the slot of its inode.
+	 */
+	ibh = NULL;
+	if (!testfs_snap_cow(sb, sbi->s_itable_blkid + blk))
+		ibh = used ? sb_bread(sb, sbi->s_itable_blkid + blk) :
+			     sb_getblk(sb, sbi->s_itable_blkid + blk);
+	if (ibh) {
+		lock_buffer(ibh);
+		for (i = 0; i < per_block; i++) {
+			if (used && i < nbits && test_bit_le(bit + i, bitmap))
+				continue;
+			memset(ibh->b_data + i * sbi->s_inode_size, 0,
+			       sbi->s_inode_size);
+		}
+		set_buffer_uptodate(ibh);
+		unlock_buffer(ibh);
+		mark_buffer_dirty(ibh);
+		brelse(ibh);
+	}
+
+	spin_lock(&sbi->s_ialloc_lock);
+	sbi->s_itable_busy = U32_MAX;
+	spin_unlock(&sbi->s_ialloc_lock);
+	brelse(bh);
+
+	return ibh != NULL;
+}
+
+void testfs_itable_zero_work(struct work_struct *work)
+{
+	struct testfs_sb_info *sbi = container_of(to_delayed_work(work),
+					struct testfs_sb_info, s_itable_work);
+	struct super_block *sb = sbi->s_sb;
+	u32 blk = sbi->s_itable_zeroed, end;
+
+	/* remounting, a read-only mount leaves the table as it is */
+	if (!down_read_trylock(&sb->s_umount)) {
+		queue_delayed_work(system_long_wq, &sbi->s_itable_work, HZ);
+		return;
+	}
+	if (sb_rdonly(sb))
+		goto out;
+
+	end = min_t(u32, blk + TESTFS_ITABLE_ZERO_BATCH,
+		    sbi->inode_table_blknr);
+	for (; blk < end; blk++) {
+		if (!testfs_zero_itable_block(sb, blk))
+			break;
+	}
+
+	/* on disk before the super block says so */
+	if (sync_blockdev(sb->s_bdev))
+		goto out;
+
+	spin_lock(&sbi->s_ialloc_lock);
+	sbi->s_itable_zeroed = blk;
+	spin_unlock(&sbi->s_ialloc_lock);
+
+	if (blk < end) {
+		log_err("failed to zero inode table block %u\n", blk);
+		goto out;
+	}
+
+	if (blk < sbi->inode_table_blknr)
+		queue_delayed_work(system_long_wq, &sbi->s_itable_work, HZ / 10);
+	else
+		log_err("inode table zeroed\n");
+out:
+	up_read(&sb->s_umount);
+}
+
 struct inode *testfs_new_inode(struct inode *dir, umode_t mode,
 				const struct qstr *qstr)
 {
@@ -546,45 +1793,43 @@ struct inode *testfs_new_inode(struct inode *dir, umode_t mode,
 	struct testfs_inode *ti;
 	struct super_block *sb;
 	struct testfs_sb_info *sbi;
-	struct buffer_head *bh;
-	unsigned long *bitmap;
 	ino_t ino;
+	int ret;
 
         sb = dir->i_sb;
 	sbi = sb->s_fs_info;
+	/* no need to scan a full bitmap */
+	if (!percpu_counter_read_positive(&sbi->s_freeinodes_counter))
+		return ERR_PTR(-ENOSPC);
+
         inode = new_inode(sb);
         if (!inode)
                 return ERR_PTR(-ENOMEM);
 
-	/* read inode bitmap from disk */
-	bh = sb_bread_unmovable(sb, TEST_FS_BLKID_IBITMAP);
-	if (!bh) {
-		log_err("failed to read inode bitmap\n");
-		goto free_inode;
-	}
-
-	bitmap = (unsigned long *)bh->b_data;
-
-	while (1) {
-		/* find the first available bit */
-		ino = find_first_zero_bit_le(bitmap, TEST_FS_BLOCK_SIZE);
-
-		/* if return 0, means this bit has been used, retry other bit */
-		if (!test_and_set_bit_le(ino, bitmap))
-			break;
+	ret = testfs_alloc_disk_inode(sb, &ino);
+	if (ret) {
+		iput(inode);
+		return ERR_PTR(ret);
 	}
 	log_err("ino:%lu\n", ino);
 
-	/* write inode bitmap back to disk */
-	mark_buffer_dirty(bh);
-	if (sb->s_flags & SB_SYNCHRONOUS)
-		sync_dirty_buffer(bh);
-	brelse(bh);
-
 	inode_init_owner(inode, dir, mode);
 	inode->i_ino = ino;
 	inode->i_blocks = 0;
 	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
+
+	ti = TESTFS_I(inode);
+	ti->is_new_inode = 1;
+	memset(ti->i_block, 0, sizeof(ti->i_block));
+	ti->i_compr_map = 0;
+
+	/*
+	 * regular files start inline and move to blocks when they grow,
+	 * compression is inherited from the directory
+	 */
+	ti->i_flags = S_ISREG(mode) ? TESTFS_INLINE_DATA_FL : 0;
+	ti->i_flags |= TESTFS_I(dir)->i_flags & TESTFS_COMPR_FL;
+
 	if (testfs_set_ops(inode)) {
 		log_err("failed to set ops for inode:%lu\n", inode->i_ino);
 		goto free_inode;
@@ -593,10 +1838,6 @@ struct inode *testfs_new_inode(struct inode *dir, umode_t mode,
 	inode->i_generation = sbi->s_inode_gen++;
 	spin_unlock(&sbi->s_inode_gen_lock);
 
-	ti = TESTFS_I(inode);
-	ti->is_new_inode = 1;
-	memset(ti->i_block, 0, sizeof(ti->i_block));
-
 	if (insert_inode_locked(inode) < 0) {
 		log_err("failed to insert inode: %ld\n", inode->i_ino);
 		goto free_inode;
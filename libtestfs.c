@@ -0,0 +1,1400 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libtestfs.h"
+
+static uint32_t div_round_up(uint64_t n, uint64_t d)
+{
+	return (n + d - 1) / d;
+}
+
+static bool test_bit_le(const uint8_t *map, uint64_t bit)
+{
+	return map[bit / 8] & (1 << (bit % 8));
+}
+
+static void set_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+static void clear_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+static int rw_blocks(struct tfs *fs, bool write, uint32_t blkid,
+		     uint32_t count, void *buf)
+{
+	size_t len = (size_t)count * fs->block_size;
+	off_t off = (off_t)blkid * fs->block_size;
+	ssize_t ret;
+
+	ret = write ? pwrite(fs->fd, buf, len, off) : pread(fs->fd, buf, len, off);
+	if (ret < 0)
+		return -errno;
+	return ret == (ssize_t)len ? 0 : -EIO;
+}
+
+/**************************************************************
+ * image
+ **************************************************************/
+
+/* the geometry as testfs_read_geometry() takes it */
+static int tfs_read_geometry(struct tfs *fs)
+{
+	struct test_super_block *tsb = &fs->tsb;
+	uint32_t bits_per_block, inodes_per_block;
+
+	fs->block_size = le32toh(tsb->s_block_size);
+	if (le16toh(tsb->s_magic) != TEST_FS_MAGIC ||
+	    fs->block_size < TEST_FS_MIN_BLOCK_SIZE ||
+	    fs->block_size > TEST_FS_BLOCK_SIZE ||
+	    (fs->block_size & (fs->block_size - 1)) ||
+	    le32toh(tsb->s_inode_size) != TESTFS_DISK_INODE_SIZE)
+		return -EINVAL;
+
+	/* file data could be on a member device, only one image is open */
+	if (le16toh(tsb->s_ndevs) > 1)
+		return -EOPNOTSUPP;
+
+	bits_per_block = fs->block_size * 8;
+	inodes_per_block = fs->block_size / TESTFS_DISK_INODE_SIZE;
+	fs->itable_blknr = le32toh(tsb->s_inode_table_blknr);
+	fs->data_blkid = le32toh(tsb->s_data_blkid);
+	fs->data_blknr = le32toh(tsb->s_data_blknr);
+	fs->refcount_blkid = le32toh(tsb->s_refcount_blkid);
+	fs->refcount_blknr = le32toh(tsb->s_refcount_blknr);
+
+	if (!tsb->s_inodes_count) {
+		fs->ibitmap_blkid = TEST_FS_BLKID_IBITMAP;
+		fs->ibitmap_blknr = 1;
+		fs->dbitmap_blkid = TEST_FS_BLKID_DBITMAP;
+		fs->blocks_per_group = bits_per_block;
+		fs->itable_blkid = TEST_FS_BLKID_ITABLE;
+		if (fs->data_blknr > bits_per_block)
+			fs->data_blknr = bits_per_block;
+		fs->inodes_count = fs->itable_blknr * inodes_per_block;
+		if (fs->inodes_count > TEST_FS_BLOCK_SIZE)
+			fs->inodes_count = TEST_FS_BLOCK_SIZE;
+	} else {
+		fs->inodes_count = le32toh(tsb->s_inodes_count);
+		fs->ibitmap_blkid = le32toh(tsb->s_ibitmap_blkid);
+		fs->ibitmap_blknr = le32toh(tsb->s_ibitmap_blknr);
+		fs->dbitmap_blkid = le32toh(tsb->s_dbitmap_blkid);
+		fs->blocks_per_group = le32toh(tsb->s_blocks_per_group);
+		fs->itable_blkid = le32toh(tsb->s_inode_table_blkid);
+	}
+
+	if (!fs->blocks_per_group || fs->blocks_per_group > bits_per_block ||
+	    !fs->data_blknr || !fs->inodes_count ||
+	    (uint64_t)fs->ibitmap_blknr * bits_per_block < fs->inodes_count ||
+	    (uint64_t)fs->itable_blknr * inodes_per_block < fs->inodes_count)
+		return -EINVAL;
+	fs->groups_count = div_round_up(fs->data_blknr, fs->blocks_per_group);
+
+	if (fs->refcount_blknr && (uint64_t)fs->refcount_blknr *
+	    (fs->block_size / sizeof(__le16)) < fs->data_blknr)
+		fs->refcount_blknr = 0;
+
+	return 0;
+}
+
+static uint32_t group_nbits(struct tfs *fs, uint32_t group)
+{
+	uint32_t left = fs->data_blknr - group * fs->blocks_per_group;
+
+	return left < fs->blocks_per_group ? left : fs->blocks_per_group;
+}
+
+static uint8_t *group_bitmap(struct tfs *fs, uint32_t group)
+{
+	return fs->dbitmap + (size_t)group * fs->block_size;
+}
+
+/* the free counts are recounted from the bitmaps, they are in memory */
+static void tfs_count_free(struct tfs *fs)
+{
+	uint32_t group, bit, ino;
+
+	fs->free_blocks = 0;
+	for (group = 0; group < fs->groups_count; group++)
+		for (bit = 0; bit < group_nbits(fs, group); bit++)
+			if (!test_bit_le(group_bitmap(fs, group), bit))
+				fs->free_blocks++;
+
+	fs->free_inodes = 0;
+	for (ino = 0; ino < fs->inodes_count; ino++)
+		if (!test_bit_le(fs->ibitmap, ino))
+			fs->free_inodes++;
+}
+
+static int tfs_write_super(struct tfs *fs, bool valid)
+{
+	char buf[TEST_FS_MIN_BLOCK_SIZE];
+	uint16_t state = le16toh(fs->tsb.s_state);
+
+	fs->tsb.s_free_blocks_count = htole32(fs->free_blocks);
+	fs->tsb.s_free_inodes_count = htole32(fs->free_inodes);
+	state = valid ? state | TESTFS_VALID_FS : state & ~TESTFS_VALID_FS;
+	fs->tsb.s_state = htole16(state);
+
+	if (pread(fs->fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return -EIO;
+	memcpy(buf, &fs->tsb, sizeof(fs->tsb));
+	if (pwrite(fs->fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return -EIO;
+	return fsync(fs->fd) ? -errno : 0;
+}
+
+/**
+ * tfs_open - open a testfs image
+ *
+ * @path:	image file or block device
+ * @rdonly:	open read-only, nothing is ever written
+ * @fsp:	out: the open image
+ *
+ * A read-write open clears TESTFS_VALID_FS on disk as a read-write mount
+ * does, tfs_close() sets it again. It fails with -EBUSY while the image has
+ * a snapshot, writes here do not preserve it, and with -EROFS on an image
+ * with read-only features.
+ */
+int tfs_open(const char *path, bool rdonly, struct tfs **fsp)
+{
+	char buf[TEST_FS_MIN_BLOCK_SIZE];
+	struct tfs *fs;
+	int ret = -ENOMEM;
+
+	fs = calloc(1, sizeof(*fs));
+	if (!fs)
+		return -ENOMEM;
+	fs->rdonly = rdonly;
+
+	fs->fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+	if (fs->fd < 0) {
+		ret = -errno;
+		free(fs);
+		return ret;
+	}
+
+	if (pread(fs->fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+		ret = -EIO;
+		goto close;
+	}
+	memcpy(&fs->tsb, buf, sizeof(fs->tsb));
+	ret = tfs_read_geometry(fs);
+	if (ret)
+		goto close;
+	if (!rdonly && fs->tsb.s_snap_store_blknr &&
+	    le32toh(fs->tsb.s_snap_state) == TESTFS_SNAP_ACTIVE) {
+		ret = -EBUSY;
+		goto close;
+	}
+	if (!rdonly && fs->tsb.s_ro_flags) {
+		ret = -EROFS;
+		goto close;
+	}
+
+	ret = -ENOMEM;
+	fs->ibitmap = malloc((size_t)fs->ibitmap_blknr * fs->block_size);
+	fs->dbitmap = malloc((size_t)fs->groups_count * fs->block_size);
+	fs->group_dirty = calloc(fs->groups_count, 1);
+	if (fs->refcount_blknr)
+		fs->refcount = malloc((size_t)fs->refcount_blknr *
+				      fs->block_size);
+	if (!fs->ibitmap || !fs->dbitmap || !fs->group_dirty ||
+	    (fs->refcount_blknr && !fs->refcount))
+		goto free;
+
+	ret = rw_blocks(fs, false, fs->ibitmap_blkid, fs->ibitmap_blknr,
+			fs->ibitmap);
+	if (!ret)
+		ret = rw_blocks(fs, false, fs->dbitmap_blkid, fs->groups_count,
+				fs->dbitmap);
+	if (!ret && fs->refcount)
+		ret = rw_blocks(fs, false, fs->refcount_blkid,
+				fs->refcount_blknr, fs->refcount);
+	if (ret)
+		goto free;
+
+	tfs_count_free(fs);
+	fs->inode_gen = time(NULL);
+
+	if (!rdonly) {
+		ret = tfs_write_super(fs, false);
+		if (ret)
+			goto free;
+	}
+
+	*fsp = fs;
+	return 0;
+free:
+	free(fs->ibitmap);
+	free(fs->dbitmap);
+	free(fs->group_dirty);
+	free(fs->refcount);
+close:
+	close(fs->fd);
+	free(fs);
+	return ret;
+}
+
+/* write back the bitmaps and the refcount table changed since the last sync */
+int tfs_sync(struct tfs *fs)
+{
+	uint32_t group;
+	int ret;
+
+	if (fs->rdonly)
+		return 0;
+
+	for (group = 0; group < fs->groups_count; group++) {
+		if (!fs->group_dirty[group])
+			continue;
+		ret = rw_blocks(fs, true, fs->dbitmap_blkid + group, 1,
+				group_bitmap(fs, group));
+		if (ret)
+			return ret;
+		fs->group_dirty[group] = 0;
+	}
+
+	if (fs->ibitmap_dirty) {
+		ret = rw_blocks(fs, true, fs->ibitmap_blkid, fs->ibitmap_blknr,
+				fs->ibitmap);
+		if (ret)
+			return ret;
+		fs->ibitmap_dirty = false;
+	}
+
+	if (fs->refcount_dirty) {
+		ret = rw_blocks(fs, true, fs->refcount_blkid,
+				fs->refcount_blknr, fs->refcount);
+		if (ret)
+			return ret;
+		fs->refcount_dirty = false;
+	}
+
+	return fsync(fs->fd) ? -errno : 0;
+}
+
+int tfs_close(struct tfs *fs)
+{
+	int ret = 0;
+
+	if (!fs->rdonly) {
+		ret = tfs_sync(fs);
+		if (!ret)
+			ret = tfs_write_super(fs, true);
+	}
+
+	close(fs->fd);
+	free(fs->ibitmap);
+	free(fs->dbitmap);
+	free(fs->group_dirty);
+	free(fs->refcount);
+	free(fs);
+	return ret;
+}
+
+/**************************************************************
+ * allocator
+ **************************************************************/
+
+/* testfs_alloc_in_group() */
+static int alloc_in_group(struct tfs *fs, uint32_t group, uint32_t start,
+			  uint32_t *count, bool exact, uint32_t *blkid)
+{
+	uint32_t nbits = group_nbits(fs, group), index, end = 0, i;
+	uint8_t *bitmap = group_bitmap(fs, group);
+
+	for (index = start; index < nbits && test_bit_le(bitmap, index);)
+		index++;
+
+	if (exact) {
+		while (index + *count <= nbits) {
+			for (end = index; end < index + *count &&
+			     !test_bit_le(bitmap, end); end++)
+				;
+			if (end - index == *count)
+				break;
+			for (index = end; index < nbits &&
+			     test_bit_le(bitmap, index); index++)
+				;
+		}
+		if (index + *count > nbits)
+			index = nbits;
+	} else if (index < nbits) {
+		for (end = index; end < nbits && end < index + *count &&
+		     !test_bit_le(bitmap, end); end++)
+			;
+	}
+
+	if (index >= nbits)
+		return -ENOSPC;
+
+	for (i = index; i < end; i++)
+		set_bit_le(bitmap, i);
+	fs->group_dirty[group] = 1;
+
+	*count = end - index;
+	*blkid = fs->data_blkid + group * fs->blocks_per_group + index;
+	fs->free_blocks -= *count;
+	return 0;
+}
+
+/* testfs_alloc_blocks(): the groups from the one of @goal, wrapping once */
+static int alloc_blocks(struct tfs *fs, uint32_t goal, uint32_t *count,
+			bool exact, uint32_t *blkid)
+{
+	uint32_t i, group = 0, start = 0;
+	int ret;
+
+	if (fs->free_blocks < (exact ? *count : 1))
+		return -ENOSPC;
+
+	if (goal >= fs->data_blkid && goal - fs->data_blkid < fs->data_blknr) {
+		group = (goal - fs->data_blkid) / fs->blocks_per_group;
+		start = (goal - fs->data_blkid) % fs->blocks_per_group;
+	}
+
+	for (i = 0; i <= fs->groups_count; i++) {
+		if (i == fs->groups_count && !start)
+			break;
+
+		ret = alloc_in_group(fs, (group + i) % fs->groups_count,
+				     i ? 0 : start, count, exact, blkid);
+		if (ret != -ENOSPC)
+			return ret;
+	}
+
+	return -ENOSPC;
+}
+
+/* a run of up to *@count blocks from @goal on, see testfs_new_blocks() */
+int tfs_new_blocks(struct tfs *fs, uint32_t goal, uint32_t *count,
+		   uint32_t *blkid)
+{
+	return alloc_blocks(fs, goal, count, false, blkid);
+}
+
+/* exactly @count contiguous blocks, see testfs_new_contig_blocks() */
+int tfs_new_contig_blocks(struct tfs *fs, uint32_t goal, uint32_t count,
+			  uint32_t *blkid)
+{
+	return alloc_blocks(fs, goal, &count, true, blkid);
+}
+
+/* testfs_stream_of(), the hint is the one persisted in the inode */
+static uint32_t stream_of(struct tfs_inode *ti)
+{
+	uint32_t hint = ti->d.i_write_hint;
+
+	if (hint <= 1)
+		return 0;
+	return hint - 1 < TESTFS_NR_STREAMS ? hint - 1 : TESTFS_NR_STREAMS - 1;
+}
+
+static uint32_t stream_start(struct tfs *fs, uint32_t stream)
+{
+	return fs->data_blkid +
+		(uint64_t)fs->data_blknr * stream / TESTFS_NR_STREAMS;
+}
+
+/* testfs_stream_goal() */
+static uint32_t stream_goal(struct tfs *fs, struct tfs_inode *ti)
+{
+	uint32_t stream = stream_of(ti);
+
+	if (!stream)
+		return 0;
+	return fs->stream_goal[stream] ? fs->stream_goal[stream] :
+		stream_start(fs, stream);
+}
+
+/* testfs_stream_advance() */
+static void stream_advance(struct tfs *fs, struct tfs_inode *ti,
+			   uint32_t blkid, uint32_t count)
+{
+	uint32_t stream = stream_of(ti), next = blkid + count;
+
+	if (!stream)
+		return;
+	if (next <= stream_start(fs, stream) ||
+	    next >= stream_start(fs, stream + 1))
+		next = 0;
+	fs->stream_goal[stream] = next;
+}
+
+static uint16_t *refcount_of(struct tfs *fs, uint32_t blkid)
+{
+	return fs->refcount ? &fs->refcount[blkid - fs->data_blkid] : NULL;
+}
+
+/* blocks shared with another file only lose a reference */
+void tfs_free_blocks(struct tfs *fs, uint32_t blkid, uint32_t count)
+{
+	uint32_t i, index, group, bit;
+	uint16_t *ref;
+
+	if (blkid < fs->data_blkid ||
+	    blkid - fs->data_blkid + count > fs->data_blknr)
+		return;
+
+	for (i = 0; i < count; i++) {
+		ref = refcount_of(fs, blkid + i);
+		if (ref && *ref) {
+			*ref = htole16(le16toh(*ref) - 1);
+			fs->refcount_dirty = true;
+			continue;
+		}
+
+		index = blkid + i - fs->data_blkid;
+		group = index / fs->blocks_per_group;
+		bit = index % fs->blocks_per_group;
+		if (!test_bit_le(group_bitmap(fs, group), bit))
+			continue;
+		clear_bit_le(group_bitmap(fs, group), bit);
+		fs->group_dirty[group] = 1;
+		fs->free_blocks++;
+	}
+}
+
+/* the first free inode, as testfs_alloc_disk_inode() */
+int tfs_alloc_ino(struct tfs *fs, uint32_t *ino)
+{
+	uint32_t i;
+
+	if (!fs->free_inodes)
+		return -ENOSPC;
+
+	for (i = 0; i < fs->inodes_count; i++) {
+		if (test_bit_le(fs->ibitmap, i))
+			continue;
+		set_bit_le(fs->ibitmap, i);
+		fs->ibitmap_dirty = true;
+		fs->free_inodes--;
+		*ino = i;
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+
+void tfs_free_ino(struct tfs *fs, uint32_t ino)
+{
+	if (ino >= fs->inodes_count || !test_bit_le(fs->ibitmap, ino))
+		return;
+
+	clear_bit_le(fs->ibitmap, ino);
+	fs->ibitmap_dirty = true;
+	fs->free_inodes++;
+}
+
+/**************************************************************
+ * inodes and block map
+ **************************************************************/
+
+static off_t inode_offset(struct tfs *fs, uint32_t ino)
+{
+	return (off_t)fs->itable_blkid * fs->block_size +
+		(off_t)ino * TESTFS_DISK_INODE_SIZE;
+}
+
+int tfs_read_inode(struct tfs *fs, uint32_t ino, struct tfs_inode *ti)
+{
+	if (ino >= fs->inodes_count || !test_bit_le(fs->ibitmap, ino))
+		return -ENOENT;
+
+	ti->ino = ino;
+	if (pread(fs->fd, &ti->d, sizeof(ti->d), inode_offset(fs, ino)) !=
+	    sizeof(ti->d))
+		return -EIO;
+	return 0;
+}
+
+int tfs_write_inode(struct tfs *fs, struct tfs_inode *ti)
+{
+	if (fs->rdonly)
+		return -EROFS;
+
+	if (pwrite(fs->fd, &ti->d, sizeof(ti->d), inode_offset(fs, ti->ino)) !=
+	    sizeof(ti->d))
+		return -EIO;
+	return 0;
+}
+
+void tfs_touch(struct tfs_inode *ti, bool atime, bool mtime, bool ctime)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (atime) {
+		ti->d.i_atime = htole32(now.tv_sec);
+		ti->d.i_atime_nsec = htole32(now.tv_nsec);
+	}
+	if (mtime) {
+		ti->d.i_mtime = htole32(now.tv_sec);
+		ti->d.i_mtime_nsec = htole32(now.tv_nsec);
+	}
+	if (ctime) {
+		ti->d.i_ctime = htole32(now.tv_sec);
+		ti->d.i_ctime_nsec = htole32(now.tv_nsec);
+	}
+}
+
+static bool has_inline_data(struct tfs_inode *ti)
+{
+	return le32toh(ti->d.i_flags) & TESTFS_INLINE_DATA_FL;
+}
+
+/* testfs_update_i_blocks() */
+static void update_i_blocks(struct tfs *fs, struct tfs_inode *ti)
+{
+	uint32_t i, blocks = 0;
+
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++)
+		if (ti->d.i_block[i])
+			blocks++;
+	ti->d.i_blocks = htole32(blocks * (fs->block_size >> 9));
+}
+
+/* testfs_lookup_extent() */
+static uint32_t lookup_extent(struct tfs_inode *ti, uint32_t iblock,
+			      uint32_t end, uint32_t *bno)
+{
+	uint32_t i, next, blkid = le32toh(ti->d.i_block[iblock]);
+
+	for (i = iblock + 1; i < end; i++) {
+		next = le32toh(ti->d.i_block[i]);
+		if (blkid ? next != blkid + (i - iblock) : next != 0)
+			break;
+	}
+
+	*bno = blkid;
+	return i - iblock;
+}
+
+/* testfs_unshare_blocks(): copy the shared head of an extent */
+static int unshare_blocks(struct tfs *fs, struct tfs_inode *ti,
+			  uint32_t iblock, uint32_t count, uint32_t *bno)
+{
+	uint32_t i, blkid;
+	uint16_t *ref = refcount_of(fs, *bno);
+	bool shared = ref && *ref;
+	char *buf;
+	int ret;
+
+	if (!fs->refcount)
+		return count;
+
+	for (i = 1; i < count; i++)
+		if ((*refcount_of(fs, *bno + i) != 0) != shared)
+			break;
+	count = i;
+	if (!shared)
+		return count;
+
+	ret = tfs_new_blocks(fs, *bno, &count, &blkid);
+	if (ret)
+		return ret;
+
+	buf = malloc((size_t)count * fs->block_size);
+	if (!buf) {
+		tfs_free_blocks(fs, blkid, count);
+		return -ENOMEM;
+	}
+	ret = rw_blocks(fs, false, *bno, count, buf);
+	if (!ret)
+		ret = rw_blocks(fs, true, blkid, count, buf);
+	free(buf);
+	if (ret) {
+		tfs_free_blocks(fs, blkid, count);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++)
+		ti->d.i_block[iblock + i] = htole32(blkid + i);
+	tfs_free_blocks(fs, *bno, count);
+
+	*bno = blkid;
+	return count;
+}
+
+/**
+ * tfs_map_blocks - map a run of file blocks to disk blocks
+ *
+ * Same contract as testfs_map_blocks(): the run is one extent or one hole,
+ * @create fills a hole right behind the previous block, or from the write
+ * lifetime stream of the file, and copies shared blocks. The caller
+ * writes @ti back. Files with compressed clusters are left to the kernel,
+ * -EOPNOTSUPP, as are tails, tfs_read() knows them.
+ */
+int tfs_map_blocks(struct tfs *fs, struct tfs_inode *ti, uint32_t iblock,
+		   uint32_t max_blocks, uint32_t *bno, bool *new, bool create)
+{
+	uint32_t i, end, blkid, goal = 0, count;
+	int ret;
+
+	*new = false;
+	if (ti->d.i_compr_map || (le32toh(ti->d.i_flags) & TESTFS_TAIL_FL))
+		return -EOPNOTSUPP;
+	if (iblock >= TEST_FS_N_BLOCKS) {
+		if (create)
+			return -EFBIG;
+		*bno = 0;
+		return max_blocks;
+	}
+	end = iblock + max_blocks < TEST_FS_N_BLOCKS ?
+		iblock + max_blocks : TEST_FS_N_BLOCKS;
+
+	ret = lookup_extent(ti, iblock, end, bno);
+	if (*bno && create)
+		return unshare_blocks(fs, ti, iblock, ret, bno);
+	if (*bno || !create)
+		return ret;
+
+	for (i = iblock; i > 0 && !goal; i--) {
+		goal = le32toh(ti->d.i_block[i - 1]);
+		if (goal)
+			goal += iblock - (i - 1);
+	}
+	if (!goal)
+		goal = stream_goal(fs, ti);
+
+	count = ret;
+	ret = tfs_new_blocks(fs, goal, &count, &blkid);
+	if (ret)
+		return ret;
+	stream_advance(fs, ti, blkid, count);
+
+	for (i = 0; i < count; i++)
+		ti->d.i_block[iblock + i] = htole32(blkid + i);
+	update_i_blocks(fs, ti);
+
+	*bno = blkid;
+	*new = true;
+	return count;
+}
+
+ssize_t tfs_read(struct tfs *fs, struct tfs_inode *ti, void *buf,
+		 size_t len, off_t off)
+{
+	uint32_t bs = fs->block_size, size = le32toh(ti->d.i_size);
+	uint32_t iblock, bno, n;
+	size_t done = 0, chunk;
+	off_t pos;
+	bool new;
+	int ret;
+
+	if (off >= size)
+		return 0;
+	if (len > (size_t)(size - off))
+		len = size - off;
+
+	if (has_inline_data(ti)) {
+		memcpy(buf, ti->d.i_data + off, len);
+		return len;
+	}
+
+	/* a tail of a packed image, i_block[1] bytes into its block */
+	if (le32toh(ti->d.i_flags) & TESTFS_TAIL_FL) {
+		if (pread(fs->fd, buf, len, (off_t)le32toh(ti->d.i_block[0]) *
+			  bs + le32toh(ti->d.i_block[1]) + off) != (ssize_t)len)
+			return -EIO;
+		return len;
+	}
+
+	while (done < len) {
+		pos = off + done;
+		iblock = pos / bs;
+		ret = tfs_map_blocks(fs, ti, iblock,
+				     div_round_up(off + len, bs) - iblock,
+				     &bno, &new, false);
+		if (ret < 0)
+			return ret;
+		n = ret;
+
+		chunk = (off_t)(iblock + n) * bs - pos;
+		if (chunk > len - done)
+			chunk = len - done;
+
+		if (!bno)
+			memset((char *)buf + done, 0, chunk);
+		else if (pread(fs->fd, (char *)buf + done, chunk,
+			       (off_t)bno * bs + pos % bs) != (ssize_t)chunk)
+			return -EIO;
+		done += chunk;
+	}
+
+	return done;
+}
+
+/* testfs_convert_inline_data(): the inline bytes move to block 0 */
+static int convert_inline_data(struct tfs *fs, struct tfs_inode *ti)
+{
+	uint8_t data[TESTFS_INLINE_DATA_SIZE];
+	uint32_t size = le32toh(ti->d.i_size);
+	ssize_t ret;
+
+	memcpy(data, ti->d.i_data, sizeof(data));
+	memset(ti->d.i_block, 0, sizeof(ti->d.i_block));
+	ti->d.i_flags = htole32(le32toh(ti->d.i_flags) &
+				~TESTFS_INLINE_DATA_FL);
+	if (!size)
+		return 0;
+
+	ret = tfs_write(fs, ti, data, size, 0);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Write @len bytes at @off, one extent at a time: a run is written with
+ * one pwrite, partial blocks at its ends are read first unless the run is
+ * new. Size and times are updated and @ti written back.
+ */
+ssize_t tfs_write(struct tfs *fs, struct tfs_inode *ti, const void *buf,
+		  size_t len, off_t off)
+{
+	uint32_t bs = fs->block_size, iblock, want, bno, n, span;
+	uint64_t end = off + len, run_start, run_end;
+	size_t done = 0;
+	char *tmp;
+	bool new;
+	int ret;
+
+	if (fs->rdonly)
+		return -EROFS;
+	if (end > (uint64_t)bs * TEST_FS_N_BLOCKS)
+		return -EFBIG;
+
+	if (has_inline_data(ti)) {
+		if (end <= TESTFS_INLINE_DATA_SIZE) {
+			memcpy(ti->d.i_data + off, buf, len);
+			goto out;
+		}
+		ret = convert_inline_data(fs, ti);
+		if (ret)
+			return ret;
+	}
+
+	while (done < len) {
+		iblock = (off + done) / bs;
+		want = div_round_up(end, bs) - iblock;
+		ret = tfs_map_blocks(fs, ti, iblock, want, &bno, &new, true);
+		if (ret < 0)
+			return ret;
+		n = ret < (int)want ? (uint32_t)ret : want;
+
+		run_start = (uint64_t)iblock * bs;
+		run_end = run_start + (uint64_t)n * bs;
+		span = n * bs;
+		tmp = malloc(span);
+		if (!tmp)
+			return -ENOMEM;
+
+		/* partial blocks at the ends keep what is around them */
+		if (new) {
+			memset(tmp, 0, span);
+		} else {
+			if ((off_t)(off + done) > (off_t)run_start &&
+			    rw_blocks(fs, false, bno, 1, tmp))
+				goto eio;
+			if (end < run_end &&
+			    rw_blocks(fs, false, bno + n - 1, 1,
+				      tmp + span - bs))
+				goto eio;
+		}
+
+		if (end < run_end)
+			run_end = end;
+		memcpy(tmp + (off + done - run_start), (const char *)buf + done,
+		       run_end - (off + done));
+		if (rw_blocks(fs, true, bno, n, tmp))
+			goto eio;
+		free(tmp);
+		done = run_end - off;
+	}
+
+out:
+	if (end > le32toh(ti->d.i_size))
+		ti->d.i_size = htole32(end);
+	tfs_touch(ti, false, true, true);
+	ret = tfs_write_inode(fs, ti);
+	return ret ? ret : (ssize_t)len;
+eio:
+	free(tmp);
+	return -EIO;
+}
+
+/* testfs_truncate_blocks() plus the size change */
+int tfs_truncate(struct tfs *fs, struct tfs_inode *ti, off_t size)
+{
+	uint32_t bs = fs->block_size, i, blkid, start = 0, count = 0;
+	uint32_t old = le32toh(ti->d.i_size);
+	char *buf;
+	int ret;
+
+	if (fs->rdonly)
+		return -EROFS;
+	if ((uint64_t)size > (uint64_t)bs * TEST_FS_N_BLOCKS)
+		return -EFBIG;
+
+	if (has_inline_data(ti)) {
+		if (size <= (off_t)TESTFS_INLINE_DATA_SIZE) {
+			if (size < old)
+				memset(ti->d.i_data + size, 0,
+				       TESTFS_INLINE_DATA_SIZE - size);
+			goto out;
+		}
+		ret = convert_inline_data(fs, ti);
+		if (ret)
+			return ret;
+	}
+
+	/* compressed clusters can only go as a whole */
+	if (ti->d.i_compr_map) {
+		if (size)
+			return -EOPNOTSUPP;
+		ti->d.i_compr_map = 0;
+	}
+
+	if (size < old) {
+		for (i = div_round_up(size, bs); i < TEST_FS_N_BLOCKS; i++) {
+			blkid = le32toh(ti->d.i_block[i]);
+			if (!blkid)
+				continue;
+			ti->d.i_block[i] = 0;
+			if (count && blkid == start + count) {
+				count++;
+				continue;
+			}
+			if (count)
+				tfs_free_blocks(fs, start, count);
+			start = blkid;
+			count = 1;
+		}
+		if (count)
+			tfs_free_blocks(fs, start, count);
+		update_i_blocks(fs, ti);
+
+		/* the tail of the last block reads back as zeros if extended */
+		if (size % bs && ti->d.i_block[size / bs]) {
+			buf = calloc(1, bs - size % bs);
+			if (!buf)
+				return -ENOMEM;
+			ti->d.i_size = htole32(size);
+			ret = tfs_write(fs, ti, buf, bs - size % bs, size);
+			free(buf);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+out:
+	ti->d.i_size = htole32(size);
+	tfs_touch(ti, false, true, true);
+	return tfs_write_inode(fs, ti);
+}
+
+/**************************************************************
+ * directories
+ **************************************************************/
+
+/*
+ * Call @fn on each used entry of @dir, one block at a time, until it
+ * returns non zero. @fn gets the entry and its slot number.
+ */
+static int dir_walk(struct tfs *fs, struct tfs_inode *dir,
+		    int (*fn)(struct testfs_dir_entry *tde, uint32_t slot,
+			      void *arg), void *arg, bool all)
+{
+	uint32_t size = le32toh(dir->d.i_size), per_block, slot = 0, i;
+	struct testfs_dir_entry *tde;
+	ssize_t n;
+	off_t pos;
+	char *buf;
+	int ret = 0;
+
+	per_block = fs->block_size / TEST_FS_DENTRY_SIZE;
+	buf = malloc(fs->block_size);
+	if (!buf)
+		return -ENOMEM;
+
+	for (pos = 0; pos < size && !ret; pos += fs->block_size) {
+		n = tfs_read(fs, dir, buf, fs->block_size, pos);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		tde = (struct testfs_dir_entry *)buf;
+		for (i = 0; i < per_block && i * TEST_FS_DENTRY_SIZE < n;
+		     i++, slot++) {
+			if (!all && !tde[i].name_len)
+				continue;
+			ret = fn(&tde[i], slot, arg);
+			if (ret)
+				break;
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
+struct dir_find {
+	const char *name;
+	size_t len;
+	uint32_t ino;
+	uint32_t slot;
+	uint32_t free_slot;
+};
+
+static int dir_find_fn(struct testfs_dir_entry *tde, uint32_t slot, void *arg)
+{
+	struct dir_find *find = arg;
+
+	if (!tde->name_len) {
+		if (find->free_slot == UINT32_MAX)
+			find->free_slot = slot;
+		return 0;
+	}
+	if (tde->name_len != find->len || memcmp(tde->name, find->name,
+						 find->len))
+		return 0;
+
+	find->ino = le32toh(tde->inode);
+	find->slot = slot;
+	return 1;
+}
+
+static int dir_find(struct tfs *fs, struct tfs_inode *dir, const char *name,
+		    struct dir_find *find)
+{
+	int ret;
+
+	find->name = name;
+	find->len = strlen(name);
+	find->free_slot = UINT32_MAX;
+	if (find->len > TESTFS_FILE_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	ret = dir_walk(fs, dir, dir_find_fn, find, true);
+	if (ret < 0)
+		return ret;
+	return ret ? 0 : -ENOENT;
+}
+
+int tfs_dir_lookup(struct tfs *fs, struct tfs_inode *dir, const char *name,
+		   uint32_t *ino)
+{
+	struct dir_find find;
+	int ret;
+
+	ret = dir_find(fs, dir, name, &find);
+	if (!ret)
+		*ino = find.ino;
+	return ret;
+}
+
+struct dir_iter {
+	tfs_filldir_t filldir;
+	void *arg;
+};
+
+static int dir_iter_fn(struct testfs_dir_entry *tde,
+		       uint32_t slot __attribute__((unused)), void *arg)
+{
+	struct dir_iter *iter = arg;
+	char name[TESTFS_FILE_NAME_LEN + 1];
+
+	memcpy(name, tde->name, tde->name_len);
+	name[tde->name_len] = '\0';
+	return iter->filldir(iter->arg, name, tde->name_len,
+			     le32toh(tde->inode), tde->file_type);
+}
+
+int tfs_dir_iterate(struct tfs *fs, struct tfs_inode *dir,
+		    tfs_filldir_t filldir, void *arg)
+{
+	struct dir_iter iter = { filldir, arg };
+	int ret;
+
+	ret = dir_walk(fs, dir, dir_iter_fn, &iter, false);
+	return ret < 0 ? ret : 0;
+}
+
+static int dir_write_slot(struct tfs *fs, struct tfs_inode *dir,
+			  uint32_t slot, struct testfs_dir_entry *tde)
+{
+	ssize_t ret;
+
+	ret = tfs_write(fs, dir, tde, sizeof(*tde),
+			(off_t)slot * TEST_FS_DENTRY_SIZE);
+	return ret < 0 ? ret : 0;
+}
+
+/* testfs_add_link(): the first free slot, or one more at the end */
+int tfs_dir_add(struct tfs *fs, struct tfs_inode *dir, const char *name,
+		uint32_t ino, int type)
+{
+	struct testfs_dir_entry tde;
+	struct dir_find find;
+	uint32_t slot;
+	int ret;
+
+	ret = dir_find(fs, dir, name, &find);
+	if (!ret)
+		return -EEXIST;
+	if (ret != -ENOENT)
+		return ret;
+
+	slot = find.free_slot;
+	if (slot == UINT32_MAX)
+		slot = le32toh(dir->d.i_size) / TEST_FS_DENTRY_SIZE;
+
+	memset(&tde, 0, sizeof(tde));
+	tde.inode = htole32(ino);
+	tde.file_type = type;
+	tde.name_len = find.len;
+	memcpy(tde.name, name, find.len);
+	return dir_write_slot(fs, dir, slot, &tde);
+}
+
+int tfs_dir_remove(struct tfs *fs, struct tfs_inode *dir, const char *name)
+{
+	struct testfs_dir_entry tde;
+	struct dir_find find;
+	int ret;
+
+	ret = dir_find(fs, dir, name, &find);
+	if (ret)
+		return ret;
+
+	memset(&tde, 0, sizeof(tde));
+	return dir_write_slot(fs, dir, find.slot, &tde);
+}
+
+static int dir_empty_fn(struct testfs_dir_entry *tde,
+			uint32_t slot __attribute__((unused)),
+			void *arg __attribute__((unused)))
+{
+	if (tde->name_len == 1 && tde->name[0] == '.')
+		return 0;
+	if (tde->name_len == 2 && !memcmp(tde->name, "..", 2))
+		return 0;
+	return 1;
+}
+
+int tfs_dir_is_empty(struct tfs *fs, struct tfs_inode *dir)
+{
+	int ret = dir_walk(fs, dir, dir_empty_fn, NULL, false);
+
+	return ret < 0 ? ret : !ret;
+}
+
+/**************************************************************
+ * namespace
+ **************************************************************/
+
+int tfs_lookup_path(struct tfs *fs, const char *path, uint32_t *ino)
+{
+	char name[TESTFS_FILE_NAME_LEN + 1];
+	struct tfs_inode dir;
+	const char *p = path, *e;
+	uint32_t cur = TESTFS_ROOT_INO;
+	int ret;
+
+	for (;;) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		for (e = p; *e && *e != '/'; e++)
+			;
+		if (e - p > TESTFS_FILE_NAME_LEN)
+			return -ENAMETOOLONG;
+		memcpy(name, p, e - p);
+		name[e - p] = '\0';
+
+		ret = tfs_read_inode(fs, cur, &dir);
+		if (ret)
+			return ret;
+		if (!S_ISDIR(le16toh(dir.d.i_mode)))
+			return -ENOTDIR;
+		ret = tfs_dir_lookup(fs, &dir, name, &cur);
+		if (ret)
+			return ret;
+		p = e;
+	}
+
+	*ino = cur;
+	return 0;
+}
+
+static int ftype(mode_t mode)
+{
+	return S_ISDIR(mode) ? TESTFS_FT_DIR : TESTFS_FT_REG_FILE;
+}
+
+static int inc_link(struct tfs *fs, struct tfs_inode *ti, int delta)
+{
+	ti->d.i_links_count = htole16(le16toh(ti->d.i_links_count) + delta);
+	tfs_touch(ti, false, false, true);
+	return tfs_write_inode(fs, ti);
+}
+
+/* testfs_create() and testfs_mkdir(): regular files start inline */
+int tfs_create(struct tfs *fs, uint32_t dir_ino, const char *name,
+	       mode_t mode, uid_t uid, gid_t gid, struct tfs_inode *ti)
+{
+	struct testfs_dir_entry dots[2];
+	struct tfs_inode dir;
+	uint32_t ino;
+	int ret;
+
+	if (!S_ISREG(mode) && !S_ISDIR(mode))
+		return -EOPNOTSUPP;
+	if (strlen(name) > TESTFS_FILE_NAME_LEN)
+		return -ENAMETOOLONG;
+
+	ret = tfs_read_inode(fs, dir_ino, &dir);
+	if (ret)
+		return ret;
+	ret = tfs_dir_lookup(fs, &dir, name, &ino);
+	if (!ret)
+		return -EEXIST;
+	if (ret != -ENOENT)
+		return ret;
+
+	ret = tfs_alloc_ino(fs, &ino);
+	if (ret)
+		return ret;
+
+	memset(ti, 0, sizeof(*ti));
+	ti->ino = ino;
+	ti->d.i_mode = htole16(mode);
+	ti->d.i_links_count = htole16(S_ISDIR(mode) ? 2 : 1);
+	ti->d.i_uid = htole32(uid);
+	ti->d.i_gid = htole32(gid);
+	ti->d.i_generation = htole32(fs->inode_gen++);
+	/* the kernel compresses the data at writeback, libtestfs does not */
+	ti->d.i_flags = htole32((S_ISREG(mode) ? TESTFS_INLINE_DATA_FL : 0) |
+				(le32toh(dir.d.i_flags) & TESTFS_COMPR_FL));
+	tfs_touch(ti, true, true, true);
+
+	if (S_ISDIR(mode)) {
+		memset(dots, 0, sizeof(dots));
+		dots[0].inode = htole32(ino);
+		dots[0].file_type = TESTFS_FT_DIR;
+		dots[0].name_len = 1;
+		dots[0].name[0] = '.';
+		dots[1].inode = htole32(dir_ino);
+		dots[1].file_type = TESTFS_FT_DIR;
+		dots[1].name_len = 2;
+		memcpy(dots[1].name, "..", 2);
+		ret = tfs_write(fs, ti, dots, sizeof(dots), 0);
+		if (ret < 0)
+			goto free;
+	}
+
+	ret = tfs_write_inode(fs, ti);
+	if (ret)
+		goto free;
+
+	ret = tfs_dir_add(fs, &dir, name, ino, ftype(mode));
+	if (ret)
+		goto free;
+
+	/* the entry is written, and @dir with it */
+	if (S_ISDIR(mode))
+		return inc_link(fs, &dir, 1);
+	return 0;
+free:
+	tfs_truncate(fs, ti, 0);
+	tfs_free_ino(fs, ino);
+	return ret;
+}
+
+int tfs_link(struct tfs *fs, uint32_t ino, uint32_t dir_ino,
+	     const char *name)
+{
+	struct tfs_inode dir, ti;
+	int ret;
+
+	ret = tfs_read_inode(fs, ino, &ti);
+	if (!ret)
+		ret = tfs_read_inode(fs, dir_ino, &dir);
+	if (ret)
+		return ret;
+	if (S_ISDIR(le16toh(ti.d.i_mode)))
+		return -EPERM;
+
+	ret = tfs_dir_add(fs, &dir, name, ino, TESTFS_FT_REG_FILE);
+	if (ret)
+		return ret;
+	return inc_link(fs, &ti, 1);
+}
+
+/* drop one link of @ino, the inode and its blocks go with the last one */
+static int put_link(struct tfs *fs, uint32_t ino)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	ret = tfs_read_inode(fs, ino, &ti);
+	if (ret)
+		return ret;
+
+	if (S_ISDIR(le16toh(ti.d.i_mode)) || le16toh(ti.d.i_links_count) <= 1) {
+		ti.d.i_links_count = 0;
+		ret = tfs_truncate(fs, &ti, 0);
+		tfs_free_ino(fs, ino);
+		return ret;
+	}
+	return inc_link(fs, &ti, -1);
+}
+
+static int remove_entry(struct tfs *fs, uint32_t dir_ino, const char *name,
+			bool want_dir)
+{
+	struct tfs_inode dir, ti;
+	uint32_t ino;
+	bool is_dir;
+	int ret;
+
+	ret = tfs_read_inode(fs, dir_ino, &dir);
+	if (!ret)
+		ret = tfs_dir_lookup(fs, &dir, name, &ino);
+	if (!ret)
+		ret = tfs_read_inode(fs, ino, &ti);
+	if (ret)
+		return ret;
+
+	is_dir = S_ISDIR(le16toh(ti.d.i_mode));
+	if (want_dir && !is_dir)
+		return -ENOTDIR;
+	if (!want_dir && is_dir)
+		return -EISDIR;
+	if (is_dir) {
+		ret = tfs_dir_is_empty(fs, &ti);
+		if (ret <= 0)
+			return ret ? ret : -ENOTEMPTY;
+	}
+
+	ret = tfs_dir_remove(fs, &dir, name);
+	if (ret)
+		return ret;
+	if (is_dir) {
+		ret = inc_link(fs, &dir, -1);
+		if (ret)
+			return ret;
+	}
+	return put_link(fs, ino);
+}
+
+int tfs_unlink(struct tfs *fs, uint32_t dir_ino, const char *name)
+{
+	return remove_entry(fs, dir_ino, name, false);
+}
+
+int tfs_rmdir(struct tfs *fs, uint32_t dir_ino, const char *name)
+{
+	return remove_entry(fs, dir_ino, name, true);
+}
+
+/* testfs_rename(): an existing target is replaced */
+int tfs_rename(struct tfs *fs, uint32_t old_dir, const char *old_name,
+	       uint32_t new_dir, const char *new_name)
+{
+	struct tfs_inode odir, ndir, ti, target;
+	struct testfs_dir_entry dotdot;
+	uint32_t ino, tino;
+	bool is_dir;
+	int ret;
+
+	ret = tfs_read_inode(fs, old_dir, &odir);
+	if (!ret)
+		ret = tfs_dir_lookup(fs, &odir, old_name, &ino);
+	if (!ret)
+		ret = tfs_read_inode(fs, ino, &ti);
+	if (ret)
+		return ret;
+	is_dir = S_ISDIR(le16toh(ti.d.i_mode));
+
+	ret = tfs_read_inode(fs, new_dir, &ndir);
+	if (ret)
+		return ret;
+	ret = tfs_dir_lookup(fs, &ndir, new_name, &tino);
+	if (!ret) {
+		if (tino == ino)
+			return 0;
+		ret = tfs_read_inode(fs, tino, &target);
+		if (ret)
+			return ret;
+		if (S_ISDIR(le16toh(target.d.i_mode)) != is_dir)
+			return is_dir ? -ENOTDIR : -EISDIR;
+		ret = remove_entry(fs, new_dir, new_name, is_dir);
+		if (ret)
+			return ret;
+		ret = tfs_read_inode(fs, new_dir, &ndir);
+		if (ret)
+			return ret;
+	} else if (ret != -ENOENT) {
+		return ret;
+	}
+
+	ret = tfs_dir_add(fs, &ndir, new_name, ino, ftype(le16toh(ti.d.i_mode)));
+	if (ret)
+		return ret;
+
+	/* same directory: odir is stale after the add, read it again */
+	ret = tfs_read_inode(fs, old_dir, &odir);
+	if (!ret)
+		ret = tfs_dir_remove(fs, &odir, old_name);
+	if (ret || !is_dir || old_dir == new_dir)
+		return ret;
+
+	/* a directory moved: ".." and the link counts of both parents */
+	memset(&dotdot, 0, sizeof(dotdot));
+	dotdot.inode = htole32(new_dir);
+	dotdot.file_type = TESTFS_FT_DIR;
+	dotdot.name_len = 2;
+	memcpy(dotdot.name, "..", 2);
+	ret = dir_write_slot(fs, &ti, 1, &dotdot);
+	if (!ret)
+		ret = inc_link(fs, &odir, -1);
+	if (!ret)
+		ret = tfs_read_inode(fs, new_dir, &ndir);
+	if (!ret)
+		ret = inc_link(fs, &ndir, 1);
+	return ret;
+}
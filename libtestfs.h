@@ -0,0 +1,233 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * libtestfs - the testfs on-disk format in userspace
+ *
+ * Reads and writes testfs images without the kernel module: the allocator,
+ * the block map and the directory code follow balloc.c, inode.c and dir.c
+ * so they can be benchmarked on their own and compared with the module.
+ * Bitmaps and the refcount table are kept in memory and written back by
+ * tfs_sync(), everything else goes straight to the image with pread and
+ * pwrite. Not thread safe, callers serialize.
+ *
+ * Functions return 0 or a length on success and a negative errno on
+ * failure, as their kernel counterparts.
+ */
+#ifndef __LIBTESTFS_H__
+#define __LIBTESTFS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define __le16 uint16_t
+#define __le32 uint32_t
+#define __u8 uint8_t
+
+#define TESTFS_ROOT_INO		0
+#define TESTFS_DISK_INODE_SIZE	128
+#define TEST_FS_N_BLOCKS	16
+#define TESTFS_INLINE_DATA_SIZE	(TEST_FS_N_BLOCKS * sizeof(__le32))
+#define TESTFS_COMPR_FL		0x00000004 /* compress data, FS_COMPR_FL */
+#define TESTFS_INLINE_DATA_FL	0x10000000 /* data stored in i_block[] */
+#define TESTFS_TAIL_FL		0x20000000 /* data in a shared tail block */
+
+/* write lifetime streams: no hint, then RWH_WRITE_LIFE_SHORT to _EXTREME */
+#define TESTFS_NR_STREAMS	5
+
+#define TEST_FS_MAGIC		0x1234
+#define TEST_FS_BLOCK_SIZE	4096
+#define TEST_FS_MIN_BLOCK_SIZE	1024
+
+/* fixed layout of volumes without geometry in the super block */
+#define TEST_FS_BLKID_IBITMAP	1
+#define TEST_FS_BLKID_DBITMAP	2
+#define TEST_FS_BLKID_ITABLE	3
+
+#define TESTFS_VALID_FS		0x0001	/* unmounted cleanly */
+
+/* s_ro_flags */
+#define TESTFS_RO_PACKED	0x0001	/* mktestfs -P, never written */
+
+/* s_snap_state */
+#define TESTFS_SNAP_NONE	0
+#define TESTFS_SNAP_ACTIVE	1
+#define TESTFS_SNAP_DROPPING	2
+
+/* directory entry file types, as fs_umode_to_ftype() */
+#define TESTFS_FT_REG_FILE	1
+#define TESTFS_FT_DIR		2
+
+struct testfs_disk_inode {
+	__le16 i_mode;		/* File mode */
+	__le16 i_links_count;	/* Links count */
+	__le32 i_uid;		/* Low 16 bits of User Uid */
+	__le32 i_gid;		/* Low 16 bits of Group Id */
+	__le32 i_size;		/* Size in bytes */
+	__le32 i_atime;		/* Access time */
+	__le32 i_ctime;		/* Creation time */
+	__le32 i_mtime;		/* Modification time */
+	__le32 i_generation;
+	__le32 i_flags;		/* File flags */
+	__le32 i_blocks;	/* Blocks count */
+	union {
+		__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
+		__u8 i_data[TESTFS_INLINE_DATA_SIZE];/* Inline data */
+	};
+	__le32 i_atime_nsec;	/* Nanoseconds of i_atime */
+	__le32 i_ctime_nsec;	/* Nanoseconds of i_ctime */
+	__le32 i_mtime_nsec;	/* Nanoseconds of i_mtime */
+	__u8   i_write_hint;	/* enum rw_hint, lifetime of the data */
+	__u8   i_compr_map;	/* compressed clusters, a bit each */
+	__u8   reserved[10];
+};
+
+#define TEST_FS_DENTRY_SIZE	64
+struct testfs_dir_entry {
+#define TESTFS_FILE_NAME_LEN 58
+	__le32 inode;
+	__u8 file_type;
+	__u8 name_len;	/* 0 means free slot */
+	__u8 name[TESTFS_FILE_NAME_LEN];
+};
+
+struct test_super_block {
+	__le32 s_version;
+	__le32 s_block_size;		/* block size (byte) */
+	__le32 s_inode_size;		/* disk inode size (byte) */
+	__le32 s_total_blknr;		/* total blocks include meta */
+	__le32 s_inode_table_blknr;	/* inode table block count */
+	__le32 s_data_blkid;		/* data block index */
+	__le32 s_data_blknr;		/* data block count */
+	__u8   s_uuid[16];             /* 128-bit uuid */
+	__le16 s_magic;
+	__le32 s_refcount_blkid;	/* refcount table index */
+	__le32 s_refcount_blknr;	/* refcount table block count */
+	__le32 s_free_blocks_count;	/* free data blocks */
+	__le32 s_free_inodes_count;	/* free inodes */
+	__le16 s_state;			/* file system state */
+	__le32 s_inodes_count;		/* inodes */
+	__le32 s_ibitmap_blkid;		/* inode bitmap index */
+	__le32 s_ibitmap_blknr;		/* inode bitmap block count */
+	__le32 s_dbitmap_blkid;		/* data bitmap index */
+	__le32 s_blocks_per_group;	/* data blocks per group */
+	__le32 s_inode_table_blkid;	/* inode table index */
+	__le32 s_itable_zeroed;
+	__le16 s_ndevs;			/* striped volumes, not supported */
+	__le16 s_stripe_blocks;
+	struct {
+		__u8   d_uuid[16];
+		__le32 d_data_blknr;
+	} s_devs[8];
+	__le32 s_dev_flags;
+	__le32 s_snap_store_blkid;	/* snapshots, see snapshot.c */
+	__le32 s_snap_store_blknr;
+	__le32 s_snap_cow_blkid;
+	__le32 s_snap_free_blkid;
+	__le32 s_snap_state;
+	__le32 s_snap_time;
+	__le32 s_ro_flags;		/* read-only features */
+	__le32 s_reserved[];
+};
+
+/* an open image */
+struct tfs {
+	int fd;
+	bool rdonly;
+	struct test_super_block tsb;
+
+	/* geometry, with the defaults of the fixed layout filled in */
+	uint32_t block_size;
+	uint32_t inodes_count;
+	uint32_t ibitmap_blkid, ibitmap_blknr;
+	uint32_t dbitmap_blkid, blocks_per_group, groups_count;
+	uint32_t itable_blkid, itable_blknr;
+	uint32_t data_blkid, data_blknr;
+	uint32_t refcount_blkid, refcount_blknr;
+
+	/* allocator state, in memory until tfs_sync() */
+	uint8_t *ibitmap, *dbitmap;
+	uint16_t *refcount;		/* little endian, as on disk */
+	uint8_t *group_dirty;
+	bool ibitmap_dirty, refcount_dirty;
+	uint32_t free_blocks, free_inodes;
+	uint32_t inode_gen;
+	uint32_t stream_goal[TESTFS_NR_STREAMS];
+};
+
+/* an inode read in, written back with tfs_write_inode() */
+struct tfs_inode {
+	uint32_t ino;
+	struct testfs_disk_inode d;
+};
+
+/* image */
+int tfs_open(const char *path, bool rdonly, struct tfs **fsp);
+int tfs_sync(struct tfs *fs);
+int tfs_close(struct tfs *fs);
+
+/* data block and inode number allocator, balloc.c */
+int tfs_new_blocks(struct tfs *fs, uint32_t goal, uint32_t *count,
+		   uint32_t *blkid);
+int tfs_new_contig_blocks(struct tfs *fs, uint32_t goal, uint32_t count,
+			  uint32_t *blkid);
+void tfs_free_blocks(struct tfs *fs, uint32_t blkid, uint32_t count);
+int tfs_alloc_ino(struct tfs *fs, uint32_t *ino);
+void tfs_free_ino(struct tfs *fs, uint32_t ino);
+
+/* inodes and the block map, inode.c */
+int tfs_read_inode(struct tfs *fs, uint32_t ino, struct tfs_inode *ti);
+int tfs_write_inode(struct tfs *fs, struct tfs_inode *ti);
+int tfs_map_blocks(struct tfs *fs, struct tfs_inode *ti, uint32_t iblock,
+		   uint32_t max_blocks, uint32_t *bno, bool *new, bool create);
+ssize_t tfs_read(struct tfs *fs, struct tfs_inode *ti, void *buf,
+		 size_t len, off_t off);
+ssize_t tfs_write(struct tfs *fs, struct tfs_inode *ti, const void *buf,
+		  size_t len, off_t off);
+int tfs_truncate(struct tfs *fs, struct tfs_inode *ti, off_t size);
+void tfs_touch(struct tfs_inode *ti, bool atime, bool mtime, bool ctime);
+
+/* directories, dir.c */
+typedef int (*tfs_filldir_t)(void *arg, const char *name, int len,
+			     uint32_t ino, int type);
+int tfs_dir_lookup(struct tfs *fs, struct tfs_inode *dir, const char *name,
+		   uint32_t *ino);
+int tfs_dir_iterate(struct tfs *fs, struct tfs_inode *dir,
+		    tfs_filldir_t filldir, void *arg);
+int tfs_dir_add(struct tfs *fs, struct tfs_inode *dir, const char *name,
+		uint32_t ino, int type);
+int tfs_dir_remove(struct tfs *fs, struct tfs_inode *dir, const char *name);
+int tfs_dir_is_empty(struct tfs *fs, struct tfs_inode *dir);
+
+/* namespace */
+int tfs_lookup_path(struct tfs *fs, const char *path, uint32_t *ino);
+int tfs_create(struct tfs *fs, uint32_t dir_ino, const char *name,
+	       mode_t mode, uid_t uid, gid_t gid, struct tfs_inode *ti);
+int tfs_link(struct tfs *fs, uint32_t ino, uint32_t dir_ino,
+	     const char *name);
+int tfs_unlink(struct tfs *fs, uint32_t dir_ino, const char *name);
+int tfs_rmdir(struct tfs *fs, uint32_t dir_ino, const char *name);
+int tfs_rename(struct tfs *fs, uint32_t old_dir, const char *old_name,
+	       uint32_t new_dir, const char *new_name);
+
+#endif
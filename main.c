@@ -21,6 +21,9 @@
  */
 #include "testfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "testfs_trace.h"
+
 static struct dentry *testfs_mount(struct file_system_type *fs_type, int flags,
 		       const char *dev_name, void *data)
 {
@@ -42,6 +45,14 @@ struct file_system_type test_fs_type = {
 	.fs_flags	= FS_REQUIRES_DEV,
 };
 
+/* the snapshot of a mounted volume, given by its device */
+static struct file_system_type testfs_snap_fs_type = {
+	.owner		= THIS_MODULE,
+	.name		= "testfs_snap",
+	.mount		= testfs_snap_mount,
+	.kill_sb	= kill_anon_super,
+};
+
 static int __init testfs_init(void) {
 	int ret;
 
@@ -52,14 +63,30 @@ static int __init testfs_init(void) {
 		return -ENOMEM;
 	}
 
+	ret = testfs_compr_init();
+	if (ret) {
+		log_err("failed to set up compression workspaces\n");
+		goto deinit_icache;
+	}
+
 	ret = register_filesystem(&test_fs_type);
 	if (ret) {
 		log_err("failed to register testfs\n");
-		goto deinit_icache;
+		goto compr_exit;
+	}
+
+	ret = register_filesystem(&testfs_snap_fs_type);
+	if (ret) {
+		log_err("failed to register testfs_snap\n");
+		goto unregister;
 	}
 
 	return 0;
 
+unregister:
+	unregister_filesystem(&test_fs_type);
+compr_exit:
+	testfs_compr_exit();
 deinit_icache:
 	testfs_inode_cache_deinit();
 	return ret;
@@ -68,7 +95,9 @@ deinit_icache:
 static void __exit testfs_exit(void) {
 	log_err("\n");
 	testfs_inode_cache_deinit();
+	unregister_filesystem(&testfs_snap_fs_type);
 	unregister_filesystem(&test_fs_type);
+	testfs_compr_exit();
 }
 
 MODULE_LICENSE("GPL");
@@ -19,7 +19,7 @@
  * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
  *
  */
-#define _GUN_SOURCE
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sched.h>
 #include <string.h>
@@ -39,6 +39,11 @@
 #include <stdint.h>
 #include <uuid/uuid.h>
 #include <endian.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <search.h>
 
 #define __le16 uint16_t
 #define __le32 uint32_t
@@ -50,9 +55,16 @@
 /* simplify the inode strcture, only support 16 blocks in a file */
 #define TEST_FS_N_BLOCKS	16
 
+/* small files keep their data in the space used by i_block[] */
+#define TESTFS_INLINE_DATA_SIZE	(TEST_FS_N_BLOCKS * sizeof(__le32))
+#define TESTFS_INLINE_DATA_FL	0x10000000 /* data stored in i_block[] */
+#define TESTFS_TAIL_FL		0x20000000 /* data in a shared tail block */
+
 #define TEST_FS_V1		0x00010000
+#define TEST_FS_V2		0x00020000	/* configurable geometry */
 #define TEST_FS_MAGIC		0x1234
 #define TEST_FS_BLOCK_SIZE	4096
+#define TEST_FS_MIN_BLOCK_SIZE	1024
 
 /* block index */
 #define TEST_FS_BLKID_SB	0	/* super block */
@@ -62,6 +74,30 @@
 
 #define TEST_FS_FILE_MAX_BYTE	(TEST_FS_BLOCK_SIZE * TEST_FS_N_BLOCKS)
 
+/* s_state, cleared while mounted read-write */
+#define TESTFS_VALID_FS		0x0001	/* unmounted cleanly */
+
+/* s_ro_flags */
+#define TESTFS_RO_PACKED	0x0001	/* -P, only mounted read-only */
+
+/* striped volumes: the first device and up to 7 members */
+#define TESTFS_MAX_DEVS		8
+#define TESTFS_MEMBER_DATA_BLKID 1	/* first data block of a member */
+#define TESTFS_META_DEV		0x0001	/* s_devs[0] only gets directories */
+
+struct testfs_dev_desc {
+	__u8   d_uuid[16];		/* m_uuid of its label */
+	__le32 d_data_blknr;		/* data blocks on the device */
+};
+
+/* block 0 of every member but the first */
+struct testfs_member_label {
+	__le16 m_magic;			/* TEST_FS_MAGIC */
+	__le16 m_index;			/* in s_devs[] */
+	__u8   m_fs_uuid[16];		/* s_uuid of the volume */
+	__u8   m_uuid[16];
+};
+
 struct testfs_disk_inode {
 	__le16 i_mode;		/* File mode */
 	__le16 i_links_count;	/* Links count */
@@ -74,8 +110,16 @@ struct testfs_disk_inode {
 /*32 */	__le32 i_generation;	/* ??? */
 	__le32 i_flags;		/* File flags */
 /*40 */	__le32 i_blocks;	/* Blocks count */
-/*104*/	__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
-	__u8   reserved[24];
+	union {
+/*104*/		__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
+		__u8 i_data[TESTFS_INLINE_DATA_SIZE];/* Inline data */
+	};
+/*108*/	__le32 i_atime_nsec;	/* Nanoseconds of i_atime */
+	__le32 i_ctime_nsec;	/* Nanoseconds of i_ctime */
+	__le32 i_mtime_nsec;	/* Nanoseconds of i_mtime */
+/*117*/	__u8   i_write_hint;	/* enum rw_hint, lifetime of the data */
+	__u8   i_compr_map;	/* compressed clusters, a bit each */
+/*128*/	__u8   reserved[10];
 };
 
 #define TEST_FS_DENTRY_SIZE	64
@@ -111,18 +155,81 @@ struct test_super_block {
 
 	__le16 s_magic;
 
+	/* per block reference counts, 0 blocks if blocks can not be shared */
+	__le32 s_refcount_blkid;	/* refcount table index */
+	__le32 s_refcount_blknr;	/* refcount table block count */
+
+	/* free counts, only trusted if s_state has TESTFS_VALID_FS */
+	__le32 s_free_blocks_count;	/* free data blocks */
+	__le32 s_free_inodes_count;	/* free inodes */
+	__le16 s_state;			/* file system state */
+
+	/*
+	 * geometry: the data region is split in groups of s_blocks_per_group
+	 * blocks, each with one data bitmap block; the inode bitmap covers
+	 * block_size * 8 inodes per block
+	 */
+	__le32 s_inodes_count;		/* inodes */
+	__le32 s_ibitmap_blkid;		/* inode bitmap index */
+	__le32 s_ibitmap_blknr;		/* inode bitmap block count */
+	__le32 s_dbitmap_blkid;		/* data bitmap index */
+	__le32 s_blocks_per_group;	/* data blocks per group */
+	__le32 s_inode_table_blkid;	/* inode table index */
+
+	/* inode table blocks below this one are known to be zeroed */
+	__le32 s_itable_zeroed;
+
+	/* striping, 0 devices on volumes of one device */
+	__le16 s_ndevs;
+	__le16 s_stripe_blocks;		/* blocks allocated per device switch */
+	struct testfs_dev_desc s_devs[TESTFS_MAX_DEVS];
+	__le32 s_dev_flags;
+
+	/*
+	 * snapshot area, 0 store blocks without: copies of the blocks below
+	 * s_snap_store_blknr, a bitmap of the copies made and one deferred
+	 * free bitmap per group
+	 */
+	__le32 s_snap_store_blkid;
+	__le32 s_snap_store_blknr;
+	__le32 s_snap_cow_blkid;
+	__le32 s_snap_free_blkid;
+	__le32 s_snap_state;
+	__le32 s_snap_time;
+
+	/* features a kernel must know of to write to the volume */
+	__le32 s_ro_flags;
+
 	/* reserved field */
 	__le32 s_reserved[];
 };
 
 const char *g_disk;
-char g_tsb_buf[TEST_FS_BLOCK_SIZE];
-struct test_super_block *g_tsb = (struct test_super_block *)g_tsb_buf;
 
-char g_inode_bitmap[TEST_FS_BLOCK_SIZE];
-char g_data_bitmap[TEST_FS_BLOCK_SIZE];
+/* geometry, from the command line */
+uint32_t g_block_size = TEST_FS_BLOCK_SIZE;
+uint64_t g_inode_ratio = 16384;		/* bytes per inode */
+uint32_t g_blocks_per_group;		/* 0: block_size * 8 */
+bool g_lazy_itable_init = true;
+
+/* -d: populate the image from this directory, with this many readers */
+const char *g_src_dir;
+int g_nr_threads;
+
+/* -m: members the data region goes on over, -c: blocks per device switch */
+const char *g_members[TESTFS_MAX_DEVS - 1];
+uint64_t g_member_size[TESTFS_MAX_DEVS - 1];
+int g_nr_members;
+uint32_t g_stripe_blocks = 256;
+bool g_meta_dev;			/* -M: file data only on the members */
+bool g_snapshots = true;		/* -S clears it */
+bool g_packed;				/* -P: read-only packed image of -d */
 
-struct testfs_disk_inode g_root_inode;
+/* zeroing goes this many bytes per write when it has to be written out */
+#define ZERO_CHUNK	(1 << 20)
+
+/* the data region of a populated image is written in chunks of this size */
+#define DATA_CHUNK	(4 << 20)
 
 static void *zmalloc(size_t size)
 {
@@ -137,141 +244,1489 @@ static void *zmalloc(size_t size)
 
 static void usage(void)
 {
-	fprintf(stderr, "Please give a disk name, linke ./mktestfs /dev/sdb1\n");
+	fprintf(stderr, "usage: mktestfs [-b block-size] [-i bytes-per-inode] "
+			"[-g blocks-per-group] [-z] [-d dir [-j threads]] "
+			"[-m member]... [-c chunk] [-M] [-S] [-P] <device>\n"
+			"\t-b  block size, 1024, 2048 or 4096 (default 4096)\n"
+			"\t-i  one inode for every this many bytes (default 16384)\n"
+			"\t-g  data blocks per group, at most block-size * 8\n"
+			"\t-z  zero the whole inode table now instead of after mount\n"
+			"\t-d  copy the tree under dir into the new file system\n"
+			"\t-j  read the files of -d with this many threads\n"
+			"\t-m  stripe the data region over this device too, up to 7\n"
+			"\t-c  new files go to the next device every this many\n"
+			"\t    blocks allocated (default 256)\n"
+			"\t-M  device only gets metadata and directories, file\n"
+			"\t    data goes to the -m members\n"
+			"\t-S  no room for snapshots\n"
+			"\t-P  with -d: a read-only image sized to fit the tree,\n"
+			"\t    identical blocks stored once, files smaller than a\n"
+			"\t    block packed together; an image file is truncated\n"
+			"\t    to the size\n"
+			"like: ./mktestfs /dev/sdb1\n"
+			"      ./mktestfs -m /dev/sdc1 -m /dev/sdd1 /dev/sdb1\n"
+			"      ./mktestfs -M -m /dev/sdc1 /dev/nvme0n1p1\n"
+			"      ./mktestfs -P -d rootfs/ rootfs.img\n");
 
-	_exit(0);
+	_exit(1);
 }
 
-static int testfs_write_super_block(int fd, size_t size, struct test_super_block *tsb)
+static uint64_t div_round_up(uint64_t n, uint64_t d)
 {
-	uuid_t uuid;
-	uint32_t inode_per_block, inode_block_nr, index;
-	size_t len = TEST_FS_BLOCK_SIZE, ret;
+	return (n + d - 1) / d;
+}
 
-	/* format super block base on image size */
-	tsb->s_version = htole32(TEST_FS_V1);
-	tsb->s_block_size = htole32(TEST_FS_BLOCK_SIZE);
-	tsb->s_inode_size = htole32(TESTFS_DISK_INODE_SIZE);
-	tsb->s_total_blknr = htole32(size / TEST_FS_BLOCK_SIZE);
+/*
+ * Zero a range of the device: let the device or the file system do it if
+ * it can, write zeros in large aligned chunks if it can't.
+ */
+static int zero_range(int fd, bool is_bdev, uint64_t off, uint64_t len)
+{
+	uint64_t range[2] = { off, len };
+	static void *buf;
+	ssize_t ret;
+	size_t n;
 
-	/* super_block + inode_bitmap + data_bitmap */
-	index = 3;
+	if (!len)
+		return 0;
 
-	/* inode block count */
-	inode_per_block = TEST_FS_BLOCK_SIZE / TESTFS_DISK_INODE_SIZE;
-	inode_block_nr = TEST_FS_BLOCK_SIZE / inode_per_block;
-	tsb->s_inode_table_blknr = htole32(inode_block_nr);
+	if (!fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		       off, len))
+		return 0;
 
-	index += inode_block_nr;
-	tsb->s_data_blkid = htole32(index);
-	tsb->s_data_blknr = htole32(tsb->s_total_blknr - index);
+	if (is_bdev && !ioctl(fd, BLKZEROOUT, range))
+		return 0;
 
-	/* uuid */
-	uuid_generate(uuid);
-	memcpy(&tsb->s_uuid[0], &uuid, sizeof(tsb->s_uuid));
+	if (!buf && posix_memalign(&buf, ZERO_CHUNK, ZERO_CHUNK))
+		return -1;
+	memset(buf, 0, ZERO_CHUNK);
 
-	/* magic */
-	tsb->s_magic = htole32(TEST_FS_MAGIC);
+	while (len) {
+		n = len < ZERO_CHUNK ? len : ZERO_CHUNK;
+		ret = pwrite(fd, buf, n, off);
+		if (ret != (ssize_t)n) {
+			fprintf(stderr, "failed to zero %lu bytes at %lu\n",
+				(unsigned long)n, (unsigned long)off);
+			return -1;
+		}
+		off += n;
+		len -= n;
+	}
 
-	ret = write(fd, (char *)tsb, len);
-	if (ret != len) {
-		fprintf(stderr, "failed to write super block, %lu != %lu\n",
-			ret, len);
+	return 0;
+}
+
+static int write_block(int fd, uint64_t blkid, const void *buf)
+{
+	ssize_t ret;
+
+	ret = pwrite(fd, buf, g_block_size, blkid * g_block_size);
+	if (ret != g_block_size) {
+		fprintf(stderr, "failed to write block %lu, %ld != %u\n",
+			(unsigned long)blkid, (long)ret, g_block_size);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int testfs_write_inode_bitmap(int fd, char *buf, size_t len)
+/* blocks of the snapshot copy bitmap for a store of @store blocks */
+static uint64_t snap_cow_blocks(uint64_t store)
 {
-	size_t ret;
+	return div_round_up(store, (uint64_t)g_block_size * 8);
+}
 
-	/* mark first bit to 1, used to root inode */
-	buf[0] = 1;
+/*
+ * metadata blocks of @data data blocks: data bitmaps and refcount table,
+ * with snapshots also the store, for them and the @fixed blocks of super
+ * block, inode bitmap and inode table, its copy bitmap and the deferred
+ * free bitmaps
+ */
+static uint64_t data_overhead(uint64_t data, uint64_t fixed)
+{
+	uint64_t groups = div_round_up(data, g_blocks_per_group);
+	uint64_t blocks = groups +
+			  div_round_up(data * sizeof(__le16), g_block_size);
+
+	if (g_snapshots)
+		blocks += fixed + groups + snap_cow_blocks(fixed + groups) +
+			  groups;
+	return blocks;
+}
+
+/*
+ * Disk layout
+ * |------|------|------|------|------|------|------|------|------------|
+ *    1      2      3      4      5      6      7      8         9
+ *
+ * index | count | usage
+ * ------------------------------------
+ * 1     | 1     | super block
+ * 2     | I     | inode bitmap, block_size * 8 inodes per block
+ * 3     | G     | data bitmap, one block per group
+ * 4     | N     | inode table
+ * 5     | R     | refcount table
+ * 6     | S     | snapshot store, a copy of blocks 0 .. S-1
+ * 7     | C     | snapshot copy bitmap, one bit per store block
+ * 8     | G     | deferred free bitmaps, one block per group
+ * 9     | M     | data region
+ *
+ * With -S there is no snapshot area, 6 to 8 take no blocks.
+ *
+ * With -m the data region goes on over the members, each one a label
+ * block followed by data blocks. The metadata covers all of them, every
+ * device but the last holds whole groups.
+ */
+static int testfs_layout(uint64_t size, struct test_super_block *tsb)
+{
+	uint64_t total = size / g_block_size, inodes, itable, ibitmap, groups;
+	uint64_t avail, data, refcount, index, members = 0, fixed, store;
+	uint64_t mdata[TESTFS_MAX_DEVS - 1], bytes = size;
+	uint32_t inode_per_block = g_block_size / TESTFS_DISK_INODE_SIZE;
+	int i;
+
+	if (total > UINT32_MAX) {
+		fprintf(stderr, "%lu blocks is too many, use a larger block size\n",
+			(unsigned long)total);
+		return -1;
+	}
+
+	for (i = 0; i < g_nr_members; i++) {
+		mdata[i] = g_member_size[i] / g_block_size;
+		mdata[i] -= mdata[i] ? TESTFS_MEMBER_DATA_BLKID : 0;
+		if (i < g_nr_members - 1)
+			mdata[i] -= mdata[i] % g_blocks_per_group;
+		if (!mdata[i]) {
+			fprintf(stderr, "%s: device too small\n", g_members[i]);
+			return -1;
+		}
+		members += mdata[i];
+		bytes += g_member_size[i];
+	}
+
+	/* inode table, in whole blocks */
+	inodes = bytes / g_inode_ratio;
+	if (inodes < inode_per_block)
+		inodes = inode_per_block;
+	if (inodes > UINT32_MAX - inode_per_block)
+		inodes = UINT32_MAX - inode_per_block;
+	itable = div_round_up(inodes, inode_per_block);
+	inodes = itable * inode_per_block;
+	ibitmap = div_round_up(inodes, g_block_size * 8);
+
+	if (1 + ibitmap + itable >= total) {
+		fprintf(stderr, "device too small\n");
+		return -1;
+	}
+	fixed = 1 + ibitmap + itable;
+	avail = total - fixed;
 
-	ret = write(fd, buf, len);
-	if (ret != len) {
-		fprintf(stderr, "failed to write inode bitmap, %lu != %lu\n",
-			ret, len);
+	/* as many data blocks as fit next to their own bitmaps and refcounts */
+	if (g_nr_members) {
+		data = avail / g_blocks_per_group * g_blocks_per_group;
+		while (data &&
+		       data + data_overhead(data + members, fixed) > avail)
+			data -= g_blocks_per_group;
+		if (!data) {
+			fprintf(stderr, "%s: no room for a group of %u blocks, try a smaller -g\n",
+				g_disk, g_blocks_per_group);
+			return -1;
+		}
+	} else {
+		/* the store of the fixed blocks comes off the top */
+		data = avail;
+		if (g_snapshots)
+			data = avail > fixed ? avail - fixed : 0;
+		data = data * g_blocks_per_group * g_block_size /
+			((uint64_t)g_blocks_per_group * g_block_size +
+			 (g_snapshots ? 3 : 1) * g_block_size +
+			 2 * g_blocks_per_group);
+		while (data && data + data_overhead(data, fixed) > avail)
+			data--;
+		while (data + 1 + data_overhead(data + 1, fixed) <= avail)
+			data++;
+	}
+	if (data < 2) {
+		fprintf(stderr, "device too small\n");
 		return -1;
 	}
 
+	if (g_nr_members) {
+		tsb->s_ndevs = htole16(g_nr_members + 1);
+		tsb->s_stripe_blocks = htole16(g_stripe_blocks);
+		tsb->s_dev_flags = htole32(g_meta_dev ? TESTFS_META_DEV : 0);
+		tsb->s_devs[0].d_data_blknr = htole32(data);
+		for (i = 0; i < g_nr_members; i++)
+			tsb->s_devs[i + 1].d_data_blknr = htole32(mdata[i]);
+		data += members;
+	}
+	groups = div_round_up(data, g_blocks_per_group);
+	refcount = div_round_up(data * sizeof(__le16), g_block_size);
+
+	tsb->s_version = htole32(TEST_FS_V2);
+	tsb->s_block_size = htole32(g_block_size);
+	tsb->s_inode_size = htole32(TESTFS_DISK_INODE_SIZE);
+	tsb->s_total_blknr = htole32(total);
+
+	index = 1;
+	tsb->s_ibitmap_blkid = htole32(index);
+	tsb->s_ibitmap_blknr = htole32(ibitmap);
+	index += ibitmap;
+
+	tsb->s_dbitmap_blkid = htole32(index);
+	tsb->s_blocks_per_group = htole32(g_blocks_per_group);
+	index += groups;
+
+	tsb->s_inode_table_blkid = htole32(index);
+	tsb->s_inode_table_blknr = htole32(itable);
+	tsb->s_inodes_count = htole32(inodes);
+	index += itable;
+
+	tsb->s_refcount_blkid = htole32(index);
+	tsb->s_refcount_blknr = htole32(refcount);
+	index += refcount;
+
+	/* the store copies everything in front of the refcount table */
+	if (g_snapshots) {
+		store = fixed + groups;
+		tsb->s_snap_store_blkid = htole32(index);
+		tsb->s_snap_store_blknr = htole32(store);
+		index += store;
+		tsb->s_snap_cow_blkid = htole32(index);
+		index += snap_cow_blocks(store);
+		tsb->s_snap_free_blkid = htole32(index);
+		index += groups;
+	}
+
+	tsb->s_data_blkid = htole32(index);
+	tsb->s_data_blknr = htole32(data);
+	if (g_nr_members) {
+		if (index + data > UINT32_MAX) {
+			fprintf(stderr, "%lu blocks is too many, use a larger block size\n",
+				(unsigned long)(index + data));
+			return -1;
+		}
+		tsb->s_total_blknr = htole32(index + data);
+	}
+
+	/* the root inode and the first data block are taken */
+	tsb->s_free_blocks_count = htole32(data - 1);
+	tsb->s_free_inodes_count = htole32(inodes - 1);
+	tsb->s_state = htole16(TESTFS_VALID_FS);
+	tsb->s_itable_zeroed = htole32(g_lazy_itable_init ? 1 : itable);
+
+	/* magic */
+	tsb->s_magic = htole16(TEST_FS_MAGIC);
+
 	return 0;
 }
 
-static int testfs_write_data_bitmap(int fd, char *buf, size_t len)
+static int testfs_write_super_block(int fd, struct test_super_block *tsb)
 {
-	size_t ret;
+	char *buf;
+	int ret;
 
-	/* mark first bit to 1, used to root inode */
-	buf[0] = 1;
+	buf = zmalloc(g_block_size);
+	if (!buf)
+		return -1;
+	memcpy(buf, tsb, sizeof(*tsb));
+
+	ret = write_block(fd, TEST_FS_BLKID_SB, buf);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Bitmaps and the refcount table start out zeroed, the first bit of the
+ * inode bitmap is the root inode and the first data block is never handed
+ * out, block 0 of a file means a hole.
+ */
+static int testfs_write_bitmap_head(int fd, uint32_t blkid)
+{
+	char *buf;
+	int ret;
 
-	ret = write(fd, buf, len);
-	if (ret != len) {
-		fprintf(stderr, "failed to write data bitmap, %lu != %lu\n",
-			ret, len);
+	buf = zmalloc(g_block_size);
+	if (!buf)
 		return -1;
-	}
 
-	return 0;
+	buf[0] = 1;
+	ret = write_block(fd, blkid, buf);
+	free(buf);
+	return ret;
 }
 
 static int testfs_write_root_inode(int fd, struct test_super_block *tsb)
 {
-	struct testfs_disk_inode *tdi = &g_root_inode;
-	size_t ret, len = sizeof(*tdi);
+	struct testfs_disk_inode *tdi;
+	char *buf;
+	int ret;
+
+	buf = zmalloc(g_block_size);
+	if (!buf)
+		return -1;
+	tdi = (struct testfs_disk_inode *)buf;
 
 	/* init root inode */
 	tdi->i_mode = htole16(S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 	tdi->i_links_count = htole16(1);
 	tdi->i_uid = htole32(0);
 	tdi->i_gid = htole32(0);
-#if 0
-	/* no files in root inode */
-	tdi->i_size = sizeof(struct testfs_dir_entry);
-#endif
 	tdi->i_size = htole32(0);
-
 	tdi->i_blocks = htole32(0);
 
-	ret = write(fd, tdi, len);
-	if (ret != len) {
-		fprintf(stderr, "failed to write inode bitmap, %lu != %lu\n",
-			ret, len);
+	/* the rest of the block is free inodes, zeroed here too */
+	ret = write_block(fd, le32toh(tsb->s_inode_table_blkid), buf);
+	free(buf);
+	return ret;
+}
+
+/*
+ * mktestfs -d: write a populated image straight from a directory tree.
+ *
+ * The tree is scanned first and everything is placed before anything is
+ * written: inodes are numbered and data blocks handed out in one pre-order
+ * walk, a directory's own blocks first, then the inodes and data of its
+ * files in name order, then its subdirectories. Files read back in
+ * directory order are thus contiguous on disk and their inodes share
+ * inode table blocks.
+ *
+ * The data region is then filled chunk by chunk, each chunk read from the
+ * source files into a buffer and written with one large write; worker
+ * threads take chunks in increasing order so the image is written close
+ * to sequentially while the source reads run in parallel. Bitmaps and
+ * the used part of the inode table are built in memory and written last.
+ *
+ * A packed image (-P) is placed before its layout is known, in blocks
+ * from the start of the data region. The directories come first, then
+ * the files in inode order: a block with the data of one placed before
+ * is shared with it through the refcount table, a block of zeros is a
+ * hole, and a file smaller than a block goes in the current tail block
+ * behind the tails before it. The layout is then sized to fit exactly.
+ */
+#define FT_REG_FILE	1
+#define FT_DIR		2
+
+struct src_node {
+	char *path;
+	char name[TESTFS_FILE_NAME_LEN];
+	uint8_t name_len;
+	struct stat st;
+	struct src_node *parent;
+	struct src_node *child;		/* first entry, directories only */
+	struct src_node *next;		/* next entry of the parent */
+	struct src_node *link;		/* hard link: the node owning the inode */
+	uint32_t nr_entries;		/* directories only */
+	uint32_t nr_subdirs;
+	uint32_t nlink;
+	uint32_t ino;
+	uint64_t blkid;			/* first data block, 0 for none */
+	uint32_t blknr;
+	char *dir_buf;			/* directory blocks, built in memory */
+	uint32_t *map;			/* -P: data block of each file block */
+	uint32_t tail_off;		/* -P: a tail at this offset of map[0] */
+	bool tail;
+};
+
+/* a run of data blocks and the node it belongs to, in block order */
+struct data_run {
+	uint64_t blkid;
+	uint32_t blknr;
+	struct src_node *node;
+	uint32_t block;			/* the first block of @node it holds */
+	char *buf;			/* -P: a tail block, in memory */
+};
+
+/* -P: data placed so far, by hash of its bytes */
+struct pack_ent {
+	uint64_t hash;
+	struct src_node *node;		/* first file with the data, NULL: free */
+	uint32_t block;			/* its block of that file */
+	uint32_t len;			/* g_block_size, or the size of a tail */
+	uint32_t index;			/* data block */
+	uint32_t offset;		/* of a tail in its block */
+	char *tail;			/* the tail block */
+};
+
+static struct src_node **g_inodes;	/* indexed by inode number */
+static uint32_t g_nr_inodes, g_max_inodes;
+static struct data_run *g_runs;
+static uint32_t g_nr_runs, g_max_runs;
+static uint64_t g_data_start, g_data_next;	/* absolute block numbers */
+static void *g_links;			/* tsearch tree of hard linked files */
+static unsigned long g_next_chunk;
+static bool g_populate_error;
+static int g_fd;
+
+/* -P: refcounts as on disk, references beyond the first */
+static uint16_t *g_refs;
+static uint64_t g_max_refs;
+static struct pack_ent *g_pack;
+static uint64_t g_pack_size, g_pack_used;
+static char *g_tail_buf;		/* the tail block being filled */
+static uint32_t g_tail_index, g_tail_used;
+static uint64_t g_shared, g_zero, g_nr_tails, g_tail_blocks;
+
+static int node_cmp(const void *a, const void *b)
+{
+	const struct src_node *x = *(struct src_node **)a;
+	const struct src_node *y = *(struct src_node **)b;
+	int ret = memcmp(x->name, y->name, x->name_len < y->name_len ?
+			 x->name_len : y->name_len);
+
+	return ret ? ret : x->name_len - y->name_len;
+}
+
+static int link_cmp(const void *a, const void *b)
+{
+	const struct stat *x = &((struct src_node *)a)->st;
+	const struct stat *y = &((struct src_node *)b)->st;
+
+	if (x->st_dev != y->st_dev)
+		return x->st_dev < y->st_dev ? -1 : 1;
+	if (x->st_ino != y->st_ino)
+		return x->st_ino < y->st_ino ? -1 : 1;
+	return 0;
+}
+
+static char *path_join(const char *dir, const char *name)
+{
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+	if (path)
+		sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+/* read the entries of @dir, sorted by name, and recurse into subdirectories */
+static int scan_dir(struct src_node *dir)
+{
+	uint64_t max_size = (uint64_t)g_block_size * TEST_FS_N_BLOCKS;
+	struct src_node **entries = NULL, **tmp, *node;
+	uint32_t i, nr = 0, max = 0;
+	struct dirent *de;
+	size_t len;
+	DIR *d;
+	int ret = -1;
+
+	d = opendir(dir->path);
+	if (!d) {
+		fprintf(stderr, "failed to open %s: %s\n", dir->path,
+			strerror(errno));
 		return -1;
 	}
 
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		len = strlen(de->d_name);
+		if (len > TESTFS_FILE_NAME_LEN) {
+			fprintf(stderr, "%s/%s: name longer than %d bytes\n",
+				dir->path, de->d_name, TESTFS_FILE_NAME_LEN);
+			goto out;
+		}
+
+		node = zmalloc(sizeof(*node));
+		if (!node || !(node->path = path_join(dir->path, de->d_name))) {
+			free(node);
+			goto out;
+		}
+		memcpy(node->name, de->d_name, len);
+		node->name_len = len;
+		node->parent = dir;
+
+		if (lstat(node->path, &node->st)) {
+			fprintf(stderr, "failed to stat %s: %s\n", node->path,
+				strerror(errno));
+			goto free_node;
+		}
+
+		/* the kernel only knows regular files and directories */
+		if (!S_ISREG(node->st.st_mode) && !S_ISDIR(node->st.st_mode)) {
+			fprintf(stderr, "skip %s: unsupported file type\n",
+				node->path);
+			goto skip;
+		}
+
+		if (S_ISREG(node->st.st_mode) &&
+		    (uint64_t)node->st.st_size > max_size) {
+			fprintf(stderr, "%s: larger than %lu bytes\n",
+				node->path, (unsigned long)max_size);
+			goto free_node;
+		}
+
+		if (nr == max) {
+			max = max ? max * 2 : 64;
+			tmp = realloc(entries, max * sizeof(*entries));
+			if (!tmp)
+				goto free_node;
+			entries = tmp;
+		}
+		entries[nr++] = node;
+		continue;
+skip:
+		free(node->path);
+		free(node);
+		continue;
+free_node:
+		free(node->path);
+		free(node);
+		goto out;
+	}
+
+	/* ".", ".." and the entries must fit in a directory */
+	if ((uint64_t)(nr + 2) * sizeof(struct testfs_dir_entry) > max_size) {
+		fprintf(stderr, "%s: more than %lu entries\n", dir->path,
+			(unsigned long)(max_size / sizeof(struct testfs_dir_entry) - 2));
+		goto out;
+	}
+
+	qsort(entries, nr, sizeof(*entries), node_cmp);
+	for (i = nr; i > 0; i--) {
+		entries[i - 1]->next = dir->child;
+		dir->child = entries[i - 1];
+		if (S_ISDIR(entries[i - 1]->st.st_mode))
+			dir->nr_subdirs++;
+	}
+	dir->nr_entries = nr;
+
+	for (node = dir->child; node; node = node->next)
+		if (S_ISDIR(node->st.st_mode) && scan_dir(node))
+			goto out;
+
+	ret = 0;
+out:
+	/* on error the nodes not linked yet are leaked, we exit anyway */
+	free(entries);
+	closedir(d);
+	return ret;
+}
+
+static int add_inode(struct src_node *node)
+{
+	if (g_nr_inodes == g_max_inodes) {
+		fprintf(stderr, "out of inodes, use a smaller -i\n");
+		return -1;
+	}
+
+	node->ino = g_nr_inodes++;
+	g_inodes[node->ino] = node;
 	return 0;
 }
 
-int main(int argc, char **argv)
+/*
+ * Hand out @blknr blocks at g_data_next for the blocks of @node from
+ * @block on, or for the tail block @buf. Blocks of a file that follow
+ * each other on both sides extend its run.
+ */
+static int add_run(struct src_node *node, uint32_t block, uint32_t blknr,
+		   char *buf)
+{
+	struct data_run *run = g_nr_runs ? &g_runs[g_nr_runs - 1] : NULL;
+	uint64_t max;
+	void *tmp;
+
+	if (run && node && !buf && run->node == node &&
+	    run->block + run->blknr == block &&
+	    run->blkid + run->blknr == g_data_next) {
+		run->blknr += blknr;
+		goto out;
+	}
+
+	if (g_nr_runs == g_max_runs) {
+		g_max_runs = g_max_runs ? g_max_runs * 2 : 1024;
+		tmp = realloc(g_runs, g_max_runs * sizeof(*g_runs));
+		if (!tmp)
+			return -1;
+		g_runs = tmp;
+	}
+
+	run = &g_runs[g_nr_runs++];
+	run->blkid = g_data_next;
+	run->blknr = blknr;
+	run->node = node;
+	run->block = block;
+	run->buf = buf;
+out:
+	g_data_next += blknr;
+	if (!g_packed || g_data_next <= g_max_refs)
+		return 0;
+
+	/* a refcount for every block handed out, 0 for now */
+	max = g_max_refs ? g_max_refs : 1024;
+	while (max < g_data_next)
+		max *= 2;
+	tmp = realloc(g_refs, max * sizeof(*g_refs));
+	if (!tmp)
+		return -1;
+	g_refs = tmp;
+	memset(g_refs + g_max_refs, 0, (max - g_max_refs) * sizeof(*g_refs));
+	g_max_refs = max;
+	return 0;
+}
+
+static int add_data(struct src_node *node, uint64_t size,
+		    struct test_super_block *tsb)
+{
+	uint64_t end = le32toh(tsb->s_data_blkid) + le32toh(tsb->s_data_blknr);
+
+	node->blknr = div_round_up(size, g_block_size);
+	if (!node->blknr)
+		return 0;
+
+	/* a packed image is sized to what it gets */
+	if (!g_packed && g_data_next + node->blknr > end) {
+		fprintf(stderr, "out of data blocks, the image is too small\n");
+		return -1;
+	}
+
+	node->blkid = g_data_next;
+	return add_run(node, 0, node->blknr, NULL);
+}
+
+/* number the inodes and place the data of everything under @dir */
+static int place_dir(struct src_node *dir, struct test_super_block *tsb)
 {
+	struct src_node *node, **found;
+
+	/* "." and ".." of @dir, and one link from each subdirectory */
+	dir->nlink = 2 + dir->nr_subdirs;
+	if (add_data(dir, (uint64_t)(dir->nr_entries + 2) *
+		     sizeof(struct testfs_dir_entry), tsb))
+		return -1;
+
+	for (node = dir->child; node; node = node->next) {
+		if (S_ISREG(node->st.st_mode) && node->st.st_nlink > 1) {
+			found = tsearch(node, &g_links, link_cmp);
+			if (!found)
+				return -1;
+			if (*found != node) {
+				node->link = *found;
+				node->link->nlink++;
+				continue;
+			}
+		}
+
+		if (add_inode(node))
+			return -1;
+		if (S_ISDIR(node->st.st_mode))
+			continue;
+
+		/* packed images place file data behind all directories */
+		node->nlink = 1;
+		if (!g_packed &&
+		    node->st.st_size > (off_t)TESTFS_INLINE_DATA_SIZE &&
+		    add_data(node, node->st.st_size, tsb))
+			return -1;
+	}
+
+	for (node = dir->child; node; node = node->next)
+		if (S_ISDIR(node->st.st_mode) && place_dir(node, tsb))
+			return -1;
+
+	return 0;
+}
+
+static void fill_dir_entry(struct testfs_dir_entry *tde, uint32_t ino,
+			   uint8_t type, const char *name, uint8_t len)
+{
+	tde->inode = htole32(ino);
+	tde->file_type = type;
+	tde->name_len = len;
+	memcpy(tde->name, name, len);
+}
+
+static int build_dir(struct src_node *dir)
+{
+	struct testfs_dir_entry *tde;
+	struct src_node *node, *target;
+
+	dir->dir_buf = zmalloc((size_t)dir->blknr * g_block_size);
+	if (!dir->dir_buf)
+		return -1;
+
+	tde = (struct testfs_dir_entry *)dir->dir_buf;
+	fill_dir_entry(tde++, dir->ino, FT_DIR, ".", 1);
+	fill_dir_entry(tde++, dir->parent ? dir->parent->ino : dir->ino,
+		       FT_DIR, "..", 2);
+	for (node = dir->child; node; node = node->next) {
+		target = node->link ? node->link : node;
+		fill_dir_entry(tde++, target->ino,
+			       S_ISDIR(node->st.st_mode) ? FT_DIR : FT_REG_FILE,
+			       node->name, node->name_len);
+	}
+
+	return 0;
+}
+
+static void fill_disk_inode(struct testfs_disk_inode *tdi,
+			    struct src_node *node)
+{
+	uint64_t size = S_ISDIR(node->st.st_mode) ?
+		(uint64_t)(node->nr_entries + 2) *
+			sizeof(struct testfs_dir_entry) :
+		(uint64_t)node->st.st_size;
+	uint32_t i, mapped;
+	int fd;
+
+	tdi->i_mode = htole16(node->st.st_mode & (S_IFMT | 07777));
+	tdi->i_links_count = htole16(node->nlink);
+	tdi->i_uid = htole32(node->st.st_uid);
+	tdi->i_gid = htole32(node->st.st_gid);
+	tdi->i_size = htole32(size);
+	tdi->i_atime = htole32(node->st.st_atim.tv_sec);
+	tdi->i_ctime = htole32(node->st.st_ctim.tv_sec);
+	tdi->i_mtime = htole32(node->st.st_mtim.tv_sec);
+	tdi->i_atime_nsec = htole32(node->st.st_atim.tv_nsec);
+	tdi->i_ctime_nsec = htole32(node->st.st_ctim.tv_nsec);
+	tdi->i_mtime_nsec = htole32(node->st.st_mtim.tv_nsec);
+	tdi->i_blocks = htole32((uint64_t)node->blknr * (g_block_size >> 9));
+
+	for (i = 0; i < node->blknr; i++)
+		tdi->i_block[i] = htole32(node->blkid + i);
+
+	/* -P: blocks shared with other files, holes and tails */
+	if (node->tail) {
+		tdi->i_flags = htole32(TESTFS_TAIL_FL);
+		tdi->i_block[0] = htole32(node->map[0]);
+		tdi->i_block[1] = htole32(node->tail_off);
+		tdi->i_blocks = htole32(g_block_size >> 9);
+		return;
+	}
+	if (node->map) {
+		for (i = 0, mapped = 0; i < TEST_FS_N_BLOCKS; i++) {
+			tdi->i_block[i] = htole32(node->map[i]);
+			mapped += !!node->map[i];
+		}
+		tdi->i_blocks = htole32(mapped * (g_block_size >> 9));
+		return;
+	}
+
+	/* small regular files start inline, as the kernel creates them */
+	if (!S_ISREG(node->st.st_mode) || node->blknr)
+		return;
+
+	tdi->i_flags = htole32(TESTFS_INLINE_DATA_FL);
+	if (!size)
+		return;
+
+	fd = open(node->path, O_RDONLY);
+	if (fd < 0 || pread(fd, tdi->i_data, size, 0) < 0) {
+		fprintf(stderr, "failed to read %s: %s\n", node->path,
+			strerror(errno));
+		g_populate_error = true;
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+/* copy the part of @run that falls in [@start, @end) into @buf at @start */
+static int read_run(struct data_run *run, uint64_t start, uint64_t end,
+		    char *buf)
+{
+	uint64_t from = run->blkid > start ? run->blkid : start;
+	uint64_t to = run->blkid + run->blknr < end ?
+		run->blkid + run->blknr : end;
+	size_t len = (to - from) * g_block_size;
+	off_t off = (from - run->blkid + run->block) * g_block_size;
+	char *dst = buf + (from - start) * g_block_size;
+	ssize_t ret;
 	int fd;
-	size_t size;
+
+	if (run->buf) {
+		memcpy(dst, run->buf + off, len);
+		return 0;
+	}
+
+	if (S_ISDIR(run->node->st.st_mode)) {
+		memcpy(dst, run->node->dir_buf + off, len);
+		return 0;
+	}
+
+	fd = open(run->node->path, O_RDONLY);
+	if (fd < 0)
+		goto fail;
+
+	/* a short read leaves zeros, the file shrank after the scan */
+	while (len) {
+		ret = pread(fd, dst, len, off);
+		if (ret < 0) {
+			close(fd);
+			goto fail;
+		}
+		if (!ret)
+			break;
+		dst += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	close(fd);
+	return 0;
+fail:
+	fprintf(stderr, "failed to read %s: %s\n", run->node->path,
+		strerror(errno));
+	return -1;
+}
+
+static void *data_writer(void *arg __attribute__((unused)))
+{
+	uint64_t chunk_blocks = DATA_CHUNK / g_block_size, start, end;
+	unsigned long chunk;
+	uint32_t lo, hi, mid;
+	ssize_t ret;
+	void *buf;
+
+	if (posix_memalign(&buf, DATA_CHUNK, DATA_CHUNK)) {
+		g_populate_error = true;
+		return NULL;
+	}
+
+	for (;;) {
+		chunk = __atomic_fetch_add(&g_next_chunk, 1, __ATOMIC_RELAXED);
+		start = g_data_start + chunk * chunk_blocks;
+		if (start >= g_data_next || g_populate_error)
+			break;
+		end = start + chunk_blocks < g_data_next ?
+			start + chunk_blocks : g_data_next;
+
+		/* first run ending after @start */
+		lo = 0;
+		hi = g_nr_runs;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (g_runs[mid].blkid + g_runs[mid].blknr <= start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		memset(buf, 0, DATA_CHUNK);
+		for (; lo < g_nr_runs && g_runs[lo].blkid < end; lo++)
+			if (read_run(&g_runs[lo], start, end, buf))
+				g_populate_error = true;
+
+		ret = pwrite(g_fd, buf, (end - start) * g_block_size,
+			     start * g_block_size);
+		if (ret != (ssize_t)((end - start) * g_block_size)) {
+			fprintf(stderr, "failed to write block %lu\n",
+				(unsigned long)start);
+			g_populate_error = true;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void set_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+/* -P: blocks @block to @block + @nr of @node, zeros past its end */
+static int read_node(struct src_node *node, uint32_t block, uint32_t nr,
+		     char *buf)
+{
+	struct data_run run = {
+		.blknr = nr,
+		.node = node,
+		.block = block,
+	};
+
+	memset(buf, 0, (size_t)nr * g_block_size);
+	return read_run(&run, 0, nr, buf);
+}
+
+static uint64_t data_hash(const char *data, uint32_t len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+	return h ^ (h >> 32);
+}
+
+static bool is_zero(const char *data, uint32_t len)
+{
+	return !data[0] && !memcmp(data, data + 1, len - 1);
+}
+
+/* the entry with the bytes of @data, or the free slot for them */
+static struct pack_ent *pack_find(uint64_t hash, const char *data,
+				  uint32_t len, char *scratch)
+{
+	uint64_t i, mask = g_pack_size - 1;
+	struct pack_ent *e;
+
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		e = &g_pack[i];
+		if (!e->node)
+			return e;
+		if (e->hash != hash || e->len != len)
+			continue;
+		/* the hash only finds candidates, the bytes decide */
+		if (e->tail) {
+			if (!memcmp(e->tail + e->offset, data, len))
+				return e;
+		} else if (!read_node(e->node, e->block, 1, scratch) &&
+			   !memcmp(scratch, data, len)) {
+			return e;
+		}
+	}
+}
+
+/* keep the table at most half full */
+static int pack_grow(void)
+{
+	struct pack_ent *old = g_pack, *e;
+	uint64_t i, size = g_pack_size, j;
+
+	if (g_pack_used * 2 < g_pack_size)
+		return 0;
+
+	g_pack_size = size ? size * 2 : 1 << 16;
+	g_pack = calloc(g_pack_size, sizeof(*g_pack));
+	if (!g_pack)
+		return -1;
+	for (i = 0; i < size; i++) {
+		if (!old[i].node)
+			continue;
+		for (j = old[i].hash & (g_pack_size - 1); g_pack[j].node;
+		     j = (j + 1) & (g_pack_size - 1))
+			;
+		e = &g_pack[j];
+		*e = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* room for @len bytes behind the last tail, or in a new tail block */
+static int pack_tail(const char *data, uint32_t len, struct pack_ent *e)
+{
+	if (!g_tail_buf || g_tail_used + len > g_block_size) {
+		g_tail_buf = zmalloc(g_block_size);
+		if (!g_tail_buf)
+			return -1;
+		g_tail_index = g_data_next;
+		g_tail_used = 0;
+		g_tail_blocks++;
+		if (add_run(NULL, 0, 1, g_tail_buf))
+			return -1;
+	} else {
+		g_refs[g_tail_index]++;
+	}
+
+	memcpy(g_tail_buf + g_tail_used, data, len);
+	e->index = g_tail_index;
+	e->offset = g_tail_used;
+	e->tail = g_tail_buf;
+	g_tail_used += len;
+	return 0;
+}
+
+/* the blocks of @node, or its tail, shared with what is there if it can */
+static int pack_file(struct src_node *node, char *buf, char *scratch)
+{
+	uint32_t size = node->st.st_size, i, len;
+	uint32_t nr = div_round_up(size, g_block_size);
+	struct pack_ent *e;
+	uint64_t hash;
+	char *data;
+
+	node->map = calloc(TEST_FS_N_BLOCKS, sizeof(*node->map));
+	if (!node->map || read_node(node, 0, nr, buf))
+		return -1;
+
+	/* a short last block is compared with the zeros behind it */
+	len = size < g_block_size ? size : g_block_size;
+	for (i = 0; i < nr; i++) {
+		data = buf + (size_t)i * g_block_size;
+		if (is_zero(data, len)) {
+			g_zero++;
+			continue;
+		}
+
+		if (pack_grow())
+			return -1;
+		hash = data_hash(data, len);
+		e = pack_find(hash, data, len, scratch);
+		if (e->node && g_refs[e->index] < UINT16_MAX) {
+			g_refs[e->index]++;
+			g_shared++;
+		} else {
+			/* new data, or a copy once the refcount is full */
+			if (!e->node)
+				g_pack_used++;
+			e->hash = hash;
+			e->node = node;
+			e->block = i;
+			e->len = len;
+			if (len < g_block_size) {
+				if (pack_tail(data, len, e))
+					return -1;
+			} else {
+				e->index = g_data_next;
+				e->tail = NULL;
+				if (add_run(node, i, 1, NULL))
+					return -1;
+			}
+		}
+
+		node->map[i] = e->index;
+		if (len < g_block_size) {
+			node->tail = true;
+			node->tail_off = e->offset;
+			g_nr_tails++;
+		}
+	}
+
+	return 0;
+}
+
+/* -P: the data of the files, in inode order */
+static int pack_files(void)
+{
+	char *buf, *scratch;
+	struct src_node *node;
+	uint32_t i;
+	int ret = 0;
+
+	buf = malloc((size_t)g_block_size * TEST_FS_N_BLOCKS);
+	scratch = malloc(g_block_size);
+	if (!buf || !scratch) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < g_nr_inodes && !ret; i++) {
+		node = g_inodes[i];
+		if (S_ISREG(node->st.st_mode) &&
+		    node->st.st_size > (off_t)TESTFS_INLINE_DATA_SIZE)
+			ret = pack_file(node, buf, scratch);
+	}
+
+	printf("pack: %lu blocks shared, %lu of zeros, %lu tails in %lu blocks\n",
+	       (unsigned long)g_shared, (unsigned long)g_zero,
+	       (unsigned long)g_nr_tails, (unsigned long)g_tail_blocks);
+out:
+	free(g_pack);
+	g_pack = NULL;
+	free(buf);
+	free(scratch);
+	return ret;
+}
+
+/*
+ * -P: the layout of testfs_layout() cut to what the tree needs, no
+ * snapshot area, an inode table of the inodes in use and a data region
+ * of the blocks handed out. Then the placement moves to the data region.
+ */
+static int testfs_packed_layout(struct test_super_block *tsb)
+{
+	uint32_t inode_per_block = g_block_size / TESTFS_DISK_INODE_SIZE;
+	uint64_t itable, inodes, ibitmap, groups, refcount, data, index, i, j;
+	struct src_node *node;
+
+	itable = div_round_up(g_nr_inodes, inode_per_block);
+	inodes = itable * inode_per_block;
+	ibitmap = div_round_up(inodes, g_block_size * 8);
+	data = g_data_next;
+	groups = div_round_up(data, g_blocks_per_group);
+	refcount = div_round_up(data * sizeof(__le16), g_block_size);
+
+	tsb->s_version = htole32(TEST_FS_V2);
+	tsb->s_block_size = htole32(g_block_size);
+	tsb->s_inode_size = htole32(TESTFS_DISK_INODE_SIZE);
+
+	index = 1;
+	tsb->s_ibitmap_blkid = htole32(index);
+	tsb->s_ibitmap_blknr = htole32(ibitmap);
+	index += ibitmap;
+
+	tsb->s_dbitmap_blkid = htole32(index);
+	tsb->s_blocks_per_group = htole32(g_blocks_per_group);
+	index += groups;
+
+	tsb->s_inode_table_blkid = htole32(index);
+	tsb->s_inode_table_blknr = htole32(itable);
+	tsb->s_inodes_count = htole32(inodes);
+	index += itable;
+
+	tsb->s_refcount_blkid = htole32(index);
+	tsb->s_refcount_blknr = htole32(refcount);
+	index += refcount;
+
+	if (index + data > UINT32_MAX) {
+		fprintf(stderr, "%lu blocks is too many, use a larger block size\n",
+			(unsigned long)(index + data));
+		return -1;
+	}
+	tsb->s_data_blkid = htole32(index);
+	tsb->s_data_blknr = htole32(data);
+	tsb->s_total_blknr = htole32(index + data);
+
+	tsb->s_free_blocks_count = 0;
+	tsb->s_free_inodes_count = htole32(inodes - g_nr_inodes);
+	tsb->s_state = htole16(TESTFS_VALID_FS);
+	tsb->s_itable_zeroed = htole32(itable);
+	tsb->s_ro_flags = htole32(TESTFS_RO_PACKED);
+	tsb->s_magic = htole16(TEST_FS_MAGIC);
+
+	for (i = 0; i < g_nr_runs; i++)
+		g_runs[i].blkid += index;
+	for (i = 0; i < g_nr_inodes; i++) {
+		node = g_inodes[i];
+		if (node->blknr)
+			node->blkid += index;
+		for (j = 0; node->map && j < TEST_FS_N_BLOCKS; j++)
+			if (node->map[j])
+				node->map[j] += index;
+	}
+	g_data_start += index;
+	g_data_next += index;
+	return 0;
+}
+
+static uint32_t count_nodes(struct src_node *dir)
+{
+	struct src_node *node;
+	uint32_t nr = dir->nr_entries;
+
+	for (node = dir->child; node; node = node->next)
+		if (S_ISDIR(node->st.st_mode))
+			nr += count_nodes(node);
+	return nr;
+}
+
+/*
+ * scan @g_src_dir and place everything, before the image is touched; a
+ * packed image gets its layout here
+ */
+static int testfs_scan_tree(struct test_super_block *tsb)
+{
+	struct src_node *root;
+	uint32_t i;
+
+	root = zmalloc(sizeof(*root));
+	if (!root || !(root->path = strdup(g_src_dir)))
+		return -1;
+	if (stat(g_src_dir, &root->st) || !S_ISDIR(root->st.st_mode)) {
+		fprintf(stderr, "%s is not a directory\n", g_src_dir);
+		return -1;
+	}
+	if (scan_dir(root))
+		return -1;
+
+	g_max_inodes = g_packed ? 1 + count_nodes(root) :
+				  le32toh(tsb->s_inodes_count);
+	g_inodes = calloc(g_max_inodes, sizeof(*g_inodes));
+	if (!g_inodes)
+		return -1;
+
+	/* data block 0 is never handed out, block 0 in i_block[] is a hole */
+	g_data_start = le32toh(tsb->s_data_blkid) + 1;
+	g_data_next = g_data_start;
+	if (add_inode(root) || place_dir(root, tsb) ||
+	    (g_packed && pack_files()))
+		return -1;
+
+	for (i = 0; i < g_nr_inodes; i++)
+		if (S_ISDIR(g_inodes[i]->st.st_mode) && build_dir(g_inodes[i]))
+			return -1;
+
+	if (g_packed)
+		return testfs_packed_layout(tsb);
+
+	tsb->s_free_blocks_count = htole32(le32toh(tsb->s_data_blknr) - 1 -
+					   (g_data_next - g_data_start));
+	tsb->s_free_inodes_count = htole32(le32toh(tsb->s_inodes_count) -
+					   g_nr_inodes);
+	return 0;
+}
+
+/*
+ * Write the data region, then the bitmaps and the used part of the inode
+ * table, each with one write.
+ */
+static int testfs_populate(int fd, struct test_super_block *tsb)
+{
+	uint32_t inode_per_block = g_block_size / TESTFS_DISK_INODE_SIZE;
+	uint64_t bs = g_block_size, itable, used, bit, i;
+	pthread_t *threads;
+	uint8_t *buf;
+	size_t len;
+	int nr;
+
+	/* data */
+	g_fd = fd;
+	threads = calloc(g_nr_threads, sizeof(*threads));
+	if (!threads)
+		return -1;
+	for (nr = 0; nr < g_nr_threads; nr++)
+		if (pthread_create(&threads[nr], NULL, data_writer, NULL))
+			break;
+	if (!nr) {
+		free(threads);
+		return -1;
+	}
+	while (nr--)
+		pthread_join(threads[nr], NULL);
+	free(threads);
+	if (g_populate_error)
+		return -1;
+	printf("write %lu data blocks done\n",
+	       (unsigned long)(g_data_next - g_data_start));
+
+	/* inode table */
+	itable = div_round_up(g_nr_inodes, inode_per_block);
+	len = itable * bs;
+	buf = zmalloc(len);
+	if (!buf)
+		return -1;
+	for (i = 0; i < g_nr_inodes; i++)
+		fill_disk_inode((struct testfs_disk_inode *)buf + i,
+				g_inodes[i]);
+	if (g_populate_error ||
+	    pwrite(fd, buf, len, bs * le32toh(tsb->s_inode_table_blkid)) !=
+	    (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	if (g_lazy_itable_init)
+		tsb->s_itable_zeroed = htole32(itable);
+	printf("write %u inodes done\n", g_nr_inodes);
+
+	/* inode bitmap */
+	len = le32toh(tsb->s_ibitmap_blknr) * bs;
+	buf = zmalloc(len);
+	if (!buf)
+		return -1;
+	for (i = 0; i < g_nr_inodes; i++)
+		set_bit_le(buf, i);
+	if (pwrite(fd, buf, len, bs * le32toh(tsb->s_ibitmap_blkid)) !=
+	    (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+
+	/* data bitmap, block g covers group g, data block 0 is taken too */
+	used = g_data_next - le32toh(tsb->s_data_blkid);
+	len = div_round_up(le32toh(tsb->s_data_blknr), g_blocks_per_group) * bs;
+	buf = zmalloc(len);
+	if (!buf)
+		return -1;
+	for (bit = 0; bit < used; bit++)
+		set_bit_le(buf, bit / g_blocks_per_group * bs * 8 +
+			   bit % g_blocks_per_group);
+	if (pwrite(fd, buf, len, bs * le32toh(tsb->s_dbitmap_blkid)) !=
+	    (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	printf("write bitmaps done\n");
+
+	/* refcount table of a packed image */
+	if (!g_packed)
+		return 0;
+	len = le32toh(tsb->s_refcount_blknr) * bs;
+	buf = zmalloc(len);
+	if (!buf)
+		return -1;
+	for (i = 0; i < used; i++)
+		((__le16 *)buf)[i] = htole16(g_refs[i]);
+	if (pwrite(fd, buf, len, bs * le32toh(tsb->s_refcount_blkid)) !=
+	    (ssize_t)len) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	printf("write refcount table done\n");
+
+	return 0;
+}
+
+/* size of the device or image file open at @fd, in whole blocks */
+static int dev_size(int fd, const char *path, uint64_t *size, bool *is_bdev)
+{
 	struct stat st;
-	struct test_super_block *tsb;
-	char *imap_buf;
 
-	if (argc != 2)
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "failed to stat: %s\n", path);
+		return -1;
+	}
+
+	*is_bdev = S_ISBLK(st.st_mode);
+	if (*is_bdev) {
+		if (ioctl(fd, BLKGETSIZE64, size)) {
+			fprintf(stderr, "failed to get size of: %s\n", path);
+			return -1;
+		}
+	} else {
+		*size = st.st_size;
+	}
+
+	/* a partial last block is left alone */
+	*size -= *size % g_block_size;
+	return 0;
+}
+
+static int testfs_size_members(void)
+{
+	bool is_bdev;
+	int i, fd, ret;
+
+	for (i = 0; i < g_nr_members; i++) {
+		fd = open(g_members[i], O_RDWR);
+		if (fd < 0) {
+			fprintf(stderr, "failed to open: %s\n", g_members[i]);
+			return -1;
+		}
+		ret = dev_size(fd, g_members[i], &g_member_size[i], &is_bdev);
+		close(fd);
+		if (ret)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Block 0 of each member ties it to the volume and gives its place, the
+ * kernel finds the members by their labels whatever order they are given.
+ */
+static int testfs_write_labels(struct test_super_block *tsb)
+{
+	struct testfs_member_label *label;
+	char *buf;
+	int i, fd, ret = 0;
+
+	buf = zmalloc(g_block_size);
+	if (!buf)
+		return -1;
+
+	for (i = 0; i < g_nr_members && !ret; i++) {
+		label = (struct testfs_member_label *)buf;
+		label->m_magic = htole16(TEST_FS_MAGIC);
+		label->m_index = htole16(i + 1);
+		memcpy(label->m_fs_uuid, tsb->s_uuid, sizeof(label->m_fs_uuid));
+		memcpy(label->m_uuid, tsb->s_devs[i + 1].d_uuid,
+		       sizeof(label->m_uuid));
+
+		fd = open(g_members[i], O_RDWR);
+		if (fd < 0) {
+			fprintf(stderr, "failed to open: %s\n", g_members[i]);
+			ret = -1;
+			break;
+		}
+		ret = write_block(fd, 0, buf);
+		if (!ret && fsync(fd))
+			ret = -1;
+		close(fd);
+	}
+
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct test_super_block tsb;
+	uint64_t size, bs, need;
+	uuid_t uuid;
+	bool is_bdev;
+	int i, fd, opt;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "b:i:g:zd:j:m:c:MSP")) != -1) {
+		switch (opt) {
+		case 'b':
+			g_block_size = strtoul(optarg, &end, 0);
+			if (*end || g_block_size < TEST_FS_MIN_BLOCK_SIZE ||
+			    g_block_size > TEST_FS_BLOCK_SIZE ||
+			    (g_block_size & (g_block_size - 1)))
+				usage();
+			break;
+		case 'i':
+			g_inode_ratio = strtoull(optarg, &end, 0);
+			if (*end || g_inode_ratio < TESTFS_DISK_INODE_SIZE)
+				usage();
+			break;
+		case 'g':
+			g_blocks_per_group = strtoul(optarg, &end, 0);
+			if (*end || !g_blocks_per_group)
+				usage();
+			break;
+		case 'z':
+			g_lazy_itable_init = false;
+			break;
+		case 'd':
+			g_src_dir = optarg;
+			break;
+		case 'j':
+			g_nr_threads = strtol(optarg, &end, 0);
+			if (*end || g_nr_threads < 1)
+				usage();
+			break;
+		case 'm':
+			if (g_nr_members == TESTFS_MAX_DEVS - 1)
+				usage();
+			g_members[g_nr_members++] = optarg;
+			break;
+		case 'M':
+			g_meta_dev = true;
+			break;
+		case 'S':
+			g_snapshots = false;
+			break;
+		case 'P':
+			g_packed = true;
+			break;
+		case 'c':
+			g_stripe_blocks = strtoul(optarg, &end, 0);
+			if (*end || !g_stripe_blocks || g_stripe_blocks > 65535)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	/* a populated image is written to the first device only */
+	if (optind != argc - 1 || (g_src_dir && g_nr_members) ||
+	    (g_meta_dev && !g_nr_members) || (g_packed && !g_src_dir))
 		usage();
+	g_disk = argv[optind];
 
-	g_disk = argv[1];
+	/* nothing is ever written to a packed image, to snapshot either */
+	if (g_packed)
+		g_snapshots = false;
 
-	/*
-	 * Disk layout
-	 * |--------|--------|--------|--------|--------------------|
-	 *     1        2        3        4             5
-	 *
-	 * index | count | usage
-	 * ------------------------------------
-	 * 1     | 1     | super block
-	 * 2     | 1     | inode bitmap
-	 * 3     | 1     | data block bitmap
-	 * 4     | N     | inode table
-	 * 5     | M     | data region
-	 *
-	 */
+	if (!g_nr_threads) {
+		g_nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (g_nr_threads < 1)
+			g_nr_threads = 1;
+		if (g_nr_threads > 16)
+			g_nr_threads = 16;
+	}
+
+	if (!g_blocks_per_group)
+		g_blocks_per_group = g_block_size * 8;
+	if (g_blocks_per_group > g_block_size * 8) {
+		fprintf(stderr, "at most %u blocks per group with %u byte blocks\n",
+			g_block_size * 8, g_block_size);
+		return -1;
+	}
 
 	fd = open(g_disk, O_RDWR);
 	if (fd < 0) {
@@ -279,59 +1734,137 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		fprintf(stderr, "failed to stat: %s\n", g_disk);
+	if (dev_size(fd, g_disk, &size, &is_bdev) || testfs_size_members())
 		goto close;
-	}
 
-	size = st.st_size;
-	if (size % TEST_FS_BLOCK_SIZE) {
-		fprintf(stderr, "%lu size is not align to %lu\n",
-					size, TEST_FS_BLOCK_SIZE);
+	memset(&tsb, 0, sizeof(tsb));
+	if (g_packed) {
+		if (testfs_scan_tree(&tsb)) {
+			fprintf(stderr, "failed to scan %s\n", g_src_dir);
+			goto close;
+		}
+		/* an image file takes the size, a device must have it */
+		need = (uint64_t)le32toh(tsb.s_total_blknr) * g_block_size;
+		if (is_bdev ? size < need : ftruncate(fd, need) != 0) {
+			fprintf(stderr, "%s: can not hold %lu bytes\n", g_disk,
+				(unsigned long)need);
+			goto close;
+		}
+	} else if (testfs_layout(size, &tsb)) {
 		goto close;
 	}
 
+	uuid_generate(uuid);
+	memcpy(tsb.s_uuid, uuid, sizeof(tsb.s_uuid));
+	for (i = 0; i < g_nr_members; i++) {
+		uuid_generate(uuid);
+		memcpy(tsb.s_devs[i + 1].d_uuid, uuid, sizeof(uuid));
+	}
+
+	bs = g_block_size;
 	printf("start make filesystem for:  %s\n", g_disk);
 	printf("\tsizeof(test_super_block):   %lu\n", sizeof(struct test_super_block));
 	printf("\tsizeof(testfs_disk_inode):  %lu\n", sizeof(struct testfs_disk_inode));
 	printf("\tsizeof(testfs_dir_entry):   %lu\n", sizeof(struct testfs_dir_entry));
-	printf("\tblock size:    %lu\n", TEST_FS_BLOCK_SIZE);
-	printf("\ttotal blocks:  %lu\n", size / TEST_FS_BLOCK_SIZE);
+	printf("\tblock size:    %u\n", g_block_size);
+	printf("\ttotal blocks:  %u\n", le32toh(tsb.s_total_blknr));
+	printf("\tinodes:        %u\n", le32toh(tsb.s_inodes_count));
+	printf("\tgroups:        %lu of %u blocks\n",
+		(unsigned long)div_round_up(le32toh(tsb.s_data_blknr),
+					    g_blocks_per_group),
+		g_blocks_per_group);
+	printf("\tdata blocks:   %u\n", le32toh(tsb.s_data_blknr));
+	for (i = 0; g_nr_members && i <= g_nr_members; i++)
+		printf("\t  device %d:    %u, %s%s\n", i,
+		       le32toh(tsb.s_devs[i].d_data_blknr),
+		       i ? g_members[i - 1] : g_disk,
+		       !i && g_meta_dev ? ", metadata" : "");
+	if (g_snapshots)
+		printf("\tsnapshot area: %u blocks\n",
+		       le32toh(tsb.s_data_blkid) - le32toh(tsb.s_snap_store_blkid));
 
-	/* super block */
-	if (testfs_write_super_block(fd, size, g_tsb)) {
-		fprintf(stderr, "failed to write super block\n");
+	if (g_src_dir && !g_packed && testfs_scan_tree(&tsb)) {
+		fprintf(stderr, "failed to scan %s\n", g_src_dir);
 		goto close;
 	}
-	printf("write super block done\n");
+	if (g_src_dir)
+		printf("scan %s done, %u inodes, %lu data blocks\n", g_src_dir,
+		       g_nr_inodes, (unsigned long)(g_data_next - g_data_start));
+
+	/*
+	 * Everything the kernel reads before it writes is zeroed: bitmaps,
+	 * refcount table and the snapshot copy and deferred free bitmaps, they
+	 * are adjacent apart from the inode table and the store. With
+	 * lazy init only the inode table block of the root inode is written,
+	 * the kernel zeroes the rest after mount.
+	 */
+	if (zero_range(fd, is_bdev, bs * le32toh(tsb.s_ibitmap_blkid),
+		       bs * (le32toh(tsb.s_inode_table_blkid) -
+			     le32toh(tsb.s_ibitmap_blkid))) ||
+	    zero_range(fd, is_bdev, bs * le32toh(tsb.s_refcount_blkid),
+		       bs * le32toh(tsb.s_refcount_blknr)) ||
+	    (g_snapshots &&
+	     zero_range(fd, is_bdev, bs * le32toh(tsb.s_snap_cow_blkid),
+			bs * (le32toh(tsb.s_data_blkid) -
+			      le32toh(tsb.s_snap_cow_blkid))))) {
+		fprintf(stderr, "failed to zero bitmaps\n");
+		goto close;
+	}
+	if (!g_lazy_itable_init &&
+	    zero_range(fd, is_bdev, bs * le32toh(tsb.s_inode_table_blkid),
+		       bs * le32toh(tsb.s_inode_table_blknr))) {
+		fprintf(stderr, "failed to zero inode table\n");
+		goto close;
+	}
+	printf("zero metadata done\n");
+
+	if (testfs_write_labels(&tsb)) {
+		fprintf(stderr, "failed to write member labels\n");
+		goto close;
+	}
+
+	if (g_src_dir) {
+		if (testfs_populate(fd, &tsb)) {
+			fprintf(stderr, "failed to populate from %s\n",
+				g_src_dir);
+			goto close;
+		}
+		goto super;
+	}
 
 	/* inode bitmap */
-	if (testfs_write_inode_bitmap(fd, g_inode_bitmap, TEST_FS_BLOCK_SIZE)) {
+	if (testfs_write_bitmap_head(fd, le32toh(tsb.s_ibitmap_blkid))) {
 		fprintf(stderr, "failed to write inode bitmap\n");
 		goto close;
 	}
 	printf("write inode bitmap done\n");
 
 	/* data bitmap */
-	if (testfs_write_data_bitmap(fd, g_data_bitmap, TEST_FS_BLOCK_SIZE)) {
+	if (testfs_write_bitmap_head(fd, le32toh(tsb.s_dbitmap_blkid))) {
 		fprintf(stderr, "failed to write data bitmap\n");
 		goto close;
 	}
 	printf("write data bitmap done\n");
 
 	/* inode table: root inode */
-	if (testfs_write_root_inode(fd, g_tsb)) {
+	if (testfs_write_root_inode(fd, &tsb)) {
 		fprintf(stderr, "failed to write root inode\n");
 		goto close;
 	}
 	printf("write root inode done\n");
+
+super:
+	/* super block last, the volume is not valid before */
+	if (fsync(fd) || testfs_write_super_block(fd, &tsb) || fsync(fd)) {
+		fprintf(stderr, "failed to write super block\n");
+		goto close;
+	}
+	printf("write super block done\n");
 	printf("finished to make filesystem for:  %s\n", g_disk);
 
 	close(fd);
 
 	return 0;
-free_tsb:
-	free(tsb);
 close:
 	close(fd);
 	return -1;
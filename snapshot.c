@@ -0,0 +1,698 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+#include <linux/backing-dev.h>
+
+#include "testfs.h"
+
+/*
+ * Snapshots.
+ *
+ * A snapshot is the volume as it was when TESTFS_IOC_SNAP_CREATE froze
+ * it, kept without copying anything up front. Two rules keep it intact:
+ *
+ * - metadata below s_snap_store_blknr (super block, bitmaps, inode table)
+ *   is copied to its slot in the store before it first changes, the copy
+ *   bitmap on disk and s_snap_copied say which slots are in use;
+ * - a data block that was in use when the snapshot was taken is never
+ *   written or freed by the live volume. Writes to it are redirected to a
+ *   new block the way writes to shared blocks are, and freeing it only
+ *   sets its bit in the deferred free bitmap of its group.
+ *
+ * Taking one thus costs a freeze and clearing the copy bitmap, whatever
+ * the size of the volume. The snapshot's view of a metadata block is its
+ * copy if it has one, the live block otherwise; in particular a data
+ * block belongs to the snapshot if the snapshot's data bitmap has it.
+ * Dropping the snapshot hands the deferred blocks back to the allocator
+ * from a worker, group by group. There is one snapshot at a time.
+ *
+ * The snapshot is mounted read-only as testfs_snap on the device of the
+ * mounted live volume, it reads everything through the live one.
+ */
+
+/* blocks of the copy bitmap */
+static u32 testfs_snap_cow_blknr(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+
+	return DIV_ROUND_UP(sbi->s_snap_store_blknr, sb->s_blocksize * 8);
+}
+
+/* fill s_snap_copied from the copy bitmap on disk */
+static int testfs_snap_load(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bits_per_block = sb->s_blocksize * 8;
+	u32 i, bit, nbits, n = testfs_snap_cow_blknr(sb);
+	struct buffer_head *bh;
+
+	for (i = 0; i < n; i++) {
+		bh = sb_bread(sb, sbi->s_snap_cow_blkid + i);
+		if (!bh) {
+			log_err("failed to read the copy bitmap\n");
+			return -EIO;
+		}
+		nbits = min(bits_per_block,
+			    sbi->s_snap_store_blknr - i * bits_per_block);
+		for (bit = find_next_bit_le(bh->b_data, nbits, 0); bit < nbits;
+		     bit = find_next_bit_le(bh->b_data, nbits, bit + 1))
+			set_bit(i * bits_per_block + bit, sbi->s_snap_copied);
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+/* read the snapshot area of the super block, at mount time */
+int testfs_snap_init(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct test_super_block *tsb = sbi->s_tsb;
+	u32 store, nr, cow, free;
+
+	mutex_init(&sbi->s_snap_mutex);
+	INIT_DELAYED_WORK(&sbi->s_snap_drop_work, testfs_snap_drop_work);
+
+	store = le32_to_cpu(tsb->s_snap_store_blkid);
+	nr = le32_to_cpu(tsb->s_snap_store_blknr);
+	cow = le32_to_cpu(tsb->s_snap_cow_blkid);
+	free = le32_to_cpu(tsb->s_snap_free_blkid);
+	if (!nr)
+		return 0;
+
+	/* the store covers the inode table, the last block copied */
+	sbi->s_snap_store_blknr = nr;
+	if (nr < sbi->s_itable_blkid + sbi->inode_table_blknr ||
+	    store < nr || cow < store + nr ||
+	    free < cow + testfs_snap_cow_blknr(sb) ||
+	    sbi->s_data_blkid < free + sbi->s_groups_count ||
+	    le32_to_cpu(tsb->s_snap_state) > TESTFS_SNAP_DROPPING) {
+		log_err("bad snapshot area\n");
+		return -EINVAL;
+	}
+	sbi->s_snap_store_blkid = store;
+	sbi->s_snap_cow_blkid = cow;
+	sbi->s_snap_free_blkid = free;
+
+	sbi->s_snap_copied = kvzalloc(BITS_TO_LONGS(nr) * sizeof(long),
+				      GFP_KERNEL);
+	if (!sbi->s_snap_copied)
+		return -ENOMEM;
+
+	sbi->s_snap_state = le32_to_cpu(tsb->s_snap_state);
+	if (sbi->s_snap_state == TESTFS_SNAP_ACTIVE && testfs_snap_load(sb)) {
+		kvfree(sbi->s_snap_copied);
+		sbi->s_snap_copied = NULL;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Set s_snap_state, in memory first, then in the super block. The super
+ * block is written in place even while the snapshot is there: the one
+ * the snapshot sees records the state it was taken in.
+ */
+static int testfs_snap_set_state(struct super_block *sb, u32 state)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+
+	spin_lock(&sbi->s_balloc_lock);
+	WRITE_ONCE(sbi->s_snap_state, state);
+	spin_unlock(&sbi->s_balloc_lock);
+
+	lock_buffer(sbi->s_sb_bh);
+	sbi->s_tsb->s_snap_state = cpu_to_le32(state);
+	unlock_buffer(sbi->s_sb_bh);
+	mark_buffer_dirty(sbi->s_sb_bh);
+	return sync_dirty_buffer(sbi->s_sb_bh);
+}
+
+/*
+ * testfs_snap_cow - copy metadata block @blkid for the snapshot
+ *
+ * Called before every change of a block below the store, outside of any
+ * spinlock and with the buffer unlocked. The copy and its bit in the copy
+ * bitmap are on disk before this returns, so the live block can change.
+ */
+int testfs_snap_cow(struct super_block *sb, u32 blkid)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bits_per_block = sb->s_blocksize * 8;
+	struct buffer_head *bh, *copy, *cbh;
+	int ret = 0;
+
+	if (likely(!testfs_snap_must_copy(sbi, blkid)))
+		return 0;
+
+	mutex_lock(&sbi->s_snap_mutex);
+	if (!testfs_snap_must_copy(sbi, blkid))
+		goto unlock;
+
+	ret = -EIO;
+	bh = sb_bread(sb, blkid);
+	if (!bh)
+		goto fail;
+	copy = sb_getblk(sb, sbi->s_snap_store_blkid + blkid);
+	if (!copy) {
+		brelse(bh);
+		goto fail;
+	}
+	lock_buffer(copy);
+	memcpy(copy->b_data, bh->b_data, sb->s_blocksize);
+	set_buffer_uptodate(copy);
+	unlock_buffer(copy);
+	brelse(bh);
+	mark_buffer_dirty(copy);
+	ret = sync_dirty_buffer(copy);
+	brelse(copy);
+	if (ret)
+		goto fail;
+
+	ret = -EIO;
+	cbh = sb_bread(sb, sbi->s_snap_cow_blkid + blkid / bits_per_block);
+	if (!cbh)
+		goto fail;
+	lock_buffer(cbh);
+	set_bit_le(blkid % bits_per_block, cbh->b_data);
+	unlock_buffer(cbh);
+	mark_buffer_dirty(cbh);
+	ret = sync_dirty_buffer(cbh);
+	brelse(cbh);
+	if (ret)
+		goto fail;
+
+	set_bit(blkid, sbi->s_snap_copied);
+	goto unlock;
+fail:
+	log_err("failed to copy block %u for the snapshot\n", blkid);
+unlock:
+	mutex_unlock(&sbi->s_snap_mutex);
+	return ret;
+}
+
+/**
+ * testfs_snap_owned - tell whether the snapshot has data block @blkid
+ *
+ * @sb:		the super block
+ * @blkid:	a data block the caller holds a reference on
+ * @nowait:	only look at a bitmap block already in the cache
+ *
+ * The caller's block keeps its bit in the live data bitmap, so it needs
+ * no lock: if the bitmap was not copied, the live one is the snapshot's
+ * as far as this bit goes.
+ *
+ * Return: 1 if it has, 0 if not or there is no snapshot, -EAGAIN or -EIO
+ * if the bitmap is not cached with @nowait or can not be read.
+ */
+int testfs_snap_owned(struct super_block *sb, u32 blkid, bool nowait)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 index = blkid - sbi->s_data_blkid;
+	u32 blknr = sbi->s_dbitmap_blkid + index / sbi->s_blocks_per_group;
+	struct buffer_head *bh;
+	int ret;
+
+	if (!testfs_snap_active(sbi))
+		return 0;
+
+	if (test_bit(blknr, sbi->s_snap_copied))
+		blknr += sbi->s_snap_store_blkid;
+
+	if (nowait) {
+		bh = sb_find_get_block(sb, blknr);
+		if (bh && !buffer_uptodate(bh)) {
+			brelse(bh);
+			bh = NULL;
+		}
+		if (!bh)
+			return -EAGAIN;
+	} else {
+		bh = sb_bread(sb, blknr);
+		if (!bh)
+			return -EIO;
+	}
+
+	ret = test_bit_le(index % sbi->s_blocks_per_group, bh->b_data);
+	brelse(bh);
+	return ret;
+}
+
+/**
+ * testfs_snap_read - read metadata the way the snapshot sees it
+ *
+ * @sb:		the super block of a mounted snapshot
+ * @blkid:	the block, below the store
+ * @offset:	where in the block to start
+ * @buf:	out: the data
+ * @len:	bytes to read
+ *
+ * The live block may be copied away and changed right after it is
+ * looked at, so the data is copied out under s_snap_mutex of the live
+ * volume rather than handed over as a buffer_head.
+ */
+int testfs_snap_read(struct super_block *sb, u32 blkid, u32 offset,
+			void *buf, u32 len)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct super_block *live = sbi->s_snap_of;
+	struct testfs_sb_info *lsbi = live->s_fs_info;
+	struct buffer_head *bh;
+
+	mutex_lock(&lsbi->s_snap_mutex);
+	if (test_bit(blkid, lsbi->s_snap_copied))
+		blkid += lsbi->s_snap_store_blkid;
+	bh = sb_bread(live, blkid);
+	if (bh)
+		memcpy(buf, bh->b_data + offset, len);
+	mutex_unlock(&lsbi->s_snap_mutex);
+
+	if (!bh) {
+		log_err("failed to read block %u of the snapshot\n", blkid);
+		return -EIO;
+	}
+	brelse(bh);
+	return 0;
+}
+
+/* clear the copy bitmap, on disk and in memory */
+static int testfs_snap_clear_copied(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 i, n = testfs_snap_cow_blknr(sb);
+	struct buffer_head *bh;
+	int ret;
+
+	for (i = 0; i < n; i++) {
+		bh = sb_getblk(sb, sbi->s_snap_cow_blkid + i);
+		if (!bh)
+			return -ENOMEM;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+		brelse(bh);
+		if (ret)
+			return ret;
+	}
+
+	bitmap_zero(sbi->s_snap_copied, sbi->s_snap_store_blknr);
+	return 0;
+}
+
+/*
+ * testfs_snap_create - take a snapshot of the volume
+ *
+ * The freeze puts everything on disk, from then on it is the snapshot.
+ * Nothing copies without a snapshot, so s_snap_mutex is safe to hold
+ * while the writers drain.
+ */
+int testfs_snap_create(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	int ret;
+
+	mutex_lock(&sbi->s_snap_mutex);
+	ret = -EOPNOTSUPP;
+	if (!sbi->s_snap_store_blknr)
+		goto unlock;
+	ret = sbi->s_snap_state == TESTFS_SNAP_ACTIVE ? -EEXIST : -EBUSY;
+	if (sbi->s_snap_state != TESTFS_SNAP_NONE)
+		goto unlock;
+
+	ret = freeze_super(sb);
+	if (ret)
+		goto unlock;
+
+	ret = -EROFS;
+	if (sb_rdonly(sb))
+		goto thaw;
+
+	ret = testfs_snap_clear_copied(sb);
+	if (!ret)
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+	if (!ret)
+		ret = testfs_flush_devs(sb);
+	if (ret)
+		goto thaw;
+
+	lock_buffer(sbi->s_sb_bh);
+	sbi->s_tsb->s_snap_time = cpu_to_le32(ktime_get_real_seconds());
+	unlock_buffer(sbi->s_sb_bh);
+	ret = testfs_snap_set_state(sb, TESTFS_SNAP_ACTIVE);
+	if (ret)
+		testfs_snap_set_state(sb, TESTFS_SNAP_NONE);
+thaw:
+	thaw_super(sb);
+unlock:
+	mutex_unlock(&sbi->s_snap_mutex);
+	if (!ret)
+		log_err("snapshot taken\n");
+	return ret;
+}
+
+/*
+ * testfs_snap_drop - drop the snapshot, its blocks are freed in the
+ * background
+ *
+ * Nothing is copied or deferred once the state is TESTFS_SNAP_DROPPING,
+ * blocks freed from then on go straight back to the allocator.
+ */
+int testfs_snap_drop(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	int ret;
+
+	mutex_lock(&sbi->s_snap_mutex);
+	if (!sbi->s_snap_store_blknr) {
+		ret = -EOPNOTSUPP;
+	} else if (sbi->s_snap_state != TESTFS_SNAP_ACTIVE) {
+		ret = -ENOENT;
+	} else if (sbi->s_snap_mounts) {
+		ret = -EBUSY;
+	} else {
+		ret = testfs_snap_set_state(sb, TESTFS_SNAP_DROPPING);
+		sbi->s_snap_drop_group = 0;
+		queue_delayed_work(system_long_wq, &sbi->s_snap_drop_work, 0);
+	}
+	mutex_unlock(&sbi->s_snap_mutex);
+
+	return ret;
+}
+
+/*
+ * Free the deferred blocks of @group. The deferred bitmap is cleared on
+ * disk first: a crash in between leaks the blocks until testfsck finds
+ * them, it never frees them twice.
+ */
+static int testfs_snap_free_group(struct super_block *sb, u32 group)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u32 bit, nbits = sb->s_blocksize * 8, freed = 0;
+	struct buffer_head *fbh, *bh;
+	int ret;
+
+	fbh = sb_bread(sb, sbi->s_snap_free_blkid + group);
+	if (!fbh)
+		return -EIO;
+	if (!memchr_inv(fbh->b_data, 0, sb->s_blocksize)) {
+		brelse(fbh);
+		return 0;
+	}
+
+	bh = sb_bread_unmovable(sb, sbi->s_dbitmap_blkid + group);
+	if (!bh) {
+		brelse(fbh);
+		return -EIO;
+	}
+
+	spin_lock(&sbi->s_balloc_lock);
+	for (bit = find_next_bit_le(fbh->b_data, nbits, 0); bit < nbits;
+	     bit = find_next_bit_le(fbh->b_data, nbits, bit + 1))
+		if (__test_and_clear_bit_le(bit, bh->b_data))
+			freed++;
+	memset(fbh->b_data, 0, sb->s_blocksize);
+	spin_unlock(&sbi->s_balloc_lock);
+
+	mark_buffer_dirty(fbh);
+	ret = sync_dirty_buffer(fbh);
+	brelse(fbh);
+	mark_buffer_dirty(bh);
+	if (!ret)
+		ret = sync_dirty_buffer(bh);
+	brelse(bh);
+
+	percpu_counter_add(&sbi->s_freeblocks_counter, freed);
+	return ret;
+}
+
+/* groups applied per run of the drop worker */
+#define TESTFS_SNAP_DROP_BATCH	64
+
+void testfs_snap_drop_work(struct work_struct *work)
+{
+	struct testfs_sb_info *sbi = container_of(to_delayed_work(work),
+					struct testfs_sb_info, s_snap_drop_work);
+	struct super_block *sb = sbi->s_sb;
+	u32 group = sbi->s_snap_drop_group, end;
+
+	/*
+	 * remounting or frozen, come back later; a read-only mount goes on
+	 * once it is remounted read-write
+	 */
+	if (!down_read_trylock(&sb->s_umount)) {
+		queue_delayed_work(system_long_wq, &sbi->s_snap_drop_work, HZ);
+		return;
+	}
+	if (sb_rdonly(sb))
+		goto out;
+	if (!sb_start_write_trylock(sb)) {
+		queue_delayed_work(system_long_wq, &sbi->s_snap_drop_work, HZ);
+		goto out;
+	}
+
+	end = min(group + TESTFS_SNAP_DROP_BATCH, sbi->s_groups_count);
+	for (; group < end; group++) {
+		if (testfs_snap_free_group(sb, group))
+			break;
+	}
+	sbi->s_snap_drop_group = group;
+
+	if (group < end) {
+		log_err("failed to free the snapshot blocks of group %u\n",
+			group);
+	} else if (group < sbi->s_groups_count) {
+		queue_delayed_work(system_long_wq, &sbi->s_snap_drop_work, 0);
+	} else {
+		mutex_lock(&sbi->s_snap_mutex);
+		testfs_snap_set_state(sb, TESTFS_SNAP_NONE);
+		mutex_unlock(&sbi->s_snap_mutex);
+		log_err("snapshot dropped\n");
+	}
+
+	sb_end_write(sb);
+out:
+	up_read(&sb->s_umount);
+}
+
+/*
+ * Mounting the snapshot.
+ *
+ * A snapshot super block has an anonymous device, s_bdev is the one of
+ * the live volume and s_snap_of the live super block, held active until
+ * the snapshot is unmounted; the snapshot can not be dropped meanwhile.
+ * It shares the devices of the live volume and reads the data blocks
+ * straight from them, nothing the snapshot has is ever written.
+ */
+
+/* let go of the live volume */
+static void testfs_snap_unpin(struct super_block *live)
+{
+	struct testfs_sb_info *lsbi = live->s_fs_info;
+
+	mutex_lock(&lsbi->s_snap_mutex);
+	lsbi->s_snap_mounts--;
+	mutex_unlock(&lsbi->s_snap_mutex);
+	deactivate_super(live);
+}
+
+void testfs_snap_put_super(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	testfs_snap_unpin(sbi->s_snap_of);
+
+	kfree(sbi);
+	sb->s_fs_info = NULL;
+}
+
+static int testfs_fill_snapshot(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct super_block *live = sbi->s_snap_of;
+	struct testfs_sb_info *lsbi = live->s_fs_info;
+	struct test_super_block *tsb;
+	struct inode *root;
+	int ret;
+
+	sbi->s_sb = sb;
+	sb->s_bdev = live->s_bdev;
+	sb->s_bdi = bdi_get(live->s_bdi);
+	sb->s_blocksize = live->s_blocksize;
+	sb->s_blocksize_bits = live->s_blocksize_bits;
+	sb->s_maxbytes = live->s_maxbytes;
+	sb->s_magic = TEST_FS_MAGIC;
+	sb->s_op = &testfs_sops;
+	sb->s_time_gran = live->s_time_gran;
+	sb->s_time_min = live->s_time_min;
+	sb->s_time_max = live->s_time_max;
+	memcpy(&sb->s_uuid, &live->s_uuid, sizeof(sb->s_uuid));
+
+	/* the geometry never changes, nor do the devices */
+	sbi->inode_table_blknr = lsbi->inode_table_blknr;
+	sbi->s_block_size = lsbi->s_block_size;
+	sbi->s_inode_size = lsbi->s_inode_size;
+	sbi->s_data_blkid = lsbi->s_data_blkid;
+	sbi->s_data_blknr = lsbi->s_data_blknr;
+	sbi->s_inodes_count = lsbi->s_inodes_count;
+	sbi->s_ibitmap_blkid = lsbi->s_ibitmap_blkid;
+	sbi->s_ibitmap_blknr = lsbi->s_ibitmap_blknr;
+	sbi->s_dbitmap_blkid = lsbi->s_dbitmap_blkid;
+	sbi->s_groups_count = lsbi->s_groups_count;
+	sbi->s_blocks_per_group = lsbi->s_blocks_per_group;
+	sbi->s_itable_blkid = lsbi->s_itable_blkid;
+	memcpy(sbi->s_devs, lsbi->s_devs, sizeof(sbi->s_devs));
+	sbi->s_ndevs = lsbi->s_ndevs;
+	sbi->s_first_file_dev = lsbi->s_first_file_dev;
+	sbi->s_stripe_blocks = lsbi->s_stripe_blocks;
+	spin_lock_init(&sbi->s_balloc_lock);
+	spin_lock_init(&sbi->s_ialloc_lock);
+	spin_lock_init(&sbi->s_inode_gen_lock);
+
+	/* taken on a frozen volume, the free counts are exact */
+	tsb = kmalloc(sizeof(*tsb), GFP_KERNEL);
+	if (!tsb) {
+		ret = -ENOMEM;
+		goto unpin;
+	}
+	ret = testfs_snap_read(sb, TEST_FS_BLKID_SB, 0, tsb, sizeof(*tsb));
+	if (!ret)
+		ret = percpu_counter_init(&sbi->s_freeblocks_counter,
+				le32_to_cpu(tsb->s_free_blocks_count),
+				GFP_KERNEL);
+	if (!ret) {
+		ret = percpu_counter_init(&sbi->s_freeinodes_counter,
+				le32_to_cpu(tsb->s_free_inodes_count),
+				GFP_KERNEL);
+		if (ret)
+			percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	}
+	kfree(tsb);
+	if (ret)
+		goto unpin;
+
+	root = testfs_iget(sb, TESTFS_ROOT_INO);
+	if (IS_ERR(root)) {
+		ret = PTR_ERR(root);
+		goto free_counters;
+	}
+	sb->s_root = d_make_root(root);
+	if (!sb->s_root) {
+		ret = -ENOMEM;
+		goto free_counters;
+	}
+
+	return 0;
+
+free_counters:
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+unpin:
+	testfs_snap_unpin(live);
+	kfree(sbi);
+	sb->s_fs_info = NULL;
+	return ret;
+}
+
+static int testfs_snap_test(struct super_block *sb, void *data)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info, *new = data;
+
+	return sbi && sbi->s_snap_of == new->s_snap_of;
+}
+
+static int testfs_snap_set(struct super_block *sb, void *data)
+{
+	sb->s_fs_info = data;
+	return set_anon_super(sb, NULL);
+}
+
+/*
+ * mount -t testfs_snap <device> <dir>: the snapshot of the testfs volume
+ * mounted from <device>, always read-only
+ */
+struct dentry *testfs_snap_mount(struct file_system_type *fs_type,
+			int flags, const char *dev_name, void *data)
+{
+	struct testfs_sb_info *sbi, *lsbi;
+	struct super_block *sb, *live;
+	struct block_device *bdev;
+	int ret = 0;
+
+	bdev = blkdev_get_by_path(dev_name, FMODE_READ, NULL);
+	if (IS_ERR(bdev))
+		return ERR_CAST(bdev);
+	live = get_super(bdev);
+	blkdev_put(bdev, FMODE_READ);
+	if (!live || live->s_type != &test_fs_type) {
+		log_err("%s has no testfs volume mounted\n", dev_name);
+		if (live)
+			drop_super(live);
+		return ERR_PTR(-EINVAL);
+	}
+	if (!atomic_inc_not_zero(&live->s_active))
+		ret = -EINVAL;
+	drop_super(live);
+	if (ret)
+		return ERR_PTR(ret);
+
+	lsbi = live->s_fs_info;
+	mutex_lock(&lsbi->s_snap_mutex);
+	if (lsbi->s_snap_state == TESTFS_SNAP_ACTIVE)
+		lsbi->s_snap_mounts++;
+	else
+		ret = -ENOENT;
+	mutex_unlock(&lsbi->s_snap_mutex);
+	if (ret) {
+		deactivate_super(live);
+		return ERR_PTR(ret);
+	}
+
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi) {
+		testfs_snap_unpin(live);
+		return ERR_PTR(-ENOMEM);
+	}
+	sbi->s_snap_of = live;
+
+	sb = sget(fs_type, testfs_snap_test, testfs_snap_set,
+		  flags | SB_RDONLY, sbi);
+	if (IS_ERR(sb) || sb->s_root) {
+		/* mounted already, with its own hold on the live volume */
+		kfree(sbi);
+		testfs_snap_unpin(live);
+		return IS_ERR(sb) ? ERR_CAST(sb) : dget(sb->s_root);
+	}
+
+	ret = testfs_fill_snapshot(sb);
+	if (ret) {
+		deactivate_locked_super(sb);
+		return ERR_PTR(ret);
+	}
+	sb->s_flags |= SB_ACTIVE;
+
+	return dget(sb->s_root);
+}
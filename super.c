@@ -33,6 +33,7 @@
 #include <linux/types.h>
 #include <linux/buffer_head.h>
 #include <linux/random.h>
+#include <linux/exportfs.h>
 
 #include "testfs.h"
 
@@ -46,13 +47,9 @@ int testfs_get_block_and_offset(struct super_block *sb, ino_t ino,
 	struct testfs_sb_info *sbi = (struct testfs_sb_info *)sb->s_fs_info;
 	int inode_per_block;
 
-	/*
-	 * since inode bitmap only use one block, so the max inode index should
-	 * less that it.
-	 */
-	if (ino >= TEST_FS_BLOCK_SIZE) {
-		log_err("ino (%ld) is too large, expect < %d\n",
-				ino, TEST_FS_BLOCK_SIZE);
+	if (ino >= sbi->s_inodes_count) {
+		log_err("ino (%ld) is too large, expect < %u\n",
+				ino, sbi->s_inodes_count);
 		return -EINVAL;
 	}
 
@@ -60,7 +57,7 @@ int testfs_get_block_and_offset(struct super_block *sb, ino_t ino,
 	inode_per_block = sbi->s_block_size / sbi->s_inode_size;
 
 	/* get the block index */
-	*blkid = ino / inode_per_block + TEST_FS_BLKID_ITABLE;
+	*blkid = ino / inode_per_block + sbi->s_itable_blkid;
 
 	/* get offset within block */
 	*offset = (ino % inode_per_block) * sbi->s_inode_size;
@@ -68,28 +65,524 @@ int testfs_get_block_and_offset(struct super_block *sb, ino_t ino,
 	return 0;
 }
 
+/*
+ * Write the free counters back to the on-disk super block, with @state the
+ * new s_state.
+ */
+static void testfs_sync_super(struct super_block *sb, u16 state, int wait)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct test_super_block *tsb = sbi->s_tsb;
+
+	if (testfs_snap_cow(sb, TEST_FS_BLKID_SB))
+		return;
+
+	lock_buffer(sbi->s_sb_bh);
+	tsb->s_free_blocks_count = cpu_to_le32(
+			percpu_counter_sum_positive(&sbi->s_freeblocks_counter));
+	tsb->s_free_inodes_count = cpu_to_le32(
+			percpu_counter_sum_positive(&sbi->s_freeinodes_counter));
+	tsb->s_state = cpu_to_le16(state);
+	spin_lock(&sbi->s_ialloc_lock);
+	tsb->s_itable_zeroed = cpu_to_le32(sbi->s_itable_zeroed);
+	spin_unlock(&sbi->s_ialloc_lock);
+	unlock_buffer(sbi->s_sb_bh);
+
+	mark_buffer_dirty(sbi->s_sb_bh);
+	if (wait)
+		sync_dirty_buffer(sbi->s_sb_bh);
+}
+
+/* flush the write caches of the members, s_bdev is up to the callers */
+int testfs_flush_devs(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	int i, err, ret = 0;
+
+	for (i = 1; i < sbi->s_ndevs; i++) {
+		err = blkdev_issue_flush(sbi->s_devs[i].bdev, GFP_KERNEL);
+		if (err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+static int testfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+
+	if (!sb_rdonly(sb))
+		testfs_sync_super(sb, le16_to_cpu(sbi->s_tsb->s_state), wait);
+
+	return wait ? testfs_flush_devs(sb) : 0;
+}
+
+/* constant time: both counts come from the percpu counters */
+static int testfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = TEST_FS_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->s_data_blknr;
+	buf->f_bfree = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->s_inodes_count;
+	buf->f_ffree = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+	buf->f_namelen = TESTFS_FILE_NAME_LEN;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+
+	return 0;
+}
+
+/*
+ * Volumes formatted before the geometry became configurable have one inode
+ * bitmap block, one data bitmap block and the inode table right behind
+ * them, all at fixed places.
+ */
+static int testfs_read_geometry(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct test_super_block *tsb = sbi->s_tsb;
+	u32 bits_per_block = sb->s_blocksize * 8;
+	u32 inodes_per_block = sb->s_blocksize / sbi->s_inode_size;
+
+	if (!tsb->s_inodes_count) {
+		sbi->s_ibitmap_blkid = TEST_FS_BLKID_IBITMAP;
+		sbi->s_ibitmap_blknr = 1;
+		sbi->s_dbitmap_blkid = TEST_FS_BLKID_DBITMAP;
+		sbi->s_blocks_per_group = bits_per_block;
+		sbi->s_itable_blkid = TEST_FS_BLKID_ITABLE;
+		sbi->s_data_blknr = min(sbi->s_data_blknr, bits_per_block);
+		sbi->s_inodes_count = min_t(u32, TEST_FS_BLOCK_SIZE,
+				sbi->inode_table_blknr * inodes_per_block);
+	} else {
+		sbi->s_inodes_count = le32_to_cpu(tsb->s_inodes_count);
+		sbi->s_ibitmap_blkid = le32_to_cpu(tsb->s_ibitmap_blkid);
+		sbi->s_ibitmap_blknr = le32_to_cpu(tsb->s_ibitmap_blknr);
+		sbi->s_dbitmap_blkid = le32_to_cpu(tsb->s_dbitmap_blkid);
+		sbi->s_blocks_per_group = le32_to_cpu(tsb->s_blocks_per_group);
+		sbi->s_itable_blkid = le32_to_cpu(tsb->s_inode_table_blkid);
+	}
+
+	if (!sbi->s_blocks_per_group ||
+	    sbi->s_blocks_per_group > bits_per_block) {
+		log_err("wrong blocks per group %u\n", sbi->s_blocks_per_group);
+		return -EINVAL;
+	}
+	sbi->s_groups_count = DIV_ROUND_UP(sbi->s_data_blknr,
+					   sbi->s_blocks_per_group);
+
+	if ((u64)sbi->s_ibitmap_blknr * bits_per_block < sbi->s_inodes_count ||
+	    (u64)sbi->inode_table_blknr * inodes_per_block <
+							sbi->s_inodes_count) {
+		log_err("%u inodes do not fit the inode bitmap or table\n",
+			sbi->s_inodes_count);
+		return -EINVAL;
+	}
+
+	if (!sbi->s_data_blknr || !sbi->s_inodes_count) {
+		log_err("no data blocks or no inodes\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void testfs_close_devs(struct testfs_sb_info *sbi)
+{
+	u32 i;
+
+	for (i = 1; i < sbi->s_ndevs; i++) {
+		if (sbi->s_devs[i].bdev)
+			blkdev_put(sbi->s_devs[i].bdev, sbi->s_dev_mode);
+		sbi->s_devs[i].bdev = NULL;
+	}
+}
+
+/* open the member at @path and put it at the place its label gives */
+static int testfs_open_member(struct super_block *sb, const char *path)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct test_super_block *tsb = sbi->s_tsb;
+	struct testfs_member_label *label;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	u32 index;
+	int ret;
+
+	bdev = blkdev_get_by_path(path, sbi->s_dev_mode, sbi);
+	if (IS_ERR(bdev)) {
+		log_err("failed to open member %s\n", path);
+		return PTR_ERR(bdev);
+	}
+
+	ret = set_blocksize(bdev, sb->s_blocksize);
+	if (ret) {
+		log_err("unsupported block size for %s\n", path);
+		goto put;
+	}
+
+	bh = __bread(bdev, 0, sb->s_blocksize);
+	if (!bh) {
+		log_err("failed to read the label of %s\n", path);
+		ret = -EIO;
+		goto put;
+	}
+
+	ret = -EINVAL;
+	label = (struct testfs_member_label *)bh->b_data;
+	index = le16_to_cpu(label->m_index);
+	if (le16_to_cpu(label->m_magic) != TEST_FS_MAGIC ||
+	    memcmp(label->m_fs_uuid, tsb->s_uuid, sizeof(tsb->s_uuid)) ||
+	    !index || index >= sbi->s_ndevs ||
+	    memcmp(label->m_uuid, tsb->s_devs[index].d_uuid,
+		   sizeof(label->m_uuid))) {
+		log_err("%s is no member of this volume\n", path);
+		goto release;
+	}
+	if (sbi->s_devs[index].bdev) {
+		log_err("member %u given twice\n", index);
+		goto release;
+	}
+	if ((bdev->bd_inode->i_size >> sb->s_blocksize_bits) <
+	    TESTFS_MEMBER_DATA_BLKID + (u64)sbi->s_devs[index].nr) {
+		log_err("member %u is smaller than its data\n", index);
+		goto release;
+	}
+
+	sbi->s_devs[index].bdev = bdev;
+	ret = 0;
+release:
+	brelse(bh);
+	if (!ret)
+		return 0;
+put:
+	blkdev_put(bdev, sbi->s_dev_mode);
+	return ret;
+}
+
+/*
+ * Set up the devices of the data region. The members of a striped volume
+ * are given with one dev=<path> mount option each, in any order, and all
+ * of them must be there: which device a file is on is only known once its
+ * inode is read. With TESTFS_META_DEV the mounted device is a metadata
+ * device, it keeps the super block, bitmaps, inode table and directories
+ * and regular files only go to the members; bulk data then never queues
+ * in front of metadata I/O. compress=lz4|zstd, the algorithm compressed
+ * files are written with, is taken here as well.
+ */
+static int testfs_read_devs(struct super_block *sb, char *options)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct test_super_block *tsb = sbi->s_tsb;
+	u32 bpg = sbi->s_blocks_per_group;
+	char *paths[TESTFS_MAX_DEVS], *p;
+	u32 i, npaths = 0, first = sbi->s_data_blkid;
+	u64 sum = 0;
+	int ret;
+
+	sbi->s_compr_algo = TESTFS_COMPR_LZ4;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		if (!strncmp(p, "compress=", 9)) {
+			ret = testfs_compr_parse(sbi, p + 9);
+			if (ret)
+				return ret;
+			continue;
+		}
+		if (strncmp(p, "dev=", 4) || !p[4] ||
+		    npaths == ARRAY_SIZE(paths)) {
+			log_err("bad mount option %s\n", p);
+			return -EINVAL;
+		}
+		paths[npaths++] = p + 4;
+	}
+
+	sbi->s_ndevs = max_t(u32, le16_to_cpu(tsb->s_ndevs), 1);
+	sbi->s_stripe_blocks = le16_to_cpu(tsb->s_stripe_blocks);
+	if (le32_to_cpu(tsb->s_dev_flags) & TESTFS_META_DEV)
+		sbi->s_first_file_dev = 1;
+	sbi->s_dev_mode = FMODE_READ | FMODE_EXCL;
+	if (!sb_rdonly(sb))
+		sbi->s_dev_mode |= FMODE_WRITE;
+
+	if (sbi->s_ndevs == 1) {
+		if (sbi->s_first_file_dev) {
+			log_err("metadata device without a data device\n");
+			return -EINVAL;
+		}
+		if (npaths) {
+			log_err("dev= given for a volume of one device\n");
+			return -EINVAL;
+		}
+		sbi->s_devs[0] = (struct testfs_dev) {
+			.bdev	= sb->s_bdev,
+			.first	= first,
+			.nr	= sbi->s_data_blknr,
+			.start	= first,
+			.ngroups = sbi->s_groups_count,
+		};
+		return 0;
+	}
+
+	if (sbi->s_ndevs > TESTFS_MAX_DEVS || !sbi->s_stripe_blocks) {
+		log_err("bad device table, %u devices\n", sbi->s_ndevs);
+		return -EINVAL;
+	}
+
+	/* the first device has the metadata too, one numbering for both */
+	for (i = 0; i < sbi->s_ndevs; i++) {
+		struct testfs_dev *dev = &sbi->s_devs[i];
+
+		dev->nr = le32_to_cpu(tsb->s_devs[i].d_data_blknr);
+		sum += dev->nr;
+		if (!dev->nr || sum > sbi->s_data_blknr ||
+		    (i < sbi->s_ndevs - 1 && dev->nr % bpg)) {
+			log_err("bad size of device %u, %u blocks\n", i,
+				dev->nr);
+			return -EINVAL;
+		}
+		dev->first = first;
+		dev->start = i ? TESTFS_MEMBER_DATA_BLKID : first;
+		dev->first_group = (first - sbi->s_data_blkid) / bpg;
+		dev->ngroups = DIV_ROUND_UP(dev->nr, bpg);
+		first += dev->nr;
+	}
+	if (sum != sbi->s_data_blknr) {
+		log_err("devices hold %llu of %u data blocks\n", sum,
+			sbi->s_data_blknr);
+		return -EINVAL;
+	}
+	sbi->s_devs[0].bdev = sb->s_bdev;
+
+	for (i = 0; i < npaths; i++) {
+		ret = testfs_open_member(sb, paths[i]);
+		if (ret)
+			goto close;
+	}
+	for (i = 1; i < sbi->s_ndevs; i++) {
+		if (!sbi->s_devs[i].bdev) {
+			log_err("member %u missing, give it with dev=\n", i);
+			ret = -ENODEV;
+			goto close;
+		}
+	}
+
+	return 0;
+
+close:
+	testfs_close_devs(sbi);
+	return ret;
+}
+
+/*
+ * The free counters on disk are trusted if the volume was unmounted
+ * cleanly, otherwise they are rebuilt from the bitmaps. TESTFS_VALID_FS is
+ * cleared while the volume is mounted read-write.
+ */
+static int testfs_init_counters(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct test_super_block *tsb = sbi->s_tsb;
+	u32 free_blocks, free_inodes;
+	int ret;
+
+	/* a packed image is never written, its counts always hold */
+	if ((le16_to_cpu(tsb->s_state) & TESTFS_VALID_FS) ||
+	    (sbi->s_ro_flags & TESTFS_RO_PACKED)) {
+		free_blocks = le32_to_cpu(tsb->s_free_blocks_count);
+		free_inodes = le32_to_cpu(tsb->s_free_inodes_count);
+	} else {
+		log_err("not cleanly unmounted, counting free blocks\n");
+		ret = testfs_count_free_blocks(sb, &free_blocks);
+		if (ret)
+			return ret;
+		ret = testfs_count_free_inodes(sb, &free_inodes);
+		if (ret)
+			return ret;
+	}
+
+	ret = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks,
+				  GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	ret = percpu_counter_init(&sbi->s_freeinodes_counter, free_inodes,
+				  GFP_KERNEL);
+	if (ret) {
+		percpu_counter_destroy(&sbi->s_freeblocks_counter);
+		return ret;
+	}
+
+	if (!sb_rdonly(sb))
+		testfs_sync_super(sb, 0, 1);
+
+	return 0;
+}
+
 static void testfs_put_super(struct super_block *sb)
 {
 	struct testfs_sb_info *sbi = (struct testfs_sb_info *)sb->s_fs_info;
 
 	log_err("\n");
 
+	if (sbi->s_snap_of) {
+		testfs_snap_put_super(sb);
+		return;
+	}
+
+	cancel_delayed_work_sync(&sbi->s_itable_work);
+	cancel_delayed_work_sync(&sbi->s_snap_drop_work);
+	if (!sb_rdonly(sb))
+		testfs_sync_super(sb, TESTFS_VALID_FS, 1);
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	kvfree(sbi->s_snap_copied);
+	testfs_close_devs(sbi);
+
 	brelse(sbi->s_sb_bh);
 	kfree(sb->s_fs_info);
 	sb->s_fs_info = NULL;
 }
 
+/* a volume with read-only features stays read-only */
+static int testfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+
+	if (sbi->s_ro_flags && !(*flags & SB_RDONLY)) {
+		log_err("read-only features %x, can not remount read-write\n",
+			sbi->s_ro_flags);
+		return -EROFS;
+	}
+
+	/* a snapshot is read-only for good and has no background work */
+	if (sbi->s_snap_of)
+		return (*flags & SB_RDONLY) ? 0 : -EROFS;
+	if (!(*flags & SB_RDONLY) == !sb_rdonly(sb))
+		return 0;
+
+	/*
+	 * the background work writes, it stops with the read-only remount;
+	 * the counters are then as valid on disk as after an unmount
+	 */
+	if (*flags & SB_RDONLY) {
+		cancel_delayed_work_sync(&sbi->s_itable_work);
+		cancel_delayed_work_sync(&sbi->s_snap_drop_work);
+		testfs_sync_super(sb, TESTFS_VALID_FS, 1);
+		return 0;
+	}
+
+	/* and no longer once it is written to, as at mount */
+	testfs_sync_super(sb, 0, 1);
+	if (sbi->s_itable_zeroed < sbi->inode_table_blknr)
+		queue_delayed_work(system_long_wq, &sbi->s_itable_work, HZ);
+	if (sbi->s_snap_state == TESTFS_SNAP_DROPPING)
+		queue_delayed_work(system_long_wq, &sbi->s_snap_drop_work, HZ);
+	return 0;
+}
+
 struct super_operations testfs_sops = {
 	.free_inode = testfs_free_inode,
 	.alloc_inode = testfs_alloc_inode,
 	.write_inode = testfs_write_inode,
 	.evict_inode = testfs_evict_inode,
 	.put_super = testfs_put_super,
+	.sync_fs = testfs_sync_fs,
+	.statfs = testfs_statfs,
+	.remount_fs = testfs_remount_fs,
 };
 
+/*
+ * NFS file handles are the inode number and generation. A handle of an
+ * inode freed since, or freed and used again, is stale.
+ */
+static struct inode *testfs_nfs_get_inode(struct super_block *sb, u64 ino,
+					  u32 generation)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct inode *inode;
+	int ret;
+
+	if (ino >= sbi->s_inodes_count)
+		return ERR_PTR(-ESTALE);
+
+	ret = testfs_inode_in_use(sb, ino);
+	if (ret <= 0)
+		return ERR_PTR(ret ? ret : -ESTALE);
+
+	inode = testfs_iget(sb, ino);
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
+
+	if (!inode->i_nlink ||
+	    (generation && inode->i_generation != generation)) {
+		iput(inode);
+		return ERR_PTR(-ESTALE);
+	}
+
+	return inode;
+}
+
+static struct dentry *testfs_fh_to_dentry(struct super_block *sb,
+				struct fid *fid, int fh_len, int fh_type)
+{
+	return generic_fh_to_dentry(sb, fid, fh_len, fh_type,
+				    testfs_nfs_get_inode);
+}
+
+static struct dentry *testfs_fh_to_parent(struct super_block *sb,
+				struct fid *fid, int fh_len, int fh_type)
+{
+	return generic_fh_to_parent(sb, fid, fh_len, fh_type,
+				    testfs_nfs_get_inode);
+}
+
+static const struct export_operations testfs_export_ops = {
+	.fh_to_dentry = testfs_fh_to_dentry,
+	.fh_to_parent = testfs_fh_to_parent,
+	.get_parent = testfs_get_parent,
+};
+
+/*
+ * Untorn writes the device can not do in place go out of place, see
+ * testfs_map_atomic(), so they do not depend on its limits: they run from
+ * one block to the largest power of two run a file can map.
+ */
+static void testfs_init_atomic_writes(struct super_block *sb,
+				struct testfs_sb_info *sbi)
+{
+	sbi->s_awu_min = sb->s_blocksize;
+	sbi->s_awu_max = rounddown_pow_of_two(TEST_FS_N_BLOCKS) <<
+			 sb->s_blocksize_bits;
+}
+
+/*
+ * Packed images have the inode table in front of the data region, read
+ * ahead under one plug it goes down as a few large reads instead of one
+ * per iget() as the tree is walked.
+ */
+static void testfs_prefetch_itable(struct super_block *sb)
+{
+	struct testfs_sb_info *sbi = sb->s_fs_info;
+	struct blk_plug plug;
+	u32 i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < sbi->inode_table_blknr; i++)
+		sb_breadahead(sb, sbi->s_itable_blkid + i);
+	blk_finish_plug(&plug);
+}
+
 int testfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	int ret, block_size, inode_size, total_blknr;
+	u32 need_blknr;
 	struct testfs_sb_info *sbi;
 	struct inode *root;
 	struct buffer_head * bh;
@@ -100,12 +593,38 @@ int testfs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
 	if (!sbi)
 		return -ENOMEM;
+	sbi->s_sb = sb;
+	sb->s_fs_info = sbi;
+	ret = -EINVAL;
 
-	/* set block size for superblock */
-	block_size = sb_min_blocksize(sb, TEST_FS_BLOCK_SIZE);
+	/*
+	 * The super block is at offset 0 whatever the block size, read it
+	 * with the smallest one and switch to the block size it records.
+	 */
+	block_size = sb_min_blocksize(sb, TEST_FS_MIN_BLOCK_SIZE);
 	if (!block_size) {
 		log_err("failed to set block size (%d) for super block\n",
-				TEST_FS_BLOCK_SIZE);
+				TEST_FS_MIN_BLOCK_SIZE);
+		goto free_sbi;
+	}
+
+	bh = sb_bread(sb, TEST_FS_BLKID_SB);
+	if (!bh) {
+		log_err("failed to read superblock from disk\n");
+		goto free_sbi;
+	}
+	tsb = (struct test_super_block *)bh->b_data;
+	if (le16_to_cpu(tsb->s_magic) != TEST_FS_MAGIC) {
+		log_err("Wrong magic number %x != %x\n",
+				le16_to_cpu(tsb->s_magic), TEST_FS_MAGIC);
+		brelse(bh);
+		goto free_sbi;
+	}
+	block_size = le32_to_cpu(tsb->s_block_size);
+	brelse(bh);
+
+	if (block_size != sb->s_blocksize && !sb_set_blocksize(sb, block_size)) {
+		log_err("unsupported block size %d\n", block_size);
 		goto free_sbi;
 	}
 	sbi->s_block_size = block_size;
@@ -158,9 +677,13 @@ int testfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	/* verify filesystem size and block device size */
 	total_blknr = sb->s_bdev->bd_inode->i_size >> sb->s_blocksize_bits;
-	if (total_blknr < tsb->s_total_blknr) {
-		log_err("filesystem size (%d) > disk size(%d), please re-format\n",
-			tsb->s_total_blknr, total_blknr);
+	need_blknr = le32_to_cpu(tsb->s_total_blknr);
+	if (le16_to_cpu(tsb->s_ndevs) > 1)
+		need_blknr = le32_to_cpu(tsb->s_data_blkid) +
+			     le32_to_cpu(tsb->s_devs[0].d_data_blknr);
+	if (total_blknr < need_blknr) {
+		log_err("filesystem size (%u) > disk size(%d), please re-format\n",
+			need_blknr, total_blknr);
 		goto free_bh;
 	}
 
@@ -169,19 +692,73 @@ int testfs_fill_super(struct super_block *sb, void *data, int silent)
 	get_random_bytes(&sbi->s_inode_gen, sizeof(u32));
 	sbi->s_data_blkid = le32_to_cpu(tsb->s_data_blkid);
 
+	sbi->s_data_blknr = le32_to_cpu(tsb->s_data_blknr);
+	sbi->inode_table_blknr = le32_to_cpu(tsb->s_inode_table_blknr);
+	spin_lock_init(&sbi->s_balloc_lock);
+
+	ret = testfs_read_geometry(sb);
+	if (ret)
+		goto free_bh;
+
+	sbi->s_ro_flags = le32_to_cpu(tsb->s_ro_flags);
+	if (sbi->s_ro_flags && !sb_rdonly(sb)) {
+		log_err("read-only features %x, mount read-only\n",
+			sbi->s_ro_flags);
+		ret = -EROFS;
+		goto free_bh;
+	}
+	if (sbi->s_ro_flags & TESTFS_RO_PACKED)
+		testfs_prefetch_itable(sb);
+
+	ret = testfs_read_devs(sb, data);
+	if (ret)
+		goto free_bh;
+
+	spin_lock_init(&sbi->s_ialloc_lock);
+	sbi->s_itable_zeroed = min_t(u32, le32_to_cpu(tsb->s_itable_zeroed),
+					sbi->inode_table_blknr);
+	sbi->s_itable_busy = U32_MAX;
+	INIT_DELAYED_WORK(&sbi->s_itable_work, testfs_itable_zero_work);
+
+	/* older volumes have no refcount table and can not share blocks */
+	sbi->s_refcount_blkid = le32_to_cpu(tsb->s_refcount_blkid);
+	sbi->s_refcount_blknr = le32_to_cpu(tsb->s_refcount_blknr);
+	if (sbi->s_refcount_blknr &&
+	    sbi->s_refcount_blknr * (block_size / sizeof(__le16)) <
+							sbi->s_data_blknr) {
+		log_err("refcount table too small, block sharing disabled\n");
+		sbi->s_refcount_blknr = 0;
+	}
+
+	ret = testfs_snap_init(sb);
+	if (ret)
+		goto close_devs;
+
+	testfs_init_atomic_writes(sb, sbi);
+
 	ret = -ENOMEM;
 
 	sb->s_magic = TEST_FS_MAGIC;
-	sb->s_fs_info = sbi;
 	sb->s_op = &testfs_sops;
+	sb->s_export_op = &testfs_export_ops;
+
+	/* on-disk timestamps: signed 32-bit seconds plus nanoseconds */
+	sb->s_time_gran = 1;
+	sb->s_time_min = S32_MIN;
+	sb->s_time_max = S32_MAX;
 
 	/* copy uuid */
 	memcpy(&sb->s_uuid, tsb->s_uuid, sizeof(sb->s_uuid));
 
+	ret = testfs_init_counters(sb);
+	if (ret)
+		goto free_snap;
+	ret = -ENOMEM;
+
 	root = testfs_iget(sb, TESTFS_ROOT_INO);
 	if (IS_ERR(root)) {
 		ret = PTR_ERR(root);
-		goto free_sbi;
+		goto free_counters;
 	}
 
 	if (!S_ISDIR(root->i_mode)) {
@@ -195,13 +772,29 @@ int testfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto free_inode;
 	}
 
+	/* zero the rest of the inode table behind the users' back */
+	if (!sb_rdonly(sb) && sbi->s_itable_zeroed < sbi->inode_table_blknr)
+		queue_delayed_work(system_long_wq, &sbi->s_itable_work, HZ);
+
+	/* and finish dropping a snapshot */
+	if (!sb_rdonly(sb) && sbi->s_snap_state == TESTFS_SNAP_DROPPING)
+		queue_delayed_work(system_long_wq, &sbi->s_snap_drop_work, HZ);
+
 	return 0;
 
 free_inode:
 	iput(root);
+free_counters:
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+free_snap:
+	kvfree(sbi->s_snap_copied);
+close_devs:
+	testfs_close_devs(sbi);
 free_bh:
 	brelse(sbi->s_sb_bh);
 free_sbi:
+	sb->s_fs_info = NULL;
 	kfree(sbi);
 	return ret;
 }
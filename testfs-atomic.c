@@ -0,0 +1,99 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-atomic - show or change whether direct writes to a file are untorn
+ *
+ *	testfs-atomic [on|off] <file>
+ *
+ * Without on or off the state and the write unit limits are printed. With
+ * it on, an O_DIRECT write to the file of one power of two unit within the
+ * limits, at an offset aligned to its length, is found either whole or not
+ * at all after a crash.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <linux/types.h>
+#include <sys/ioctl.h>
+
+/* ioctls, see testfs.h */
+struct testfs_atomic_info {
+	__u32 enabled;
+	__u32 unit_min;
+	__u32 unit_max;
+};
+#define TESTFS_IOC_GET_ATOMIC	_IOR('f', 0x83, struct testfs_atomic_info)
+#define TESTFS_IOC_SET_ATOMIC	_IOW('f', 0x84, __u32)
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-atomic [on|off] <file>\n"
+			"\ton   direct writes to the file are untorn\n"
+			"\toff  direct writes may be torn, as on other files\n");
+
+	_exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct testfs_atomic_info info;
+	const char *path = argv[argc - 1];
+	__u32 enable = 0;
+	int fd;
+
+	if (argc == 3 && !strcmp(argv[1], "on"))
+		enable = 1;
+	else if (argc != 2 && (argc != 3 || strcmp(argv[1], "off")))
+		usage();
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", path,
+			strerror(errno));
+		return 1;
+	}
+
+	if (argc == 3) {
+		if (ioctl(fd, TESTFS_IOC_SET_ATOMIC, &enable)) {
+			fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+			close(fd);
+			return 1;
+		}
+		close(fd);
+		return 0;
+	}
+
+	if (ioctl(fd, TESTFS_IOC_GET_ATOMIC, &info)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	printf("%s: untorn direct writes %s, %u to %u bytes\n", path,
+	       info.enabled ? "on" : "off", info.unit_min, info.unit_max);
+
+	close(fd);
+	return 0;
+}
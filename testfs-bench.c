@@ -0,0 +1,372 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-bench - microbenchmarks of the allocator, directory and block map
+ * code through libtestfs, on a scratch image
+ *
+ *	testfs-bench [-n rounds] [-H] <alloc|dir|map|churn> <image>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libtestfs.h"
+
+static unsigned long g_rounds;		/* 0: the benchmark's default */
+static bool g_hints;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-bench [-n rounds] [-H] <alloc|dir|map|churn> <image>\n"
+			"\talloc  allocate and free runs of 1-16 blocks\n"
+			"\tdir    look up names in a full directory\n"
+			"\tmap    map the blocks of a fragmented file\n"
+			"\tchurn  short and long lived files written side by side,\n"
+			"\t       report free space fragmentation; -H sets write\n"
+			"\t       lifetime hints on them\n"
+			"the image is modified, use a scratch copy\n");
+
+	_exit(1);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *what, unsigned long ops, double start)
+{
+	double ns = now_ns() - start;
+
+	printf("%-8s %10lu ops %10.1f ns/op\n", what, ops, ns / ops);
+}
+
+/* allocate runs the way writeback does, goal behind the previous run */
+static int bench_alloc(struct tfs *fs)
+{
+	uint32_t blkid[TEST_FS_N_BLOCKS], count[TEST_FS_N_BLOCKS], goal = 0;
+	unsigned long i, ops = 0;
+	double start;
+	int j, ret;
+
+	srand(1);
+	start = now_ns();
+	for (i = 0; i < g_rounds; i++) {
+		for (j = 0; j < TEST_FS_N_BLOCKS; j++) {
+			count[j] = 1 + rand() % TEST_FS_N_BLOCKS;
+			ret = tfs_new_blocks(fs, goal, &count[j], &blkid[j]);
+			if (ret)
+				return ret;
+			goal = blkid[j] + count[j];
+			ops++;
+		}
+		for (j = 0; j < TEST_FS_N_BLOCKS; j++)
+			tfs_free_blocks(fs, blkid[j], count[j]);
+	}
+	report("alloc", ops, start);
+	return 0;
+}
+
+/* fill a directory, then look up names spread over it */
+static int bench_dir(struct tfs *fs)
+{
+	uint32_t dir_ino, ino, nr, i;
+	struct tfs_inode dir, ti;
+	char name[32];
+	double start;
+	int ret;
+
+	ret = tfs_create(fs, TESTFS_ROOT_INO, "bench-dir", S_IFDIR | 0755, 0, 0,
+			 &dir);
+	if (ret)
+		return ret;
+	dir_ino = dir.ino;
+
+	nr = fs->block_size * TEST_FS_N_BLOCKS / TEST_FS_DENTRY_SIZE - 2;
+	if (nr > fs->free_inodes)
+		nr = fs->free_inodes;
+	start = now_ns();
+	for (i = 0; i < nr; i++) {
+		snprintf(name, sizeof(name), "file-%u", i);
+		ret = tfs_create(fs, dir_ino, name, S_IFREG | 0644, 0, 0, &ti);
+		if (ret)
+			return ret;
+	}
+	report("create", nr, start);
+
+	ret = tfs_read_inode(fs, dir_ino, &dir);
+	if (ret)
+		return ret;
+	start = now_ns();
+	for (i = 0; i < g_rounds; i++) {
+		snprintf(name, sizeof(name), "file-%u", (i * 7919) % nr);
+		ret = tfs_dir_lookup(fs, &dir, name, &ino);
+		if (ret)
+			return ret;
+	}
+	report("lookup", g_rounds, start);
+	return 0;
+}
+
+/* a file of single block extents, the worst case of the extent lookup */
+static int bench_map(struct tfs *fs)
+{
+	uint32_t i, bno, pad, padno[TEST_FS_N_BLOCKS] = { 0 };
+	struct tfs_inode ti;
+	unsigned long n, ops = 0;
+	char *buf;
+	double start;
+	bool new;
+	int ret;
+
+	ret = tfs_create(fs, TESTFS_ROOT_INO, "bench-map", S_IFREG | 0644, 0, 0,
+			 &ti);
+	if (ret)
+		return ret;
+
+	buf = calloc(1, fs->block_size);
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+		ret = tfs_write(fs, &ti, buf, fs->block_size,
+				(off_t)i * fs->block_size);
+		if (ret < 0)
+			break;
+		/* a block taken between two of the file */
+		pad = 1;
+		tfs_new_blocks(fs, le32toh(ti.d.i_block[i]) + 1, &pad,
+			       &padno[i]);
+	}
+	free(buf);
+	if (ret < 0)
+		goto out;
+
+	start = now_ns();
+	for (n = 0; n < g_rounds; n++) {
+		for (i = 0; i < TEST_FS_N_BLOCKS; i += ret) {
+			ret = tfs_map_blocks(fs, &ti, i, TEST_FS_N_BLOCKS - i,
+					     &bno, &new, false);
+			if (ret <= 0) {
+				ret = ret ? ret : -EIO;
+				goto out;
+			}
+			ops++;
+		}
+	}
+	report("map", ops, start);
+	ret = 0;
+out:
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++)
+		if (padno[i])
+			tfs_free_blocks(fs, padno[i], 1);
+	return ret;
+}
+
+/* free runs in the data bitmaps; runs never cross a group */
+static void report_free(struct tfs *fs, unsigned long round)
+{
+	uint32_t group, bit, nbits, run, runs = 0, largest = 0, free = 0;
+	uint32_t in_long = 0;
+	const uint8_t *bitmap;
+
+	for (group = 0; group < fs->groups_count; group++) {
+		bitmap = fs->dbitmap + (size_t)group * fs->block_size;
+		nbits = fs->data_blknr - group * fs->blocks_per_group;
+		if (nbits > fs->blocks_per_group)
+			nbits = fs->blocks_per_group;
+		for (bit = 0, run = 0; bit <= nbits; bit++) {
+			if (bit < nbits && !(bitmap[bit >> 3] & (1 << (bit & 7)))) {
+				run++;
+				continue;
+			}
+			if (!run)
+				continue;
+			runs++;
+			free += run;
+			if (run > largest)
+				largest = run;
+			if (run >= TEST_FS_N_BLOCKS)
+				in_long += run;
+			run = 0;
+		}
+	}
+
+	printf("%8lu %10u %8u %10.1f %10u %9.1f%%\n", round, free, runs,
+	       runs ? (double)free / runs : 0.0, largest,
+	       free ? 100.0 * in_long / free : 0.0);
+}
+
+static int churn_file(struct tfs *fs, const char *name, bool short_lived,
+		      struct tfs_inode *ti)
+{
+	int ret;
+
+	ret = tfs_create(fs, TESTFS_ROOT_INO, name, S_IFREG | 0644, 0, 0, ti);
+	if (ret)
+		return ret;
+	if (g_hints)
+		ti->d.i_write_hint = short_lived ? RWH_WRITE_LIFE_SHORT :
+						   RWH_WRITE_LIFE_LONG;
+	return 0;
+}
+
+/*
+ * Each round writes a few short lived files block by block in between
+ * long lived ones, as concurrent writers would, then deletes the short
+ * ones. The oldest long lived files go once the image is three quarters
+ * full. Without streams the two kinds interleave and every delete leaves
+ * holes; with -H they come from separate regions.
+ */
+#define CHURN_SHORT	4
+#define CHURN_LONG	2
+#define CHURN_KEEP	256
+
+static int bench_churn(struct tfs *fs)
+{
+	struct tfs_inode files[CHURN_SHORT + CHURN_LONG];
+	uint32_t blocks[CHURN_SHORT + CHURN_LONG], b;
+	unsigned long round, oldest = 0, every = g_rounds / 10;
+	char name[32], *buf;
+	int i, ret = 0;
+
+	buf = calloc(1, fs->block_size);
+	if (!buf)
+		return -ENOMEM;
+
+	printf("%8s %10s %8s %10s %10s %10s\n", "round", "free", "runs",
+	       "avg run", "largest", ">=16 blks");
+	report_free(fs, 0);
+	srand(1);
+	for (round = 0; round < g_rounds; round++) {
+		while (round - oldest >= CHURN_KEEP ||
+		       (round > oldest &&
+			fs->free_blocks < fs->data_blknr / 4)) {
+			for (i = 0; i < CHURN_LONG; i++) {
+				snprintf(name, sizeof(name), "churn-l-%lu-%d",
+					 oldest, i);
+				ret = tfs_unlink(fs, TESTFS_ROOT_INO, name);
+				if (ret)
+					goto out;
+			}
+			oldest++;
+		}
+
+		for (i = 0; i < CHURN_SHORT + CHURN_LONG; i++) {
+			snprintf(name, sizeof(name), "churn-%c-%lu-%d",
+				 i < CHURN_SHORT ? 's' : 'l', round,
+				 i < CHURN_SHORT ? i : i - CHURN_SHORT);
+			ret = churn_file(fs, name, i < CHURN_SHORT, &files[i]);
+			if (ret)
+				goto out;
+			blocks[i] = 1 + rand() % TEST_FS_N_BLOCKS;
+		}
+
+		for (b = 0; b < TEST_FS_N_BLOCKS; b++) {
+			for (i = 0; i < CHURN_SHORT + CHURN_LONG; i++) {
+				if (b >= blocks[i])
+					continue;
+				ret = tfs_write(fs, &files[i], buf,
+						fs->block_size,
+						(off_t)b * fs->block_size);
+				if (ret < 0)
+					goto out;
+			}
+		}
+
+		for (i = 0; i < CHURN_SHORT; i++) {
+			snprintf(name, sizeof(name), "churn-s-%lu-%d", round,
+				 i);
+			ret = tfs_unlink(fs, TESTFS_ROOT_INO, name);
+			if (ret)
+				goto out;
+		}
+
+		if (every && (round + 1) % every == 0)
+			report_free(fs, round + 1);
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct tfs *fs;
+	char *end;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "n:H")) != -1) {
+		switch (opt) {
+		case 'n':
+			g_rounds = strtoul(optarg, &end, 0);
+			if (*end || !g_rounds)
+				usage();
+			break;
+		case 'H':
+			g_hints = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 2)
+		usage();
+
+	ret = tfs_open(argv[optind + 1], false, &fs);
+	if (ret) {
+		fprintf(stderr, "failed to open %s: %s\n", argv[optind + 1],
+			strerror(-ret));
+		return 1;
+	}
+
+	if (!g_rounds)
+		g_rounds = strcmp(argv[optind], "churn") ? 100000 : 1000;
+
+	if (!strcmp(argv[optind], "alloc"))
+		ret = bench_alloc(fs);
+	else if (!strcmp(argv[optind], "dir"))
+		ret = bench_dir(fs);
+	else if (!strcmp(argv[optind], "map"))
+		ret = bench_map(fs);
+	else if (!strcmp(argv[optind], "churn"))
+		ret = bench_churn(fs);
+	else
+		usage();
+
+	if (ret)
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+	if (tfs_close(fs))
+		ret = -EIO;
+	return ret ? 1 : 0;
+}
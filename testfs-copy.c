@@ -0,0 +1,261 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-copy - copy a file with read/write, sendfile, splice and
+ * copy_file_range and compare them
+ *
+ *	testfs-copy [-b buffer size] [-n rounds] [-m method] <src> <dst>
+ *
+ * Each round truncates the destination, copies the whole source and
+ * fsyncs the destination, the copy is only done once its data is on
+ * disk. Throughput and the CPU time spent per GiB copied are reported
+ * per method. copy_file_range between two files of one testfs copies
+ * block aligned ranges disk to disk, without the page cache.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+static size_t g_bs = 1 << 16;
+static unsigned long g_rounds = 10;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-copy [-b buffer size] [-n rounds] [-m method] <src> <dst>\n"
+			"\t-b  read/write buffer and splice chunk size, default 65536\n"
+			"\t-n  copies per method, default 10\n"
+			"\t-m  only one of rw, sendfile, splice, copy\n"
+			"the destination is overwritten\n");
+
+	_exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static ssize_t copy_rw(int in, int out, size_t len)
+{
+	static char *buf;
+	size_t done = 0;
+	ssize_t n, w;
+
+	if (!buf && !(buf = malloc(g_bs)))
+		return -ENOMEM;
+
+	while (done < len) {
+		n = read(in, buf, g_bs);
+		if (n <= 0)
+			return n ? -errno : (ssize_t)done;
+		for (w = 0; w < n; ) {
+			ssize_t ret = write(out, buf + w, n - w);
+
+			if (ret < 0)
+				return -errno;
+			w += ret;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t copy_sendfile(int in, int out, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = sendfile(out, in, NULL, len - done);
+		if (n <= 0)
+			return n ? -errno : (ssize_t)done;
+		done += n;
+	}
+	return done;
+}
+
+/* file to pipe to file, the pages are moved rather than copied */
+static ssize_t copy_splice(int in, int out, size_t len)
+{
+	static int pfd[2] = { -1, -1 };
+	size_t done = 0;
+	ssize_t n, w;
+
+	if (pfd[0] < 0 && pipe(pfd))
+		return -errno;
+
+	while (done < len) {
+		n = splice(in, NULL, pfd[1], NULL, g_bs, SPLICE_F_MOVE);
+		if (n <= 0)
+			return n ? -errno : (ssize_t)done;
+		for (w = 0; w < n; ) {
+			ssize_t ret = splice(pfd[0], NULL, out, NULL, n - w,
+					     SPLICE_F_MOVE);
+
+			if (ret <= 0)
+				return ret ? -errno : -EIO;
+			w += ret;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static ssize_t copy_cfr(int in, int out, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = copy_file_range(in, NULL, out, NULL, len - done, 0);
+		if (n <= 0)
+			return n ? -errno : (ssize_t)done;
+		done += n;
+	}
+	return done;
+}
+
+static const struct method {
+	const char *name;
+	ssize_t (*copy)(int in, int out, size_t len);
+} methods[] = {
+	{ "rw",		copy_rw },
+	{ "sendfile",	copy_sendfile },
+	{ "splice",	copy_splice },
+	{ "copy",	copy_cfr },
+};
+
+static int run(const struct method *m, int in, int out, size_t len)
+{
+	uint64_t t0, c0, secs_ns, cpu;
+	unsigned long i;
+	ssize_t ret;
+
+	t0 = now_ns();
+	c0 = cpu_ns();
+	for (i = 0; i < g_rounds; i++) {
+		if (ftruncate(out, 0) || lseek(in, 0, SEEK_SET) ||
+		    lseek(out, 0, SEEK_SET))
+			return -errno;
+		ret = m->copy(in, out, len);
+		if (ret < 0)
+			return ret;
+		if ((size_t)ret != len)
+			return -EIO;
+		if (fsync(out))
+			return -errno;
+	}
+	secs_ns = now_ns() - t0;
+	cpu = cpu_ns() - c0;
+
+	printf("%-8s %10.1f MiB/s %12.1f ms cpu/GiB\n", m->name,
+	       (double)len * g_rounds * 1e9 / secs_ns / (1 << 20),
+	       cpu / 1e6 / ((double)len * g_rounds / (1 << 30)));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+	struct stat st;
+	char *end;
+	unsigned int i;
+	int opt, in, out, ret;
+
+	while ((opt = getopt(argc, argv, "b:n:m:")) != -1) {
+		switch (opt) {
+		case 'b':
+			g_bs = strtoul(optarg, &end, 0);
+			if (*end || !g_bs)
+				usage();
+			break;
+		case 'n':
+			g_rounds = strtoul(optarg, &end, 0);
+			if (*end || !g_rounds)
+				usage();
+			break;
+		case 'm':
+			only = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 2)
+		usage();
+	for (i = 0; only && i < sizeof(methods) / sizeof(methods[0]); i++)
+		if (!strcmp(only, methods[i].name))
+			break;
+	if (i == sizeof(methods) / sizeof(methods[0]))
+		usage();
+
+	in = open(argv[optind], O_RDONLY);
+	if (in < 0 || fstat(in, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	out = open(argv[optind + 1], O_WRONLY | O_CREAT, 0644);
+	if (out < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	if (!st.st_size) {
+		fprintf(stderr, "%s: empty\n", argv[optind]);
+		return 1;
+	}
+
+	printf("%lld bytes, %lu rounds\n", (long long)st.st_size, g_rounds);
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (only && strcmp(only, methods[i].name))
+			continue;
+		ret = run(&methods[i], in, out, st.st_size);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", methods[i].name,
+				strerror(-ret));
+			return 1;
+		}
+	}
+	return 0;
+}
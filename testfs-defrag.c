@@ -0,0 +1,169 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+/* ioctl: move the blocks of a regular file into one contiguous run */
+#define TESTFS_IOC_DEFRAG	_IO('f', 0x80)
+
+struct defrag_stat {
+	unsigned long files;		/* regular files seen */
+	unsigned long fragmented;	/* files in more than one extent */
+	unsigned long defragged;	/* files the ioctl moved */
+	unsigned long failed;
+	unsigned long extents_before;
+	unsigned long extents_after;
+};
+
+static struct defrag_stat g_stat;
+static bool g_verbose;
+static bool g_dry_run;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-defrag [-n] [-v] <file or directory>...\n"
+			"\t-n  only report fragmentation, move nothing\n"
+			"\t-v  report every fragmented file\n");
+
+	_exit(1);
+}
+
+/* number of extents, counted by FIEMAP without fetching them */
+static int count_extents(int fd)
+{
+	struct fiemap fm;
+
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags = FIEMAP_FLAG_SYNC;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm))
+		return -errno;
+
+	return fm.fm_mapped_extents;
+}
+
+static int defrag_one(const char *path, const struct stat *st, int type,
+			struct FTW *ftw __attribute__((unused)))
+{
+	int fd, before, after;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	g_stat.files++;
+
+	fd = open(path, g_dry_run ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		g_stat.failed++;
+		return 0;
+	}
+
+	before = count_extents(fd);
+	if (before < 0) {
+		fprintf(stderr, "failed to map %s: %s\n", path, strerror(-before));
+		g_stat.failed++;
+		goto close;
+	}
+
+	after = before;
+	if (before > 1 && !g_dry_run) {
+		if (ioctl(fd, TESTFS_IOC_DEFRAG)) {
+			fprintf(stderr, "failed to defrag %s: %s\n", path,
+				strerror(errno));
+			g_stat.failed++;
+		} else {
+			after = count_extents(fd);
+			if (after < 0)
+				after = before;
+			g_stat.defragged++;
+		}
+	}
+
+	if (before > 1) {
+		g_stat.fragmented++;
+		if (g_verbose)
+			printf("%s: %d -> %d extents\n", path, before, after);
+	}
+
+	g_stat.extents_before += before;
+	g_stat.extents_after += after;
+close:
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "nv")) != -1) {
+		switch (opt) {
+		case 'n':
+			g_dry_run = true;
+			break;
+		case 'v':
+			g_verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind == argc)
+		usage();
+
+	for (i = optind; i < argc; i++) {
+		/* stay on the file system we were pointed at */
+		if (nftw(argv[i], defrag_one, 64, FTW_PHYS | FTW_MOUNT)) {
+			fprintf(stderr, "failed to walk %s: %s\n", argv[i],
+				strerror(errno));
+			return 1;
+		}
+	}
+
+	printf("files:       %lu\n", g_stat.files);
+	printf("fragmented:  %lu\n", g_stat.fragmented);
+	if (!g_dry_run)
+		printf("defragged:   %lu\n", g_stat.defragged);
+	printf("failed:      %lu\n", g_stat.failed);
+	printf("extents:     %lu -> %lu\n", g_stat.extents_before,
+		g_stat.extents_after);
+	if (g_stat.files)
+		printf("extents per file: %.2f -> %.2f\n",
+			(double)g_stat.extents_before / g_stat.files,
+			(double)g_stat.extents_after / g_stat.files);
+
+	return g_stat.failed ? 1 : 0;
+}
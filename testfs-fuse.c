@@ -0,0 +1,462 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-fuse - mount a testfs image without the kernel module
+ *
+ *	testfs-fuse disk.img /mnt [fuse options]
+ *
+ * Every operation goes to libtestfs under one lock, the image is synced on
+ * fsync and at unmount.
+ */
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "libtestfs.h"
+
+static struct tfs *g_fs;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* split @path in its parent directory, looked up, and the last name */
+static int lookup_parent(const char *path, uint32_t *dir, const char **name)
+{
+	char *parent, *slash;
+	int ret;
+
+	slash = strrchr(path, '/');
+	if (!slash || !slash[1])
+		return -EINVAL;
+	*name = slash + 1;
+
+	parent = strndup(path, slash - path);
+	if (!parent)
+		return -ENOMEM;
+	ret = tfs_lookup_path(g_fs, parent, dir);
+	free(parent);
+	return ret;
+}
+
+static int get_inode(const char *path, struct fuse_file_info *fi,
+		     struct tfs_inode *ti)
+{
+	uint32_t ino;
+	int ret;
+
+	if (fi)
+		return tfs_read_inode(g_fs, fi->fh, ti);
+
+	ret = tfs_lookup_path(g_fs, path, &ino);
+	return ret ? ret : tfs_read_inode(g_fs, ino, ti);
+}
+
+static void fill_stat(struct tfs_inode *ti, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ti->ino;
+	st->st_mode = le16toh(ti->d.i_mode);
+	st->st_nlink = le16toh(ti->d.i_links_count);
+	st->st_uid = le32toh(ti->d.i_uid);
+	st->st_gid = le32toh(ti->d.i_gid);
+	st->st_size = le32toh(ti->d.i_size);
+	st->st_blocks = le32toh(ti->d.i_blocks);
+	st->st_blksize = g_fs->block_size;
+	st->st_atim.tv_sec = (int32_t)le32toh(ti->d.i_atime);
+	st->st_atim.tv_nsec = le32toh(ti->d.i_atime_nsec);
+	st->st_mtim.tv_sec = (int32_t)le32toh(ti->d.i_mtime);
+	st->st_mtim.tv_nsec = le32toh(ti->d.i_mtime_nsec);
+	st->st_ctim.tv_sec = (int32_t)le32toh(ti->d.i_ctime);
+	st->st_ctim.tv_nsec = le32toh(ti->d.i_ctime_nsec);
+}
+
+static void *tfuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	/* inode numbers are stable, let stat show them */
+	cfg->use_ino = 1;
+	return NULL;
+}
+
+static void tfuse_destroy(void *private_data)
+{
+	if (tfs_close(g_fs))
+		fprintf(stderr, "testfs-fuse: failed to write back the image\n");
+}
+
+static int tfuse_getattr(const char *path, struct stat *st,
+			 struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = get_inode(path, fi, &ti);
+	if (!ret)
+		fill_stat(&ti, st);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+struct readdir_ctx {
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int tfuse_filldir(void *arg, const char *name, int len, uint32_t ino,
+			 int type)
+{
+	struct readdir_ctx *ctx = arg;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = type == TESTFS_FT_DIR ? S_IFDIR : S_IFREG;
+	return ctx->filler(ctx->buf, name, &st, 0, 0);
+}
+
+static int tfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	struct readdir_ctx ctx = { buf, filler };
+	struct tfs_inode dir;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = get_inode(path, NULL, &dir);
+	if (!ret && !S_ISDIR(le16toh(dir.d.i_mode)))
+		ret = -ENOTDIR;
+	if (!ret)
+		ret = tfs_dir_iterate(g_fs, &dir, tfuse_filldir, &ctx);
+	pthread_mutex_unlock(&g_lock);
+	/* the filler returns 1 when its buffer is full, that is no error */
+	return ret < 0 ? ret : 0;
+}
+
+static int tfuse_mknod_common(const char *path, mode_t mode,
+			      struct fuse_file_info *fi)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	struct tfs_inode ti;
+	const char *name;
+	uint32_t dir;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = lookup_parent(path, &dir, &name);
+	if (!ret)
+		ret = tfs_create(g_fs, dir, name, mode, ctx->uid, ctx->gid,
+				 &ti);
+	if (!ret && fi)
+		fi->fh = ti.ino;
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_create(const char *path, mode_t mode,
+			struct fuse_file_info *fi)
+{
+	return tfuse_mknod_common(path, S_IFREG | (mode & 07777), fi);
+}
+
+static int tfuse_mkdir(const char *path, mode_t mode)
+{
+	return tfuse_mknod_common(path, S_IFDIR | (mode & 07777), NULL);
+}
+
+static int tfuse_unlink(const char *path)
+{
+	const char *name;
+	uint32_t dir;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = lookup_parent(path, &dir, &name);
+	if (!ret)
+		ret = tfs_unlink(g_fs, dir, name);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_rmdir(const char *path)
+{
+	const char *name;
+	uint32_t dir;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = lookup_parent(path, &dir, &name);
+	if (!ret)
+		ret = tfs_rmdir(g_fs, dir, name);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_rename(const char *from, const char *to, unsigned int flags)
+{
+	const char *old_name, *new_name;
+	uint32_t old_dir, new_dir, ino;
+	int ret;
+
+	if (flags & ~RENAME_NOREPLACE)
+		return -EINVAL;
+
+	pthread_mutex_lock(&g_lock);
+	ret = lookup_parent(from, &old_dir, &old_name);
+	if (!ret)
+		ret = lookup_parent(to, &new_dir, &new_name);
+	if (!ret && (flags & RENAME_NOREPLACE) &&
+	    !tfs_lookup_path(g_fs, to, &ino))
+		ret = -EEXIST;
+	if (!ret)
+		ret = tfs_rename(g_fs, old_dir, old_name, new_dir, new_name);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_link(const char *from, const char *to)
+{
+	const char *name;
+	uint32_t ino, dir;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = tfs_lookup_path(g_fs, from, &ino);
+	if (!ret)
+		ret = lookup_parent(to, &dir, &name);
+	if (!ret)
+		ret = tfs_link(g_fs, ino, dir, name);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_chmod(const char *path, mode_t mode,
+		       struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = get_inode(path, fi, &ti);
+	if (!ret) {
+		ti.d.i_mode = htole16((le16toh(ti.d.i_mode) & S_IFMT) |
+				      (mode & 07777));
+		tfs_touch(&ti, false, false, true);
+		ret = tfs_write_inode(g_fs, &ti);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_chown(const char *path, uid_t uid, gid_t gid,
+		       struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = get_inode(path, fi, &ti);
+	if (!ret) {
+		if (uid != (uid_t)-1)
+			ti.d.i_uid = htole32(uid);
+		if (gid != (gid_t)-1)
+			ti.d.i_gid = htole32(gid);
+		tfs_touch(&ti, false, false, true);
+		ret = tfs_write_inode(g_fs, &ti);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_truncate(const char *path, off_t size,
+			  struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = get_inode(path, fi, &ti);
+	if (!ret && S_ISDIR(le16toh(ti.d.i_mode)))
+		ret = -EISDIR;
+	if (!ret)
+		ret = tfs_truncate(g_fs, &ti, size);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static void set_time(__le32 *sec, __le32 *nsec, const struct timespec *ts)
+{
+	struct timespec now;
+
+	if (ts->tv_nsec == UTIME_OMIT)
+		return;
+	if (ts->tv_nsec == UTIME_NOW) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		ts = &now;
+	}
+	*sec = htole32(ts->tv_sec);
+	*nsec = htole32(ts->tv_nsec);
+}
+
+static int tfuse_utimens(const char *path, const struct timespec tv[2],
+			 struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = get_inode(path, fi, &ti);
+	if (!ret) {
+		set_time(&ti.d.i_atime, &ti.d.i_atime_nsec, &tv[0]);
+		set_time(&ti.d.i_mtime, &ti.d.i_mtime_nsec, &tv[1]);
+		tfs_touch(&ti, false, false, true);
+		ret = tfs_write_inode(g_fs, &ti);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_open(const char *path, struct fuse_file_info *fi)
+{
+	uint32_t ino;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = tfs_lookup_path(g_fs, path, &ino);
+	if (!ret)
+		fi->fh = ino;
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_read(const char *path, char *buf, size_t size, off_t off,
+		      struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = tfs_read_inode(g_fs, fi->fh, &ti);
+	if (!ret)
+		ret = tfs_read(g_fs, &ti, buf, size, off);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_write(const char *path, const char *buf, size_t size,
+		       off_t off, struct fuse_file_info *fi)
+{
+	struct tfs_inode ti;
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = tfs_read_inode(g_fs, fi->fh, &ti);
+	if (!ret) {
+		if (fi->flags & O_APPEND)
+			off = le32toh(ti.d.i_size);
+		ret = tfs_write(g_fs, &ti, buf, size, off);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_fsync(const char *path, int datasync,
+		       struct fuse_file_info *fi)
+{
+	int ret;
+
+	pthread_mutex_lock(&g_lock);
+	ret = tfs_sync(g_fs);
+	pthread_mutex_unlock(&g_lock);
+	return ret;
+}
+
+static int tfuse_statfs(const char *path, struct statvfs *st)
+{
+	pthread_mutex_lock(&g_lock);
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = g_fs->block_size;
+	st->f_frsize = g_fs->block_size;
+	st->f_blocks = g_fs->data_blknr;
+	st->f_bfree = g_fs->free_blocks;
+	st->f_bavail = g_fs->free_blocks;
+	st->f_files = g_fs->inodes_count;
+	st->f_ffree = g_fs->free_inodes;
+	st->f_favail = g_fs->free_inodes;
+	st->f_namemax = TESTFS_FILE_NAME_LEN;
+	pthread_mutex_unlock(&g_lock);
+	return 0;
+}
+
+static const struct fuse_operations testfs_fuse_ops = {
+	.init		= tfuse_init,
+	.destroy	= tfuse_destroy,
+	.getattr	= tfuse_getattr,
+	.readdir	= tfuse_readdir,
+	.create		= tfuse_create,
+	.mkdir		= tfuse_mkdir,
+	.unlink		= tfuse_unlink,
+	.rmdir		= tfuse_rmdir,
+	.rename		= tfuse_rename,
+	.link		= tfuse_link,
+	.chmod		= tfuse_chmod,
+	.chown		= tfuse_chown,
+	.truncate	= tfuse_truncate,
+	.utimens	= tfuse_utimens,
+	.open		= tfuse_open,
+	.read		= tfuse_read,
+	.write		= tfuse_write,
+	.fsync		= tfuse_fsync,
+	.statfs		= tfuse_statfs,
+};
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: testfs-fuse <image> <mountpoint> "
+				"[fuse options]\n");
+		return 1;
+	}
+
+	/* packed images are served read-only */
+	ret = tfs_open(argv[1], false, &g_fs);
+	if (ret == -EROFS)
+		ret = tfs_open(argv[1], true, &g_fs);
+	if (ret) {
+		fprintf(stderr, "failed to open %s: %s\n", argv[1],
+			strerror(-ret));
+		return 1;
+	}
+
+	/* the image is ours, fuse sees the rest of the command line */
+	argv[1] = argv[0];
+	return fuse_main(argc - 1, argv + 1, &testfs_fuse_ops, NULL);
+}
@@ -0,0 +1,81 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-snap - take or drop the snapshot of a mounted testfs
+ *
+ *	testfs-snap <create|drop> <path on the file system>
+ *
+ * The snapshot is mounted with: mount -t testfs_snap <device> <dir>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+/* ioctls, see testfs.h */
+#define TESTFS_IOC_SNAP_CREATE	_IO('f', 0x81)
+#define TESTFS_IOC_SNAP_DROP	_IO('f', 0x82)
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-snap <create|drop> <path>\n"
+			"\tcreate  take a snapshot of the file system now\n"
+			"\tdrop    release the snapshot, its blocks are freed in\n"
+			"\t        the background\n");
+
+	_exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long cmd;
+	int fd;
+
+	if (argc != 3)
+		usage();
+	if (!strcmp(argv[1], "create"))
+		cmd = TESTFS_IOC_SNAP_CREATE;
+	else if (!strcmp(argv[1], "drop"))
+		cmd = TESTFS_IOC_SNAP_DROP;
+	else
+		usage();
+
+	fd = open(argv[2], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", argv[2],
+			strerror(errno));
+		return 1;
+	}
+
+	if (ioctl(fd, cmd)) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,1283 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-trace - record the operations on a testfs mount and replay them
+ *
+ *	testfs-trace record [-t seconds] <mountpoint> <trace>
+ *	testfs-trace replay [-f] [-j threads] <trace> <mountpoint>
+ *
+ * record snapshots the tree under the mount point, then copies the testfs
+ * tracepoints (testfs_trace.h) of that mount from tracefs to the trace file
+ * until interrupted. replay recreates the snapshot on another, fresh, mount
+ * and issues the system calls that end up in the same entry points, one
+ * replay thread per recorded thread, at the recorded times or as fast as
+ * possible (-f). Latency percentiles are reported per entry point.
+ *
+ * The trace is text:
+ *	T <ino> <d|f> <size> <path>			the snapshot
+ *	<ns> <tid> <event> <key> <value> ...		one event
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define TRACE_MAGIC	"# testfs-trace 1"
+
+/* the entry points, named as their events without the testfs_ prefix */
+enum {
+	OP_LOOKUP,
+	OP_CREATE,
+	OP_MKDIR,
+	OP_UNLINK,
+	OP_RMDIR,
+	OP_GETATTR,
+	OP_OPEN,
+	OP_RELEASE,
+	OP_READ,
+	OP_WRITE,
+	OP_LLSEEK,
+	OP_READDIR,
+	OP_FSYNC,
+	OP_MMAP,
+	OP_MKWRITE,
+	OP_SPLICE_READ,
+	OP_SPLICE_WRITE,
+	OP_COPY,
+	OP_REMAP,
+	OP_IOCTL,
+	OP_FIEMAP,
+	OP_NR,
+};
+
+static const char *op_names[OP_NR] = {
+	[OP_LOOKUP]		= "lookup",
+	[OP_CREATE]		= "create",
+	[OP_MKDIR]		= "mkdir",
+	[OP_UNLINK]		= "unlink",
+	[OP_RMDIR]		= "rmdir",
+	[OP_GETATTR]		= "getattr",
+	[OP_OPEN]		= "open",
+	[OP_RELEASE]		= "release",
+	[OP_READ]		= "read_iter",
+	[OP_WRITE]		= "write_iter",
+	[OP_LLSEEK]		= "llseek",
+	[OP_READDIR]		= "readdir",
+	[OP_FSYNC]		= "fsync",
+	[OP_MMAP]		= "mmap",
+	[OP_MKWRITE]		= "page_mkwrite",
+	[OP_SPLICE_READ]	= "splice_read",
+	[OP_SPLICE_WRITE]	= "splice_write",
+	[OP_COPY]		= "copy_file_range",
+	[OP_REMAP]		= "remap_file_range",
+	[OP_IOCTL]		= "ioctl",
+	[OP_FIEMAP]		= "fiemap",
+};
+
+/* one recorded event, its paths resolved at the time it happened */
+struct op {
+	uint64_t ts;
+	int tid;
+	int type;
+	uint32_t ino, ino2;	/* ino2: destination of copy and remap */
+	const char *path, *path2;
+	int64_t pos, pos2, len;
+	unsigned int flags;	/* open flags, rwf, whence, mode, cmd, ... */
+	long long ret;		/* recorded result, ino of a lookup */
+	bool direct, write;
+	bool nested;		/* issued by another entry point */
+};
+
+/* the files a replay thread has open, by recorded inode number */
+struct ofile {
+	pthread_mutex_t lock;
+	int *fds, nr, cap;	/* opened by open events */
+	int fd, fd_direct;	/* opened for events of unopened files */
+};
+
+struct op_stat {
+	uint64_t *lat, nr, cap;	/* latencies in ns */
+	uint64_t errors, bytes;
+};
+
+struct worker {
+	pthread_t thread;
+	struct op **ops;
+	size_t nr, cap;
+	struct op_stat stat[OP_NR];
+	void *buf;
+	size_t buf_size;
+	int pipe[2], pipe_size, null_fd;
+};
+
+static volatile sig_atomic_t g_stop;
+static bool g_fast;
+static struct op *g_ops;
+static size_t g_ops_nr, g_ops_cap, g_unresolved;
+static const char **g_path;	/* recorded inode number to path */
+static uint32_t g_path_nr;
+static struct ofile *g_files;
+static uint64_t g_start_ns, g_ts0;
+static long g_page_size;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-trace record [-t seconds] <mountpoint> <trace>\n"
+			"       testfs-trace replay [-f] [-j threads] <trace> <mountpoint>\n"
+			"\t-t  stop recording after this many seconds\n"
+			"\t-f  replay as fast as possible, not at the recorded times\n"
+			"\t-j  replay threads, default one per recorded thread\n"
+			"replay into a fresh mount, the snapshot is recreated there\n");
+
+	_exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(8);
+	}
+	return p;
+}
+
+/* record */
+
+static char g_tracefs[64];
+static FILE *g_out;
+static const char *g_mnt;
+
+static int find_tracefs(void)
+{
+	static const char *dirs[] = {
+		"/sys/kernel/tracing",
+		"/sys/kernel/debug/tracing",
+	};
+	char path[PATH_MAX];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		snprintf(path, sizeof(path), "%s/events/testfs", dirs[i]);
+		if (!access(path, F_OK)) {
+			strcpy(g_tracefs, dirs[i]);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "no testfs events in tracefs, is the module loaded?\n");
+	return -ENOENT;
+}
+
+static int tracefs_write(const char *file, const char *val)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", g_tracefs, file);
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0 || write(fd, val, strlen(val)) < 0)
+		ret = -errno;
+	if (fd >= 0)
+		close(fd);
+	if (ret)
+		fprintf(stderr, "failed to write %s: %s\n", path, strerror(-ret));
+	return ret;
+}
+
+static int snapshot_one(const char *path, const struct stat *st,
+			int type __attribute__((unused)),
+			struct FTW *ftw __attribute__((unused)))
+{
+	const char *rel = path + strlen(g_mnt);
+	char kind;
+
+	if (S_ISDIR(st->st_mode))
+		kind = 'd';
+	else if (S_ISREG(st->st_mode))
+		kind = 'f';
+	else
+		return 0;
+
+	while (*rel == '/')
+		rel++;
+	fprintf(g_out, "T %lu %c %lld %s\n", (unsigned long)st->st_ino, kind,
+		(long long)st->st_size, *rel ? rel : ".");
+	return 0;
+}
+
+/*
+ * A trace_pipe line:
+ *	<comm>-<tid> [<cpu>] <flags> <sec>.<usec>: testfs_<event>: <fields>
+ * written out as "<ns> <tid> <event> <fields>".
+ */
+static bool convert_line(char *line)
+{
+	char *ev, *ts, *p, *fields;
+	unsigned long long sec, usec;
+	int tid;
+
+	ev = strstr(line, ": testfs_");
+	if (!ev)
+		return false;
+	*ev = 0;
+	ev += strlen(": testfs_");
+
+	ts = strrchr(line, ' ');
+	if (!ts || sscanf(ts, " %llu.%llu", &sec, &usec) != 2)
+		return false;
+
+	/* the tid ends the task field, before the cpu in brackets */
+	*ts = 0;
+	p = strrchr(line, '[');
+	if (!p)
+		return false;
+	while (p > line && p[-1] == ' ')
+		p--;
+	while (p > line && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+	tid = atoi(p);
+
+	fields = strstr(ev, ": ");
+	if (!fields)
+		return false;
+	*fields = 0;
+	fields += 2;
+
+	fprintf(g_out, "%llu %d %s %s\n", sec * 1000000000ULL + usec * 1000,
+		tid, ev, fields);
+	return true;
+}
+
+/* copy lines from trace_pipe, the rest of the last read stays in buf */
+static size_t pump(int fd, char *buf, size_t len, size_t size,
+		   unsigned long *events, unsigned long *lost)
+{
+	char *line, *nl;
+	ssize_t n;
+
+	n = read(fd, buf + len, size - len - 1);
+	if (n <= 0)
+		return n < 0 && errno != EINTR && errno != EAGAIN ? (size_t)-1 : len;
+	len += n;
+	buf[len] = 0;
+
+	for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = 0;
+		if (convert_line(line))
+			(*events)++;
+		else if (strstr(line, "LOST"))
+			(*lost)++;
+	}
+
+	len -= line - buf;
+	memmove(buf, line, len);
+	return len;
+}
+
+static void stop(int sig __attribute__((unused)))
+{
+	g_stop = 1;
+}
+
+static int record(int argc, char **argv)
+{
+	unsigned long seconds = 0, events = 0, lost = 0;
+	struct sigaction sa = { .sa_handler = stop };
+	char path[PATH_MAX], filter[64], buf[65536];
+	struct stat st;
+	size_t len = 0;
+	int opt, fd, ret;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = strtoul(optarg, &end, 0);
+			if (*end)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 2)
+		usage();
+	g_mnt = argv[optind];
+
+	if (stat(g_mnt, &st)) {
+		perror(g_mnt);
+		return 1;
+	}
+	if (find_tracefs())
+		return 1;
+
+	g_out = fopen(argv[optind + 1], "w");
+	if (!g_out) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+
+	/* before the events are on, the walk would be recorded */
+	fprintf(g_out, "%s\n", TRACE_MAGIC);
+	if (nftw(g_mnt, snapshot_one, 64, FTW_PHYS | FTW_MOUNT)) {
+		perror(g_mnt);
+		return 1;
+	}
+
+	/* dev_t as the kernel has it, MKDEV() */
+	snprintf(filter, sizeof(filter), "dev == %u",
+		 major(st.st_dev) << 20 | minor(st.st_dev));
+	ret = tracefs_write("trace", "");
+	ret = ret ?: tracefs_write("events/testfs/filter", filter);
+	ret = ret ?: tracefs_write("events/testfs/enable", "1");
+	if (ret)
+		return 1;
+
+	snprintf(path, sizeof(path), "%s/trace_pipe", g_tracefs);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		tracefs_write("events/testfs/enable", "0");
+		return 1;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGALRM, &sa, NULL);
+	if (seconds)
+		alarm(seconds);
+	fprintf(stderr, "recording %s, interrupt to stop\n", g_mnt);
+
+	while (!g_stop && (ssize_t)len >= 0)
+		len = pump(fd, buf, len, sizeof(buf), &events, &lost);
+
+	/* what is still buffered */
+	tracefs_write("events/testfs/enable", "0");
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	while ((ssize_t)len >= 0) {
+		size_t prev = events;
+
+		len = pump(fd, buf, len, sizeof(buf), &events, &lost);
+		if (events == prev)
+			break;
+	}
+	close(fd);
+	tracefs_write("events/testfs/filter", "0");
+
+	fprintf(stderr, "%lu events recorded\n", events);
+	if (lost)
+		fprintf(stderr, "events were lost, raise %s/buffer_size_kb\n",
+			g_tracefs);
+	if (fclose(g_out)) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	return 0;
+}
+
+/* replay: the trace */
+
+/* the value of a "key value" field, a name runs to the end of the line */
+static const char *field(const char *fields, const char *key)
+{
+	size_t len = strlen(key);
+	const char *p = fields;
+
+	while (*p) {
+		if (!strncmp(p, key, len) && p[len] == ' ')
+			return p + len + 1;
+		if (!strncmp(p, "name ", 5))
+			break;
+		/* skip the key and its value */
+		p = strchr(p, ' ');
+		if (!p || !(p = strchr(p + 1, ' ')))
+			break;
+		p++;
+	}
+	return NULL;
+}
+
+static long long field_num(const char *fields, const char *key)
+{
+	const char *v = field(fields, key);
+
+	return v ? strtoll(v, NULL, 0) : 0;
+}
+
+static const char *path_get(uint32_t ino)
+{
+	return ino < g_path_nr ? g_path[ino] : NULL;
+}
+
+static void path_set(uint32_t ino, const char *path)
+{
+	uint32_t nr = g_path_nr;
+
+	if (ino >= nr) {
+		g_path_nr = ino + 1 > nr * 2 ? ino + 1 : nr * 2;
+		g_path = xrealloc(g_path, g_path_nr * sizeof(*g_path));
+		memset(g_path + nr, 0, (g_path_nr - nr) * sizeof(*g_path));
+	}
+	g_path[ino] = path;
+}
+
+static const char *path_join(const char *dir, const char *name)
+{
+	char *p;
+
+	if (!strcmp(dir, "."))
+		return strdup(name);
+	if (asprintf(&p, "%s/%s", dir, name) < 0)
+		return NULL;
+	return p;
+}
+
+static int op_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < OP_NR; i++)
+		if (!strcmp(name, op_names[i]))
+			return i;
+	return -1;
+}
+
+/*
+ * Parse an event and resolve the paths it works on, as they were at that
+ * point of the trace: creates and lookups name inodes, removals forget them.
+ */
+static void parse_event(char *line)
+{
+	char event[32];
+	const char *f, *name, *dir;
+	struct op *op;
+	int n, type;
+
+	if (g_ops_nr == g_ops_cap) {
+		g_ops_cap = g_ops_cap ? g_ops_cap * 2 : 4096;
+		g_ops = xrealloc(g_ops, g_ops_cap * sizeof(*g_ops));
+	}
+	op = &g_ops[g_ops_nr];
+	memset(op, 0, sizeof(*op));
+
+	if (sscanf(line, "%" SCNu64 " %d %31s %n", &op->ts, &op->tid, event,
+		   &n) != 3)
+		return;
+	type = op_type(event);
+	if (type < 0)
+		return;
+	op->type = type;
+	f = line + n;
+
+	switch (type) {
+	case OP_LOOKUP:
+	case OP_CREATE:
+	case OP_MKDIR:
+	case OP_UNLINK:
+	case OP_RMDIR:
+		name = field(f, "name");
+		dir = path_get(field_num(f, "dir"));
+		if (!name || !dir)
+			break;
+		op->path = path_join(dir, name);
+		op->flags = field_num(f, "mode");
+		op->ret = field_num(f, "ret");
+		/* -1 when there is no inode, a negative lookup */
+		if (field_num(f, "ino") < 0) {
+			if (type == OP_LOOKUP && !op->ret)
+				op->ret = -ENOENT;
+			break;
+		}
+		op->ino = field_num(f, "ino");
+		if (op->ret)
+			break;
+		if (type == OP_UNLINK || type == OP_RMDIR)
+			path_set(op->ino, NULL);
+		else
+			path_set(op->ino, op->path);
+		break;
+	case OP_COPY:
+	case OP_REMAP:
+		op->ino = field_num(f, "src");
+		op->ino2 = field_num(f, "dst");
+		op->path = path_get(op->ino);
+		op->path2 = path_get(op->ino2);
+		op->pos = field_num(f, "pos_in");
+		op->pos2 = field_num(f, "pos_out");
+		op->len = field_num(f, "len");
+		op->flags = field_num(f, "flags");
+		op->ret = field_num(f, "ret");
+		break;
+	default:
+		op->ino = field_num(f, "ino");
+		op->path = path_get(op->ino);
+		switch (type) {
+		case OP_OPEN:
+			op->flags = field_num(f, "flags");
+			break;
+		case OP_READ:
+		case OP_WRITE:
+			op->pos = field_num(f, "pos");
+			op->len = field_num(f, "count");
+			op->flags = field_num(f, "rwf");
+			op->direct = field_num(f, "direct");
+			break;
+		case OP_LLSEEK:
+			op->pos = field_num(f, "offset");
+			op->flags = field_num(f, "whence");
+			break;
+		case OP_READDIR:
+		case OP_MKWRITE:
+			op->pos = field_num(f, "pos");
+			break;
+		case OP_FSYNC:
+			op->flags = field_num(f, "datasync");
+			break;
+		case OP_MMAP:
+			op->pos = field_num(f, "pgoff") * g_page_size;
+			op->len = field_num(f, "len");
+			op->flags = field_num(f, "shared");
+			op->write = field_num(f, "write");
+			break;
+		case OP_SPLICE_READ:
+		case OP_SPLICE_WRITE:
+			op->pos = field_num(f, "pos");
+			op->len = field_num(f, "len");
+			op->ret = field_num(f, "ret");
+			break;
+		case OP_IOCTL:
+			op->flags = field_num(f, "cmd");
+			break;
+		case OP_FIEMAP:
+			op->pos = field_num(f, "start");
+			op->len = field_num(f, "len");
+			break;
+		}
+	}
+
+	if (!op->path) {
+		g_unresolved++;
+		return;
+	}
+	g_ops_nr++;
+}
+
+static bool in_range(int64_t pos, int64_t start, long long len)
+{
+	return pos >= start && pos < start + (len > 0 ? len : 1);
+}
+
+/* would @inner have been issued by the kernel on behalf of @outer */
+static bool nested_in(const struct op *inner, const struct op *outer)
+{
+	switch (outer->type) {
+	case OP_SPLICE_READ:
+		return inner->type == OP_READ && inner->ino == outer->ino &&
+			in_range(inner->pos, outer->pos, outer->ret);
+	case OP_SPLICE_WRITE:
+		/* and the fsync of a synchronous write */
+		return inner->ino == outer->ino &&
+			((inner->type == OP_WRITE &&
+			  in_range(inner->pos, outer->pos, outer->ret)) ||
+			 inner->type == OP_FSYNC);
+	case OP_COPY:
+		return (inner->type == OP_SPLICE_READ &&
+			inner->ino == outer->ino &&
+			in_range(inner->pos, outer->pos, outer->ret)) ||
+		       (inner->type == OP_SPLICE_WRITE &&
+			inner->ino == outer->ino2 &&
+			in_range(inner->pos, outer->pos2, outer->ret));
+	}
+	return false;
+}
+
+/*
+ * Splice calls ->read_iter and ->write_iter, copy_file_range falls back to
+ * splice and synchronous writes call ->fsync. Those events are recorded
+ * too, the replay must not issue them a second time. The outer events are
+ * traced when they return, right after the ones they caused.
+ */
+static void mark_nested(void)
+{
+	size_t *last = NULL, *prev_op, i, j, nr = 0;
+	struct op *op, *prev;
+
+	prev_op = xrealloc(NULL, g_ops_nr * sizeof(*prev_op));
+	for (i = 0; i < g_ops_nr; i++) {
+		op = &g_ops[i];
+		if (op->tid >= (int)nr) {
+			size_t n = op->tid + 1024;
+
+			last = xrealloc(last, n * sizeof(*last));
+			memset(last + nr, 0xff, (n - nr) * sizeof(*last));
+			nr = n;
+		}
+		j = prev_op[i] = last[op->tid];
+		last[op->tid] = i;
+
+		/* a synchronous write and its fsync, traced in that order */
+		if (op->type == OP_FSYNC && j != (size_t)-1) {
+			prev = &g_ops[j];
+			if (prev->type == OP_WRITE && prev->ino == op->ino &&
+			    (prev->flags & (RWF_DSYNC | RWF_SYNC)))
+				op->nested = true;
+		}
+
+		for (; j != (size_t)-1; j = prev_op[j]) {
+			prev = &g_ops[j];
+			if (!prev->nested && !nested_in(prev, op))
+				break;
+			prev->nested = true;
+		}
+	}
+	free(prev_op);
+	free(last);
+}
+
+/* replay: the snapshot */
+
+static int prepare_file(const char *path, long long size, void *buf,
+			size_t buf_size)
+{
+	long long off;
+	ssize_t n;
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	for (off = 0; off < size; off += n) {
+		n = buf_size;
+		if (size - off < n)
+			n = size - off;
+		n = write(fd, buf, n);
+		if (n <= 0) {
+			ret = n ? -errno : -ENOSPC;
+			break;
+		}
+	}
+
+	if (close(fd) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+static int load_trace(const char *file)
+{
+	unsigned long dirs = 0, files = 0;
+	long long bytes = 0, size;
+	size_t buf_size = 1 << 20;
+	char *line = NULL, *buf;
+	unsigned long ino;
+	size_t cap = 0;
+	ssize_t n;
+	char kind;
+	FILE *fp;
+	int pos, ret = 0;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		perror(file);
+		return -errno;
+	}
+
+	buf = xrealloc(NULL, buf_size);
+	memset(buf, 0xa5, buf_size);
+
+	n = getline(&line, &cap, fp);
+	if (n < 0 || strncmp(line, TRACE_MAGIC, strlen(TRACE_MAGIC))) {
+		fprintf(stderr, "%s: not a testfs trace\n", file);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	while ((n = getline(&line, &cap, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[n - 1] = 0;
+
+		if (line[0] != 'T') {
+			parse_event(line);
+			continue;
+		}
+
+		/* the snapshot comes first, in walk order, parents first */
+		if (sscanf(line, "T %lu %c %lld %n", &ino, &kind, &size,
+			   &pos) != 3)
+			continue;
+		path_set(ino, strdup(line + pos));
+		if (!strcmp(line + pos, "."))
+			continue;
+
+		if (kind == 'd') {
+			ret = mkdir(line + pos, 0755) ? -errno : 0;
+			dirs++;
+		} else {
+			ret = prepare_file(line + pos, size, buf, buf_size);
+			files++;
+			bytes += size;
+		}
+		if (ret && ret != -EEXIST) {
+			fprintf(stderr, "failed to create %s: %s\n", line + pos,
+				strerror(-ret));
+			goto out;
+		}
+		ret = 0;
+	}
+
+	fprintf(stderr, "snapshot: %lu directories, %lu files, %lld MiB\n",
+		dirs, files, bytes >> 20);
+	if (g_unresolved)
+		fprintf(stderr, "%zu events on files outside the snapshot "
+			"dropped\n", g_unresolved);
+	mark_nested();
+out:
+	free(line);
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+
+/* replay: the operations */
+
+/*
+ * A descriptor for the events of an open file: the latest one an open event
+ * returned, or, for mappings, direct I/O and files opened before recording
+ * started, one opened read-write here.
+ */
+static int ofile_fd(uint32_t ino, const char *path, bool own, bool direct)
+{
+	struct ofile *of = &g_files[ino];
+	int *fdp, fd;
+
+	pthread_mutex_lock(&of->lock);
+	if (!own && !direct && of->nr) {
+		fd = of->fds[of->nr - 1];
+		goto out;
+	}
+
+	fdp = direct ? &of->fd_direct : &of->fd;
+	if (*fdp <= 0) {
+		*fdp = open(path, O_RDWR | (direct ? O_DIRECT : 0));
+		if (*fdp < 0 && errno == EISDIR)
+			*fdp = open(path, O_RDONLY | O_DIRECTORY);
+		if (*fdp < 0)
+			*fdp = -errno;
+	}
+	fd = *fdp;
+out:
+	pthread_mutex_unlock(&of->lock);
+	return fd;
+}
+
+static void ofile_push(uint32_t ino, int fd)
+{
+	struct ofile *of = &g_files[ino];
+
+	pthread_mutex_lock(&of->lock);
+	if (of->nr == of->cap) {
+		of->cap = of->cap ? of->cap * 2 : 4;
+		of->fds = xrealloc(of->fds, of->cap * sizeof(*of->fds));
+	}
+	of->fds[of->nr++] = fd;
+	pthread_mutex_unlock(&of->lock);
+}
+
+static int ofile_pop(uint32_t ino)
+{
+	struct ofile *of = &g_files[ino];
+	int fd = -EBADF;
+
+	pthread_mutex_lock(&of->lock);
+	if (of->nr)
+		fd = of->fds[--of->nr];
+	pthread_mutex_unlock(&of->lock);
+	return fd;
+}
+
+static void *worker_buf(struct worker *w, size_t size)
+{
+	if (size > w->buf_size) {
+		free(w->buf);
+		if (posix_memalign(&w->buf, 4096, size)) {
+			fprintf(stderr, "out of memory\n");
+			exit(8);
+		}
+		memset(w->buf, 0x5a, size);
+		w->buf_size = size;
+	}
+	return w->buf;
+}
+
+/* move len bytes between a file and the worker's pipe */
+static ssize_t do_splice(struct worker *w, int fd, loff_t pos, size_t len,
+			 bool out)
+{
+	size_t done = 0, chunk;
+	ssize_t n;
+
+	while (done < len) {
+		chunk = len - done > (size_t)w->pipe_size ?
+			(size_t)w->pipe_size : len - done;
+		if (out) {
+			n = write(w->pipe[1], worker_buf(w, chunk), chunk);
+			if (n > 0)
+				n = splice(w->pipe[0], NULL, fd, &pos, n, 0);
+		} else {
+			n = splice(fd, &pos, w->pipe[1], NULL, chunk, 0);
+			if (n > 0)
+				splice(w->pipe[0], NULL, w->null_fd, NULL, n, 0);
+		}
+		if (n <= 0)
+			return done ? (ssize_t)done : n ? -errno : 0;
+		done += n;
+	}
+	return done;
+}
+
+static long long replay_remap(struct op *op, int src, int dst)
+{
+	struct file_clone_range fcr = {
+		.src_fd		= src,
+		.src_offset	= op->pos,
+		.src_length	= op->len,
+		.dest_offset	= op->pos2,
+	};
+	struct {
+		struct file_dedupe_range range;
+		struct file_dedupe_range_info info;
+	} fdr = {
+		.range = {
+			.src_offset	= op->pos,
+			.src_length	= op->len,
+			.dest_count	= 1,
+		},
+		.info = {
+			.dest_fd	= dst,
+			.dest_offset	= op->pos2,
+		},
+	};
+
+	/* REMAP_FILE_DEDUP */
+	if (!(op->flags & 1))
+		return ioctl(dst, FICLONERANGE, &fcr) ? -errno : 0;
+
+	if (ioctl(src, FIDEDUPERANGE, &fdr))
+		return -errno;
+	return fdr.info.status < 0 ? fdr.info.status : 0;
+}
+
+/*
+ * Issue the system call that reaches the entry point of @op. Returns the
+ * bytes moved or a negative errno.
+ */
+static long long replay_one(struct worker *w, struct op *op)
+{
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe[32];
+	} fm;
+	struct iovec iov;
+	struct stat st;
+	long long ret;
+	loff_t pin, pout;
+	int fd, fd2;
+	void *p;
+
+	switch (op->type) {
+	case OP_LOOKUP:
+		/* a path walk without ->getattr */
+		return access(op->path, F_OK) ? -errno : 0;
+	case OP_CREATE:
+		return mknod(op->path, S_IFREG | (op->flags & 07777), 0) ?
+			-errno : 0;
+	case OP_MKDIR:
+		return mkdir(op->path, op->flags & 07777) ? -errno : 0;
+	case OP_UNLINK:
+		return unlink(op->path) ? -errno : 0;
+	case OP_RMDIR:
+		return rmdir(op->path) ? -errno : 0;
+	case OP_GETATTR:
+		return stat(op->path, &st) ? -errno : 0;
+	case OP_OPEN:
+		/* the open flags that are left in f_flags */
+		fd = open(op->path, op->flags & (O_ACCMODE | O_APPEND |
+				O_DIRECT | O_DSYNC | O_SYNC | O_NOATIME |
+				O_NONBLOCK | O_LARGEFILE));
+		if (fd < 0)
+			return -errno;
+		ofile_push(op->ino, fd);
+		return 0;
+	case OP_RELEASE:
+		fd = ofile_pop(op->ino);
+		if (fd < 0)
+			return fd;
+		return close(fd) ? -errno : 0;
+	}
+
+	fd = ofile_fd(op->ino, op->path,
+		      op->type == OP_MMAP || op->type == OP_MKWRITE, op->direct);
+	if (fd < 0)
+		return fd;
+
+	switch (op->type) {
+	case OP_READ:
+	case OP_WRITE:
+		iov.iov_base = worker_buf(w, op->len);
+		iov.iov_len = op->len;
+		if (op->type == OP_READ)
+			ret = preadv2(fd, &iov, 1, op->pos,
+				      op->flags & ~RWF_APPEND);
+		else
+			ret = pwritev2(fd, &iov, 1, op->pos, op->flags);
+		return ret < 0 ? -errno : ret;
+	case OP_LLSEEK:
+		return lseek(fd, op->pos, op->flags) < 0 ? -errno : 0;
+	case OP_READDIR:
+		if (lseek(fd, op->pos, SEEK_SET) < 0)
+			return -errno;
+		ret = syscall(SYS_getdents64, fd, worker_buf(w, 32768), 32768);
+		return ret < 0 ? -errno : 0;
+	case OP_FSYNC:
+		ret = op->flags ? fdatasync(fd) : fsync(fd);
+		return ret ? -errno : 0;
+	case OP_MMAP:
+		p = mmap(NULL, op->len, PROT_READ | (op->write ? PROT_WRITE : 0),
+			 op->flags ? MAP_SHARED : MAP_PRIVATE, fd, op->pos);
+		if (p == MAP_FAILED)
+			return -errno;
+		munmap(p, op->len);
+		return 0;
+	case OP_MKWRITE:
+		/* a page past EOF would be SIGBUS */
+		if (fstat(fd, &st))
+			return -errno;
+		if (op->pos >= st.st_size)
+			return -ENXIO;
+		p = mmap(NULL, g_page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, op->pos);
+		if (p == MAP_FAILED)
+			return -errno;
+		*(volatile char *)p = *(volatile char *)p;
+		munmap(p, g_page_size);
+		return 0;
+	case OP_SPLICE_READ:
+	case OP_SPLICE_WRITE:
+		return do_splice(w, fd, op->pos, op->ret > 0 ? op->ret : op->len,
+				 op->type == OP_SPLICE_WRITE);
+	case OP_IOCTL:
+		/* only those that do not take data in, into a scratch buffer */
+		if (_IOC_DIR(op->flags) & _IOC_WRITE)
+			return -EPERM;
+		return ioctl(fd, op->flags, worker_buf(w, 4096)) ? -errno : 0;
+	case OP_FIEMAP:
+		memset(&fm, 0, sizeof(fm));
+		fm.fm.fm_start = op->pos;
+		fm.fm.fm_length = op->len;
+		fm.fm.fm_extent_count = 32;
+		return ioctl(fd, FS_IOC_FIEMAP, &fm) ? -errno : 0;
+	}
+
+	fd2 = ofile_fd(op->ino2, op->path2, false, false);
+	if (fd2 < 0)
+		return fd2;
+
+	switch (op->type) {
+	case OP_COPY:
+		pin = op->pos;
+		pout = op->pos2;
+		ret = copy_file_range(fd, &pin, fd2, &pout, op->len, 0);
+		return ret < 0 ? -errno : ret;
+	case OP_REMAP:
+		return replay_remap(op, fd, fd2);
+	}
+	return -EINVAL;
+}
+
+static void stat_add(struct op_stat *s, uint64_t lat)
+{
+	if (s->nr == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->lat = xrealloc(s->lat, s->cap * sizeof(*s->lat));
+	}
+	s->lat[s->nr++] = lat;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	struct timespec ts;
+	struct op_stat *s;
+	struct op *op;
+	uint64_t start, target;
+	long long ret;
+	size_t i;
+
+	for (i = 0; i < w->nr; i++) {
+		op = w->ops[i];
+		if (!g_fast) {
+			target = g_start_ns + (op->ts - g_ts0);
+			ts.tv_sec = target / 1000000000ULL;
+			ts.tv_nsec = target % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &ts, NULL) == EINTR)
+				;
+		}
+
+		start = now_ns();
+		ret = replay_one(w, op);
+		s = &w->stat[op->type];
+		stat_add(s, now_ns() - start);
+
+		/* errors are results that differ from the recorded ones */
+		if (ret < 0 && (op->ret >= 0 || ret != op->ret))
+			s->errors++;
+		else if (ret >= 0 && op->ret < 0)
+			s->errors++;
+		else if (ret > 0)
+			s->bytes += ret;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *lat, uint64_t nr, double p)
+{
+	uint64_t i = (uint64_t)(p * nr + 0.999999);
+
+	return lat[i ? i - 1 : 0] / 1000.0;
+}
+
+static void report(struct worker *w, int nr_workers, double secs)
+{
+	struct op_stat all;
+	uint64_t total = 0, read = 0, written = 0;
+	int type, i;
+
+	printf("%-17s %9s %7s %9s %9s %9s %9s %9s %9s\n", "op", "count",
+	       "errors", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)",
+	       "max(us)", "MiB/s");
+	for (type = 0; type < OP_NR; type++) {
+		memset(&all, 0, sizeof(all));
+		for (i = 0; i < nr_workers; i++) {
+			struct op_stat *s = &w[i].stat[type];
+
+			all.lat = xrealloc(all.lat,
+					(all.nr + s->nr + 1) * sizeof(*all.lat));
+			memcpy(all.lat + all.nr, s->lat, s->nr * sizeof(*s->lat));
+			all.nr += s->nr;
+			all.errors += s->errors;
+			all.bytes += s->bytes;
+		}
+		if (!all.nr) {
+			free(all.lat);
+			continue;
+		}
+
+		qsort(all.lat, all.nr, sizeof(*all.lat), cmp_u64);
+		printf("%-17s %9lu %7lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		       op_names[type], (unsigned long)all.nr,
+		       (unsigned long)all.errors,
+		       percentile(all.lat, all.nr, 0.5),
+		       percentile(all.lat, all.nr, 0.9),
+		       percentile(all.lat, all.nr, 0.99),
+		       percentile(all.lat, all.nr, 0.999),
+		       all.lat[all.nr - 1] / 1000.0,
+		       all.bytes / secs / (1 << 20));
+
+		total += all.nr;
+		if (type == OP_READ || type == OP_SPLICE_READ)
+			read += all.bytes;
+		else if (type == OP_WRITE || type == OP_SPLICE_WRITE ||
+			 type == OP_COPY)
+			written += all.bytes;
+		free(all.lat);
+	}
+
+	printf("%lu ops in %.3f s, %.0f ops/s, read %.1f MiB/s, "
+	       "write %.1f MiB/s\n", (unsigned long)total, secs, total / secs,
+	       read / secs / (1 << 20), written / secs / (1 << 20));
+}
+
+static int replay(int argc, char **argv)
+{
+	int opt, i, nr_workers = 0, *slot = NULL, tids = 0, nr_slot = 0;
+	struct worker *w;
+	uint32_t ino_nr = 0;
+	uint64_t end;
+	size_t n, skipped = 0;
+	struct op *op;
+	char *e;
+
+	while ((opt = getopt(argc, argv, "fj:")) != -1) {
+		switch (opt) {
+		case 'f':
+			g_fast = true;
+			break;
+		case 'j':
+			nr_workers = strtoul(optarg, &e, 0);
+			if (*e || nr_workers <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 2)
+		usage();
+
+	if (chdir(argv[optind + 1])) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	if (load_trace(argv[optind]))
+		return 1;
+	if (!g_ops_nr) {
+		fprintf(stderr, "nothing to replay\n");
+		return 1;
+	}
+	sync();
+
+	/* recorded threads to replay threads, in order of appearance */
+	for (n = 0; n < g_ops_nr; n++) {
+		op = &g_ops[n];
+		if (op->tid >= nr_slot) {
+			int nr = op->tid + 1024;
+
+			slot = xrealloc(slot, nr * sizeof(*slot));
+			memset(slot + nr_slot, 0xff, (nr - nr_slot) * sizeof(*slot));
+			nr_slot = nr;
+		}
+		if (slot[op->tid] < 0)
+			slot[op->tid] = tids++;
+		if (op->ino >= ino_nr)
+			ino_nr = op->ino + 1;
+		if (op->ino2 >= ino_nr)
+			ino_nr = op->ino2 + 1;
+	}
+	if (!nr_workers || nr_workers > tids)
+		nr_workers = tids;
+
+	w = calloc(nr_workers, sizeof(*w));
+	g_files = calloc(ino_nr, sizeof(*g_files));
+	if (!w || !g_files) {
+		fprintf(stderr, "out of memory\n");
+		return 8;
+	}
+	for (n = 0; n < ino_nr; n++)
+		pthread_mutex_init(&g_files[n].lock, NULL);
+
+	for (n = 0; n < g_ops_nr; n++) {
+		op = &g_ops[n];
+		if (op->nested) {
+			skipped++;
+			continue;
+		}
+		i = slot[op->tid] % nr_workers;
+		if (w[i].nr == w[i].cap) {
+			w[i].cap = w[i].cap ? w[i].cap * 2 : 1024;
+			w[i].ops = xrealloc(w[i].ops, w[i].cap * sizeof(*w[i].ops));
+		}
+		w[i].ops[w[i].nr++] = op;
+	}
+	free(slot);
+
+	fprintf(stderr, "replaying %zu ops of %d threads on %d threads%s, "
+		"%zu issued by other ops\n", g_ops_nr - skipped, tids,
+		nr_workers, g_fast ? ", as fast as possible" : "", skipped);
+
+	g_ts0 = g_ops[0].ts;
+	g_start_ns = now_ns();
+	for (i = 0; i < nr_workers; i++) {
+		w[i].null_fd = open("/dev/null", O_WRONLY);
+		if (pipe(w[i].pipe) || w[i].null_fd < 0) {
+			perror("pipe");
+			return 1;
+		}
+		fcntl(w[i].pipe[1], F_SETPIPE_SZ, 1 << 20);
+		w[i].pipe_size = fcntl(w[i].pipe[1], F_GETPIPE_SZ);
+		if (pthread_create(&w[i].thread, NULL, worker_fn, &w[i])) {
+			fprintf(stderr, "failed to create thread\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(w[i].thread, NULL);
+	end = now_ns();
+
+	report(w, nr_workers, (end - g_start_ns) / 1e9);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	g_page_size = sysconf(_SC_PAGESIZE);
+
+	if (argc < 2)
+		usage();
+
+	/* the subcommand's options follow it */
+	optind = 2;
+	if (!strcmp(argv[1], "record"))
+		return record(argc, argv);
+	if (!strcmp(argv[1], "replay"))
+		return replay(argc, argv);
+	usage();
+	return 1;
+}
@@ -0,0 +1,326 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfs-uring - random reads or writes of a file through io_uring
+ *
+ *	testfs-uring [-w] [-d] [-p] [-b block size] [-q depth] [-n ios] <file>
+ *
+ * Requests that the file system completes without blocking are finished
+ * inside io_uring_enter(), the others go to io-wq worker threads. The
+ * share of completions already posted when the submit call returns tells
+ * the two apart, it is reported next to IOPS and latency percentiles.
+ * Writes go over the existing blocks of the file, nothing is allocated.
+ * With -p the ring polls for completions (IORING_SETUP_IOPOLL), the
+ * device needs poll queues, null_blk with poll_queues= for instance.
+ *
+ * Raw system calls, no liburing needed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct ring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static bool g_write, g_direct, g_poll;
+static unsigned int g_bs = 4096, g_depth = 32;
+static unsigned long g_ios = 100000;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfs-uring [-w] [-d] [-p] [-b block size] [-q depth] [-n ios] <file>\n"
+			"\t-w  write instead of read, over the blocks the file has\n"
+			"\t-d  O_DIRECT\n"
+			"\t-p  poll for completions, needs -d\n"
+			"\t-b  I/O size, default 4096\n"
+			"\t-q  queue depth, default 32\n"
+			"\t-n  number of I/Os, default 100000\n");
+
+	_exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int ring_setup(struct ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	void *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if (g_poll)
+		p.flags |= IORING_SETUP_IOPOLL;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -errno;
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		return -errno;
+
+	r->sq_head = sq + p.sq_off.head;
+	r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = sq + p.sq_off.ring_mask;
+	r->sq_array = sq + p.sq_off.array;
+	r->cq_head = cq + p.cq_off.head;
+	r->cq_tail = cq + p.cq_off.tail;
+	r->cq_mask = cq + p.cq_off.ring_mask;
+	r->cqes = cq + p.cq_off.cqes;
+	return 0;
+}
+
+static void ring_queue(struct ring *r, int fd, unsigned int slot, void *buf,
+		       uint64_t off)
+{
+	unsigned int tail = *r->sq_tail, index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = g_write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = g_bs;
+	sqe->off = off;
+	sqe->user_data = slot;
+	r->sq_array[index] = index;
+
+	/* the sqe must be visible before the tail that publishes it */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_enter(struct ring *r, unsigned int submit, unsigned int wait)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+		      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	return ret < 0 ? -errno : ret;
+}
+
+static unsigned int ring_ready(struct ring *r)
+{
+	return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *lat, unsigned long nr, double p)
+{
+	unsigned long i = (unsigned long)(p * nr + 0.999999);
+
+	return lat[i ? i - 1 : 0] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long submitted = 0, done = 0, inline_done = 0, errors = 0;
+	uint64_t *start, *lat, blocks, t0, secs_ns;
+	unsigned int i, inflight = 0, queued, ready, head;
+	struct rusage ru0, ru1;
+	struct io_uring_cqe *cqe;
+	struct ring ring = { .fd = -1 };
+	struct stat st;
+	char *bufs, *end;
+	int opt, fd, ret;
+
+	while ((opt = getopt(argc, argv, "wdpb:q:n:")) != -1) {
+		switch (opt) {
+		case 'w':
+			g_write = true;
+			break;
+		case 'd':
+			g_direct = true;
+			break;
+		case 'p':
+			g_poll = true;
+			break;
+		case 'b':
+			g_bs = strtoul(optarg, &end, 0);
+			if (*end || !g_bs || g_bs % 512)
+				usage();
+			break;
+		case 'q':
+			g_depth = strtoul(optarg, &end, 0);
+			if (*end || !g_depth || g_depth > 4096)
+				usage();
+			break;
+		case 'n':
+			g_ios = strtoul(optarg, &end, 0);
+			if (*end || !g_ios)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || (g_poll && !g_direct))
+		usage();
+
+	fd = open(argv[optind], (g_write ? O_RDWR : O_RDONLY) |
+		  (g_direct ? O_DIRECT : 0));
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	blocks = st.st_size / g_bs;
+	if (!blocks) {
+		fprintf(stderr, "%s: smaller than one I/O\n", argv[optind]);
+		return 1;
+	}
+
+	ret = ring_setup(&ring, g_depth);
+	if (ret) {
+		fprintf(stderr, "io_uring_setup: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	start = calloc(g_depth, sizeof(*start));
+	lat = calloc(g_ios, sizeof(*lat));
+	if (!start || !lat || posix_memalign((void **)&bufs, 4096,
+					     (size_t)g_depth * g_bs)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(bufs, 0x5a, (size_t)g_depth * g_bs);
+
+	srand(1);
+	getrusage(RUSAGE_SELF, &ru0);
+	t0 = now_ns();
+	while (done < g_ios) {
+		/* fill the free slots, user_data is the slot */
+		queued = 0;
+		for (i = 0; i < g_depth && submitted < g_ios &&
+			    inflight + queued < g_depth; i++) {
+			if (start[i])
+				continue;
+			start[i] = now_ns();
+			ring_queue(&ring, fd, i, bufs + (size_t)i * g_bs,
+				   (uint64_t)(rand() % blocks) * g_bs);
+			queued++;
+			submitted++;
+		}
+
+		if (queued) {
+			ret = ring_enter(&ring, queued, 0);
+			if (ret < 0) {
+				fprintf(stderr, "io_uring_enter: %s\n",
+					strerror(-ret));
+				return 1;
+			}
+			inflight += queued;
+			/* posted before the submit call returned */
+			ready = ring_ready(&ring);
+			inline_done += ready < queued ? ready : queued;
+		}
+
+		if (!ring_ready(&ring)) {
+			ret = ring_enter(&ring, 0, 1);
+			if (ret < 0 && ret != -EINTR) {
+				fprintf(stderr, "io_uring_enter: %s\n",
+					strerror(-ret));
+				return 1;
+			}
+		}
+
+		head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring.cqes[head & *ring.cq_mask];
+			i = cqe->user_data;
+			lat[done++] = now_ns() - start[i];
+			if (cqe->res != (int)g_bs)
+				errors++;
+			start[i] = 0;
+			inflight--;
+			head++;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	secs_ns = now_ns() - t0;
+	getrusage(RUSAGE_SELF, &ru1);
+
+	qsort(lat, done, sizeof(*lat), cmp_u64);
+	printf("%s%s%s, %u bytes, depth %u: %lu ios in %.3f s\n",
+	       g_write ? "write" : "read", g_direct ? " direct" : "",
+	       g_poll ? " polled" : "", g_bs,
+	       g_depth, done, secs_ns / 1e9);
+	printf("%.0f IOPS, %.1f MiB/s, %lu errors\n", done * 1e9 / secs_ns,
+	       (double)done * g_bs * 1e9 / secs_ns / (1 << 20), errors);
+	printf("latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       percentile(lat, done, 0.5), percentile(lat, done, 0.9),
+	       percentile(lat, done, 0.99), percentile(lat, done, 0.999),
+	       lat[done - 1] / 1000.0);
+	printf("completed inline %.1f%%, context switches %ld voluntary %ld involuntary\n",
+	       100.0 * inline_done / done, ru1.ru_nvcsw - ru0.ru_nvcsw,
+	       ru1.ru_nivcsw - ru0.ru_nivcsw);
+	return errors ? 1 : 0;
+}
@@ -10,14 +10,15 @@
 #include <linux/genhd.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/percpu_counter.h>
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/buffer_head.h>
 #include <linux/fiemap.h>
 #include <linux/iomap.h>
+#include <linux/mount.h>
 #include <linux/namei.h>
 #include <linux/uio.h>
-#include <linux/fiemap.h>
 #include <linux/delay.h>
 #include <linux/errno.h>
 #include <linux/kernel.h>
@@ -33,6 +34,8 @@
 #include <linux/proc_fs.h>
 #include <linux/iversion.h>
 #include <linux/writeback.h>
+#include <linux/workqueue.h>
+#include <linux/lz4.h>
 
 
 #define log_err(fmt,...) pr_err("[%-30s,%-4d] "fmt,  __func__, __LINE__,  ## __VA_ARGS__)
@@ -45,15 +48,78 @@
 /* simplify the inode strcture, only support 16 blocks in a file */
 #define TEST_FS_N_BLOCKS	16
 
+/*
+ * Small files keep their data in the inode itself, in the space used by the
+ * block map, until they grow past TESTFS_INLINE_DATA_SIZE bytes.
+ */
+#define TESTFS_INLINE_DATA_SIZE	(TEST_FS_N_BLOCKS * sizeof(__le32))
+
+/*
+ * Write lifetime streams: stream 0 for data without a hint, one each for
+ * WRITE_LIFE_SHORT to WRITE_LIFE_EXTREME.
+ */
+#define TESTFS_NR_STREAMS	(WRITE_LIFE_EXTREME - WRITE_LIFE_NONE + 1)
+
+/*
+ * Compressed files: the block map is split in clusters of
+ * TESTFS_CLUSTER_BLOCKS blocks, compressed one at a time at writeback. A
+ * compressed cluster has its bit in i_compr_map and its first entries
+ * point at a contiguous run, fewer blocks than the cluster, starting with
+ * a struct testfs_compr_hdr; the other entries are 0.
+ */
+#define TESTFS_CLUSTER_BLOCKS	4
+#define TESTFS_NR_CLUSTERS	(TEST_FS_N_BLOCKS / TESTFS_CLUSTER_BLOCKS)
+
+#define TESTFS_COMPR_LZ4	1
+#define TESTFS_COMPR_ZSTD	2
+
+struct testfs_compr_hdr {
+	__le32 c_len;		/* compressed bytes following the header */
+	__u8   c_algo;		/* TESTFS_COMPR_* */
+	__u8   c_reserved[3];
+};
+
+/* inode flags, stored in i_flags */
+#define TESTFS_COMPR_FL		0x00000004 /* compress data, FS_COMPR_FL */
+#define TESTFS_INLINE_DATA_FL	0x10000000 /* data stored in i_block[] */
+#define TESTFS_TAIL_FL		0x20000000 /* data in a shared tail block */
+#define TESTFS_ATOMIC_FL	0x40000000 /* direct writes of a unit untorn */
+
+/* FS_IOC_GETFLAGS shows these, FS_IOC_SETFLAGS changes these */
+#define TESTFS_FL_USER_VISIBLE		(TESTFS_COMPR_FL | TESTFS_INLINE_DATA_FL)
+#define TESTFS_FL_USER_MODIFIABLE	TESTFS_COMPR_FL
+
 struct testfs_inode {
 	struct inode vfs_inode;
 	/*
 	 * use to record the mapping between disk->lba and file's offset,
 	 * to avoid read/write disk every time, we only record/update the mapping
 	 * int memory, until it was write back to the underline disk.
+	 *
+	 * If TESTFS_INLINE_DATA_FL is set, the same space holds the file data.
+	 * If TESTFS_TAIL_FL is set, i_block[0] is the tail block and i_block[1]
+	 * the byte offset of the data in it.
 	 */
-	__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
+	union {
+		__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
+		/*
+		 * inline data, aligned to its size so that it never crosses
+		 * a page boundary, iomap requires this for IOMAP_INLINE.
+		 */
+		__u8 i_data[TESTFS_INLINE_DATA_SIZE]
+				__aligned(TESTFS_INLINE_DATA_SIZE);
+	};
+	__u32 i_flags;
 	int is_new_inode;
+
+	/* protects i_block[] and i_compr_map, i_map_seq counts changes */
+	struct rw_semaphore i_map_sem;
+	u32 i_map_seq;
+	u8 i_compr_map;		/* compressed clusters, a bit each */
+
+	/* extending direct writes in flight, in issue order */
+	spinlock_t i_dio_lock;
+	struct list_head i_dio_extends;
 };
 
 struct testfs_disk_inode {
@@ -68,21 +134,49 @@ struct testfs_disk_inode {
 /*32 */	__le32 i_generation;	/* ??? */
 	__le32 i_flags;		/* File flags */
 /*40 */	__le32 i_blocks;	/* Blocks count */
-/*104*/	__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
-	__u8   reserved[24];
+	union {
+/*104*/		__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
+		__u8 i_data[TESTFS_INLINE_DATA_SIZE];/* Inline data */
+	};
+/*108*/	__le32 i_atime_nsec;	/* Nanoseconds of i_atime */
+	__le32 i_ctime_nsec;	/* Nanoseconds of i_ctime */
+	__le32 i_mtime_nsec;	/* Nanoseconds of i_mtime */
+/*117*/	__u8   i_write_hint;	/* enum rw_hint, lifetime of the data */
+	__u8   i_compr_map;	/* compressed clusters, a bit each */
+/*128*/	__u8   reserved[10];
 };
 
 #define TESTFS_I(inode) container_of(inode, struct testfs_inode, vfs_inode)
 
+static inline bool testfs_has_inline_data(struct inode *inode)
+{
+	return TESTFS_I(inode)->i_flags & TESTFS_INLINE_DATA_FL;
+}
+
+/*
+ * the data goes through compress.c: the file is compressed at writeback,
+ * or still has compressed clusters from before the flag was cleared
+ */
+static inline bool testfs_compr_inode(struct inode *inode)
+{
+	struct testfs_inode *ti = TESTFS_I(inode);
+
+	return (ti->i_flags & TESTFS_COMPR_FL) || READ_ONCE(ti->i_compr_map);
+}
+
 
 /**************************************************************
  * super block
  **************************************************************/
 struct inode *testfs_alloc_inode(struct super_block *sb);
 #define TEST_FS_MAGIC		0x1234
-#define TEST_FS_BLOCK_SIZE	4096
+#define TEST_FS_BLOCK_SIZE	4096	/* block size of volumes without geometry */
+#define TEST_FS_MIN_BLOCK_SIZE	1024
 
-/* block index */
+/*
+ * block index, fixed for volumes formatted before the geometry became
+ * configurable (s_inodes_count is 0), read from the super block otherwise
+ */
 #define TEST_FS_BLKID_SB	0	/* super block */
 #define TEST_FS_BLKID_IBITMAP	1	/* inode bitmap */
 #define TEST_FS_BLKID_DBITMAP	2	/* data block bitmap */
@@ -90,6 +184,56 @@ struct inode *testfs_alloc_inode(struct super_block *sb);
 
 #define TEST_FS_FILE_MAX_BYTE	(TEST_FS_BLOCK_SIZE * TEST_FS_N_BLOCKS)
 
+/* ioctl: move the blocks of a regular file into one contiguous run */
+#define TESTFS_IOC_DEFRAG	_IO('f', 0x80)
+/* ioctls: take a snapshot of the volume, drop it */
+#define TESTFS_IOC_SNAP_CREATE	_IO('f', 0x81)
+#define TESTFS_IOC_SNAP_DROP	_IO('f', 0x82)
+
+/*
+ * Untorn direct writes: a power of two number of bytes between unit_min
+ * and unit_max, at a file offset aligned to its length; after a crash the
+ * file has either all of it or none of it. They are asked for with
+ * RWF_ATOMIC where the kernel has it, statx reports the limits there too,
+ * and on any kernel with TESTFS_ATOMIC_FL, for every direct write of a
+ * unit to the file. A run the device can overwrite untorn is written in
+ * place, else the data goes to a new run of blocks and the block map is
+ * switched over to it in one inode write.
+ */
+struct testfs_atomic_info {
+	__u32 enabled;		/* TESTFS_ATOMIC_FL is set */
+	__u32 unit_min;		/* in bytes */
+	__u32 unit_max;
+};
+/* ioctls: get the untorn write state and limits of a file, set or clear it */
+#define TESTFS_IOC_GET_ATOMIC	_IOR('f', 0x83, struct testfs_atomic_info)
+#define TESTFS_IOC_SET_ATOMIC	_IOW('f', 0x84, __u32)
+
+/*
+ * Striped volumes: the data region goes on over up to TESTFS_MAX_DEVS
+ * devices. The first one has all the metadata, every other one starts with
+ * a member label and has data blocks only. On a volume with a metadata
+ * device the data region of the first one only holds directories.
+ */
+#define TESTFS_MAX_DEVS		8
+#define TESTFS_MEMBER_DATA_BLKID 1	/* first data block of a member */
+
+/* s_dev_flags */
+#define TESTFS_META_DEV		0x0001	/* s_devs[0] only gets directories */
+
+struct testfs_dev_desc {
+	__u8   d_uuid[16];		/* m_uuid of its label */
+	__le32 d_data_blknr;		/* data blocks on the device */
+};
+
+/* block 0 of every member but the first */
+struct testfs_member_label {
+	__le16 m_magic;			/* TEST_FS_MAGIC */
+	__le16 m_index;			/* in s_devs[] */
+	__u8   m_fs_uuid[16];		/* s_uuid of the volume */
+	__u8   m_uuid[16];
+};
+
 struct test_super_block {
 	__le32 s_version;
 	__le32 s_block_size;		/* block size (byte) */
@@ -107,11 +251,95 @@ struct test_super_block {
 
 	__le16 s_magic;
 
+	/* per block reference counts, 0 blocks if blocks can not be shared */
+	__le32 s_refcount_blkid;	/* refcount table index */
+	__le32 s_refcount_blknr;	/* refcount table block count */
+
+	/* free counts, only trusted if s_state has TESTFS_VALID_FS */
+	__le32 s_free_blocks_count;	/* free data blocks */
+	__le32 s_free_inodes_count;	/* free inodes */
+	__le16 s_state;			/* file system state */
+
+	/*
+	 * geometry: the data region is split in groups of s_blocks_per_group
+	 * blocks, each with one data bitmap block; the inode bitmap covers
+	 * block_size * 8 inodes per block
+	 */
+	__le32 s_inodes_count;		/* inodes */
+	__le32 s_ibitmap_blkid;		/* inode bitmap index */
+	__le32 s_ibitmap_blknr;		/* inode bitmap block count */
+	__le32 s_dbitmap_blkid;		/* data bitmap index */
+	__le32 s_blocks_per_group;	/* data blocks per group */
+	__le32 s_inode_table_blkid;	/* inode table index */
+
+	/* inode table blocks below this one are known to be zeroed */
+	__le32 s_itable_zeroed;
+
+	/*
+	 * striping, 0 devices on volumes of one device: the data blocks are
+	 * numbered across s_devs[] in order, each device but the last holds
+	 * whole groups; new files go to the next device every
+	 * s_stripe_blocks blocks allocated
+	 */
+	__le16 s_ndevs;
+	__le16 s_stripe_blocks;
+	struct testfs_dev_desc s_devs[TESTFS_MAX_DEVS];
+	__le32 s_dev_flags;
+
+	/*
+	 * snapshot area, no store blocks if the volume can not take
+	 * snapshots: block b below s_snap_store_blknr is copied to
+	 * s_snap_store_blkid + b before it first changes while there is a
+	 * snapshot, the copy bitmap has a bit for each copy made and the
+	 * deferred free bitmaps, one block per group, the data blocks the
+	 * live volume let go of but the snapshot still has
+	 */
+	__le32 s_snap_store_blkid;
+	__le32 s_snap_store_blknr;
+	__le32 s_snap_cow_blkid;	/* copy bitmap index */
+	__le32 s_snap_free_blkid;	/* deferred free bitmap index */
+	__le32 s_snap_state;
+	__le32 s_snap_time;		/* when the snapshot was taken */
+
+	/* features a kernel must know of to write to the volume */
+	__le32 s_ro_flags;
+
 	/* reserved field */
 	__le32 s_reserved[];
 
 };
+
+/* s_state, cleared while mounted read-write */
+#define TESTFS_VALID_FS		0x0001	/* unmounted cleanly */
+
+/* s_snap_state */
+#define TESTFS_SNAP_NONE	0
+#define TESTFS_SNAP_ACTIVE	1	/* blocks are copied before they change */
+#define TESTFS_SNAP_DROPPING	2	/* deferred frees being applied */
+
+/*
+ * s_ro_flags: a packed image (mktestfs -P) is never written. Blocks with
+ * the same data are stored once and counted in the refcount table, files
+ * smaller than a block share tail blocks (TESTFS_TAIL_FL). The inode
+ * table, read ahead in one go at mount, and the directories come first.
+ * There are no free blocks, no snapshot area.
+ */
+#define TESTFS_RO_PACKED	0x0001
+
+struct testfs_dev {
+	struct block_device *bdev;
+	u32 first;		/* first data block on it */
+	u32 nr;			/* data blocks on it */
+	u32 start;		/* where @first is on the device */
+	u32 first_group;
+	u32 ngroups;
+
+	/* next block of each write lifetime stream, 0 for its start */
+	u32 stream_goal[TESTFS_NR_STREAMS];
+};
+
 struct testfs_sb_info {
+	struct super_block *s_sb;
 	struct buffer_head *s_sb_bh;
 	struct test_super_block *s_tsb;
 
@@ -119,11 +347,94 @@ struct testfs_sb_info {
 	u32 s_block_size;
 	u32 s_inode_size;
 	u32 s_data_blkid;
+	u32 s_data_blknr;
+	u32 s_refcount_blkid;
+	u32 s_refcount_blknr;
+	u32 s_inodes_count;
+	u32 s_ibitmap_blkid;
+	u32 s_ibitmap_blknr;
+	u32 s_dbitmap_blkid;
+	u32 s_groups_count;
+	u32 s_blocks_per_group;
+	u32 s_itable_blkid;
+
+	/*
+	 * lazy inode table zeroing: blocks below s_itable_zeroed are done,
+	 * s_itable_busy is being zeroed and gets no new inode; both under
+	 * s_ialloc_lock, which also serializes inode bitmap updates
+	 */
+	u32 s_itable_zeroed;
+	u32 s_itable_busy;
+	spinlock_t s_ialloc_lock;
+	struct delayed_work s_itable_work;
+
+	/*
+	 * kept by every allocation and free, statfs and the ENOSPC checks
+	 * read them instead of the bitmaps
+	 */
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+
+	/* serializes data bitmap and refcount table updates */
+	spinlock_t s_balloc_lock;
 
 	spinlock_t s_inode_gen_lock;
 	u32 s_inode_gen;
+
+	/*
+	 * the devices of the data region, s_devs[0] is s_bdev and also has
+	 * the metadata; volumes of one device have s_ndevs 1
+	 */
+	struct testfs_dev s_devs[TESTFS_MAX_DEVS];
+	u32 s_ndevs;
+	u32 s_first_file_dev;		/* 1 with a metadata device */
+	u32 s_stripe_blocks;
+	atomic_t s_stripe_pos;		/* blocks allocated, picks the device */
+	fmode_t s_dev_mode;
+
+	/* untorn write unit limits in bytes, see TESTFS_IOC_GET_ATOMIC */
+	u32 s_awu_min;
+	u32 s_awu_max;
+
+	/* TESTFS_COMPR_* new clusters are compressed with, compress= */
+	u32 s_compr_algo;
+
+	/* s_ro_flags, the volume is only mounted read-only if not 0 */
+	u32 s_ro_flags;
+
+	/*
+	 * snapshot, s_snap_store_blknr is 0 if the volume can not take one.
+	 * s_snap_copied has a bit for each store block in use, set once the
+	 * copy is on disk. s_snap_mutex serializes copies, state changes and
+	 * snapshot mounts; s_snap_state changes under s_balloc_lock too.
+	 * A mounted snapshot has s_snap_of, the live volume.
+	 */
+	u32 s_snap_store_blkid;
+	u32 s_snap_store_blknr;
+	u32 s_snap_cow_blkid;
+	u32 s_snap_free_blkid;
+	u32 s_snap_state;
+	unsigned long *s_snap_copied;
+	struct mutex s_snap_mutex;
+	struct delayed_work s_snap_drop_work;
+	u32 s_snap_drop_group;		/* next group to apply */
+	int s_snap_mounts;
+	struct super_block *s_snap_of;
 };
 
+static inline bool testfs_snap_active(struct testfs_sb_info *sbi)
+{
+	return READ_ONCE(sbi->s_snap_state) == TESTFS_SNAP_ACTIVE;
+}
+
+/* block @blkid has to be copied for the snapshot before it changes */
+static inline bool testfs_snap_must_copy(struct testfs_sb_info *sbi,
+				u32 blkid)
+{
+	return testfs_snap_active(sbi) && blkid < sbi->s_snap_store_blknr &&
+	       !test_bit(blkid, sbi->s_snap_copied);
+}
+
 /**************************************************************
  * inode
  **************************************************************/
@@ -146,10 +457,69 @@ struct testfs_dir_entry {
 
 
 int testfs_fill_super(struct super_block *sb, void *data, int silent);
+int testfs_flush_devs(struct super_block *sb);
 int testfs_get_block_and_offset(struct super_block *sb, ino_t ino,
 				unsigned long *blkid, unsigned long *offset);
 int testfs_get_block(struct inode *inode, sector_t iblock,
                 struct buffer_head *bh_result, int create);
+/* testfs_map_blocks() flags */
+#define TESTFS_MAP_CREATE	0x0001	/* fill holes, unshare shared blocks */
+#define TESTFS_MAP_NOWAIT	0x0002	/* -EAGAIN rather than block */
+#define TESTFS_MAP_DECOMPRESS	0x0004	/* store compressed clusters plain */
+int testfs_map_blocks(struct inode *inode, u32 iblock, u32 max_blocks,
+			u32 *bno, bool *new, int flags);
+void testfs_punch_blocks(struct inode *inode, loff_t start, loff_t end);
+int testfs_convert_inline_data(struct inode *inode);
+void testfs_update_i_blocks(struct inode *inode);
+u32 testfs_file_dev(struct inode *inode);
+vm_fault_t testfs_inline_page_mkwrite(struct vm_fault *vmf);
+int testfs_new_blocks(struct super_block *sb, u32 goal, u32 *count,
+			u32 *blkid);
+int testfs_new_contig_blocks(struct super_block *sb, u32 goal, u32 count,
+				u32 *blkid);
+void testfs_free_blocks(struct super_block *sb, u32 blkid, u32 count);
+u32 testfs_stream_goal(struct inode *inode, u32 dev);
+void testfs_stream_advance(struct inode *inode, u32 blkid, u32 count);
+u32 testfs_dev_of(struct super_block *sb, u32 blkid);
+u32 testfs_next_dev(struct super_block *sb);
+struct block_device *testfs_map_dev(struct super_block *sb, u32 blkid,
+				sector_t *pblk, u32 *left);
+int testfs_count_free(struct super_block *sb, u32 blkid, u32 nbits,
+			u32 *free);
+int testfs_count_free_blocks(struct super_block *sb, u32 *free);
+int testfs_count_free_inodes(struct super_block *sb, u32 *free);
+void testfs_itable_zero_work(struct work_struct *work);
+int testfs_share_blocks(struct super_block *sb, u32 blkid, u32 count);
+u32 testfs_shared_blocks(struct super_block *sb, u32 blkid, u32 count,
+			bool *shared, bool nowait);
+int testfs_rw_blocks(struct super_block *sb, unsigned int op, u32 blkid,
+			u32 count, struct page **pages);
+int testfs_copy_blocks(struct super_block *sb, u32 src, u32 dst, u32 count);
+int testfs_zero_blocks(struct super_block *sb, u32 blkid, u32 count);
+int testfs_defrag_file(struct inode *inode);
+int testfs_map_atomic(struct inode *inode, u32 iblock, u32 count,
+			struct page **pages, loff_t end);
+int testfs_snap_init(struct super_block *sb);
+int testfs_snap_cow(struct super_block *sb, u32 blkid);
+int testfs_snap_owned(struct super_block *sb, u32 blkid, bool nowait);
+int testfs_snap_read(struct super_block *sb, u32 blkid, u32 offset,
+			void *buf, u32 len);
+int testfs_snap_create(struct super_block *sb);
+int testfs_snap_drop(struct super_block *sb);
+void testfs_snap_drop_work(struct work_struct *work);
+struct dentry *testfs_snap_mount(struct file_system_type *fs_type,
+			int flags, const char *dev_name, void *data);
+void testfs_snap_put_super(struct super_block *sb);
+int testfs_compr_init(void);
+void testfs_compr_exit(void);
+int testfs_compr_parse(struct testfs_sb_info *sbi, const char *algo);
+int testfs_uncompress_cluster(struct inode *inode, u32 cluster, bool nowait);
+int testfs_compr_readpage(struct page *page);
+void testfs_compr_readahead(struct readahead_control *rac);
+int testfs_compr_writepages(struct address_space *mapping,
+			struct writeback_control *wbc);
+int testfs_remap_blocks(struct inode *src, u32 iblock, struct inode *dst,
+			u32 oblock, u32 count);
 struct inode *testfs_new_inode(struct inode *dir, umode_t mode,
 				const struct qstr *qstr);
 int testfs_inode_cache_init(void);
@@ -157,6 +527,7 @@ void testfs_inode_cache_deinit(void);
 void testfs_free_inode(struct inode *inode);
 void testfs_evict_inode(struct inode * inode);
 struct inode *testfs_iget(struct super_block *sb, int ino);
+int testfs_inode_in_use(struct super_block *sb, ino_t ino);
 int testfs_write_inode(struct inode *inode, struct writeback_control *wbc);
 int testfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 long testfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
@@ -166,8 +537,12 @@ long testfs_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 int testfs_getattr(const struct path *path, struct kstat *stat,
                 unsigned int request_mask, unsigned int query_flags);
 
+extern struct file_system_type test_fs_type;
+extern struct super_operations testfs_sops;
+extern const struct iomap_ops testfs_iomap_ops;
 extern const struct inode_operations testfs_file_iops;
 extern const struct file_operations testfs_file_fops;
 extern const struct inode_operations testfs_dir_iops;
+struct dentry *testfs_get_parent(struct dentry *child);
 extern const struct file_operations testfs_dir_fops;
 #endif /* __TESTFS_H__ */
@@ -0,0 +1,430 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * One event per testfs_dir_iops and testfs_file_fops entry point, recorded
+ * and replayed by testfs-trace. The output is "key value" pairs, a name
+ * always comes last. Namespace operations and the wrappers that call other
+ * entry points (splice, copy_file_range) are traced on the way out with
+ * their result, everything else on the way in.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM testfs
+
+#if !defined(_TESTFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TESTFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(testfs_namei_class,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, inode, mode, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		dir)
+		__field(long long,	ino)
+		__field(umode_t,	mode)
+		__field(int,		ret)
+		__string(name,		dentry->d_name.name)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dir->i_sb->s_dev;
+		__entry->dir	= dir->i_ino;
+		__entry->ino	= inode ? (long long)inode->i_ino : -1;
+		__entry->mode	= mode;
+		__entry->ret	= ret;
+		__assign_str(name, dentry->d_name.name);
+	),
+
+	TP_printk("dev %d,%d dir %lu ino %lld mode 0%o ret %d name %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->dir, __entry->ino, __entry->mode,
+		  __entry->ret, __get_str(name))
+);
+
+DEFINE_EVENT(testfs_namei_class, testfs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, inode, mode, ret));
+
+DEFINE_EVENT(testfs_namei_class, testfs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, inode, mode, ret));
+
+DEFINE_EVENT(testfs_namei_class, testfs_mkdir,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, inode, mode, ret));
+
+DEFINE_EVENT(testfs_namei_class, testfs_unlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, inode, mode, ret));
+
+DEFINE_EVENT(testfs_namei_class, testfs_rmdir,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode,
+		 umode_t mode, int ret),
+	TP_ARGS(dir, dentry, inode, mode, ret));
+
+TRACE_EVENT(testfs_getattr,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(ino_t,	ino)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+	),
+
+	TP_printk("dev %d,%d ino %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino)
+);
+
+DECLARE_EVENT_CLASS(testfs_file_class,
+	TP_PROTO(struct inode *inode, struct file *file),
+	TP_ARGS(inode, file),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(unsigned int,	flags)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->flags	= file->f_flags;
+	),
+
+	TP_printk("dev %d,%d ino %lu flags 0x%x",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->flags)
+);
+
+DEFINE_EVENT(testfs_file_class, testfs_open,
+	TP_PROTO(struct inode *inode, struct file *file),
+	TP_ARGS(inode, file));
+
+DEFINE_EVENT(testfs_file_class, testfs_release,
+	TP_PROTO(struct inode *inode, struct file *file),
+	TP_ARGS(inode, file));
+
+/* rwf is the RWF_* subset of ki_flags, they share their values */
+DECLARE_EVENT_CLASS(testfs_rw_class,
+	TP_PROTO(struct kiocb *iocb, size_t count),
+	TP_ARGS(iocb, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(loff_t,		pos)
+		__field(size_t,		count)
+		__field(int,		rwf)
+		__field(bool,		direct)
+	),
+
+	TP_fast_assign(
+		struct inode *inode = file_inode(iocb->ki_filp);
+
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= iocb->ki_pos;
+		__entry->count	= count;
+		__entry->rwf	= iocb->ki_flags & (IOCB_HIPRI | IOCB_DSYNC |
+					IOCB_SYNC | IOCB_NOWAIT | IOCB_APPEND);
+		__entry->direct	= !!(iocb->ki_flags & IOCB_DIRECT);
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld count %zu rwf 0x%x direct %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->pos, __entry->count,
+		  __entry->rwf, __entry->direct)
+);
+
+DEFINE_EVENT(testfs_rw_class, testfs_read_iter,
+	TP_PROTO(struct kiocb *iocb, size_t count),
+	TP_ARGS(iocb, count));
+
+DEFINE_EVENT(testfs_rw_class, testfs_write_iter,
+	TP_PROTO(struct kiocb *iocb, size_t count),
+	TP_ARGS(iocb, count));
+
+TRACE_EVENT(testfs_llseek,
+	TP_PROTO(struct inode *inode, loff_t offset, int whence),
+	TP_ARGS(inode, offset, whence),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(ino_t,	ino)
+		__field(loff_t,	offset)
+		__field(int,	whence)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->offset	= offset;
+		__entry->whence	= whence;
+	),
+
+	TP_printk("dev %d,%d ino %lu offset %lld whence %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->offset, __entry->whence)
+);
+
+TRACE_EVENT(testfs_readdir,
+	TP_PROTO(struct inode *inode, loff_t pos),
+	TP_ARGS(inode, pos),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(ino_t,	ino)
+		__field(loff_t,	pos)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->pos)
+);
+
+TRACE_EVENT(testfs_fsync,
+	TP_PROTO(struct inode *inode, loff_t start, loff_t end, int datasync),
+	TP_ARGS(inode, start, end, datasync),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(ino_t,	ino)
+		__field(loff_t,	start)
+		__field(loff_t,	end)
+		__field(int,	datasync)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->start		= start;
+		__entry->end		= end;
+		__entry->datasync	= datasync;
+	),
+
+	TP_printk("dev %d,%d ino %lu start %lld end %lld datasync %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->start, __entry->end,
+		  __entry->datasync)
+);
+
+TRACE_EVENT(testfs_mmap,
+	TP_PROTO(struct inode *inode, struct vm_area_struct *vma),
+	TP_ARGS(inode, vma),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(unsigned long,	pgoff)
+		__field(unsigned long,	len)
+		__field(bool,		shared)
+		__field(bool,		write)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pgoff	= vma->vm_pgoff;
+		__entry->len	= vma->vm_end - vma->vm_start;
+		__entry->shared	= !!(vma->vm_flags & VM_SHARED);
+		__entry->write	= !!(vma->vm_flags & VM_WRITE);
+	),
+
+	TP_printk("dev %d,%d ino %lu pgoff %lu len %lu shared %d write %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->pgoff, __entry->len,
+		  __entry->shared, __entry->write)
+);
+
+TRACE_EVENT(testfs_page_mkwrite,
+	TP_PROTO(struct inode *inode, loff_t pos),
+	TP_ARGS(inode, pos),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(ino_t,	ino)
+		__field(loff_t,	pos)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->pos)
+);
+
+DECLARE_EVENT_CLASS(testfs_splice_class,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+	TP_ARGS(inode, pos, len, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(loff_t,		pos)
+		__field(size_t,		len)
+		__field(ssize_t,	ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->pos	= pos;
+		__entry->len	= len;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu pos %lld len %zu ret %zd",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->pos, __entry->len,
+		  __entry->ret)
+);
+
+DEFINE_EVENT(testfs_splice_class, testfs_splice_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+	TP_ARGS(inode, pos, len, ret));
+
+DEFINE_EVENT(testfs_splice_class, testfs_splice_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+	TP_ARGS(inode, pos, len, ret));
+
+DECLARE_EVENT_CLASS(testfs_copy_class,
+	TP_PROTO(struct inode *src, loff_t pos_in, struct inode *dst,
+		 loff_t pos_out, u64 len, unsigned int flags, s64 ret),
+	TP_ARGS(src, pos_in, dst, pos_out, len, flags, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		src)
+		__field(loff_t,		pos_in)
+		__field(ino_t,		dst)
+		__field(loff_t,		pos_out)
+		__field(u64,		len)
+		__field(unsigned int,	flags)
+		__field(s64,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= dst->i_sb->s_dev;
+		__entry->src		= src->i_ino;
+		__entry->pos_in		= pos_in;
+		__entry->dst		= dst->i_ino;
+		__entry->pos_out	= pos_out;
+		__entry->len		= len;
+		__entry->flags		= flags;
+		__entry->ret		= ret;
+	),
+
+	TP_printk("dev %d,%d src %lu pos_in %lld dst %lu pos_out %lld len %llu flags 0x%x ret %lld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->src, __entry->pos_in,
+		  (unsigned long)__entry->dst, __entry->pos_out,
+		  __entry->len, __entry->flags, __entry->ret)
+);
+
+DEFINE_EVENT(testfs_copy_class, testfs_copy_file_range,
+	TP_PROTO(struct inode *src, loff_t pos_in, struct inode *dst,
+		 loff_t pos_out, u64 len, unsigned int flags, s64 ret),
+	TP_ARGS(src, pos_in, dst, pos_out, len, flags, ret));
+
+DEFINE_EVENT(testfs_copy_class, testfs_remap_file_range,
+	TP_PROTO(struct inode *src, loff_t pos_in, struct inode *dst,
+		 loff_t pos_out, u64 len, unsigned int flags, s64 ret),
+	TP_ARGS(src, pos_in, dst, pos_out, len, flags, ret));
+
+TRACE_EVENT(testfs_ioctl,
+	TP_PROTO(struct inode *inode, unsigned int cmd, unsigned long arg),
+	TP_ARGS(inode, cmd, arg),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(unsigned int,	cmd)
+		__field(unsigned long,	arg)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->cmd	= cmd;
+		__entry->arg	= arg;
+	),
+
+	TP_printk("dev %d,%d ino %lu cmd 0x%x arg 0x%lx",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->cmd, __entry->arg)
+);
+
+TRACE_EVENT(testfs_fiemap,
+	TP_PROTO(struct inode *inode, u64 start, u64 len),
+	TP_ARGS(inode, start, len),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	dev)
+		__field(ino_t,	ino)
+		__field(u64,	start)
+		__field(u64,	len)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= inode->i_sb->s_dev;
+		__entry->ino	= inode->i_ino;
+		__entry->start	= start;
+		__entry->len	= len;
+	),
+
+	TP_printk("dev %d,%d ino %lu start %llu len %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long)__entry->ino, __entry->start, __entry->len)
+);
+
+#endif /* _TESTFS_TRACE_H */
+
+/* the module is built out of tree, the header is next to the sources */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE testfs_trace
+#include <trace/define_trace.h>
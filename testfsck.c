@@ -0,0 +1,1282 @@
+/*
+ * testfs - A simple block device based file system
+ *
+ * The license below covers all files distributed with testfs unless otherwise
+ * noted in the file itself.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 3 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2020 Weiping Zhang <zwp10758@gmail.com>
+ *
+ */
+
+/*
+ * testfsck - check and repair an unmounted testfs volume
+ *
+ * pass 1: inode bitmap and inode table, read in large chunks, checked by
+ *         inode range in parallel; every mapped data block is claimed
+ * pass 2: directories, in parallel: entries pointing to free or bad
+ *         inodes are dropped, file types fixed
+ * pass 3: connectivity and link counts, walking the tree from the root;
+ *         inodes it does not reach are released
+ * pass 4: data bitmap and refcount table against the claims, in parallel
+ *         by block group: leaked blocks are freed, blocks claimed more
+ *         often than their refcount allows are shared or copied
+ * pass 5: inode bitmap and the free counts in the super block
+ *
+ * Nothing is written before all passes ran, and only with -y.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define __le16 uint16_t
+#define __le32 uint32_t
+#define __u8 uint8_t
+
+#define TESTFS_ROOT_INO		0
+#define TESTFS_DISK_INODE_SIZE	128
+#define TEST_FS_N_BLOCKS	16
+#define TESTFS_INLINE_DATA_SIZE	(TEST_FS_N_BLOCKS * sizeof(__le32))
+#define TESTFS_INLINE_DATA_FL	0x10000000 /* data stored in i_block[] */
+#define TESTFS_TAIL_FL		0x20000000 /* data in a shared tail block */
+
+/* compressed clusters, a bit each in i_compr_map */
+#define TESTFS_CLUSTER_BLOCKS	4
+#define TESTFS_NR_CLUSTERS	(TEST_FS_N_BLOCKS / TESTFS_CLUSTER_BLOCKS)
+
+#define TEST_FS_MAGIC		0x1234
+#define TEST_FS_BLOCK_SIZE	4096
+#define TEST_FS_MIN_BLOCK_SIZE	1024
+
+/* fixed layout of volumes without geometry in the super block */
+#define TEST_FS_BLKID_IBITMAP	1
+#define TEST_FS_BLKID_DBITMAP	2
+#define TEST_FS_BLKID_ITABLE	3
+
+#define TESTFS_VALID_FS		0x0001	/* unmounted cleanly */
+#define TESTFS_RO_PACKED	0x0001	/* s_ro_flags, mktestfs -P */
+
+#define TESTFS_MAX_DEVS		8
+
+/* s_snap_state */
+#define TESTFS_SNAP_NONE	0
+#define TESTFS_SNAP_ACTIVE	1
+#define TESTFS_SNAP_DROPPING	2
+
+struct testfs_dev_desc {
+	__u8   d_uuid[16];
+	__le32 d_data_blknr;
+};
+
+#define FT_REG_FILE	1
+#define FT_DIR		2
+
+struct testfs_disk_inode {
+	__le16 i_mode;		/* File mode */
+	__le16 i_links_count;	/* Links count */
+	__le32 i_uid;		/* Low 16 bits of User Uid */
+	__le32 i_gid;		/* Low 16 bits of Group Id */
+	__le32 i_size;		/* Size in bytes */
+	__le32 i_atime;		/* Access time */
+	__le32 i_ctime;		/* Creation time */
+	__le32 i_mtime;		/* Modification time */
+	__le32 i_generation;
+	__le32 i_flags;		/* File flags */
+	__le32 i_blocks;	/* Blocks count */
+	union {
+		__le32 i_block[TEST_FS_N_BLOCKS];/* Pointers to blocks */
+		__u8 i_data[TESTFS_INLINE_DATA_SIZE];/* Inline data */
+	};
+	__le32 i_atime_nsec;	/* Nanoseconds of i_atime */
+	__le32 i_ctime_nsec;	/* Nanoseconds of i_ctime */
+	__le32 i_mtime_nsec;	/* Nanoseconds of i_mtime */
+	__u8   i_write_hint;	/* enum rw_hint, lifetime of the data */
+	__u8   i_compr_map;	/* compressed clusters, a bit each */
+	__u8   reserved[10];
+};
+
+struct testfs_dir_entry {
+#define TESTFS_FILE_NAME_LEN 58
+	__le32 inode;
+	__u8 file_type;
+	__u8 name_len;	/* 0 means free slot */
+	__u8 name[TESTFS_FILE_NAME_LEN];
+};
+
+struct test_super_block {
+	__le32 s_version;
+	__le32 s_block_size;		/* block size (byte) */
+	__le32 s_inode_size;		/* disk inode size (byte) */
+	__le32 s_total_blknr;		/* total blocks include meta */
+	__le32 s_inode_table_blknr;	/* inode table block count */
+	__le32 s_data_blkid;		/* data block index */
+	__le32 s_data_blknr;		/* data block count */
+	__u8   s_uuid[16];             /* 128-bit uuid */
+	__le16 s_magic;
+	__le32 s_refcount_blkid;	/* refcount table index */
+	__le32 s_refcount_blknr;	/* refcount table block count */
+	__le32 s_free_blocks_count;	/* free data blocks */
+	__le32 s_free_inodes_count;	/* free inodes */
+	__le16 s_state;			/* file system state */
+	__le32 s_inodes_count;		/* inodes */
+	__le32 s_ibitmap_blkid;		/* inode bitmap index */
+	__le32 s_ibitmap_blknr;		/* inode bitmap block count */
+	__le32 s_dbitmap_blkid;		/* data bitmap index */
+	__le32 s_blocks_per_group;	/* data blocks per group */
+	__le32 s_inode_table_blkid;	/* inode table index */
+	__le32 s_itable_zeroed;
+	__le16 s_ndevs;
+	__le16 s_stripe_blocks;
+	struct testfs_dev_desc s_devs[TESTFS_MAX_DEVS];
+	__le32 s_dev_flags;
+	__le32 s_snap_store_blkid;
+	__le32 s_snap_store_blknr;
+	__le32 s_snap_cow_blkid;
+	__le32 s_snap_free_blkid;
+	__le32 s_snap_state;
+	__le32 s_snap_time;
+	__le32 s_ro_flags;
+	__le32 s_reserved[];
+};
+
+/* exit codes, as other fsck tools */
+#define FSCK_OK			0
+#define FSCK_NONDESTRUCT	1	/* errors corrected */
+#define FSCK_UNCORRECTED	4	/* errors left */
+#define FSCK_ERROR		8	/* operational error */
+
+/* inodes are checked in units of this many bytes of inode table */
+#define ITABLE_UNIT		(1 << 20)
+
+/* inode state, from pass 1 on */
+enum {
+	INO_FREE,		/* bitmap clear, or released by a pass */
+	INO_BAD,		/* bitmap set but nothing usable in it */
+	INO_REG,
+	INO_DIR,
+};
+
+struct dir_entry_ref {
+	uint32_t target;
+	uint32_t slot;		/* entry index in the directory */
+};
+
+struct dir_info {
+	uint32_t ino;
+	uint32_t size;
+	char *buf;		/* directory blocks, holes read as zeros */
+	struct dir_entry_ref *ents;	/* entries but "." and ".." */
+	uint32_t nr_ents, max_ents;
+	uint32_t nr_subdirs;
+	int32_t dotdot_slot;	/* -1 if there is none */
+	bool has_dot;
+	bool dirty;
+};
+
+/* geometry */
+static struct test_super_block g_tsb;
+static uint32_t g_bs, g_inodes_count, g_ibitmap_blkid, g_ibitmap_blknr;
+static uint32_t g_dbitmap_blkid, g_blocks_per_group, g_groups_count;
+static uint32_t g_itable_blkid, g_itable_blknr, g_data_blkid, g_data_blknr;
+static uint32_t g_refcount_blkid, g_refcount_blknr, g_ndevs;
+static uint32_t g_snap_free_blkid, g_snap_state;
+
+/* metadata read in */
+static uint8_t *g_ibitmap, *g_dbitmap;
+static uint8_t *g_snap_free;		/* blocks the snapshot holds, or NULL */
+static __le16 *g_refcount;
+static char *g_itable;
+static uint32_t g_itable_used;		/* inodes read, up to the last in use */
+
+/* what the passes found */
+static uint8_t *g_ino_state;
+static uint8_t *g_itable_dirty;	/* per inode table block */
+static uint8_t *g_group_dirty;	/* per data bitmap block */
+static bool g_refcount_dirty, g_ibitmap_dirty;
+static uint16_t *g_claims;		/* per data block */
+static uint32_t *g_parent;		/* directory naming a directory */
+static uint32_t *g_nlink;		/* names of a regular file */
+static uint8_t *g_reachable;
+static struct dir_info **g_dirs;	/* indexed by inode number */
+static uint32_t *g_dir_list, g_nr_dirs;
+static uint32_t g_free_blocks, g_multi_claimed;
+
+static const char *g_dev;
+static int g_fd;
+static bool g_repair, g_verbose;
+static int g_nr_threads;
+static unsigned long g_problems, g_fixed;
+static pthread_mutex_t g_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: testfsck [-n|-y] [-v] [-j threads] <device>\n"
+			"\t-n  only check, open the device read-only (default)\n"
+			"\t-y  repair every problem found\n"
+			"\t-v  report progress of every pass\n"
+			"\t-j  check with this many threads\n");
+
+	_exit(FSCK_ERROR);
+}
+
+static void *zmalloc(size_t size)
+{
+	void *buf = malloc(size);
+
+	if (!buf)
+		return NULL;
+
+	memset(buf, 0, size);
+	return buf;
+}
+
+static uint64_t div_round_up(uint64_t n, uint64_t d)
+{
+	return (n + d - 1) / d;
+}
+
+/* a problem was found, @fixed if it will be repaired on the way out */
+static void problem(bool fixed, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&g_report_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("%s\n", fixed ? ", fixed" : "");
+	g_problems++;
+	if (fixed)
+		g_fixed++;
+	pthread_mutex_unlock(&g_report_lock);
+}
+
+static int read_blocks(uint64_t blkid, uint64_t count, void *buf)
+{
+	size_t len = count * g_bs;
+	ssize_t ret;
+
+	ret = pread(g_fd, buf, len, blkid * g_bs);
+	if (ret != (ssize_t)len) {
+		fprintf(stderr, "failed to read blocks %lu-%lu\n",
+			(unsigned long)blkid, (unsigned long)(blkid + count - 1));
+		return -1;
+	}
+	return 0;
+}
+
+static int write_blocks(uint64_t blkid, uint64_t count, const void *buf)
+{
+	size_t len = count * g_bs;
+	ssize_t ret;
+
+	ret = pwrite(g_fd, buf, len, blkid * g_bs);
+	if (ret != (ssize_t)len) {
+		fprintf(stderr, "failed to write blocks %lu-%lu\n",
+			(unsigned long)blkid, (unsigned long)(blkid + count - 1));
+		return -1;
+	}
+	return 0;
+}
+
+static bool test_bit_le(const uint8_t *map, uint64_t bit)
+{
+	return map[bit / 8] & (1 << (bit % 8));
+}
+
+static void set_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] |= 1 << (bit % 8);
+}
+
+static void clear_bit_le(uint8_t *map, uint64_t bit)
+{
+	map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* bit of data block @index (relative to the data region) in g_dbitmap */
+static uint64_t dbitmap_bit(uint32_t index)
+{
+	return (uint64_t)(index / g_blocks_per_group) * g_bs * 8 +
+		index % g_blocks_per_group;
+}
+
+static struct testfs_disk_inode *get_inode(uint32_t ino)
+{
+	return (struct testfs_disk_inode *)(g_itable +
+					    (size_t)ino * TESTFS_DISK_INODE_SIZE);
+}
+
+static void dirty_inode(uint32_t ino)
+{
+	g_itable_dirty[ino / (g_bs / TESTFS_DISK_INODE_SIZE)] = 1;
+}
+
+/*
+ * Run @fn on units 0 .. @nr - 1, each worker takes the next unit until
+ * none are left.
+ */
+struct parallel_work {
+	int (*fn)(uint32_t unit);
+	uint32_t nr;
+	uint32_t next;
+	bool error;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel_work *work = arg;
+	uint32_t unit;
+
+	for (;;) {
+		unit = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+		if (unit >= work->nr || work->error)
+			break;
+		if (work->fn(unit))
+			work->error = true;
+	}
+	return NULL;
+}
+
+static int run_parallel(int (*fn)(uint32_t unit), uint32_t nr)
+{
+	struct parallel_work work = { .fn = fn, .nr = nr };
+	pthread_t threads[g_nr_threads];
+	int i, started = 0;
+
+	for (i = 0; i < g_nr_threads && i < (int)nr; i++) {
+		if (pthread_create(&threads[i], NULL, parallel_worker, &work))
+			break;
+		started++;
+	}
+	/* no thread at all: do it here */
+	if (!started)
+		parallel_worker(&work);
+	while (started--)
+		pthread_join(threads[started], NULL);
+
+	return work.error ? -1 : 0;
+}
+
+static int read_super(void)
+{
+	uint32_t inodes_per_block, bits_per_block;
+	char buf[TEST_FS_MIN_BLOCK_SIZE];
+
+	if (pread(g_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+		fprintf(stderr, "failed to read the super block\n");
+		return -1;
+	}
+	memcpy(&g_tsb, buf, sizeof(g_tsb));
+	if (le16toh(g_tsb.s_magic) != TEST_FS_MAGIC) {
+		fprintf(stderr, "%s: not a testfs volume\n", g_dev);
+		return -1;
+	}
+
+	g_bs = le32toh(g_tsb.s_block_size);
+	if (g_bs < TEST_FS_MIN_BLOCK_SIZE || g_bs > TEST_FS_BLOCK_SIZE ||
+	    (g_bs & (g_bs - 1)) ||
+	    le32toh(g_tsb.s_inode_size) != TESTFS_DISK_INODE_SIZE) {
+		fprintf(stderr, "bad block size %u or inode size %u\n", g_bs,
+			le32toh(g_tsb.s_inode_size));
+		return -1;
+	}
+	inodes_per_block = g_bs / TESTFS_DISK_INODE_SIZE;
+	bits_per_block = g_bs * 8;
+
+	g_itable_blknr = le32toh(g_tsb.s_inode_table_blknr);
+	g_data_blkid = le32toh(g_tsb.s_data_blkid);
+	g_data_blknr = le32toh(g_tsb.s_data_blknr);
+	g_refcount_blkid = le32toh(g_tsb.s_refcount_blkid);
+	g_refcount_blknr = le32toh(g_tsb.s_refcount_blknr);
+
+	/* the same defaults the kernel takes for volumes of the fixed layout */
+	if (!g_tsb.s_inodes_count) {
+		g_ibitmap_blkid = TEST_FS_BLKID_IBITMAP;
+		g_ibitmap_blknr = 1;
+		g_dbitmap_blkid = TEST_FS_BLKID_DBITMAP;
+		g_blocks_per_group = bits_per_block;
+		g_itable_blkid = TEST_FS_BLKID_ITABLE;
+		if (g_data_blknr > bits_per_block)
+			g_data_blknr = bits_per_block;
+		g_inodes_count = g_itable_blknr * inodes_per_block;
+		if (g_inodes_count > TEST_FS_BLOCK_SIZE)
+			g_inodes_count = TEST_FS_BLOCK_SIZE;
+	} else {
+		g_inodes_count = le32toh(g_tsb.s_inodes_count);
+		g_ibitmap_blkid = le32toh(g_tsb.s_ibitmap_blkid);
+		g_ibitmap_blknr = le32toh(g_tsb.s_ibitmap_blknr);
+		g_dbitmap_blkid = le32toh(g_tsb.s_dbitmap_blkid);
+		g_blocks_per_group = le32toh(g_tsb.s_blocks_per_group);
+		g_itable_blkid = le32toh(g_tsb.s_inode_table_blkid);
+	}
+
+	if (!g_blocks_per_group || g_blocks_per_group > bits_per_block ||
+	    !g_data_blknr || !g_inodes_count ||
+	    (uint64_t)g_ibitmap_blknr * bits_per_block < g_inodes_count ||
+	    (uint64_t)g_itable_blknr * inodes_per_block < g_inodes_count ||
+	    (uint64_t)g_data_blkid + g_data_blknr >
+					le32toh(g_tsb.s_total_blknr)) {
+		fprintf(stderr, "bad geometry in the super block\n");
+		return -1;
+	}
+	g_groups_count = div_round_up(g_data_blknr, g_blocks_per_group);
+
+	/*
+	 * Striped volumes keep all metadata on the device checked here, only
+	 * the device table is looked at; the members are not opened.
+	 */
+	g_ndevs = le16toh(g_tsb.s_ndevs);
+	if (g_ndevs > 1) {
+		uint64_t sum = 0;
+		uint32_t i, nr;
+
+		for (i = 0; i < g_ndevs && i < TESTFS_MAX_DEVS; i++) {
+			nr = le32toh(g_tsb.s_devs[i].d_data_blknr);
+			if (!nr || (i < g_ndevs - 1 && nr % g_blocks_per_group))
+				break;
+			sum += nr;
+		}
+		if (g_ndevs > TESTFS_MAX_DEVS || i < g_ndevs ||
+		    sum != g_data_blknr || !g_tsb.s_stripe_blocks) {
+			fprintf(stderr, "bad device table in the super block\n");
+			return -1;
+		}
+	}
+
+	/*
+	 * Blocks a snapshot still holds are in the deferred free bitmaps,
+	 * only those are read; the store is not checked.
+	 */
+	g_snap_state = le32toh(g_tsb.s_snap_state);
+	g_snap_free_blkid = le32toh(g_tsb.s_snap_free_blkid);
+	if (g_tsb.s_snap_store_blknr &&
+	    (g_snap_state > TESTFS_SNAP_DROPPING ||
+	     (uint64_t)g_snap_free_blkid + g_groups_count > g_data_blkid)) {
+		fprintf(stderr, "bad snapshot area in the super block\n");
+		return -1;
+	}
+	if (!g_tsb.s_snap_store_blknr)
+		g_snap_state = TESTFS_SNAP_NONE;
+
+	/* as the kernel, a refcount table too small is ignored */
+	if (g_refcount_blknr && (uint64_t)g_refcount_blknr *
+	    (g_bs / sizeof(__le16)) < g_data_blknr)
+		g_refcount_blknr = 0;
+
+	return 0;
+}
+
+static int read_metadata(void)
+{
+	uint32_t last = 0, ino, itable_blocks;
+
+	g_ibitmap = malloc((size_t)g_ibitmap_blknr * g_bs);
+	g_dbitmap = malloc((size_t)g_groups_count * g_bs);
+	if (!g_ibitmap || !g_dbitmap)
+		return -1;
+	if (read_blocks(g_ibitmap_blkid, g_ibitmap_blknr, g_ibitmap) ||
+	    read_blocks(g_dbitmap_blkid, g_groups_count, g_dbitmap))
+		return -1;
+
+	if (g_snap_state != TESTFS_SNAP_NONE) {
+		g_snap_free = malloc((size_t)g_groups_count * g_bs);
+		if (!g_snap_free ||
+		    read_blocks(g_snap_free_blkid, g_groups_count, g_snap_free))
+			return -1;
+	}
+
+	if (g_refcount_blknr) {
+		g_refcount = malloc((size_t)g_refcount_blknr * g_bs);
+		if (!g_refcount ||
+		    read_blocks(g_refcount_blkid, g_refcount_blknr, g_refcount))
+			return -1;
+	}
+
+	/* the inode table is read up to the last inode in use only */
+	for (ino = 0; ino < g_inodes_count; ino++)
+		if (test_bit_le(g_ibitmap, ino))
+			last = ino + 1;
+	g_itable_used = last;
+	itable_blocks = div_round_up(last, g_bs / TESTFS_DISK_INODE_SIZE);
+
+	g_itable = zmalloc((size_t)itable_blocks * g_bs + 1);
+	g_itable_dirty = zmalloc(itable_blocks + 1);
+	g_group_dirty = zmalloc(g_groups_count);
+	g_ino_state = zmalloc(g_inodes_count);
+	g_parent = zmalloc(sizeof(*g_parent) * (size_t)g_inodes_count);
+	g_nlink = zmalloc(sizeof(*g_nlink) * (size_t)g_inodes_count);
+	g_reachable = zmalloc(g_inodes_count);
+	g_dirs = zmalloc(sizeof(*g_dirs) * (size_t)g_inodes_count);
+	g_dir_list = malloc(sizeof(*g_dir_list) * (size_t)g_inodes_count);
+	g_claims = zmalloc(sizeof(*g_claims) * (size_t)g_data_blknr);
+	if (!g_itable || !g_itable_dirty || !g_group_dirty || !g_ino_state ||
+	    !g_parent || !g_nlink || !g_reachable || !g_dirs || !g_dir_list ||
+	    !g_claims)
+		return -1;
+
+	return 0;
+}
+
+/* blocks an inode claims: the block map of files and directories */
+static void claim_blocks(struct testfs_disk_inode *tdi, int delta)
+{
+	uint32_t i, blkid;
+
+	if (le32toh(tdi->i_flags) & TESTFS_INLINE_DATA_FL)
+		return;
+
+	/* a tail claims its block, i_block[1] is an offset */
+	if (le32toh(tdi->i_flags) & TESTFS_TAIL_FL) {
+		blkid = le32toh(tdi->i_block[0]);
+		__atomic_fetch_add(&g_claims[blkid - g_data_blkid], delta,
+				   __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+		blkid = le32toh(tdi->i_block[i]);
+		if (blkid)
+			__atomic_fetch_add(&g_claims[blkid - g_data_blkid],
+					   delta, __ATOMIC_RELAXED);
+	}
+}
+
+/* a compressed cluster is a run from its first entry, shorter than it */
+static bool compr_cluster_ok(struct testfs_disk_inode *tdi, uint32_t c)
+{
+	uint32_t i, first = c * TESTFS_CLUSTER_BLOCKS;
+	uint32_t blkid = le32toh(tdi->i_block[first]), next;
+
+	if (!blkid || tdi->i_block[first + TESTFS_CLUSTER_BLOCKS - 1])
+		return false;
+	for (i = 1; i < TESTFS_CLUSTER_BLOCKS; i++) {
+		next = le32toh(tdi->i_block[first + i]);
+		if (!next)
+			break;
+		if (next != blkid + i)
+			return false;
+	}
+	for (; i < TESTFS_CLUSTER_BLOCKS; i++)
+		if (tdi->i_block[first + i])
+			return false;
+	return true;
+}
+
+/* a tail of a packed image lies in one data block */
+static bool tail_ok(struct testfs_disk_inode *tdi)
+{
+	uint32_t blkid = le32toh(tdi->i_block[0]);
+	uint32_t offset = le32toh(tdi->i_block[1]), i;
+
+	if (!(le32toh(g_tsb.s_ro_flags) & TESTFS_RO_PACKED) ||
+	    !S_ISREG(le16toh(tdi->i_mode)) || tdi->i_compr_map ||
+	    (le32toh(tdi->i_flags) & TESTFS_INLINE_DATA_FL) ||
+	    blkid <= g_data_blkid || blkid >= g_data_blkid + g_data_blknr ||
+	    offset >= g_bs || le32toh(tdi->i_size) > g_bs - offset)
+		return false;
+	for (i = 2; i < TEST_FS_N_BLOCKS; i++)
+		if (tdi->i_block[i])
+			return false;
+	return true;
+}
+
+static void check_inode(uint32_t ino)
+{
+	struct testfs_disk_inode *tdi = get_inode(ino);
+	uint32_t mode = le16toh(tdi->i_mode), flags = le32toh(tdi->i_flags);
+	uint32_t size = le32toh(tdi->i_size), max_size, i, blkid, mapped = 0;
+	uint32_t c;
+
+	if (!S_ISREG(mode) && !S_ISDIR(mode)) {
+		problem(g_repair, "inode %u: in use but bad mode 0%o", ino, mode);
+		g_ino_state[ino] = INO_BAD;
+		return;
+	}
+
+	if (S_ISDIR(mode) && (flags & TESTFS_INLINE_DATA_FL)) {
+		problem(g_repair, "inode %u: directory with inline data", ino);
+		g_ino_state[ino] = INO_BAD;
+		return;
+	}
+
+	if (tdi->i_write_hint > RWH_WRITE_LIFE_EXTREME) {
+		problem(g_repair, "inode %u: bad write hint %u", ino,
+			tdi->i_write_hint);
+		tdi->i_write_hint = RWH_WRITE_LIFE_NOT_SET;
+		dirty_inode(ino);
+	}
+
+	/* the data of a bad tail is lost, the file becomes a hole */
+	if ((flags & TESTFS_TAIL_FL) && !tail_ok(tdi)) {
+		problem(g_repair, "inode %u: bad tail %u:%u", ino,
+			le32toh(tdi->i_block[0]), le32toh(tdi->i_block[1]));
+		flags &= ~TESTFS_TAIL_FL;
+		tdi->i_flags = htole32(flags);
+		memset(tdi->i_block, 0, sizeof(tdi->i_block));
+		dirty_inode(ino);
+	}
+
+	/* the data of a bad compressed cluster is lost, it becomes a hole */
+	for (c = 0; c < 8; c++) {
+		if (!(tdi->i_compr_map & (1 << c)))
+			continue;
+		if (c < TESTFS_NR_CLUSTERS && S_ISREG(mode) &&
+		    !(flags & TESTFS_INLINE_DATA_FL) && compr_cluster_ok(tdi, c))
+			continue;
+		problem(g_repair, "inode %u: bad compressed cluster %u", ino, c);
+		tdi->i_compr_map &= ~(1 << c);
+		if (c < TESTFS_NR_CLUSTERS && !(flags & TESTFS_INLINE_DATA_FL))
+			memset(&tdi->i_block[c * TESTFS_CLUSTER_BLOCKS], 0,
+			       TESTFS_CLUSTER_BLOCKS * sizeof(__le32));
+		dirty_inode(ino);
+	}
+
+	max_size = flags & TESTFS_INLINE_DATA_FL ? TESTFS_INLINE_DATA_SIZE :
+		g_bs * TEST_FS_N_BLOCKS;
+	if (size > max_size) {
+		problem(g_repair, "inode %u: size %u larger than %u", ino,
+			size, max_size);
+		tdi->i_size = htole32(max_size);
+		dirty_inode(ino);
+	}
+
+	if (flags & TESTFS_TAIL_FL) {
+		mapped = 1;
+		claim_blocks(tdi, 1);
+	} else if (!(flags & TESTFS_INLINE_DATA_FL)) {
+		for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+			blkid = le32toh(tdi->i_block[i]);
+			if (!blkid)
+				continue;
+			/* data block 0 is never handed out */
+			if (blkid <= g_data_blkid ||
+			    blkid >= g_data_blkid + g_data_blknr) {
+				problem(g_repair, "inode %u: block %u of "
+					"block %u out of the data region",
+					ino, i, blkid);
+				tdi->i_block[i] = 0;
+				dirty_inode(ino);
+				continue;
+			}
+			mapped++;
+		}
+		claim_blocks(tdi, 1);
+	}
+
+	if (le32toh(tdi->i_blocks) != mapped * (g_bs >> 9)) {
+		problem(g_repair, "inode %u: i_blocks %u, should be %u", ino,
+			le32toh(tdi->i_blocks), mapped * (g_bs >> 9));
+		tdi->i_blocks = htole32(mapped * (g_bs >> 9));
+		dirty_inode(ino);
+	}
+
+	g_ino_state[ino] = S_ISDIR(mode) ? INO_DIR : INO_REG;
+}
+
+/* pass 1, one unit of inode table */
+static int pass1_unit(uint32_t unit)
+{
+	uint32_t per_unit = ITABLE_UNIT / TESTFS_DISK_INODE_SIZE;
+	uint32_t first = unit * per_unit, last = first + per_unit, ino;
+	uint32_t inodes_per_block = g_bs / TESTFS_DISK_INODE_SIZE;
+
+	if (last > g_itable_used)
+		last = g_itable_used;
+
+	if (read_blocks(g_itable_blkid + first / inodes_per_block,
+			div_round_up(last - first, inodes_per_block),
+			get_inode(first)))
+		return -1;
+
+	for (ino = first; ino < last; ino++)
+		if (test_bit_le(g_ibitmap, ino))
+			check_inode(ino);
+
+	return 0;
+}
+
+static void drop_dir_entry(struct dir_info *di, uint32_t slot)
+{
+	struct testfs_dir_entry *tde;
+
+	tde = (struct testfs_dir_entry *)di->buf + slot;
+	memset(tde, 0, sizeof(*tde));
+	di->dirty = true;
+}
+
+/* pass 2, one directory */
+static int pass2_dir(uint32_t index)
+{
+	uint32_t ino = g_dir_list[index], nr_slots, slot, target, i, blkid;
+	struct testfs_disk_inode *tdi = get_inode(ino);
+	struct testfs_dir_entry *tde;
+	struct dir_info *di;
+	uint8_t type;
+	void *tmp;
+
+	di = zmalloc(sizeof(*di));
+	if (!di)
+		return -1;
+	di->ino = ino;
+	di->size = le32toh(tdi->i_size);
+	di->dotdot_slot = -1;
+	di->buf = zmalloc(div_round_up(di->size, g_bs) * g_bs + 1);
+	if (!di->buf)
+		return -1;
+	g_dirs[ino] = di;
+
+	for (i = 0; i < div_round_up(di->size, g_bs); i++) {
+		blkid = le32toh(tdi->i_block[i]);
+		if (blkid && read_blocks(blkid, 1, di->buf + (size_t)i * g_bs))
+			return -1;
+	}
+
+	nr_slots = di->size / sizeof(*tde);
+	for (slot = 0; slot < nr_slots; slot++) {
+		tde = (struct testfs_dir_entry *)di->buf + slot;
+		if (!tde->name_len)
+			continue;
+
+		target = le32toh(tde->inode);
+		if (tde->name_len > TESTFS_FILE_NAME_LEN ||
+		    target >= g_inodes_count ||
+		    (g_ino_state[target] != INO_REG &&
+		     g_ino_state[target] != INO_DIR)) {
+			problem(g_repair, "directory %u: entry %.*s to free "
+				"or bad inode %u", ino,
+				tde->name_len > TESTFS_FILE_NAME_LEN ?
+				TESTFS_FILE_NAME_LEN : tde->name_len,
+				tde->name, target);
+			drop_dir_entry(di, slot);
+			continue;
+		}
+
+		type = g_ino_state[target] == INO_DIR ? FT_DIR : FT_REG_FILE;
+		if (tde->file_type != type) {
+			problem(g_repair, "directory %u: entry %.*s has file "
+				"type %u, should be %u", ino, tde->name_len,
+				tde->name, tde->file_type, type);
+			tde->file_type = type;
+			di->dirty = true;
+		}
+
+		if (tde->name_len == 1 && tde->name[0] == '.') {
+			if (target != ino) {
+				problem(g_repair, "directory %u: \".\" points "
+					"to %u", ino, target);
+				tde->inode = htole32(ino);
+				tde->file_type = FT_DIR;
+				di->dirty = true;
+			}
+			di->has_dot = true;
+			continue;
+		}
+		if (tde->name_len == 2 && !memcmp(tde->name, "..", 2)) {
+			di->dotdot_slot = slot;
+			continue;
+		}
+
+		if (di->nr_ents == di->max_ents) {
+			di->max_ents = di->max_ents ? di->max_ents * 2 : 16;
+			tmp = realloc(di->ents, di->max_ents *
+				      sizeof(*di->ents));
+			if (!tmp)
+				return -1;
+			di->ents = tmp;
+		}
+		di->ents[di->nr_ents].target = target;
+		di->ents[di->nr_ents].slot = slot;
+		di->nr_ents++;
+	}
+
+	return 0;
+}
+
+/* release an inode no directory reaches, its blocks are unclaimed */
+static void release_inode(uint32_t ino)
+{
+	struct testfs_disk_inode *tdi = get_inode(ino);
+
+	if (g_ino_state[ino] == INO_REG || g_ino_state[ino] == INO_DIR)
+		claim_blocks(tdi, -1);
+	g_ino_state[ino] = INO_FREE;
+}
+
+/*
+ * Pass 3: walk the tree breadth first from the root over what pass 2
+ * found. The first entry reached for a directory is its name, any other
+ * entry naming it is dropped; a file has as many links as names reached.
+ */
+static int pass3(void)
+{
+	uint32_t ino, i, head = 0, tail = 0, expect, *queue;
+	struct testfs_disk_inode *tdi;
+	struct testfs_dir_entry *tde;
+	struct dir_entry_ref *ent;
+	struct dir_info *di;
+
+	if (g_ino_state[TESTFS_ROOT_INO] != INO_DIR) {
+		fprintf(stderr, "root inode is not a directory, giving up\n");
+		return -1;
+	}
+
+	queue = malloc(sizeof(*queue) * (g_nr_dirs + 1));
+	if (!queue)
+		return -1;
+
+	g_reachable[TESTFS_ROOT_INO] = 1;
+	g_parent[TESTFS_ROOT_INO] = TESTFS_ROOT_INO;
+	queue[tail++] = TESTFS_ROOT_INO;
+
+	while (head < tail) {
+		ino = queue[head++];
+		di = g_dirs[ino];
+
+		for (i = 0; i < di->nr_ents; i++) {
+			ent = &di->ents[i];
+			if (g_ino_state[ent->target] == INO_REG) {
+				g_nlink[ent->target]++;
+				continue;
+			}
+
+			if (g_reachable[ent->target]) {
+				tde = (struct testfs_dir_entry *)di->buf +
+					ent->slot;
+				problem(g_repair, "directory %u: entry %.*s is "
+					"a second name of directory %u", ino,
+					tde->name_len, tde->name, ent->target);
+				drop_dir_entry(di, ent->slot);
+				continue;
+			}
+			g_reachable[ent->target] = 1;
+			g_parent[ent->target] = ino;
+			di->nr_subdirs++;
+			queue[tail++] = ent->target;
+		}
+
+		if (di->dotdot_slot < 0)
+			continue;
+		tde = (struct testfs_dir_entry *)di->buf + di->dotdot_slot;
+		if (le32toh(tde->inode) != g_parent[ino]) {
+			problem(g_repair, "directory %u: \"..\" points to %u, "
+				"parent is %u", ino, le32toh(tde->inode),
+				g_parent[ino]);
+			tde->inode = htole32(g_parent[ino]);
+			tde->file_type = FT_DIR;
+			di->dirty = true;
+		}
+	}
+	free(queue);
+
+	for (ino = 0; ino < g_itable_used; ino++) {
+		if (g_ino_state[ino] == INO_FREE)
+			continue;
+
+		if (g_ino_state[ino] == INO_BAD) {
+			release_inode(ino);
+			continue;
+		}
+
+		if (g_ino_state[ino] == INO_DIR && !g_reachable[ino]) {
+			problem(g_repair, "directory %u: not reachable from "
+				"the root, released", ino);
+			release_inode(ino);
+			continue;
+		}
+		if (g_ino_state[ino] == INO_REG && !g_nlink[ino]) {
+			problem(g_repair, "inode %u: in no directory, released",
+				ino);
+			release_inode(ino);
+			continue;
+		}
+
+		/*
+		 * "." and the entry in the parent, and ".." of every
+		 * subdirectory. A root without "." (as mktestfs makes it)
+		 * counts one link for being the root.
+		 */
+		if (g_ino_state[ino] == INO_DIR)
+			expect = (g_dirs[ino]->has_dot ||
+				  ino != TESTFS_ROOT_INO ? 2 : 1) +
+				g_dirs[ino]->nr_subdirs;
+		else
+			expect = g_nlink[ino];
+
+		tdi = get_inode(ino);
+		if (le16toh(tdi->i_links_count) != expect) {
+			problem(g_repair, "inode %u: link count %u, should "
+				"be %u", ino, le16toh(tdi->i_links_count),
+				expect);
+			tdi->i_links_count = htole16(expect);
+			dirty_inode(ino);
+		}
+	}
+
+	return 0;
+}
+
+/* pass 4, one block group of the data region */
+static int pass4_group(uint32_t group)
+{
+	uint32_t first = group * g_blocks_per_group, last, index;
+	uint32_t claims, free = 0, ref;
+	bool used, set;
+
+	last = first + g_blocks_per_group;
+	if (last > g_data_blknr)
+		last = g_data_blknr;
+
+	for (index = first; index < last; index++) {
+		claims = g_claims[index];
+		/*
+		 * data block 0 is always taken, 0 in i_block[] is a hole;
+		 * blocks deleted under a snapshot stay taken until it goes
+		 */
+		used = claims || !index ||
+			(g_snap_free &&
+			 test_bit_le(g_snap_free, dbitmap_bit(index)));
+		set = test_bit_le(g_dbitmap, dbitmap_bit(index));
+
+		if (set && !used) {
+			problem(g_repair, "block %u: marked in use, but not "
+				"in any file", g_data_blkid + index);
+			clear_bit_le(g_dbitmap, dbitmap_bit(index));
+			g_group_dirty[group] = 1;
+		} else if (!set && used) {
+			problem(g_repair, "block %u: in use, but marked free",
+				g_data_blkid + index);
+			set_bit_le(g_dbitmap, dbitmap_bit(index));
+			g_group_dirty[group] = 1;
+		}
+		if (!used)
+			free++;
+
+		if (!g_refcount) {
+			/* without a refcount table, copied in pass 4b */
+			if (claims > 1)
+				__atomic_fetch_add(&g_multi_claimed, 1,
+						   __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* the table counts references beyond the first */
+		ref = le16toh(g_refcount[index]);
+		if (ref != (claims ? claims - 1 : 0)) {
+			problem(g_repair, "block %u: %u references, refcount "
+				"says %u", g_data_blkid + index, claims,
+				ref + 1);
+			g_refcount[index] = htole16(claims ? claims - 1 : 0);
+			g_refcount_dirty = true;
+		}
+	}
+
+	__atomic_fetch_add(&g_free_blocks, free, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int64_t find_free_block(uint32_t *hint)
+{
+	uint32_t index;
+
+	for (index = *hint; index < g_data_blknr; index++) {
+		if (!index || g_claims[index])
+			continue;
+		*hint = index + 1;
+		return index;
+	}
+	return -1;
+}
+
+/*
+ * Pass 4b: a volume without refcount table can not share blocks, the
+ * first inode keeps a block claimed more than once and the others get a
+ * copy, or a hole if the volume is full.
+ */
+static int pass4b(void)
+{
+	uint32_t ino, i, blkid, index, hint = 1;
+	struct testfs_disk_inode *tdi;
+	uint8_t *seen;
+	int64_t copy;
+	char *buf;
+
+	if (g_refcount || !g_multi_claimed)
+		return 0;
+
+	seen = zmalloc(div_round_up(g_data_blknr, 8));
+	buf = malloc(g_bs);
+	if (!seen || !buf)
+		return -1;
+
+	for (ino = 0; ino < g_itable_used; ino++) {
+		if (g_ino_state[ino] != INO_REG && g_ino_state[ino] != INO_DIR)
+			continue;
+		tdi = get_inode(ino);
+		if (le32toh(tdi->i_flags) &
+		    (TESTFS_INLINE_DATA_FL | TESTFS_TAIL_FL))
+			continue;
+
+		for (i = 0; i < TEST_FS_N_BLOCKS; i++) {
+			blkid = le32toh(tdi->i_block[i]);
+			if (!blkid)
+				continue;
+			index = blkid - g_data_blkid;
+			if (g_claims[index] < 2)
+				continue;
+			if (!test_bit_le(seen, index)) {
+				set_bit_le(seen, index);
+				continue;
+			}
+
+			/* the data may be on a member, not open here */
+			copy = g_ndevs > 1 ? -1 : find_free_block(&hint);
+			problem(g_repair, "inode %u: block %u also in another "
+				"file, %s", ino, blkid,
+				copy < 0 ? "dropped" : "copied");
+			g_claims[index]--;
+			if (copy >= 0) {
+				if (read_blocks(blkid, 1, buf) ||
+				    (g_repair &&
+				     write_blocks(g_data_blkid + copy, 1, buf)))
+					goto fail;
+				g_claims[copy] = 1;
+				set_bit_le(g_dbitmap, dbitmap_bit(copy));
+				g_group_dirty[copy / g_blocks_per_group] = 1;
+				g_free_blocks--;
+				tdi->i_block[i] = htole32(g_data_blkid + copy);
+			} else {
+				tdi->i_block[i] = 0;
+				tdi->i_blocks = htole32(le32toh(tdi->i_blocks) -
+							(g_bs >> 9));
+			}
+			dirty_inode(ino);
+		}
+	}
+
+	free(seen);
+	free(buf);
+	return 0;
+fail:
+	free(seen);
+	free(buf);
+	return -1;
+}
+
+/* pass 5: inode bitmap against the inodes in use */
+static uint32_t pass5(void)
+{
+	uint32_t ino, used = 0;
+
+	for (ino = 0; ino < g_inodes_count; ino++) {
+		if (ino < g_itable_used && g_ino_state[ino] != INO_FREE) {
+			used++;
+			continue;
+		}
+		if (test_bit_le(g_ibitmap, ino)) {
+			problem(g_repair, "inode %u: marked in use, but free",
+				ino);
+			clear_bit_le(g_ibitmap, ino);
+			g_ibitmap_dirty = true;
+		}
+	}
+
+	return g_inodes_count - used;
+}
+
+static int write_changes(uint32_t free_inodes)
+{
+	uint32_t inodes_per_block = g_bs / TESTFS_DISK_INODE_SIZE, i, blkid, b;
+	char buf[TEST_FS_MIN_BLOCK_SIZE];
+	struct testfs_disk_inode *tdi;
+	struct dir_info *di;
+
+	for (i = 0; i < div_round_up(g_itable_used, inodes_per_block); i++)
+		if (g_itable_dirty[i] &&
+		    write_blocks(g_itable_blkid + i, 1,
+				 g_itable + (size_t)i * g_bs))
+			return -1;
+
+	for (i = 0; i < g_nr_dirs; i++) {
+		di = g_dirs[g_dir_list[i]];
+		if (!di->dirty || g_ino_state[di->ino] != INO_DIR)
+			continue;
+		tdi = get_inode(di->ino);
+		for (b = 0; b < div_round_up(di->size, g_bs); b++) {
+			blkid = le32toh(tdi->i_block[b]);
+			if (blkid && write_blocks(blkid, 1,
+					di->buf + (size_t)b * g_bs))
+				return -1;
+		}
+	}
+
+	for (i = 0; i < g_groups_count; i++)
+		if (g_group_dirty[i] &&
+		    write_blocks(g_dbitmap_blkid + i, 1,
+				 g_dbitmap + (size_t)i * g_bs))
+			return -1;
+
+	if (g_refcount_dirty &&
+	    write_blocks(g_refcount_blkid, g_refcount_blknr, g_refcount))
+		return -1;
+
+	if (g_ibitmap_dirty &&
+	    write_blocks(g_ibitmap_blkid, g_ibitmap_blknr, g_ibitmap))
+		return -1;
+
+	if (fsync(g_fd))
+		return -1;
+
+	/* counts are right now, the kernel may trust them */
+	if (pread(g_fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return -1;
+	memcpy(&g_tsb, buf, sizeof(g_tsb));
+	g_tsb.s_free_blocks_count = htole32(g_free_blocks);
+	g_tsb.s_free_inodes_count = htole32(free_inodes);
+	g_tsb.s_state = htole16(le16toh(g_tsb.s_state) | TESTFS_VALID_FS);
+	memcpy(buf, &g_tsb, sizeof(g_tsb));
+	if (pwrite(g_fd, buf, sizeof(buf), 0) != sizeof(buf) || fsync(g_fd))
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t ino, free_inodes, per_unit;
+	bool counts_ok;
+	int opt;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "nyvj:")) != -1) {
+		switch (opt) {
+		case 'n':
+			g_repair = false;
+			break;
+		case 'y':
+			g_repair = true;
+			break;
+		case 'v':
+			g_verbose = true;
+			break;
+		case 'j':
+			g_nr_threads = strtol(optarg, &end, 0);
+			if (*end || g_nr_threads < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+	g_dev = argv[optind];
+
+	if (!g_nr_threads) {
+		g_nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (g_nr_threads < 1)
+			g_nr_threads = 1;
+		if (g_nr_threads > 64)
+			g_nr_threads = 64;
+	}
+
+	/* exclusive open of a block device fails while it is mounted */
+	g_fd = open(g_dev, (g_repair ? O_RDWR : O_RDONLY) | O_EXCL);
+	if (g_fd < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", g_dev,
+			strerror(errno));
+		return FSCK_ERROR;
+	}
+
+	if (read_super() || read_metadata())
+		goto error;
+
+	/* repairs bypass the copy the kernel makes before it writes */
+	if (g_repair && g_snap_state == TESTFS_SNAP_ACTIVE) {
+		fprintf(stderr, "%s has a snapshot, drop it before repairs\n",
+			g_dev);
+		goto error;
+	}
+
+	if (!(le16toh(g_tsb.s_state) & TESTFS_VALID_FS))
+		printf("%s was not unmounted cleanly\n", g_dev);
+
+	if (g_verbose)
+		printf("pass 1: inodes\n");
+	per_unit = ITABLE_UNIT / TESTFS_DISK_INODE_SIZE;
+	if (run_parallel(pass1_unit, div_round_up(g_itable_used, per_unit)))
+		goto error;
+
+	if (g_verbose)
+		printf("pass 2: directories\n");
+	for (ino = 0; ino < g_itable_used; ino++)
+		if (g_ino_state[ino] == INO_DIR)
+			g_dir_list[g_nr_dirs++] = ino;
+	if (run_parallel(pass2_dir, g_nr_dirs))
+		goto error;
+
+	if (g_verbose)
+		printf("pass 3: connectivity and link counts\n");
+	if (pass3())
+		goto error;
+
+	if (g_verbose)
+		printf("pass 4: data blocks\n");
+	if (run_parallel(pass4_group, g_groups_count) || pass4b())
+		goto error;
+
+	if (g_verbose)
+		printf("pass 5: inode bitmap and free counts\n");
+	free_inodes = pass5();
+
+	counts_ok = le16toh(g_tsb.s_state) & TESTFS_VALID_FS &&
+		le32toh(g_tsb.s_free_blocks_count) == g_free_blocks &&
+		le32toh(g_tsb.s_free_inodes_count) == free_inodes;
+	if (!counts_ok && (le16toh(g_tsb.s_state) & TESTFS_VALID_FS))
+		problem(g_repair, "free counts %u blocks %u inodes, should "
+			"be %u and %u", le32toh(g_tsb.s_free_blocks_count),
+			le32toh(g_tsb.s_free_inodes_count), g_free_blocks,
+			free_inodes);
+
+	if (g_repair && (g_problems || !counts_ok) && write_changes(free_inodes))
+		goto error;
+
+	printf("%s: %u/%u inodes, %u/%u blocks, %lu problems, %lu fixed\n",
+	       g_dev, g_inodes_count - free_inodes, g_inodes_count,
+	       g_data_blknr - g_free_blocks, g_data_blknr, g_problems,
+	       g_fixed);
+
+	close(g_fd);
+	if (g_problems > g_fixed)
+		return FSCK_UNCORRECTED;
+	return g_fixed ? FSCK_NONDESTRUCT : FSCK_OK;
+
+error:
+	fprintf(stderr, "%s: check aborted\n", g_dev);
+	close(g_fd);
+	return FSCK_ERROR;
+}